@@ -1,1432 +1,12569 @@
-#define _CRT_SECURE_NO_WARNINGS
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-#include <time.h>
-
-#define MAX_USERS 100
-#define MAX_PATIENTS 1000
-#define MAX_USERNAME_LEN 50
-#define MAX_PASSWORD_LEN 50
-#define MAX_NAME_LEN 128
-#define MAX_GUARDIAN_LEN 128
-#define MAX_PHONE_LEN 16
-#define MAX_ADDRESS_LEN 256
-#define MAX_DISEASE_LEN 200
-#define MAX_DOCTOR_LEN 100
-#define MAX_BLOOD_GROUP_LEN 8
-#define SCREEN_WIDTH 80
-#define HEADER_WIDTH 40
-
-#define COLOR_RED     "\033[31m"
-#define COLOR_GREEN   "\033[32m"
-#define COLOR_MAROON  "\033[38;5;88m"
-#define COLOR_RESET   "\033[0m"
-
-typedef enum {
-    ROLE_ADMIN,
-    ROLE_MODERATOR
-} UserRole;
-
-typedef struct {
-    int user_id;
-    char username[MAX_USERNAME_LEN];
-    char password[MAX_PASSWORD_LEN];
-    UserRole role;
-    int is_active;
-} User;
-
-typedef struct {
-    int id;
-    char name[MAX_NAME_LEN];
-    char guardian[MAX_GUARDIAN_LEN];
-    char gender[10];
-    int age;
-    char blood_group[MAX_BLOOD_GROUP_LEN];
-    char phone[MAX_PHONE_LEN];
-    char address[MAX_ADDRESS_LEN];
-    char disease[MAX_DISEASE_LEN];
-    char referred_doctor[MAX_DOCTOR_LEN];
-    char registration_date[20];
-    int is_active;
-} Patient;
-
-User users[MAX_USERS];
-Patient patients[MAX_PATIENTS];
-int user_count = 0;
-int patient_count = 0;
-int next_user_id = 1;
-int next_patient_id = 1;
-User *current_user = NULL;
-
-/* ===================== HELPER FUNCTIONS ===================== */
-
-int read_line(char *buffer, int max_len) {
-    if (fgets(buffer, max_len, stdin) == NULL) {
-        return 0;
-    }
-    buffer[strcspn(buffer, "\n")] = '\0';
-    return 1;
-}
-
-void trim(char *str) {
-    int i = 0, j = 0;
-    int len = (int)strlen(str);
-
-    while (isspace((unsigned char)str[i])) i++;
-
-    if (i > 0) {
-        for (j = 0; i <= len; i++, j++) {
-            str[j] = str[i];
-        }
-    }
-
-    len = (int)strlen(str);
-    while (len > 0 && isspace((unsigned char)str[len - 1])) {
-        str[len - 1] = '\0';
-        len--;
-    }
-}
-
-int is_digits_only(const char *str) {
-    for (int i = 0; str[i] != '\0'; i++) {
-        if (!isdigit((unsigned char)str[i])) {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-int contains_pipe(const char *str) {
-    return strchr(str, '|') != NULL;
-}
-
-void get_current_date(char *buffer) {
-    time_t t = time(NULL);
-    struct tm *tm_info = localtime(&t);
-    strftime(buffer, 20, "%Y-%m-%d", tm_info);
-}
-
-void clear_screen() {
-#ifdef _WIN32
-    system("cls");
-#else
-    system("clear");
-#endif
-}
-
-void print_centered(const char *text) {
-    int width = 80;
-    int text_len = (int)strlen(text);
-    int padding = (width - text_len) / 2;
-    if (padding < 0) padding = 0;
-
-    printf("%*s%s\n", padding, "", text);
-}
-
-void print_centered_title(const char *title) {
-    int width = 80;
-    int header_width = 40;
-    int left_margin = (width - header_width) / 2;
-    if (left_margin < 0) left_margin = 0;
-
-    int title_len = (int)strlen(title);
-    int inner_pad = (header_width - title_len) / 2;
-    if (inner_pad < 0) inner_pad = 0;
-
-    printf("\n%s%*s", COLOR_MAROON, left_margin, "");
-    for (int i = 0; i < header_width; i++) printf("=");
-    printf("\n");
-
-    printf("%*s%*s%s\n", left_margin, "", inner_pad, "", title);
-
-    printf("%*s", left_margin, "");
-    for (int i = 0; i < header_width; i++) printf("=");
-    printf("%s\n\n", COLOR_RESET);
-}
-
-int is_duplicate_patient(const char *name, const char *guardian, const char *phone) {
-    for (int i = 0; i < patient_count; i++) {
-        if (!patients[i].is_active) continue;
-
-        char name1[MAX_NAME_LEN], name2[MAX_NAME_LEN];
-        strcpy(name1, name);
-        strcpy(name2, patients[i].name);
-        for (char *p = name1; *p; p++) *p = (char)tolower((unsigned char)*p);
-        for (char *p = name2; *p; p++) *p = (char)tolower((unsigned char)*p);
-
-        char guard1[MAX_GUARDIAN_LEN], guard2[MAX_GUARDIAN_LEN];
-        strcpy(guard1, guardian);
-        strcpy(guard2, patients[i].guardian);
-        for (char *p = guard1; *p; p++) *p = (char)tolower((unsigned char)*p);
-        for (char *p = guard2; *p; p++) *p = (char)tolower((unsigned char)*p);
-
-        if (strcmp(name1, name2) == 0 &&
-            strcmp(guard1, guard2) == 0 &&
-            strcmp(phone, patients[i].phone) == 0) {
-            return patients[i].id;
-        }
-    }
-    return 0;
-}
-
-/* ===================== FILE OPERATIONS ===================== */
-
-int load_users() {
-    FILE *file = fopen("users.txt", "r");
-    if (!file) {
-        return 0;
-    }
-
-    user_count = 0;
-    next_user_id = 1;
-
-    char line[512];
-    while (fgets(line, sizeof(line), file) && user_count < MAX_USERS) {
-        User *user = &users[user_count];
-        int role_int;
-
-        if (sscanf(line, "%d|%[^|]|%[^|]|%d|%d",
-                   &user->user_id,
-                   user->username,
-                   user->password,
-                   &role_int,
-                   &user->is_active) == 5) {
-
-            user->role = (role_int == 0) ? ROLE_ADMIN : ROLE_MODERATOR;
-
-            if (user->user_id >= next_user_id) {
-                next_user_id = user->user_id + 1;
-            }
-
-            user_count++;
-        }
-    }
-
-    fclose(file);
-    return 1;
-}
-
-int save_users() {
-    FILE *file = fopen("users.txt", "w");
-    if (!file) {
-        perror("Error opening users.txt");
-        return 0;
-    }
-
-    for (int i = 0; i < user_count; i++) {
-        User *user = &users[i];
-        fprintf(file, "%d|%s|%s|%d|%d\n",
-                user->user_id,
-                user->username,
-                user->password,
-                user->role,
-                user->is_active);
-    }
-
-    fclose(file);
-    return 1;
-}
-
-int load_patients() {
-    FILE *file = fopen("patients.txt", "r");
-    if (!file) {
-        return 0;
-    }
-
-    patient_count = 0;
-    next_patient_id = 1;
-
-    char line[1024];
-    while (fgets(line, sizeof(line), file) && patient_count < MAX_PATIENTS) {
-        Patient *patient = &patients[patient_count];
-        int temp_active;
-
-        if (sscanf(line, "%d|%[^|]|%[^|]|%[^|]|%d|%[^|]|%[^|]|%[^|]|%[^|]|%[^|]|%[^|]|%d",
-                   &patient->id,
-                   patient->name,
-                   patient->guardian,
-                   patient->gender,
-                   &patient->age,
-                   patient->blood_group,
-                   patient->phone,
-                   patient->address,
-                   patient->disease,
-                   patient->referred_doctor,
-                   patient->registration_date,
-                   &temp_active) == 12) {
-
-            patient->is_active = temp_active;
-
-            if (patient->id >= next_patient_id) {
-                next_patient_id = patient->id + 1;
-            }
-
-            patient_count++;
-        }
-    }
-
-    fclose(file);
-    return 1;
-}
-
-int save_patients() {
-    FILE *test_file = fopen("patients.txt", "a");
-    if (!test_file) {
-        perror("Error creating/opening patients.txt");
-        return 0;
-    }
-    fclose(test_file);
-
-    FILE *file = fopen("patients.txt", "w");
-    if (!file) {
-        perror("Error opening patients.txt for writing");
-        return 0;
-    }
-
-    for (int i = 0; i < patient_count; i++) {
-        Patient *patient = &patients[i];
-        fprintf(file, "%d|%s|%s|%s|%d|%s|%s|%s|%s|%s|%s|%d\n",
-                patient->id,
-                patient->name,
-                patient->guardian,
-                patient->gender,
-                patient->age,
-                patient->blood_group,
-                patient->phone,
-                patient->address,
-                patient->disease,
-                patient->referred_doctor,
-                patient->registration_date,
-                patient->is_active);
-    }
-
-    fclose(file);
-    return 1;
-}
-
-/* ===================== USER OPERATIONS ===================== */
-
-User* find_user_by_username(const char *username) {
-    for (int i = 0; i < user_count; i++) {
-        if (strcmp(users[i].username, username) == 0 && users[i].is_active) {
-            return &users[i];
-        }
-    }
-    return NULL;
-}
-
-int authenticate_user(const char *username, const char *password) {
-    User *user = find_user_by_username(username);
-    if (!user) {
-        return 0;
-    }
-    return strcmp(user->password, password) == 0;
-}
-
-int count_active_admins() {
-    int count = 0;
-    for (int i = 0; i < user_count; i++) {
-        if (users[i].is_active && users[i].role == ROLE_ADMIN) {
-            count++;
-        }
-    }
-    return count;
-}
-
-int register_user(const char *username, const char *password, UserRole role) {
-    if (user_count >= MAX_USERS) {
-        return 0;
-    }
-
-    if (find_user_by_username(username)) {
-        return -1;
-    }
-
-    User *new_user = &users[user_count];
-    new_user->user_id = next_user_id++;
-    strncpy(new_user->username, username, MAX_USERNAME_LEN);
-    new_user->username[MAX_USERNAME_LEN - 1] = '\0';
-    strncpy(new_user->password, password, MAX_PASSWORD_LEN);
-    new_user->password[MAX_PASSWORD_LEN - 1] = '\0';
-    new_user->role = role;
-    new_user->is_active = 1;
-
-    user_count++;
-    save_users();
-    return 1;
-}
-
-/* ===================== PATIENT OPERATIONS ===================== */
-
-int add_patient(Patient *patient) {
-    if (patient_count >= MAX_PATIENTS) {
-        return 0;
-    }
-
-    patient->id = next_patient_id++;
-    patient->is_active = 1;
-
-    patients[patient_count] = *patient;
-    int old_count = patient_count;
-    int old_next_id = next_patient_id - 1;
-    patient_count++;
-
-    if (!save_patients()) {
-        patient_count = old_count;
-        next_patient_id = old_next_id;
-        return 0;
-    }
-
-    return 1;
-}
-
-int modify_patient(int patient_id, Patient *updated_patient) {
-    for (int i = 0; i < patient_count; i++) {
-        if (patients[i].id == patient_id && patients[i].is_active) {
-            updated_patient->id = patient_id;
-            updated_patient->is_active = 1;
-            strcpy(updated_patient->registration_date, patients[i].registration_date);
-            patients[i] = *updated_patient;
-            return save_patients();
-        }
-    }
-    return 0;
-}
-
-int delete_patient(int patient_id) {
-    for (int i = 0; i < patient_count; i++) {
-        if (patients[i].id == patient_id && patients[i].is_active) {
-            patients[i].is_active = 0;
-            return save_patients();
-        }
-    }
-    return 0;
-}
-
-Patient* find_patient_by_id(int patient_id) {
-    for (int i = 0; i < patient_count; i++) {
-        if (patients[i].id == patient_id && patients[i].is_active) {
-            return &patients[i];
-        }
-    }
-    return NULL;
-}
-
-int find_patients_by_name(const char *search_name, int *result_indices, int max_results) {
-    int found_count = 0;
-    char search_lower[MAX_NAME_LEN];
-
-    strcpy(search_lower, search_name);
-    for (char *p = search_lower; *p; p++) *p = (char)tolower((unsigned char)*p);
-
-    for (int i = 0; i < patient_count && found_count < max_results; i++) {
-        if (!patients[i].is_active) continue;
-
-        char patient_name_lower[MAX_NAME_LEN];
-        strcpy(patient_name_lower, patients[i].name);
-        for (char *p = patient_name_lower; *p; p++) *p = (char)tolower((unsigned char)*p);
-
-        if (strstr(patient_name_lower, search_lower) != NULL) {
-            result_indices[found_count++] = i;
-        }
-    }
-
-    return found_count;
-}
-
-/* ===================== UI FUNCTIONS ===================== */
-
-void show_startup_menu() {
-    clear_screen();
-    print_centered_title("PATIENT RECORD MANAGEMENT SYSTEM");
-
-    printf("1) Login\n");
-    printf("2) Exit\n\n");
-    printf("Enter your choice: ");
-}
-
-void show_admin_menu() {
-    clear_screen();
-    print_centered_title("ADMIN DASHBOARD");
-
-    printf("1. Add New Patient\n");
-    printf("2. View All Patients\n");
-    printf("3. Search Patient\n");
-    printf("4. Modify Patient\n");
-    printf("5. Delete Patient\n");
-    printf("6. Register New User\n");
-    printf("7. Logout\n\n");
-    printf("Enter your choice: ");
-}
-
-void show_moderator_menu() {
-    clear_screen();
-    print_centered_title("MODERATOR DASHBOARD");
-
-    printf("1. Add New Patient\n");
-    printf("2. View All Patients\n");
-    printf("3. Search Patient\n");
-    printf("4. Logout\n\n");
-    printf("Enter your choice: ");
-}
-
-/* ===================== PATIENT FORMS ===================== */
-
-void add_patient_form() {
-    Patient patient = {0};
-    char input[256];
-
-    clear_screen();
-    print_centered_title("ADD NEW PATIENT");
-
-    printf("Enter '0' For Go Back.\n\n");
-
-    while (1) {
-        printf("Patient Name: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please enter a name.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.name, input);
-        break;
-    }
-
-    while (1) {
-        printf("Guardian Name: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please enter guardian name.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Guardian name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.guardian, input);
-        break;
-    }
-
-    while (1) {
-        printf("Enter gender (M=Male, F=Female): ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please select a gender.\n" COLOR_RESET);
-            continue;
-        }
-
-        char gender = (char)toupper((unsigned char)input[0]);
-        if (gender == 'M' || gender == 'F') {
-            strcpy(patient.gender, (gender == 'M') ? "Male" : "Female");
-            break;
-        } else {
-            printf(COLOR_RED "That doesn't look right. Please enter M or F.\n" COLOR_RESET);
-        }
-    }
-
-    while (1) {
-        printf("Age: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please enter age.\n" COLOR_RESET);
-            continue;
-        }
-
-        patient.age = atoi(input);
-        if (patient.age <= 0 || patient.age > 150) {
-            printf(COLOR_RED "Age must be between 1 and 150.\n" COLOR_RESET);
-            continue;
-        }
-        break;
-    }
-
-    printf("\nSelect Blood Group:\n");
-    printf("1) A+\n");
-    printf("2) A-\n");
-    printf("3) B+\n");
-    printf("4) B-\n");
-    printf("5) AB+\n");
-    printf("6) AB-\n");
-    printf("7) O+\n");
-    printf("8) O-\n");
-
-    while (1) {
-        printf("Select Blood Group [1-8]: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please select blood group.\n" COLOR_RESET);
-            continue;
-        }
-
-        int choice = atoi(input);
-        if (choice < 1 || choice > 8) {
-            printf(COLOR_RED "Please select 1-8.\n" COLOR_RESET);
-            continue;
-        }
-
-        switch (choice) {
-            case 1: strcpy(patient.blood_group, "A+"); break;
-            case 2: strcpy(patient.blood_group, "A-"); break;
-            case 3: strcpy(patient.blood_group, "B+"); break;
-            case 4: strcpy(patient.blood_group, "B-"); break;
-            case 5: strcpy(patient.blood_group, "AB+"); break;
-            case 6: strcpy(patient.blood_group, "AB-"); break;
-            case 7: strcpy(patient.blood_group, "O+"); break;
-            case 8: strcpy(patient.blood_group, "O-"); break;
-        }
-        break;
-    }
-
-    while (1) {
-        printf("Phone (11 digits): ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Phone number is required.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (strlen(input) != 11 || !is_digits_only(input)) {
-            printf(COLOR_RED "Phone must be exactly 11 digits.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.phone, input);
-        break;
-    }
-
-    int duplicate_id = is_duplicate_patient(patient.name, patient.guardian, patient.phone);
-    if (duplicate_id) {
-        printf(COLOR_RED "\n⚠️  Similar patient found!\n" COLOR_RESET);
-        printf("Existing Patient ID: %d\n", duplicate_id);
-        printf("Same name, guardian, and phone already exists.\n\n");
-
-        while (1) {
-            printf("1) Cancel (keep existing)\n");
-            printf("2) Add anyway (new record)\n");
-            printf("Choice [1]: ");
-
-            if (!read_line(input, sizeof(input))) continue;
-            trim(input);
-
-            if (strlen(input) == 0 || strcmp(input, "1") == 0) {
-                printf("Cancelled. Patient not added.\n");
-                printf("\nPress Enter to continue...");
-                getchar();
-                return;
-            }
-
-            if (strcmp(input, "2") == 0) {
-                printf("Proceeding with new patient...\n");
-                break;
-            }
-
-            printf(COLOR_RED "Please enter 1 or 2.\n" COLOR_RESET);
-        }
-    }
-
-    while (1) {
-        printf("Address: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Address is required.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Address cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.address, input);
-        break;
-    }
-
-    while (1) {
-        printf("Disease: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please enter disease.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Disease cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.disease, input);
-        break;
-    }
-
-    while (1) {
-        printf("Referred Doctor: ");
-        if (!read_line(input, sizeof(input))) continue;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            printf("Operation cancelled.\n");
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            printf(COLOR_RED "Please enter doctor's name.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Doctor name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(patient.referred_doctor, input);
-        break;
-    }
-
-    get_current_date(patient.registration_date);
-
-    if (add_patient(&patient)) {
-        printf(COLOR_GREEN "\nPatient added successfully!\n" COLOR_RESET);
-        printf("Patient ID: %d\n", patient.id);
-        printf("Registration Date: %s \n", patient.registration_date);
-    } else {
-        printf(COLOR_RED "\nFailed to add patient.\n" COLOR_RESET);
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void view_all_patients() {
-    clear_screen();
-    print_centered_title("ALL PATIENT RECORDS");
-
-    int active_count = 0;
-    for (int i = 0; i < patient_count; i++) {
-        if (patients[i].is_active) active_count++;
-    }
-
-    if (active_count == 0) {
-        printf("No patient records found.\n");
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-
-    printf("S.No  ID    Name                Gender  Age  Phone       Disease\n");
-    printf("----------------------------------------------------------------\n");
-
-    int serial = 1;
-    for (int i = 0; i < patient_count; i++) {
-        if (!patients[i].is_active) continue;
-
-        printf("%-5d %-5d %-20s %-7s %-4d %-11s %s\n",
-               serial++, patients[i].id, patients[i].name, patients[i].gender,
-               patients[i].age, patients[i].phone, patients[i].disease);
-
-        if ((serial - 1) % 20 == 0 && (serial - 1) < active_count) {
-            printf("\nPress Enter to continue...");
-            getchar();
-            clear_screen();
-            print_centered_title("ALL PATIENT RECORDS (CONTINUED)");
-            printf("S.No  ID    Name                Gender  Age  Phone       Disease\n");
-            printf("----------------------------------------------------------------\n");
-        }
-    }
-
-    printf("\nTotal patients: %d\n", serial - 1);
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void search_patient_menu() {
-    char search[256];
-    int patient_id;
-
-    clear_screen();
-    print_centered_title("SEARCH PATIENT");
-
-    printf("Enter patient ID or name to search: ");
-    if (!read_line(search, sizeof(search))) {
-        return;
-    }
-
-    trim(search);
-
-    if (strlen(search) == 0) {
-        return;
-    }
-
-    if (is_digits_only(search)) {
-        patient_id = atoi(search);
-        Patient *patient = find_patient_by_id(patient_id);
-
-        if (patient) {
-            printf("\nPatient Found:\n");
-            printf("ID: %d\n", patient->id);
-            printf("Name: %s\n", patient->name);
-            printf("Guardian: %s\n", patient->guardian);
-            printf("Gender: %s\n", patient->gender);
-            printf("Age: %d\n", patient->age);
-            printf("Blood Group: %s\n", patient->blood_group);
-            printf("Phone: %s\n", patient->phone);
-            printf("Address: %s\n", patient->address);
-            printf("Disease: %s\n", patient->disease);
-            printf("Referred Doctor: %s\n", patient->referred_doctor);
-            printf("Registration Date: %s\n", patient->registration_date);
-        } else {
-            printf("\nNo patient found with ID: %d\n", patient_id);
-        }
-    } else {
-        int result_indices[100];
-        int found_count = find_patients_by_name(search, result_indices, 100);
-
-        if (found_count == 0) {
-            printf("\nNo patients found with name containing: %s\n", search);
-        } else if (found_count == 1) {
-            Patient *patient = &patients[result_indices[0]];
-            printf("\nPatient Found:\n");
-            printf("ID: %d\n", patient->id);
-            printf("Name: %s\n", patient->name);
-            printf("Guardian: %s\n", patient->guardian);
-            printf("Gender: %s\n", patient->gender);
-            printf("Age: %d\n", patient->age);
-            printf("Blood Group: %s\n", patient->blood_group);
-            printf("Phone: %s\n", patient->phone);
-            printf("Address: %s\n", patient->address);
-            printf("Disease: %s\n", patient->disease);
-            printf("Referred Doctor: %s\n", patient->referred_doctor);
-            printf("Registration Date: %s\n", patient->registration_date);
-        } else {
-            printf("\nMultiple patients found:\n");
-            printf("S.No  ID    Name\n");
-            printf("----------------------------\n");
-
-            for (int i = 0; i < found_count; i++) {
-                Patient *patient = &patients[result_indices[i]];
-                printf("%-5d %-5d %s\n", i + 1, patient->id, patient->name);
-            }
-
-            printf("\nEnter patient ID to view details: ");
-            if (!read_line(search, sizeof(search))) {
-                return;
-            }
-
-            trim(search);
-
-            if (is_digits_only(search)) {
-                patient_id = atoi(search);
-                if (patient_id == 0) {
-                    return;
-                }
-
-                Patient *patient = find_patient_by_id(patient_id);
-                if (patient) {
-                    printf("\nPatient Details:\n");
-                    printf("ID: %d\n", patient->id);
-                    printf("Name: %s\n", patient->name);
-                    printf("Guardian: %s\n", patient->guardian);
-                    printf("Gender: %s\n", patient->gender);
-                    printf("Age: %d\n", patient->age);
-                    printf("Blood Group: %s\n", patient->blood_group);
-                    printf("Phone: %s\n", patient->phone);
-                    printf("Address: %s\n", patient->address);
-                    printf("Disease: %s\n", patient->disease);
-                    printf("Referred Doctor: %s\n", patient->referred_doctor);
-                    printf("Registration Date: %s\n", patient->registration_date);
-                } else {
-                    printf(COLOR_RED "\nPatient not found.\n" COLOR_RESET);
-                }
-            }
-        }
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void modify_patient_form() {
-    int patient_id;
-    Patient *patient;
-    Patient updated_patient = {0};
-    char input[256];
-
-    clear_screen();
-    print_centered_title("MODIFY PATIENT");
-
-    printf("Enter Patient ID to modify: ");
-    if (!read_line(input, sizeof(input))) return;
-
-    patient_id = atoi(input);
-    if (patient_id == 0) {
-        return;
-    }
-
-    patient = find_patient_by_id(patient_id);
-    if (!patient) {
-        printf(COLOR_RED "Patient not found.\n" COLOR_RESET);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-
-    printf("\nCurrent Details:\n");
-    printf("Name: %s\n", patient->name);
-    printf("Leave field blank to keep current value.\n\n");
-
-    while (1) {
-        printf("Patient Name [%s]: ", patient->name);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) {
-            return;
-        }
-
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.name, patient->name);
-            break;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(updated_patient.name, input);
-        break;
-    }
-
-    while (1) {
-        printf("Guardian Name [%s]: ", patient->guardian);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.guardian, patient->guardian);
-            break;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Guardian name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(updated_patient.guardian, input);
-        break;
-    }
-
-    while (1) {
-        printf("Gender (M/F) [%s]: ", patient->gender);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.gender, patient->gender);
-            break;
-        }
-
-        char gender = (char)toupper((unsigned char)input[0]);
-        if (gender == 'M' || gender == 'F') {
-            strcpy(updated_patient.gender, (gender == 'M') ? "Male" : "Female");
-            break;
-        } else {
-            printf(COLOR_RED "Please enter M or F.\n" COLOR_RESET);
-        }
-    }
-
-    while (1) {
-        printf("Age [%d]: ", patient->age);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            updated_patient.age = patient->age;
-            break;
-        }
-
-        int age_input = atoi(input);
-        if (age_input > 0 && age_input <= 150) {
-            updated_patient.age = age_input;
-            break;
-        } else {
-            printf(COLOR_RED "Age must be 1-150.\n" COLOR_RESET);
-        }
-    }
-
-    while (1) {
-        printf("Phone [%s]: ", patient->phone);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.phone, patient->phone);
-            break;
-        }
-
-        if (strlen(input) == 11 && is_digits_only(input)) {
-            strcpy(updated_patient.phone, input);
-            break;
-        } else {
-            printf(COLOR_RED "Phone must be 11 digits.\n" COLOR_RESET);
-        }
-    }
-
-    while (1) {
-        printf("Address [%s]: ", patient->address);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.address, patient->address);
-            break;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Address cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(updated_patient.address, input);
-        break;
-    }
-
-    while (1) {
-        printf("Disease [%s]: ", patient->disease);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.disease, patient->disease);
-            break;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Disease cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(updated_patient.disease, input);
-        break;
-    }
-
-    while (1) {
-        printf("Referred Doctor [%s]: ", patient->referred_doctor);
-        if (!read_line(input, sizeof(input))) break;
-        trim(input);
-
-        if (strcmp(input, "0") == 0) return;
-        if (strlen(input) == 0) {
-            strcpy(updated_patient.referred_doctor, patient->referred_doctor);
-            break;
-        }
-
-        if (contains_pipe(input)) {
-            printf(COLOR_RED "Doctor name cannot contain '|' character.\n" COLOR_RESET);
-            continue;
-        }
-
-        strcpy(updated_patient.referred_doctor, input);
-        break;
-    }
-
-    strcpy(updated_patient.blood_group, patient->blood_group);
-    strcpy(updated_patient.registration_date, patient->registration_date);
-
-    if (modify_patient(patient_id, &updated_patient)) {
-        printf(COLOR_GREEN "\nPatient updated.\n" COLOR_RESET);
-    } else {
-        printf(COLOR_RED "\nUpdate failed.\n" COLOR_RESET);
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void delete_patient_form() {
-    int patient_id;
-    char confirm[10];
-
-    clear_screen();
-    print_centered_title("DELETE PATIENT");
-
-    printf("Enter Patient ID to delete: ");
-    if (!read_line(confirm, sizeof(confirm))) return;
-
-    patient_id = atoi(confirm);
-    if (patient_id == 0) {
-        return;
-    }
-
-    Patient *patient = find_patient_by_id(patient_id);
-    if (!patient) {
-        printf(COLOR_RED "Patient not found.\n" COLOR_RESET);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-
-    printf("\nPatient Details:\n");
-    printf("ID: %d\n", patient->id);
-    printf("Name: %s\n", patient->name);
-    printf("Age: %d\n", patient->age);
-    printf("Disease: %s\n", patient->disease);
-    printf("Phone: %s\n", patient->phone);
-
-    printf("\nAre you sure? (y/N): ");
-    read_line(confirm, sizeof(confirm));
-    trim(confirm);
-
-    if (confirm[0] == 'y' || confirm[0] == 'Y') {
-        if (delete_patient(patient_id)) {
-            printf(COLOR_GREEN "\nPatient deleted.\n" COLOR_RESET);
-        } else {
-            printf(COLOR_RED "\nFailed to delete.\n" COLOR_RESET);
-        }
-    } else {
-        printf("\nCancelled.\n");
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-/* ===================== USER MANAGEMENT ===================== */
-
-void registration_flow(int is_first_user) {
-    char username[MAX_USERNAME_LEN];
-    char password[MAX_PASSWORD_LEN];
-    char confirm_password[MAX_PASSWORD_LEN];
-    UserRole role = ROLE_MODERATOR;
-
-    clear_screen();
-    print_centered_title("USER REGISTRATION");
-
-    if (is_first_user) {
-        printf("ADMIN REGISTRATION.\n\n");
-        role = ROLE_ADMIN;
-    } else if (current_user && current_user->role == ROLE_ADMIN) {
-        printf("New User Registration\n\n");
-    } else {
-        printf("New users will be MODERATORs.\n\n");
-    }
-
-    while (1) {
-        printf("Username: ");
-        if (!read_line(username, MAX_USERNAME_LEN)) continue;
-        trim(username);
-
-        if (strlen(username) == 0) {
-            printf(COLOR_RED "Username required.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(username)) {
-            printf(COLOR_RED "Username cannot contain '|'.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (find_user_by_username(username)) {
-            printf(COLOR_RED "Username taken.\n" COLOR_RESET);
-            continue;
-        }
-
-        break;
-    }
-
-    while (1) {
-        printf("Password: ");
-        if (!read_line(password, MAX_PASSWORD_LEN)) continue;
-        trim(password);
-
-        if (strlen(password) == 0) {
-            printf(COLOR_RED "Password required.\n" COLOR_RESET);
-            continue;
-        }
-
-        if (contains_pipe(password)) {
-            printf(COLOR_RED "Password cannot contain '|'.\n" COLOR_RESET);
-            continue;
-        }
-
-        break;
-    }
-
-    while (1) {
-        printf("Confirm Password: ");
-        if (!read_line(confirm_password, MAX_PASSWORD_LEN)) continue;
-        trim(confirm_password);
-
-        if (strcmp(password, confirm_password) != 0) {
-            printf(COLOR_RED "Passwords don't match.\n" COLOR_RESET);
-
-            printf("Password: ");
-            if (!read_line(password, MAX_PASSWORD_LEN)) continue;
-            trim(password);
-
-            if (strlen(password) == 0) {
-                printf(COLOR_RED "Password required.\n" COLOR_RESET);
-                continue;
-            }
-
-            continue;
-        }
-        break;
-    }
-
-    if (!is_first_user && current_user && current_user->role == ROLE_ADMIN) {
-        printf("\nRole (1=ADMIN, 2=MODERATOR): ");
-        char role_input[10];
-        read_line(role_input, sizeof(role_input));
-        trim(role_input);
-
-        if (atoi(role_input) == 1) {
-            role = ROLE_ADMIN;
-        }
-    }
-
-    int result = register_user(username, password, role);
-    if (result == 1) {
-        printf(COLOR_GREEN "\nRegistration successful.\n" COLOR_RESET);
-
-        if (is_first_user) {
-            current_user = find_user_by_username(username);
-            printf("Automatically logged in as first user.\n");
-        }
-    } else if (result == -1) {
-        printf(COLOR_RED "\nUsername already exists.\n" COLOR_RESET);
-    } else {
-        printf(COLOR_RED "\nRegistration failed.\n" COLOR_RESET);
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-void login_flow() {
-    char username[MAX_USERNAME_LEN];
-    char password[MAX_PASSWORD_LEN];
-
-    clear_screen();
-    print_centered_title("LOGIN");
-
-    printf("Username: ");
-    read_line(username, MAX_USERNAME_LEN);
-    trim(username);
-
-    if (strlen(username) == 0) {
-        printf(COLOR_RED "\nUsername required.\n" COLOR_RESET);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-
-    printf("Password: ");
-    read_line(password, MAX_PASSWORD_LEN);
-    trim(password);
-
-    if (strlen(password) == 0) {
-        printf(COLOR_RED "\nPassword required.\n" COLOR_RESET);
-        printf("\nPress Enter to continue...");
-        getchar();
-        return;
-    }
-
-    if (authenticate_user(username, password)) {
-        current_user = find_user_by_username(username);
-        printf(COLOR_GREEN "\nWelcome, %s.\n" COLOR_RESET, current_user->username);
-    } else {
-        printf(COLOR_RED "\nInvalid Password or Username.\n" COLOR_RESET);
-    }
-
-    printf("\nPress Enter to continue...");
-    getchar();
-}
-
-/* ===================== MAIN APPLICATION FLOW ===================== */
-
-void admin_flow() {
-    while (current_user && current_user->role == ROLE_ADMIN) {
-        show_admin_menu();
-
-        char choice_str[10];
-        read_line(choice_str, sizeof(choice_str));
-        int choice = atoi(choice_str);
-
-        switch (choice) {
-            case 1:
-                add_patient_form();
-                break;
-            case 2:
-                view_all_patients();
-                break;
-            case 3:
-                search_patient_menu();
-                break;
-            case 4:
-                modify_patient_form();
-                break;
-            case 5:
-                delete_patient_form();
-                break;
-            case 6:
-                registration_flow(0);
-                break;
-            case 7:
-                current_user = NULL;
-                return;
-            default:
-                printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
-                printf("\nPress Enter to continue...");
-                getchar();
-                break;
-        }
-    }
-}
-
-void moderator_flow() {
-    while (current_user && current_user->role == ROLE_MODERATOR) {
-        show_moderator_menu();
-
-        char choice_str[10];
-        read_line(choice_str, sizeof(choice_str));
-        int choice = atoi(choice_str);
-
-        switch (choice) {
-            case 1:
-                add_patient_form();
-                break;
-            case 2:
-                view_all_patients();
-                break;
-            case 3:
-                search_patient_menu();
-                break;
-            case 4:
-                current_user = NULL;
-                return;
-            default:
-                printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
-                printf("\nPress Enter to continue...");
-                getchar();
-                break;
-        }
-    }
-}
-
-int main() {
-    load_users();
-    load_patients();
-
-    while (1) {
-        if (current_user) {
-            if (current_user->role == ROLE_ADMIN) {
-                admin_flow();
-            } else {
-                moderator_flow();
-            }
-        } else {
-            if (user_count == 0) {
-                clear_screen();
-                print_centered_title("PATIENT RECORD MANAGEMENT SYSTEM");
-                printf("No users found. Please Register First User.\n\n");
-                registration_flow(1);
-            } else {
-                show_startup_menu();
-
-                char choice_str[10];
-                read_line(choice_str, sizeof(choice_str));
-                int choice = atoi(choice_str);
-
-                switch (choice) {
-                    case 1:
-                        login_flow();
-                        break;
-                    case 2:
-                        clear_screen();
-                        printf("Thank you for using Patient Record Management System!\n");
-                        return 0;
-                    default:
-                        printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
-                        printf("\nPress Enter to continue...");
-                        getchar();
-                        break;
-                }
-            }
-        }
-    }
-
-    return 0;
-}
+#define _CRT_SECURE_NO_WARNINGS
+#define _CRT_RAND_S
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#else
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <termios.h>
+#define HAVE_PTHREADS
+#define IO_BACKGROUND
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define IO_URING
+#endif
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define TEXT_SIMD
+#define CRYPTO_AESNI
+#define CRC32C_SSE42
+#endif
+
+#define MAX_USERS 100
+#define MAX_PATIENTS 1000
+#define MAX_USERNAME_LEN 50
+#define MAX_PASSWORD_LEN 50
+#define MAX_NAME_LEN 128
+#define MAX_GUARDIAN_LEN 128
+#define MAX_ADDRESS_LEN 256
+#define MAX_DISEASE_LEN 200
+#define MAX_DOCTOR_LEN 100
+#define MAX_BLOOD_GROUP_LEN 8
+#define SCREEN_WIDTH 80
+#define HEADER_WIDTH 40
+#define MAX_SEARCH_RESULTS 100
+#define TEXT_PATTERN_LEN 256
+#define DEFAULT_COUNTRY_CODE "880"
+#define PHONE_MIN_DIGITS 8
+#define PHONE_MAX_DIGITS 15
+#define PHONE_TEXT_LEN 20
+#define PATIENT_PAGE_SIZE 20
+#define FUZZY_TOKEN_LEN 64
+#define PHONETIC_WORD_LEN 16
+#define PHONETIC_KEY_LEN 64
+#define PHONETIC_BUCKETS 2048
+#define AUTOCOMPLETE_TOP_K 5
+#define ARCHIVE_AFTER_YEARS 5
+#define ARCHIVE_BLOCK_SIZE 16384
+#define ARCHIVE_BLOCK_HEADER 12
+#define ARCHIVE_SEGMENT_SIZE (4 * 1024 * 1024)
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MIN_MATCH 4
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+#define EXPORT_CHUNK_SIZE (64 * 1024)
+#define BTREE_PAGE_SIZE 4096
+#define BTREE_PAGE_LEAF 1
+#define BTREE_PAGE_INTERNAL 2
+#define BTREE_LEAF_HEADER 12
+#define BTREE_LEAF_ENTRY 16
+#define BTREE_LEAF_MAX ((BTREE_PAGE_SIZE - BTREE_LEAF_HEADER) / BTREE_LEAF_ENTRY)
+#define BTREE_INTERNAL_HEADER 8
+#define BTREE_INTERNAL_ENTRY 8
+#define BTREE_INTERNAL_MAX ((BTREE_PAGE_SIZE - BTREE_INTERNAL_HEADER) / BTREE_INTERNAL_ENTRY)
+#define BTREE_MAX_DEPTH 16
+#define BTREE_MIN_POOL_PAGES 8
+#define BTREE_MAX_RECORD 1024
+#define JOURNAL_CHECKPOINT_RECORDS 1000
+#define SLOT_SIZE 256
+#define SLOT_HEADER 12
+#define SLOT_INLINE (SLOT_SIZE - SLOT_HEADER)
+#define OVERFLOW_PAGE_SIZE 256
+#define OVERFLOW_DATA (OVERFLOW_PAGE_SIZE - 4)
+#define IO_RING_ENTRIES 64
+#define IO_MAX_FILES 16
+#define GROUP_COMMIT_FILES 16
+#define SCAN_MAX_THREADS 64
+#define SCAN_MORSEL_SIZE 128
+#define SCAN_PARALLEL_MIN_RECORDS 4096
+#define DUPLICATE_PHONE_SUFFIX 7
+#define DUPLICATE_MAX_BLOCK 256
+#define DUPLICATE_MIN_SCORE 80
+#define DUPLICATE_BLOCK_BATCH 64
+#define DUPLICATE_SHOWN 20
+#define REPLICA_LINE_LEN (BTREE_MAX_RECORD + 64)
+#define REPLICA_TAIL_SIZE (2 * REPLICA_LINE_LEN)
+#define FEED_LINE_LEN (2 * BTREE_MAX_RECORD + 64)
+#define MAX_CHANGE_LISTENERS 8
+#define MAIN_BRANCH "main"
+#define BRANCH_NAME_LEN 32
+#define BRANCH_PATH_LEN 96
+#define MAX_BRANCHES 64
+#define MAX_OPEN_BRANCHES 16
+#define QUERY_CACHE_ENTRIES 32
+#define QUERY_CACHE_IDS 256
+#define MAX_SESSION_SCREENS 64
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS 1024
+#define BITMAP_MAX_AGE 150
+#define BITMAP_FIRST_YEAR 1900
+#define RECORD_CHECKSUM_LEN 9
+#define VERIFY_SHOWN 20
+#define SECURE_MAGIC "PRMSENC1"
+#define SECURE_HEADER_SIZE 16
+#define SECURE_CHUNK_SIZE 65536
+#define SECURE_TAG_SIZE 16
+#define SECURE_FRAME_OVERHEAD (4 + 12 + SECURE_TAG_SIZE)
+#define KDF_ITERATIONS 200000
+#define KDF_SALT_SIZE 16
+
+#define COLOR_RED     "\033[31m"
+#define COLOR_GREEN   "\033[32m"
+#define COLOR_MAROON  "\033[38;5;88m"
+#define COLOR_RESET   "\033[0m"
+
+typedef enum {
+    ROLE_ADMIN,
+    ROLE_MODERATOR
+} UserRole;
+
+typedef struct {
+    int user_id;
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+    UserRole role;
+    int is_active;
+} User;
+
+/*
+ * The patient record, one line per field in file order:
+ *   X(tag, member, kind, size, dictionary, label, column, min, max)
+ * kind decides how a field is stored, coded and shown:
+ *   INT   - int, written in decimal, valid within [min, max]
+ *   TEXT  - char[size], written as is
+ *   CODE  - int code into dictionary; written as the value, or as the code
+ *           in the dictionary-encoded patients.txt
+ *   PHONE - packed E.164 number, written in national form
+ *   FLAG  - int within [min, max], not shown in detail views
+ * column names the field in exports and dictionary lines. The struct, the
+ * record parsers and writers, the detail printer, the validator and the
+ * export columns are generated from this table.
+ */
+#define PATIENT_FIELDS(X) \
+    X(FIELD_ID,                id,                INT,   0,                none,             "ID",                "id",                1, 2000000000) \
+    X(FIELD_NAME,              name,              TEXT,  MAX_NAME_LEN,     none,             "Name",              "name",              0, 0) \
+    X(FIELD_GUARDIAN,          guardian,          TEXT,  MAX_GUARDIAN_LEN, none,             "Guardian",          "guardian",          0, 0) \
+    X(FIELD_GENDER,            gender,            CODE,  0,                gender_dict,      "Gender",            "gender",            0, 0) \
+    X(FIELD_AGE,               age,               INT,   0,                none,             "Age",               "age",               1, 150) \
+    X(FIELD_BLOOD_GROUP,       blood_group,       CODE,  0,                blood_group_dict, "Blood Group",       "blood_group",       0, 0) \
+    X(FIELD_PHONE,             phone,             PHONE, 0,                none,             "Phone",             "phone",             0, 0) \
+    X(FIELD_ADDRESS,           address,           CODE,  0,                address_dict,     "Address",           "address",           0, 0) \
+    X(FIELD_DISEASE,           disease,           CODE,  0,                disease_dict,     "Disease",           "disease",           0, 0) \
+    X(FIELD_DOCTOR,            referred_doctor,   CODE,  0,                doctor_dict,      "Referred Doctor",   "referred_doctor",   0, 0) \
+    X(FIELD_REGISTRATION_DATE, registration_date, TEXT,  20,               none,             "Registration Date", "registration_date", 0, 0) \
+    X(FIELD_IS_ACTIVE,         is_active,         FLAG,  0,                none,             "Active",            "is_active",         0, 1)
+
+#define MEMBER_INT(member, size) int member;
+#define MEMBER_TEXT(member, size) char member[size];
+#define MEMBER_CODE(member, size) int member;
+#define MEMBER_PHONE(member, size) uint64_t member;
+#define MEMBER_FLAG(member, size) int member;
+#define PATIENT_MEMBER(tag, member, kind, size, dict, label, column, min, max) MEMBER_##kind(member, size)
+
+typedef struct {
+    PATIENT_FIELDS(PATIENT_MEMBER)
+} Patient;
+
+#define FIELD_TAG(tag, member, kind, size, dict, label, column, min, max) tag,
+
+typedef enum {
+    PATIENT_FIELDS(FIELD_TAG)
+    FIELD_COUNT
+} PatientField;
+
+/* Dictionary columns, numbered in schema order: FIELD_GENDER_COLUMN, ... */
+#define COLUMN_TAG_INT(tag)
+#define COLUMN_TAG_TEXT(tag)
+#define COLUMN_TAG_CODE(tag) tag##_COLUMN,
+#define COLUMN_TAG_PHONE(tag)
+#define COLUMN_TAG_FLAG(tag)
+#define COLUMN_TAG(tag, member, kind, size, dict, label, column, min, max) COLUMN_TAG_##kind(tag)
+
+enum {
+    PATIENT_FIELDS(COLUMN_TAG)
+    DICTIONARY_COLUMN_COUNT
+};
+
+User users[MAX_USERS];
+Patient patients[MAX_PATIENTS];
+int user_count = 0;
+int patient_count = 0;
+int next_user_id = 1;
+int next_patient_id = 1;
+User *current_user = NULL;
+
+/* ===================== SESSION RECORDING ===================== */
+
+/*
+ * Record and replay of operator sessions, for timing the menu flows.
+ *
+ * --record <trace> writes every piece of input the program consumes to
+ * the trace, one line each:
+ *   <ms since start>|<input; backslash, newline and control bytes escaped>
+ * The data passphrase and passwords are left out; set PRMS_PASSPHRASE and
+ * PRMS_PASSWORD when replaying.
+ *
+ * --replay <trace> feeds the recorded input back without waiting, with
+ * clear_screen a no-op. The time from handing over one input to the
+ * next request for input is charged to the screen whose title was shown
+ * last, and a table per screen goes to stderr when the input runs out
+ * or the operator exits.
+ */
+typedef enum {
+    SESSION_LIVE,
+    SESSION_RECORD,
+    SESSION_REPLAY
+} SessionMode;
+
+typedef struct {
+    int screen;
+    long long us;
+} SessionSample;
+
+typedef struct {
+    SessionMode mode;
+    FILE *trace;               /* record: where input is written */
+    char *input;               /* replay: the recorded input stream */
+    size_t input_len;
+    size_t input_pos;
+    long long recorded_ms;     /* replay: length of the recorded session */
+    long long started_us;
+    long long resumed_us;      /* when input was last handed over; 0 before */
+    int secret;                /* the pending line is not recorded */
+    int screen;                /* screen last titled */
+    char screens[MAX_SESSION_SCREENS][HEADER_WIDTH + 1];
+    int screen_count;
+    SessionSample *samples;
+    size_t sample_count;
+    size_t sample_capacity;
+} Session;
+
+Session session = {SESSION_LIVE};
+
+/* Called when a replay runs out of input; saves and exits. */
+void (*session_end_handler)(void) = NULL;
+
+long long session_clock_us() {
+#ifdef _WIN32
+    LARGE_INTEGER now;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (long long)(now.QuadPart / frequency.QuadPart * 1000000 +
+                       now.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+int session_screen_index(const char *title) {
+    for (int i = 0; i < session.screen_count; i++) {
+        if (strcmp(session.screens[i], title) == 0) return i;
+    }
+    if (session.screen_count == MAX_SESSION_SCREENS) {
+        return MAX_SESSION_SCREENS - 1;
+    }
+    snprintf(session.screens[session.screen_count], sizeof(session.screens[0]), "%s", title);
+    return session.screen_count++;
+}
+
+void session_note_screen(const char *title) {
+    if (session.mode == SESSION_REPLAY) {
+        session.screen = session_screen_index(title);
+    }
+}
+
+void session_input_requested() {
+    if (session.mode != SESSION_REPLAY) {
+        return;
+    }
+
+    long long now = session_clock_us();
+    SessionSample sample;
+    if (session.resumed_us == 0) {
+        sample.screen = session_screen_index("(startup)");
+        sample.us = now - session.started_us;
+    } else {
+        sample.screen = session.screen;
+        sample.us = now - session.resumed_us;
+    }
+
+    if (session.sample_count == session.sample_capacity) {
+        size_t capacity = session.sample_capacity ? session.sample_capacity * 2 : 256;
+        SessionSample *grown = realloc(session.samples, capacity * sizeof(SessionSample));
+        if (!grown) return;
+        session.samples = grown;
+        session.sample_capacity = capacity;
+    }
+    session.samples[session.sample_count++] = sample;
+}
+
+void session_input_returned() {
+    if (session.mode == SESSION_REPLAY) {
+        session.resumed_us = session_clock_us();
+    }
+}
+
+void session_record(const char *input, size_t len) {
+    if (session.mode != SESSION_RECORD || session.secret) {
+        return;
+    }
+
+    fprintf(session.trace, "%lld|", (session_clock_us() - session.started_us) / 1000);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)input[i];
+        if (c == '\\') {
+            fputs("\\\\", session.trace);
+        } else if (c == '\n') {
+            fputs("\\n", session.trace);
+        } else if (c < 0x20 || c == 0x7f) {
+            fprintf(session.trace, "\\x%02x", c);
+        } else {
+            fputc(c, session.trace);
+        }
+    }
+    fputc('\n', session.trace);
+    fflush(session.trace);
+}
+
+/* Ends the replay once the recorded input is used up. */
+int session_input_left() {
+    if (session.input_pos < session.input_len) {
+        return 1;
+    }
+    if (session_end_handler) {
+        session_end_handler();
+    }
+    return 0;
+}
+
+/* fgets over the recorded input. */
+char *session_replay_gets(char *buffer, int max_len) {
+    int len = 0;
+
+    if (!session_input_left()) {
+        return NULL;
+    }
+    while (len < max_len - 1 && session.input_pos < session.input_len) {
+        char c = session.input[session.input_pos++];
+        buffer[len++] = c;
+        if (c == '\n') break;
+    }
+    buffer[len] = '\0';
+    return buffer;
+}
+
+int session_replay_char() {
+    if (!session_input_left()) {
+        return EOF;
+    }
+    return (unsigned char)session.input[session.input_pos++];
+}
+
+int session_start_record(const char *path) {
+    session.trace = fopen(path, "w");
+    if (!session.trace) {
+        perror(path);
+        return 0;
+    }
+    session.mode = SESSION_RECORD;
+    session.started_us = session_clock_us();
+    return 1;
+}
+
+/*
+ * Reads one whole line of a trace into *line, growing it as needed; an
+ * escaped input can be four times as long as what was typed. Returns 1,
+ * 0 at the end of the file, or -1 when memory runs out.
+ */
+int read_trace_line(FILE *trace, char **line, size_t *capacity) {
+    size_t len = 0;
+
+    while (1) {
+        if (*capacity - len < 2) {
+            size_t grown_capacity = *capacity ? *capacity * 2 : 1024;
+            char *grown = realloc(*line, grown_capacity);
+            if (!grown) return -1;
+            *line = grown;
+            *capacity = grown_capacity;
+        }
+        if (!fgets(*line + len, (int)(*capacity - len), trace)) {
+            return len > 0;
+        }
+        len += strlen(*line + len);
+        if ((*line)[len - 1] == '\n') return 1;
+    }
+}
+
+int session_start_replay(const char *path) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int status = 0;
+    FILE *trace = fopen(path, "r");
+    if (!trace) {
+        perror(path);
+        return 0;
+    }
+
+    size_t capacity = 4096;
+    session.input = malloc(capacity);
+    while (session.input && (status = read_trace_line(trace, &line, &line_capacity)) > 0) {
+        char *text = strchr(line, '|');
+        if (!text) continue;
+        session.recorded_ms = atoll(line);
+        text++;
+        text[strcspn(text, "\n")] = '\0';
+
+        if (session.input_len + strlen(text) > capacity) {
+            capacity = capacity * 2 + strlen(text);
+            char *grown = realloc(session.input, capacity);
+            if (!grown) {
+                free(session.input);
+                session.input = NULL;
+                break;
+            }
+            session.input = grown;
+        }
+        for (char *p = text; *p; p++) {
+            char c = *p;
+            unsigned int byte;
+            if (c == '\\' && p[1] == 'n') {
+                c = '\n';
+                p++;
+            } else if (c == '\\' && p[1] == 'x' && sscanf(p + 2, "%2x", &byte) == 1) {
+                c = (char)byte;
+                p += 3;
+            } else if (c == '\\' && p[1] == '\\') {
+                p++;
+            }
+            session.input[session.input_len++] = c;
+        }
+    }
+    fclose(trace);
+    free(line);
+
+    if (!session.input || status < 0) {
+        free(session.input);
+        session.input = NULL;
+        fprintf(stderr, "Not enough memory for %s.\n", path);
+        return 0;
+    }
+    session.mode = SESSION_REPLAY;
+    session.started_us = session_clock_us();
+    return 1;
+}
+
+int compare_sample_us(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void session_report() {
+    long long *times = malloc((session.sample_count ? session.sample_count : 1) * sizeof(long long));
+    long long total_us = session_clock_us() - session.started_us;
+
+    if (!times) return;
+    fprintf(stderr, "\nReplayed %zu inputs in %.3f s (recorded session: %.1f s).\n",
+            session.sample_count, total_us / 1e6, session.recorded_ms / 1e3);
+    fprintf(stderr, "%-40s %7s %10s %9s %9s %9s\n", "Screen", "Inputs", "Total ms", "Mean ms", "p95 ms", "Max ms");
+
+    for (int s = 0; s < session.screen_count; s++) {
+        size_t count = 0;
+        long long sum = 0;
+        for (size_t i = 0; i < session.sample_count; i++) {
+            if (session.samples[i].screen == s) {
+                times[count++] = session.samples[i].us;
+                sum += session.samples[i].us;
+            }
+        }
+        if (count == 0) continue;
+
+        qsort(times, count, sizeof(long long), compare_sample_us);
+        fprintf(stderr, "%-40s %7zu %10.2f %9.3f %9.3f %9.3f\n", session.screens[s], count,
+                sum / 1e3, sum / 1e3 / count, times[count * 95 / 100] / 1e3,
+                times[count - 1] / 1e3);
+    }
+    free(times);
+}
+
+/* Reports a replay, or closes the trace being recorded. */
+void session_finish() {
+    if (session.mode == SESSION_REPLAY) {
+        session_report();
+    } else if (session.mode == SESSION_RECORD) {
+        fclose(session.trace);
+    }
+    session.mode = SESSION_LIVE;
+}
+
+/* ===================== HELPER FUNCTIONS ===================== */
+
+int read_line(char *buffer, int max_len) {
+    session_input_requested();
+    char *line = session.mode == SESSION_REPLAY ? session_replay_gets(buffer, max_len)
+                                                : fgets(buffer, max_len, stdin);
+    session_input_returned();
+    if (line == NULL) {
+        return 0;
+    }
+    session_record(buffer, strlen(buffer));
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 1;
+}
+
+/*
+ * Reads a login or new-account password. It is left out of a recorded
+ * trace, and a replay takes it from PRMS_PASSWORD instead, the way the
+ * data passphrase comes from PRMS_PASSPHRASE.
+ */
+int read_password(char *buffer, int max_len) {
+    if (session.mode == SESSION_REPLAY) {
+        const char *env = getenv("PRMS_PASSWORD");
+        if (!env) {
+            fprintf(stderr, "The session types a password; set PRMS_PASSWORD to replay it.\n");
+            if (session_end_handler) session_end_handler();
+            return 0;
+        }
+        snprintf(buffer, max_len, "%s", env);
+        return 1;
+    }
+
+    session.secret = 1;
+    int entered = read_line(buffer, max_len);
+    session.secret = 0;
+    return entered;
+}
+
+/* getchar() for the "Press Enter" pauses, recorded and replayed. */
+int read_char() {
+    session_input_requested();
+    int c = session.mode == SESSION_REPLAY ? session_replay_char() : getchar();
+    session_input_returned();
+    if (c != EOF) {
+        char byte = (char)c;
+        session_record(&byte, 1);
+    }
+    return c;
+}
+
+void trim(char *str) {
+    int i = 0, j = 0;
+    int len = (int)strlen(str);
+
+    while (isspace((unsigned char)str[i])) i++;
+
+    if (i > 0) {
+        for (j = 0; i <= len; i++, j++) {
+            str[j] = str[i];
+        }
+    }
+
+    len = (int)strlen(str);
+    while (len > 0 && isspace((unsigned char)str[len - 1])) {
+        str[len - 1] = '\0';
+        len--;
+    }
+}
+
+int is_digits_only(const char *str) {
+    for (int i = 0; str[i] != '\0'; i++) {
+        if (!isdigit((unsigned char)str[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int contains_pipe(const char *str) {
+    return strchr(str, '|') != NULL;
+}
+
+void get_current_date(char *buffer) {
+    time_t t = time(NULL);
+    struct tm *tm_info = localtime(&t);
+    strftime(buffer, 20, "%Y-%m-%d", tm_info);
+}
+
+void clear_screen() {
+    if (session.mode == SESSION_REPLAY) {
+        return;
+    }
+#ifdef _WIN32
+    system("cls");
+#else
+    system("clear");
+#endif
+}
+
+void print_centered(const char *text) {
+    int width = 80;
+    int text_len = (int)strlen(text);
+    int padding = (width - text_len) / 2;
+    if (padding < 0) padding = 0;
+
+    printf("%*s%s\n", padding, "", text);
+}
+
+void print_centered_title(const char *title) {
+    session_note_screen(title);
+    int width = 80;
+    int header_width = 40;
+    int left_margin = (width - header_width) / 2;
+    if (left_margin < 0) left_margin = 0;
+
+    int title_len = (int)strlen(title);
+    int inner_pad = (header_width - title_len) / 2;
+    if (inner_pad < 0) inner_pad = 0;
+
+    printf("\n%s%*s", COLOR_MAROON, left_margin, "");
+    for (int i = 0; i < header_width; i++) printf("=");
+    printf("\n");
+
+    printf("%*s%*s%s\n", left_margin, "", inner_pad, "", title);
+
+    printf("%*s", left_margin, "");
+    for (int i = 0; i < header_width; i++) printf("=");
+    printf("%s\n\n", COLOR_RESET);
+}
+
+void put_u32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+    p[3] = (unsigned char)(value >> 24);
+}
+
+uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+void put_u16(unsigned char *p, uint16_t value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+void put_u64(unsigned char *p, uint64_t value) {
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/* ===================== TEXT MATCHING ===================== */
+
+/*
+ * Case-insensitive (ASCII) substring search straight over stored fields.
+ * A pattern is folded once per query. The kernel compares the pattern's
+ * first and last bytes against a whole vector of candidate positions at a
+ * time and checks the rest only where both match. The widest kernel the
+ * CPU supports is picked at run time: AVX2, then SSE2, then plain C.
+ *
+ * A letter folds by setting bit 0x20, and that maps only 'A'-'Z' onto
+ * 'a'-'z', so OR-ing the haystack with the pattern byte's fold bit and
+ * comparing is an exact case-insensitive test.
+ */
+typedef struct {
+    char text[TEXT_PATTERN_LEN];
+    int len;
+    unsigned char first;
+    unsigned char last;
+    unsigned char first_fold;
+    unsigned char last_fold;
+} TextPattern;
+
+unsigned char fold_bit(unsigned char c) {
+    return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ? 0x20 : 0;
+}
+
+unsigned char fold_char(unsigned char c) {
+    return (unsigned char)(c | fold_bit(c));
+}
+
+/* Compares len bytes of text with the folded pattern bytes. */
+int folded_equals(const char *text, const char *folded, int len) {
+    for (int i = 0; i < len; i++) {
+        if (fold_char((unsigned char)text[i]) != (unsigned char)folded[i]) return 0;
+    }
+    return 1;
+}
+
+int text_find_scalar(const char *text, size_t len, const TextPattern *pattern) {
+    size_t n = (size_t)pattern->len;
+
+    for (size_t i = 0; i + n <= len; i++) {
+        if (((unsigned char)text[i] | pattern->first_fold) == pattern->first &&
+            ((unsigned char)text[i + n - 1] | pattern->last_fold) == pattern->last &&
+            folded_equals(text + i + 1, pattern->text + 1, (int)n - 2)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef TEXT_SIMD
+
+int candidates_match(const char *text, uint32_t mask, const TextPattern *pattern) {
+    while (mask) {
+        int bit = __builtin_ctz(mask);
+        if (folded_equals(text + bit + 1, pattern->text + 1, pattern->len - 2)) return 1;
+        mask &= mask - 1;
+    }
+    return 0;
+}
+
+int text_find_sse2(const char *text, size_t len, const TextPattern *pattern) {
+    size_t n = (size_t)pattern->len;
+    const __m128i first = _mm_set1_epi8((char)pattern->first);
+    const __m128i last = _mm_set1_epi8((char)pattern->last);
+    const __m128i first_fold = _mm_set1_epi8((char)pattern->first_fold);
+    const __m128i last_fold = _mm_set1_epi8((char)pattern->last_fold);
+    size_t i = 0;
+
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i head = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i)), first_fold);
+        __m128i tail = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + i + n - 1)), last_fold);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        if (mask && candidates_match(text + i, mask, pattern)) return 1;
+    }
+    return text_find_scalar(text + i, len - i, pattern);
+}
+
+__attribute__((target("avx2")))
+int text_find_avx2(const char *text, size_t len, const TextPattern *pattern) {
+    size_t n = (size_t)pattern->len;
+    const __m256i first = _mm256_set1_epi8((char)pattern->first);
+    const __m256i last = _mm256_set1_epi8((char)pattern->last);
+    const __m256i first_fold = _mm256_set1_epi8((char)pattern->first_fold);
+    const __m256i last_fold = _mm256_set1_epi8((char)pattern->last_fold);
+    size_t i = 0;
+
+    for (; i + n - 1 + 32 <= len; i += 32) {
+        __m256i head = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i)), first_fold);
+        __m256i tail = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + i + n - 1)), last_fold);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        if (mask && candidates_match(text + i, mask, pattern)) return 1;
+    }
+    return text_find_sse2(text + i, len - i, pattern);
+}
+
+#endif
+
+int (*text_find_kernel)(const char *, size_t, const TextPattern *) = NULL;
+
+/* Picks the kernel once; called from the main thread before any scan. */
+void select_text_kernel() {
+    if (text_find_kernel) return;
+    text_find_kernel = text_find_scalar;
+#ifdef TEXT_SIMD
+    __builtin_cpu_init();
+    text_find_kernel = __builtin_cpu_supports("avx2") ? text_find_avx2 : text_find_sse2;
+#endif
+}
+
+void text_pattern_init(TextPattern *pattern, const char *needle) {
+    int len = 0;
+
+    select_text_kernel();
+    for (; needle[len] && len < TEXT_PATTERN_LEN - 1; len++) {
+        pattern->text[len] = (char)fold_char((unsigned char)needle[len]);
+    }
+    pattern->text[len] = '\0';
+    pattern->len = len;
+    pattern->first = (unsigned char)pattern->text[0];
+    pattern->last = len ? (unsigned char)pattern->text[len - 1] : 0;
+    pattern->first_fold = fold_bit(pattern->first);
+    pattern->last_fold = fold_bit(pattern->last);
+}
+
+/* An empty pattern is found in every text. */
+int text_contains(const char *text, const TextPattern *pattern) {
+    if (pattern->len == 0) return 1;
+    if (pattern->len == 1) {
+        for (; *text; text++) {
+            if (((unsigned char)*text | pattern->first_fold) == pattern->first) return 1;
+        }
+        return 0;
+    }
+    return text_find_kernel(text, strlen(text), pattern);
+}
+
+/* Case-insensitive (ASCII) equality without copying either side. */
+int text_equals(const char *a, const char *b) {
+    while (*a && fold_char((unsigned char)*a) == fold_char((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return *a == '\0' && *b == '\0';
+}
+
+/* ===================== CONFIGURATION ===================== */
+
+typedef enum {
+    STORAGE_TEXT,
+    STORAGE_BTREE,
+    STORAGE_SLOTS
+} StorageMode;
+
+/*
+ * When committed writes are forced to disk with fsync:
+ *   sync  - after every operation; nothing acknowledged is lost.
+ *   group - once per group_commit_ms window, by the first commit after the
+ *           window closes, and at logout and exit. A power failure can lose
+ *           the operations committed since the last sync.
+ *   os    - never; the OS writes back on its own schedule, so a power
+ *           failure can lose anything it has not written back yet.
+ * Every mode hands data to the OS before reporting success, so a crash
+ * of this program alone loses nothing.
+ */
+typedef enum {
+    DURABILITY_SYNC,
+    DURABILITY_GROUP,
+    DURABILITY_OS
+} Durability;
+
+typedef enum {
+    REPLICA_PRIMARY,
+    REPLICA_STANDBY
+} ReplicaRole;
+
+/*
+ * Deployment settings, read from config.txt as "key=value" lines.
+ * Missing file or keys keep the defaults below.
+ */
+typedef struct {
+    StorageMode storage;
+    int buffer_pool_pages;
+    Durability durability;
+    int group_commit_ms;
+    int background_io;
+    int lazy_load;
+    int scan_threads;
+    char replica_dir[192];
+    ReplicaRole replica_role;
+    int open_branches;
+    int encryption;
+    int change_feed;
+} Config;
+
+Config config = {STORAGE_TEXT, 64, DURABILITY_GROUP, 50, 1, 0, 0, "", REPLICA_PRIMARY, 4, 0, 0};
+
+void load_config() {
+    char line[256];
+    char key[64];
+    char value[192];
+
+    FILE *file = fopen("config.txt", "r");
+    if (!file) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || sscanf(line, " %63[^= ] = %191[^\n]", key, value) != 2) {
+            continue;
+        }
+        trim(value);
+
+        if (strcmp(key, "storage") == 0) {
+            if (strcmp(value, "btree") == 0) {
+                config.storage = STORAGE_BTREE;
+            } else if (strcmp(value, "slots") == 0) {
+                config.storage = STORAGE_SLOTS;
+            } else {
+                config.storage = STORAGE_TEXT;
+            }
+        } else if (strcmp(key, "buffer_pool_pages") == 0) {
+            config.buffer_pool_pages = atoi(value);
+            if (config.buffer_pool_pages < BTREE_MIN_POOL_PAGES) {
+                config.buffer_pool_pages = BTREE_MIN_POOL_PAGES;
+            }
+        } else if (strcmp(key, "durability") == 0) {
+            if (strcmp(value, "sync") == 0) {
+                config.durability = DURABILITY_SYNC;
+            } else if (strcmp(value, "os") == 0) {
+                config.durability = DURABILITY_OS;
+            } else {
+                config.durability = DURABILITY_GROUP;
+            }
+        } else if (strcmp(key, "group_commit_ms") == 0) {
+            config.group_commit_ms = atoi(value);
+            if (config.group_commit_ms < 0) config.group_commit_ms = 0;
+        } else if (strcmp(key, "background_io") == 0) {
+            config.background_io = (strcmp(value, "off") != 0);
+        } else if (strcmp(key, "lazy_load") == 0) {
+            config.lazy_load = (strcmp(value, "on") == 0);
+        } else if (strcmp(key, "scan_threads") == 0) {
+            config.scan_threads = atoi(value);
+            if (config.scan_threads < 0) config.scan_threads = 0;
+        } else if (strcmp(key, "replica_dir") == 0) {
+            snprintf(config.replica_dir, sizeof(config.replica_dir), "%s", value);
+        } else if (strcmp(key, "replica_role") == 0) {
+            config.replica_role = (strcmp(value, "standby") == 0) ? REPLICA_STANDBY : REPLICA_PRIMARY;
+        } else if (strcmp(key, "open_branches") == 0) {
+            config.open_branches = atoi(value);
+            if (config.open_branches < 1) config.open_branches = 1;
+            if (config.open_branches > MAX_OPEN_BRANCHES) config.open_branches = MAX_OPEN_BRANCHES;
+        } else if (strcmp(key, "encryption") == 0) {
+            config.encryption = (strcmp(value, "on") == 0);
+        } else if (strcmp(key, "change_feed") == 0) {
+            config.change_feed = (strcmp(value, "on") == 0);
+        }
+    }
+
+    /* Lazy loading seeks to record offsets, which ciphertext does not have. */
+    if (config.encryption) {
+        config.lazy_load = 0;
+    }
+
+    fclose(file);
+}
+
+/* Rewrites one "key=value" line of config.txt, appending it if missing. */
+int save_config_value(const char *key, const char *value) {
+    char line[256];
+    char existing[64];
+    int replaced = 0;
+
+    FILE *in = fopen("config.txt", "r");
+    FILE *out = fopen("config.txt.tmp", "w");
+    if (!out) {
+        if (in) fclose(in);
+        return 0;
+    }
+
+    while (in && fgets(line, sizeof(line), in)) {
+        if (line[0] != '#' && sscanf(line, " %63[^= ]", existing) == 1 && strcmp(existing, key) == 0) {
+            fprintf(out, "%s=%s\n", key, value);
+            replaced = 1;
+        } else {
+            fputs(line, out);
+        }
+    }
+    if (!replaced) {
+        fprintf(out, "%s=%s\n", key, value);
+    }
+    if (in) fclose(in);
+
+    if (fclose(out) != 0) {
+        remove("config.txt.tmp");
+        return 0;
+    }
+#ifdef _WIN32
+    return MoveFileExA("config.txt.tmp", "config.txt", MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename("config.txt.tmp", "config.txt") == 0;
+#endif
+}
+
+/* ===================== DURABILITY ===================== */
+
+long long monotonic_ms() {
+#ifdef _WIN32
+    return (long long)GetTickCount64();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+/* Milliseconds since the Unix epoch; comparable between processes. */
+long long wall_clock_ms() {
+#ifdef _WIN32
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    long long ticks = ((long long)now.dwHighDateTime << 32) | now.dwLowDateTime;
+    return (ticks - 116444736000000000LL) / 10000;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+int sync_file(FILE *file) {
+    if (fflush(file) != 0) {
+        return 0;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+FILE *open_or_create(const char *path) {
+    FILE *file = fopen(path, "r+b");
+    if (!file) file = fopen(path, "w+b");
+    return file;
+}
+
+/* Positional I/O on the file's descriptor; the FILE buffer is bypassed. */
+int write_at(FILE *file, uint64_t offset, const void *data, size_t len) {
+#ifdef _WIN32
+    int fd = _fileno(file);
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return 0;
+    return _write(fd, data, (unsigned int)len) == (int)len;
+#else
+    return pwrite(fileno(file), data, len, (off_t)offset) == (ssize_t)len;
+#endif
+}
+
+int read_at(FILE *file, uint64_t offset, void *data, size_t len) {
+#ifdef _WIN32
+    int fd = _fileno(file);
+    if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return 0;
+    return _read(fd, data, (unsigned int)len) == (int)len;
+#else
+    return pread(fileno(file), data, len, (off_t)offset) == (ssize_t)len;
+#endif
+}
+
+int truncate_file(FILE *file, uint64_t size) {
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), (__int64)size) == 0;
+#else
+    return ftruncate(fileno(file), (off_t)size) == 0;
+#endif
+}
+
+/* fseek and ftell with 64-bit offsets; long is 32 bits on Windows. */
+int file_seek(FILE *file, uint64_t offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, whence) == 0;
+#else
+    return fseeko(file, (off_t)offset, whence) == 0;
+#endif
+}
+
+int64_t file_tell(FILE *file) {
+#ifdef _WIN32
+    return (int64_t)_ftelli64(file);
+#else
+    return (int64_t)ftello(file);
+#endif
+}
+
+/* Moves to the end of file and returns its size, or 0 on failure. */
+uint64_t file_size(FILE *file) {
+    int64_t size = file_seek(file, 0, SEEK_END) ? file_tell(file) : -1;
+    return size > 0 ? (uint64_t)size : 0;
+}
+
+/* Puts a fully written temporary file in place of path in one step. */
+int replace_file(const char *temporary, const char *path) {
+#ifdef _WIN32
+    return MoveFileExA(temporary, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if (rename(temporary, path) != 0) {
+        perror(path);
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+/* Operations committed but not yet covered by an fsync, and the files
+ * they wrote. The journal, replication log and change feed share one
+ * window, so whichever commit closes it syncs them all. */
+typedef struct {
+    int pending;
+    long long window_start_ms;
+    FILE *files[GROUP_COMMIT_FILES];
+    int file_count;
+} GroupCommit;
+
+GroupCommit group_commit = {0};
+
+/* Syncs every file written in the window and closes it. */
+int group_commit_sync() {
+    GroupCommit *group = &group_commit;
+    int ok = 1;
+
+    for (int i = 0; i < group->file_count; i++) {
+        if (!sync_file(group->files[i])) ok = 0;
+    }
+    group->file_count = 0;
+    group->pending = 0;
+    return ok;
+}
+
+int group_commit_note(FILE *file) {
+    GroupCommit *group = &group_commit;
+
+    for (int i = 0; i < group->file_count; i++) {
+        if (group->files[i] == file) return 1;
+    }
+    /* Out of room: sync early rather than lose track of a file. */
+    int ok = group->file_count < GROUP_COMMIT_FILES || group_commit_sync();
+    group->files[group->file_count++] = file;
+    return ok;
+}
+
+/*
+ * Commit point for one operation whose data is already written to files.
+ * force syncs outstanding work right away (logout, exit, checkpoints)
+ * unless durability is os. A file must not be closed while it is still
+ * waiting for its sync; io_flush() first.
+ */
+int durable_commit(FILE **files, int file_count, int force) {
+    GroupCommit *group = &group_commit;
+
+    for (int i = 0; i < file_count; i++) {
+        if (fflush(files[i]) != 0) return 0;
+    }
+
+    if (config.durability == DURABILITY_OS) {
+        return 1;
+    }
+    for (int i = 0; i < file_count; i++) {
+        if (!group_commit_note(files[i])) return 0;
+    }
+    if (!force) {
+        if (group->pending++ == 0) {
+            group->window_start_ms = monotonic_ms();
+        }
+        if (config.durability == DURABILITY_GROUP &&
+            monotonic_ms() - group->window_start_ms < config.group_commit_ms) {
+            return 1;
+        }
+    }
+
+    return group_commit_sync();
+}
+
+/* ===================== ENCRYPTION ===================== */
+
+/*
+ * With encryption=on, patients.txt, patients.journal and users.txt are
+ * sealed with AES-256-GCM under a key derived from a passphrase with
+ * PBKDF2-HMAC-SHA256. The passphrase comes from PRMS_PASSPHRASE or is asked
+ * for at startup. encryption.txt keeps the salt, the iteration count and a
+ * check value, so a wrong passphrase is told apart from a damaged file.
+ *
+ * A sealed file is a header (magic and a random file ID) followed by
+ * chunks of up to SECURE_CHUNK_SIZE bytes, each with its own tag:
+ *   [be32 length | final bit][ciphertext][tag]
+ * The nonce is the file ID and the chunk number, and the length word is
+ * authenticated, so chunks cannot be reordered, moved between files or
+ * cut off after a chunk boundary. Loads and saves stream chunk by chunk.
+ * AES-NI and PCLMULQDQ are used when the CPU has them, plain C otherwise.
+ */
+uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void put_be32(unsigned char *p, uint32_t value) {
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+void sha256_compress(uint32_t state[8], const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = get_be32(block + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(Sha256 *ctx) {
+    const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    ctx->length += len;
+    while (len > 0) {
+        size_t n = 64 - ctx->used;
+        if (n > len) n = len;
+        memcpy(ctx->block + ctx->used, bytes, n);
+        ctx->used += n;
+        bytes += n;
+        len -= n;
+        if (ctx->used == 64) {
+            sha256_compress(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(Sha256 *ctx, unsigned char digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (ctx->used < 56 ? 56 : 120) - ctx->used;
+
+    put_be32(pad + pad_len, (uint32_t)(bits >> 32));
+    put_be32(pad + pad_len + 4, (uint32_t)bits);
+    sha256_update(ctx, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        put_be32(digest + 4 * i, ctx->state[i]);
+    }
+}
+
+/* HMAC-SHA256 with the padded key already absorbed, for repeated use. */
+typedef struct {
+    Sha256 inner;
+    Sha256 outer;
+} HmacSha256;
+
+void hmac_sha256_init(HmacSha256 *hmac, const void *key, size_t key_len) {
+    unsigned char block[64] = {0};
+
+    if (key_len > sizeof(block)) {
+        Sha256 ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_len);
+        sha256_final(&ctx, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    for (int i = 0; i < 64; i++) block[i] ^= 0x36;
+    sha256_init(&hmac->inner);
+    sha256_update(&hmac->inner, block, sizeof(block));
+    for (int i = 0; i < 64; i++) block[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&hmac->outer);
+    sha256_update(&hmac->outer, block, sizeof(block));
+    memset(block, 0, sizeof(block));
+}
+
+void hmac_sha256(const HmacSha256 *hmac, const void *data, size_t len, unsigned char mac[32]) {
+    Sha256 ctx = hmac->inner;
+    unsigned char digest[32];
+
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+    ctx = hmac->outer;
+    sha256_update(&ctx, digest, sizeof(digest));
+    sha256_final(&ctx, mac);
+}
+
+/* PBKDF2 (RFC 8018) with HMAC-SHA256; salt is at most 60 bytes. */
+void pbkdf2_sha256(const char *passphrase, const unsigned char *salt, size_t salt_len,
+                   uint32_t iterations, unsigned char *out, size_t out_len) {
+    HmacSha256 hmac;
+    unsigned char message[64];
+
+    hmac_sha256_init(&hmac, passphrase, strlen(passphrase));
+    memcpy(message, salt, salt_len);
+
+    for (uint32_t block = 1; out_len > 0; block++) {
+        unsigned char u[32];
+        unsigned char t[32];
+        size_t n = out_len < sizeof(t) ? out_len : sizeof(t);
+
+        put_be32(message + salt_len, block);
+        hmac_sha256(&hmac, message, salt_len + 4, u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            hmac_sha256(&hmac, u, sizeof(u), u);
+            for (int j = 0; j < 32; j++) t[j] ^= u[j];
+        }
+
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+    memset(&hmac, 0, sizeof(hmac));
+}
+
+/* AES-256 key schedule, as big-endian words for the C rounds and as the
+ * same bytes in order for AES-NI. */
+typedef struct {
+    uint32_t words[60];
+    unsigned char bytes[240];
+} AesKey;
+
+unsigned char aes_sbox[256];
+uint32_t aes_table[256];
+
+unsigned char aes_xtime(unsigned char x) {
+    return (unsigned char)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+unsigned char rotl8(unsigned char x, int n) {
+    return (unsigned char)((x << n) | (x >> (8 - n)));
+}
+
+/*
+ * Fills the S-box by walking the multiplicative group with generator 3
+ * and its inverse at once, then the round table of {2s, s, s, 3s}
+ * columns; the other three tables are byte rotations of it.
+ */
+void aes_build_tables() {
+    unsigned char p = 1;
+    unsigned char q = 1;
+
+    if (aes_sbox[0]) return;
+    do {
+        p = (unsigned char)(p ^ aes_xtime(p));
+        q ^= (unsigned char)(q << 1);
+        q ^= (unsigned char)(q << 2);
+        q ^= (unsigned char)(q << 4);
+        if (q & 0x80) q ^= 0x09;
+        aes_sbox[p] = (unsigned char)(q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4) ^ 0x63);
+    } while (p != 1);
+    aes_sbox[0] = 0x63;
+
+    for (int i = 0; i < 256; i++) {
+        unsigned char s = aes_sbox[i];
+        unsigned char s2 = aes_xtime(s);
+        aes_table[i] = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint32_t)(s2 ^ s);
+    }
+}
+
+uint32_t aes_sub_word(uint32_t word) {
+    return ((uint32_t)aes_sbox[word >> 24] << 24) | ((uint32_t)aes_sbox[(word >> 16) & 0xff] << 16) |
+           ((uint32_t)aes_sbox[(word >> 8) & 0xff] << 8) | aes_sbox[word & 0xff];
+}
+
+void aes256_expand(AesKey *key, const unsigned char secret[32]) {
+    uint32_t *w = key->words;
+    unsigned char rcon = 0x01;
+
+    aes_build_tables();
+    for (int i = 0; i < 8; i++) {
+        w[i] = get_be32(secret + 4 * i);
+    }
+    for (int i = 8; i < 60; i++) {
+        uint32_t t = w[i - 1];
+        if (i % 8 == 0) {
+            t = aes_sub_word((t << 8) | (t >> 24)) ^ ((uint32_t)rcon << 24);
+            rcon = aes_xtime(rcon);
+        } else if (i % 8 == 4) {
+            t = aes_sub_word(t);
+        }
+        w[i] = w[i - 8] ^ t;
+    }
+    for (int i = 0; i < 60; i++) {
+        put_be32(key->bytes + 4 * i, w[i]);
+    }
+}
+
+#define AES_COLUMN(a, b, c, d) \
+    (aes_table[(a) >> 24] ^ ROTR32(aes_table[((b) >> 16) & 0xff], 8) ^ \
+     ROTR32(aes_table[((c) >> 8) & 0xff], 16) ^ ROTR32(aes_table[(d) & 0xff], 24))
+
+#define AES_LAST_COLUMN(a, b, c, d) \
+    (((uint32_t)aes_sbox[(a) >> 24] << 24) | ((uint32_t)aes_sbox[((b) >> 16) & 0xff] << 16) | \
+     ((uint32_t)aes_sbox[((c) >> 8) & 0xff] << 8) | aes_sbox[(d) & 0xff])
+
+void aes256_encrypt_block(const AesKey *key, const unsigned char in[16], unsigned char out[16]) {
+    const uint32_t *rk = key->words;
+    uint32_t s0 = get_be32(in) ^ rk[0];
+    uint32_t s1 = get_be32(in + 4) ^ rk[1];
+    uint32_t s2 = get_be32(in + 8) ^ rk[2];
+    uint32_t s3 = get_be32(in + 12) ^ rk[3];
+
+    for (int round = 1; round < 14; round++) {
+        rk += 4;
+        uint32_t t0 = AES_COLUMN(s0, s1, s2, s3) ^ rk[0];
+        uint32_t t1 = AES_COLUMN(s1, s2, s3, s0) ^ rk[1];
+        uint32_t t2 = AES_COLUMN(s2, s3, s0, s1) ^ rk[2];
+        uint32_t t3 = AES_COLUMN(s3, s0, s1, s2) ^ rk[3];
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+
+    rk += 4;
+    put_be32(out, AES_LAST_COLUMN(s0, s1, s2, s3) ^ rk[0]);
+    put_be32(out + 4, AES_LAST_COLUMN(s1, s2, s3, s0) ^ rk[1]);
+    put_be32(out + 8, AES_LAST_COLUMN(s2, s3, s0, s1) ^ rk[2]);
+    put_be32(out + 12, AES_LAST_COLUMN(s3, s0, s1, s2) ^ rk[3]);
+}
+
+/* The GCM key: the cipher, H = E(0) and Shoup's 4-bit tables of H. */
+typedef struct {
+    AesKey aes;
+    unsigned char h[16];
+    uint64_t table_high[16];
+    uint64_t table_low[16];
+} GcmKey;
+
+void gcm_counter_block(unsigned char block[16], const unsigned char nonce[12], uint32_t counter) {
+    memcpy(block, nonce, 12);
+    put_be32(block + 12, counter);
+}
+
+/* CTR mode from counter 2; counter 1 is kept for the tag. */
+void gcm_ctr_soft(const GcmKey *key, const unsigned char nonce[12],
+                  const unsigned char *in, unsigned char *out, size_t len) {
+    unsigned char block[16];
+    unsigned char stream[16];
+    uint32_t counter = 2;
+
+    while (len > 0) {
+        size_t n = len < 16 ? len : 16;
+        gcm_counter_block(block, nonce, counter++);
+        aes256_encrypt_block(&key->aes, block, stream);
+        for (size_t i = 0; i < n; i++) out[i] = in[i] ^ stream[i];
+        in += n;
+        out += n;
+        len -= n;
+    }
+}
+
+const uint64_t ghash_reduce4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+/* x = x * H in GF(2^128), four bits of x at a time. */
+void ghash_multiply(const GcmKey *key, unsigned char x[16]) {
+    int low = x[15] & 0xf;
+    uint64_t zh = key->table_high[low];
+    uint64_t zl = key->table_low[low];
+
+    for (int i = 15; i >= 0; i--) {
+        int high = x[i] >> 4;
+        int rem;
+
+        low = x[i] & 0xf;
+        if (i != 15) {
+            rem = (int)(zl & 0xf);
+            zl = (zh << 60) | (zl >> 4);
+            zh = (zh >> 4) ^ (ghash_reduce4[rem] << 48) ^ key->table_high[low];
+            zl ^= key->table_low[low];
+        }
+        rem = (int)(zl & 0xf);
+        zl = (zh << 60) | (zl >> 4);
+        zh = (zh >> 4) ^ (ghash_reduce4[rem] << 48) ^ key->table_high[high];
+        zl ^= key->table_low[high];
+    }
+
+    put_be32(x, (uint32_t)(zh >> 32));
+    put_be32(x + 4, (uint32_t)zh);
+    put_be32(x + 8, (uint32_t)(zl >> 32));
+    put_be32(x + 12, (uint32_t)zl);
+}
+
+/* Folds data, zero-padded to whole blocks, into the hash x. */
+void ghash_soft(const GcmKey *key, unsigned char x[16], const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < 16 ? len : 16;
+        for (size_t i = 0; i < n; i++) x[i] ^= data[i];
+        ghash_multiply(key, x);
+        data += n;
+        len -= n;
+    }
+}
+
+#ifdef CRYPTO_AESNI
+
+__attribute__((target("aes,sse4.1")))
+void gcm_ctr_aesni(const GcmKey *key, const unsigned char nonce[12],
+                   const unsigned char *in, unsigned char *out, size_t len) {
+    __m128i rk[15];
+    unsigned char first[16];
+    uint32_t counter = 2;
+
+    for (int r = 0; r < 15; r++) {
+        rk[r] = _mm_loadu_si128((const __m128i *)(key->aes.bytes + 16 * r));
+    }
+    gcm_counter_block(first, nonce, 0);
+    const __m128i base = _mm_loadu_si128((const __m128i *)first);
+
+    while (len > 0) {
+        __m128i b[4];
+        for (int k = 0; k < 4; k++) {
+            b[k] = _mm_xor_si128(_mm_insert_epi32(base, (int)__builtin_bswap32(counter + (uint32_t)k), 3), rk[0]);
+        }
+        counter += 4;
+        for (int r = 1; r < 14; r++) {
+            for (int k = 0; k < 4; k++) b[k] = _mm_aesenc_si128(b[k], rk[r]);
+        }
+        for (int k = 0; k < 4; k++) b[k] = _mm_aesenclast_si128(b[k], rk[14]);
+
+        if (len >= 64) {
+            for (int k = 0; k < 4; k++) {
+                __m128i data = _mm_loadu_si128((const __m128i *)(in + 16 * k));
+                _mm_storeu_si128((__m128i *)(out + 16 * k), _mm_xor_si128(data, b[k]));
+            }
+            in += 64;
+            out += 64;
+            len -= 64;
+        } else {
+            unsigned char stream[64];
+            for (int k = 0; k < 4; k++) _mm_storeu_si128((__m128i *)(stream + 16 * k), b[k]);
+            for (size_t i = 0; i < len; i++) out[i] = in[i] ^ stream[i];
+            len = 0;
+        }
+    }
+}
+
+/* Carry-less multiply of byte-reversed operands with the shift-and-reduce
+ * of Intel's GCM white paper. */
+__attribute__((target("pclmul,ssse3")))
+__m128i ghash_clmul(__m128i a, __m128i b) {
+    __m128i lo = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i hi = _mm_clmulepi64_si128(a, b, 0x11);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    /* Shift the 256-bit product left by one bit. */
+    __m128i lo_carry = _mm_srli_epi32(lo, 31);
+    __m128i hi_carry = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    __m128i cross = _mm_srli_si128(lo_carry, 12);
+    hi_carry = _mm_slli_si128(hi_carry, 4);
+    lo_carry = _mm_slli_si128(lo_carry, 4);
+    lo = _mm_or_si128(lo, lo_carry);
+    hi = _mm_or_si128(hi, _mm_or_si128(hi_carry, cross));
+
+    /* Reduce modulo x^128 + x^7 + x^2 + x + 1. */
+    __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    __m128i carry = _mm_srli_si128(t, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+    __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    u = _mm_xor_si128(u, carry);
+    lo = _mm_xor_si128(lo, u);
+    return _mm_xor_si128(hi, lo);
+}
+
+__attribute__((target("pclmul,ssse3")))
+void ghash_pclmul(const GcmKey *key, unsigned char x[16], const unsigned char *data, size_t len) {
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)key->h), reverse);
+    __m128i acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)x), reverse);
+
+    for (; len >= 16; data += 16, len -= 16) {
+        __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), reverse);
+        acc = ghash_clmul(_mm_xor_si128(acc, block), h);
+    }
+    if (len > 0) {
+        unsigned char last[16] = {0};
+        memcpy(last, data, len);
+        __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)last), reverse);
+        acc = ghash_clmul(_mm_xor_si128(acc, block), h);
+    }
+    _mm_storeu_si128((__m128i *)x, _mm_shuffle_epi8(acc, reverse));
+}
+
+#endif
+
+void (*gcm_ctr_kernel)(const GcmKey *, const unsigned char *, const unsigned char *, unsigned char *, size_t) = NULL;
+void (*ghash_kernel)(const GcmKey *, unsigned char *, const unsigned char *, size_t) = NULL;
+
+/* Picks the kernels once; called from the main thread before any use. */
+void select_crypto_kernels() {
+    if (gcm_ctr_kernel) return;
+    gcm_ctr_kernel = gcm_ctr_soft;
+    ghash_kernel = ghash_soft;
+#ifdef CRYPTO_AESNI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.1")) {
+        gcm_ctr_kernel = gcm_ctr_aesni;
+        ghash_kernel = ghash_pclmul;
+    }
+#endif
+}
+
+void gcm_init(GcmKey *key, const unsigned char secret[32]) {
+    unsigned char zero[16] = {0};
+
+    select_crypto_kernels();
+    aes256_expand(&key->aes, secret);
+    aes256_encrypt_block(&key->aes, zero, key->h);
+
+    uint64_t vh = ((uint64_t)get_be32(key->h) << 32) | get_be32(key->h + 4);
+    uint64_t vl = ((uint64_t)get_be32(key->h + 8) << 32) | get_be32(key->h + 12);
+    key->table_high[0] = key->table_low[0] = 0;
+    key->table_high[8] = vh;
+    key->table_low[8] = vl;
+    for (int i = 4; i > 0; i >>= 1) {
+        uint64_t reduce = (vl & 1) ? 0xe100000000000000ULL : 0;
+        vl = (vh << 63) | (vl >> 1);
+        vh = (vh >> 1) ^ reduce;
+        key->table_high[i] = vh;
+        key->table_low[i] = vl;
+    }
+    for (int i = 2; i <= 8; i *= 2) {
+        for (int j = 1; j < i; j++) {
+            key->table_high[i + j] = key->table_high[i] ^ key->table_high[j];
+            key->table_low[i + j] = key->table_low[i] ^ key->table_low[j];
+        }
+    }
+}
+
+void gcm_tag(const GcmKey *key, const unsigned char nonce[12], const unsigned char *aad, size_t aad_len,
+             const unsigned char *ciphertext, size_t len, unsigned char tag[16]) {
+    unsigned char x[16] = {0};
+    unsigned char lengths[16];
+    unsigned char j0[16];
+
+    ghash_kernel(key, x, aad, aad_len);
+    ghash_kernel(key, x, ciphertext, len);
+    put_be32(lengths, (uint32_t)((uint64_t)aad_len >> 29));
+    put_be32(lengths + 4, (uint32_t)(aad_len << 3));
+    put_be32(lengths + 8, (uint32_t)((uint64_t)len >> 29));
+    put_be32(lengths + 12, (uint32_t)(len << 3));
+    ghash_kernel(key, x, lengths, sizeof(lengths));
+
+    gcm_counter_block(j0, nonce, 1);
+    aes256_encrypt_block(&key->aes, j0, tag);
+    for (int i = 0; i < 16; i++) tag[i] ^= x[i];
+}
+
+/* Encrypts len bytes (in and out may be the same) and writes the tag. */
+void gcm_seal(const GcmKey *key, const unsigned char nonce[12], const unsigned char *aad, size_t aad_len,
+              const unsigned char *in, unsigned char *out, size_t len, unsigned char tag[16]) {
+    gcm_ctr_kernel(key, nonce, in, out, len);
+    gcm_tag(key, nonce, aad, aad_len, out, len, tag);
+}
+
+/* Decrypts only if the tag matches; returns 0 otherwise. */
+int gcm_open(const GcmKey *key, const unsigned char nonce[12], const unsigned char *aad, size_t aad_len,
+             const unsigned char *in, unsigned char *out, size_t len, const unsigned char tag[16]) {
+    unsigned char expected[16];
+    unsigned char diff = 0;
+
+    gcm_tag(key, nonce, aad, aad_len, in, len, expected);
+    for (int i = 0; i < 16; i++) diff |= (unsigned char)(expected[i] ^ tag[i]);
+    if (diff) {
+        return 0;
+    }
+    gcm_ctr_kernel(key, nonce, in, out, len);
+    return 1;
+}
+
+int random_bytes(unsigned char *out, size_t len) {
+#ifdef _WIN32
+    for (size_t i = 0; i < len; i++) {
+        unsigned int value;
+        if (rand_s(&value) != 0) return 0;
+        out[i] = (unsigned char)value;
+    }
+    return 1;
+#else
+    FILE *source = fopen("/dev/urandom", "rb");
+    if (!source) {
+        return 0;
+    }
+    int filled = fread(out, 1, len, source) == len;
+    fclose(source);
+    return filled;
+#endif
+}
+
+/* The data key once unlocked, and the nonce source for journal frames. */
+typedef struct {
+    int unlocked;
+    GcmKey key;
+    unsigned char session[8];
+    uint32_t next_nonce;
+} Crypto;
+
+Crypto crypto = {0};
+
+/* Session prefix and counter; unique for every frame this run seals. */
+void next_frame_nonce(unsigned char nonce[12]) {
+    memcpy(nonce, crypto.session, sizeof(crypto.session));
+    put_be32(nonce + 8, crypto.next_nonce++);
+}
+
+void hex_encode(const unsigned char *data, size_t len, char *text) {
+    for (size_t i = 0; i < len; i++) {
+        sprintf(text + 2 * i, "%02x", data[i]);
+    }
+}
+
+int hex_decode(const char *text, unsigned char *data, size_t len) {
+    if (strlen(text) != 2 * len) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(text + 2 * i, "%2x", &byte) != 1) return 0;
+        data[i] = (unsigned char)byte;
+    }
+    return 1;
+}
+
+void key_check_value(const unsigned char key[32], unsigned char check[32]) {
+    HmacSha256 hmac;
+    hmac_sha256_init(&hmac, key, 32);
+    hmac_sha256(&hmac, "prms key check", 14, check);
+}
+
+/* Reads the passphrase from PRMS_PASSPHRASE, else from the terminal
+ * without echoing it. */
+int read_passphrase(char *buffer, int size) {
+    const char *env = getenv("PRMS_PASSPHRASE");
+    int entered;
+
+    if (env && *env) {
+        snprintf(buffer, size, "%s", env);
+        return 1;
+    }
+
+    printf("Data passphrase: ");
+    fflush(stdout);
+#ifdef _WIN32
+    HANDLE console = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD mode = 0;
+    int hidden = GetConsoleMode(console, &mode) &&
+                 SetConsoleMode(console, mode & ~(DWORD)ENABLE_ECHO_INPUT);
+    session.secret = 1;
+    entered = read_line(buffer, size);
+    session.secret = 0;
+    if (hidden) {
+        SetConsoleMode(console, mode);
+        printf("\n");
+    }
+#else
+    struct termios saved;
+    int hidden = 0;
+    if (tcgetattr(STDIN_FILENO, &saved) == 0) {
+        struct termios quiet = saved;
+        quiet.c_lflag &= ~(tcflag_t)ECHO;
+        hidden = tcsetattr(STDIN_FILENO, TCSAFLUSH, &quiet) == 0;
+    }
+    session.secret = 1;
+    entered = read_line(buffer, size);
+    session.secret = 0;
+    if (hidden) {
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+        printf("\n");
+    }
+#endif
+    return entered && buffer[0];
+}
+
+/*
+ * Derives the data key. encryption.txt holds "iterations|salt|check" in
+ * hex; it is created with a fresh salt the first time. Returns 0 for a
+ * wrong passphrase or a missing or unreadable key file.
+ */
+int crypto_unlock() {
+    char passphrase[256];
+    char line[256];
+    char salt_hex[2 * KDF_SALT_SIZE + 1];
+    char check_hex[65];
+    unsigned char salt[KDF_SALT_SIZE];
+    unsigned char check[32];
+    unsigned char expected[32];
+    unsigned char secret[32];
+    unsigned long iterations = KDF_ITERATIONS;
+    int existing = 0;
+
+    if (crypto.unlocked) {
+        return 1;
+    }
+
+    FILE *file = fopen("encryption.txt", "r");
+    if (file) {
+        int valid = fgets(line, sizeof(line), file) &&
+                    sscanf(line, "%lu|%32[0-9a-f]|%64[0-9a-f]", &iterations, salt_hex, check_hex) == 3 &&
+                    iterations > 0 && hex_decode(salt_hex, salt, sizeof(salt)) &&
+                    hex_decode(check_hex, expected, sizeof(expected));
+        fclose(file);
+        if (!valid) {
+            fprintf(stderr, "encryption.txt is damaged.\n");
+            return 0;
+        }
+        existing = 1;
+    } else if (!random_bytes(salt, sizeof(salt))) {
+        fprintf(stderr, "No random source to create a key with.\n");
+        return 0;
+    }
+
+    if (!random_bytes(crypto.session, sizeof(crypto.session))) {
+        fprintf(stderr, "No random source to create a key with.\n");
+        return 0;
+    }
+    if (!read_passphrase(passphrase, sizeof(passphrase))) {
+        return 0;
+    }
+    pbkdf2_sha256(passphrase, salt, sizeof(salt), (uint32_t)iterations, secret, sizeof(secret));
+    memset(passphrase, 0, sizeof(passphrase));
+    key_check_value(secret, check);
+
+    if (existing && memcmp(check, expected, sizeof(check)) != 0) {
+        memset(secret, 0, sizeof(secret));
+        fprintf(stderr, COLOR_RED "Wrong passphrase.\n" COLOR_RESET);
+        return 0;
+    }
+    if (!existing) {
+        hex_encode(salt, sizeof(salt), salt_hex);
+        hex_encode(check, sizeof(check), check_hex);
+        file = fopen("encryption.txt", "w");
+        if (!file || fprintf(file, "%lu|%s|%s\n", iterations, salt_hex, check_hex) < 0 || fclose(file) != 0) {
+            memset(secret, 0, sizeof(secret));
+            perror("Error writing encryption.txt");
+            return 0;
+        }
+    }
+
+    gcm_init(&crypto.key, secret);
+    memset(secret, 0, sizeof(secret));
+    crypto.unlocked = 1;
+    return 1;
+}
+
+/*
+ * Only patients.txt, the journal and users.txt are encrypted. Settings
+ * that keep patient records in other files are refused with encryption=on
+ * rather than leave plaintext copies beside the sealed ones.
+ */
+int encryption_settings_ok() {
+    const char *setting = NULL;
+
+    if (config.storage == STORAGE_BTREE) {
+        setting = "storage=btree";
+    } else if (config.storage == STORAGE_SLOTS) {
+        setting = "storage=slots";
+    } else if (config.change_feed) {
+        setting = "change_feed=on";
+    } else if (config.replica_dir[0]) {
+        setting = "replica_dir";
+    } else if (session.mode == SESSION_RECORD) {
+        setting = "--record";
+    }
+
+    if (setting) {
+        fprintf(stderr, "encryption=on cannot be used with %s, which writes patient records unencrypted.\n", setting);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * A data file read or written through the chunk format when sealed, or
+ * through stdio when plain. Readers detect the format from the header,
+ * so plain files from before encryption was turned on still load.
+ */
+typedef struct {
+    FILE *file;
+    int encrypted;
+    int finished;
+    int failed;
+    unsigned char file_id[8];
+    uint32_t chunk_index;
+    unsigned char *chunk;
+    size_t chunk_len;
+    size_t chunk_pos;
+} SecureFile;
+
+int secure_file_sealed(const char *path) {
+    char magic[8];
+    FILE *file = fopen(path, "rb");
+    int sealed = file && fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(magic, SECURE_MAGIC, sizeof(magic)) == 0;
+    if (file) fclose(file);
+    return sealed;
+}
+
+int secure_open_read(SecureFile *file, const char *path) {
+    unsigned char header[SECURE_HEADER_SIZE];
+
+    memset(file, 0, sizeof(*file));
+    file->file = fopen(path, "rb");
+    if (!file->file) {
+        return 0;
+    }
+
+    if (fread(header, 1, sizeof(header), file->file) == sizeof(header) &&
+        memcmp(header, SECURE_MAGIC, 8) == 0) {
+        memcpy(file->file_id, header + 8, sizeof(file->file_id));
+        file->encrypted = 1;
+        file->chunk = malloc(SECURE_CHUNK_SIZE);
+        if (!file->chunk || !crypto_unlock()) {
+            file->failed = 1;
+        }
+        return 1;
+    }
+
+    fclose(file->file);
+    file->file = fopen(path, "r");
+    return file->file != NULL;
+}
+
+int secure_read_chunk(SecureFile *file) {
+    unsigned char header[4];
+    unsigned char nonce[12];
+    unsigned char tag[SECURE_TAG_SIZE];
+
+    if (file->finished || file->failed) {
+        return 0;
+    }
+
+    /* Running out before the final chunk means the file was cut short. */
+    if (fread(header, 1, sizeof(header), file->file) != sizeof(header)) {
+        file->failed = 1;
+        return 0;
+    }
+    uint32_t word = get_be32(header);
+    size_t len = word & 0x7fffffff;
+    if (len > SECURE_CHUNK_SIZE || fread(file->chunk, 1, len, file->file) != len ||
+        fread(tag, 1, sizeof(tag), file->file) != sizeof(tag)) {
+        file->failed = 1;
+        return 0;
+    }
+
+    memcpy(nonce, file->file_id, sizeof(file->file_id));
+    put_be32(nonce + 8, file->chunk_index++);
+    if (!gcm_open(&crypto.key, nonce, header, sizeof(header), file->chunk, file->chunk, len, tag)) {
+        file->failed = 1;
+        return 0;
+    }
+
+    file->finished = (word >> 31) != 0;
+    if (file->finished && fgetc(file->file) != EOF) {
+        file->failed = 1;
+        return 0;
+    }
+    file->chunk_len = len;
+    file->chunk_pos = 0;
+    return 1;
+}
+
+/* fgets over either format. */
+char *secure_gets(char *line, int size, SecureFile *file) {
+    int len = 0;
+
+    if (!file->encrypted) {
+        return fgets(line, size, file->file);
+    }
+
+    while (len < size - 1) {
+        if (file->chunk_pos == file->chunk_len && !secure_read_chunk(file)) {
+            break;
+        }
+        size_t n = file->chunk_len - file->chunk_pos;
+        if (n > (size_t)(size - 1 - len)) n = (size_t)(size - 1 - len);
+
+        const unsigned char *start = file->chunk + file->chunk_pos;
+        const unsigned char *newline = memchr(start, '\n', n);
+        if (newline) n = (size_t)(newline - start) + 1;
+
+        memcpy(line + len, start, n);
+        len += (int)n;
+        file->chunk_pos += n;
+        if (newline) break;
+    }
+
+    if (len == 0) {
+        return NULL;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+/* Creates path sealed when encryption is on, plain otherwise. */
+int secure_open_write(SecureFile *file, const char *path) {
+    unsigned char header[SECURE_HEADER_SIZE];
+
+    memset(file, 0, sizeof(*file));
+    if (!config.encryption) {
+        file->file = fopen(path, "w");
+        return file->file != NULL;
+    }
+
+    file->file = fopen(path, "wb");
+    if (!file->file) {
+        return 0;
+    }
+    file->encrypted = 1;
+    file->chunk = malloc(SECURE_CHUNK_SIZE);
+    memcpy(header, SECURE_MAGIC, 8);
+    if (!file->chunk || !crypto.unlocked || !random_bytes(file->file_id, sizeof(file->file_id))) {
+        file->failed = 1;
+        return 1;
+    }
+    memcpy(header + 8, file->file_id, sizeof(file->file_id));
+    if (fwrite(header, 1, sizeof(header), file->file) != sizeof(header)) {
+        file->failed = 1;
+    }
+    return 1;
+}
+
+int secure_seal_chunk(SecureFile *file, int final) {
+    unsigned char header[4];
+    unsigned char nonce[12];
+    unsigned char tag[SECURE_TAG_SIZE];
+
+    put_be32(header, (uint32_t)file->chunk_len | (final ? 0x80000000U : 0));
+    memcpy(nonce, file->file_id, sizeof(file->file_id));
+    put_be32(nonce + 8, file->chunk_index++);
+    gcm_seal(&crypto.key, nonce, header, sizeof(header), file->chunk, file->chunk, file->chunk_len, tag);
+
+    if (fwrite(header, 1, sizeof(header), file->file) != sizeof(header) ||
+        fwrite(file->chunk, 1, file->chunk_len, file->file) != file->chunk_len ||
+        fwrite(tag, 1, sizeof(tag), file->file) != sizeof(tag)) {
+        file->failed = 1;
+    }
+    file->chunk_len = 0;
+    return !file->failed;
+}
+
+int secure_write(SecureFile *file, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+
+    if (!file->encrypted) {
+        return fwrite(data, 1, len, file->file) == len;
+    }
+
+    while (len > 0 && !file->failed) {
+        size_t n = SECURE_CHUNK_SIZE - file->chunk_len;
+        if (n > len) n = len;
+        memcpy(file->chunk + file->chunk_len, bytes, n);
+        file->chunk_len += n;
+        bytes += n;
+        len -= n;
+        if (file->chunk_len == SECURE_CHUNK_SIZE) {
+            secure_seal_chunk(file, 0);
+        }
+    }
+    return !file->failed;
+}
+
+int secure_printf(SecureFile *file, const char *format, ...) {
+    char line[1024];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line)) {
+        file->failed = 1;
+        return 0;
+    }
+    return secure_write(file, line, (size_t)len);
+}
+
+/* Seals the final chunk; everything is in the FILE buffer afterwards. */
+int secure_finish(SecureFile *file) {
+    if (file->encrypted && !file->finished && !file->failed) {
+        secure_seal_chunk(file, 1);
+        file->finished = 1;
+    }
+    return !file->failed && !ferror(file->file);
+}
+
+/* Returns 0 if anything failed, including authentication while reading. */
+int secure_close(SecureFile *file) {
+    int ok = !file->failed;
+
+    if (file->file && fclose(file->file) != 0) {
+        ok = 0;
+    }
+    if (file->chunk) {
+        memset(file->chunk, 0, SECURE_CHUNK_SIZE);
+        free(file->chunk);
+    }
+    file->file = NULL;
+    file->chunk = NULL;
+    return ok;
+}
+
+/* Called when a data file did not authenticate or was cut short. */
+void report_damaged_file(const char *path) {
+    fprintf(stderr, COLOR_RED "%s could not be decrypted: the file was damaged or altered.\n" COLOR_RESET, path);
+}
+
+/*
+ * Seals one record as a frame of patients.journal:
+ *   [be32 length][nonce][ciphertext][tag]
+ * A sealed journal therefore starts with a zero byte, which no plain
+ * journal line does. Returns the frame length.
+ */
+int seal_journal_frame(const char *line, int len, unsigned char *frame) {
+    put_be32(frame, (uint32_t)len);
+    next_frame_nonce(frame + 4);
+    gcm_seal(&crypto.key, frame + 4, frame, 4, (const unsigned char *)line, frame + 16, (size_t)len,
+             frame + 16 + len);
+    return len + SECURE_FRAME_OVERHEAD;
+}
+
+/* ===================== CHECKSUMS ===================== */
+
+/*
+ * CRC32C (Castagnoli polynomial), computed with the SSE4.2 crc32
+ * instruction when the CPU has it and a slicing-by-8 table otherwise.
+ * Record lines of patients.txt and patients.journal end with "|" and the
+ * CRC32C of the text before it as 8 hex digits; the last field of a
+ * record is its one-digit active flag, so the two cannot be confused.
+ */
+uint32_t crc32c_table[8][256];
+
+void crc32c_build_table() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t)i;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c_soft(uint32_t crc, const unsigned char *data, size_t len) {
+    for (; len >= 8; data += 8, len -= 8) {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 |
+                              (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t high = (uint32_t)data[4] | (uint32_t)data[5] << 8 |
+                        (uint32_t)data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+              crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xff] ^ crc32c_table[2][(high >> 8) & 0xff] ^
+              crc32c_table[1][(high >> 16) & 0xff] ^ crc32c_table[0][high >> 24];
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t len) {
+    uint64_t wide = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+#endif
+
+uint32_t (*crc32c_kernel)(uint32_t, const unsigned char *, size_t) = NULL;
+
+/* Picks the kernel once; called from the main thread before any use. */
+void select_crc32c_kernel() {
+    if (crc32c_kernel) return;
+    crc32c_build_table();
+    crc32c_kernel = crc32c_soft;
+#ifdef CRC32C_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_kernel = crc32c_sse42;
+    }
+#endif
+}
+
+/* Continues crc over data; a checksum starts from 0. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    select_crc32c_kernel();
+    return ~crc32c_kernel(~crc, (const unsigned char *)data, len);
+}
+
+/* Ends a record line of len bytes, newline included, with its checksum.
+ * Returns the new length, or -1 if it does not fit in size. */
+int seal_record_line(char *line, int len, int size) {
+    if (len <= 0 || len + RECORD_CHECKSUM_LEN >= size || line[len - 1] != '\n') {
+        return -1;
+    }
+    uint32_t crc = crc32c(0, line, (size_t)len - 1);
+    snprintf(line + len - 1, (size_t)(size - len + 1), "|%08x\n", (unsigned)crc);
+    return len + RECORD_CHECKSUM_LEN;
+}
+
+/*
+ * Checks a record line's checksum and cuts it off, leaving the line as it
+ * was before sealing. Returns 1 if it matches, -1 if not, and 0 for a line
+ * without one.
+ */
+int open_record_line(char *line) {
+    size_t len = strcspn(line, "\r\n");
+    if (len <= RECORD_CHECKSUM_LEN || line[len - RECORD_CHECKSUM_LEN] != '|') {
+        return 0;
+    }
+
+    char *hex = line + len - RECORD_CHECKSUM_LEN + 1;
+    for (int i = 0; i < RECORD_CHECKSUM_LEN - 1; i++) {
+        if (!isxdigit((unsigned char)hex[i])) return 0;
+    }
+    uint32_t stored = (uint32_t)strtoul(hex, NULL, 16);
+    uint32_t actual = crc32c(0, line, len - RECORD_CHECKSUM_LEN);
+
+    memmove(hex - 1, line + len, strlen(line + len) + 1);
+    return stored == actual ? 1 : -1;
+}
+
+/* ===================== BACKGROUND I/O ===================== */
+
+/*
+ * With background_io on (the default outside Windows), journal and slot
+ * writes are copied into a queue and performed by a dedicated thread, so
+ * menus never wait for the disk. The thread submits each batch through
+ * io_uring where the kernel allows it and falls back to pwrite otherwise.
+ * fsyncs follow the durability setting; because a batch is synced as a
+ * whole, concurrent commits share one fsync. io_flush() is the barrier
+ * used at logout and exit. A write that fails is reported through
+ * io_failure_handler, since the operation has already been acknowledged.
+ */
+typedef void (*IoFailureHandler)(const char *operation, int error);
+
+IoFailureHandler io_failure_handler = NULL;
+
+#ifdef IO_BACKGROUND
+
+typedef struct IoRequest {
+    int fd;
+    uint64_t offset;
+    struct iovec iov;
+    int commit;
+    struct IoRequest *next;
+} IoRequest;
+
+#ifdef IO_URING
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned entries;
+} IoRing;
+#endif
+
+typedef struct {
+    int running;
+    int stopping;
+    int busy;
+    int sync_requested;
+    IoRequest *head;
+    IoRequest *tail;
+    unsigned long failures;
+    int unsynced_fds[IO_MAX_FILES];
+    int unsynced_count;
+    int commit_pending;
+    long long window_start_ms;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+#ifdef IO_URING
+    int use_ring;
+    IoRing ring;
+#endif
+} IoThread;
+
+IoThread io = {0};
+
+void io_report_failure(const char *operation, int error) {
+    pthread_mutex_lock(&io.lock);
+    io.failures++;
+    pthread_mutex_unlock(&io.lock);
+    if (io_failure_handler) {
+        io_failure_handler(operation, error);
+    }
+}
+
+#ifdef IO_URING
+int io_ring_setup(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) {
+        sq_size = cq_size;
+    }
+
+    unsigned char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+
+    unsigned char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(ring->fd);
+            return 0;
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return 0;
+    }
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    return 1;
+}
+
+void io_ring_push(IoRing *ring, int opcode, int fd, const struct iovec *iov, uint64_t offset, uint64_t tag) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = iov ? 1 : 0;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits everything pushed and waits for all of it; tags of failed
+ * entries are passed to io_report_failure with the kernel's error. */
+int io_ring_run(IoRing *ring, int count, IoRequest **requests) {
+    int ok = 1;
+    int done = 0;
+
+    while (done < count) {
+        int submit = (done == 0) ? count : 0;
+        if (syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            if (errno == EINTR) continue;
+            io_report_failure("io_uring_enter", errno);
+            return 0;
+        }
+
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            IoRequest *request = requests ? requests[cqe->user_data] : NULL;
+            if (cqe->res < 0) {
+                io_report_failure(request ? "write" : "fsync", -cqe->res);
+                ok = 0;
+            } else if (request && (size_t)cqe->res != request->iov.iov_len) {
+                io_report_failure("write", EIO);
+                ok = 0;
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return ok;
+}
+#endif
+
+int io_overlaps(IoRequest **chunk, int count, const IoRequest *request) {
+    for (int i = 0; i < count; i++) {
+        if (chunk[i]->fd == request->fd &&
+            chunk[i]->offset < request->offset + request->iov.iov_len &&
+            request->offset < chunk[i]->offset + chunk[i]->iov.iov_len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Performs a chunk of writes to distinct byte ranges, in any order. */
+void io_write_chunk(IoRequest **chunk, int count) {
+#ifdef IO_URING
+    if (io.use_ring) {
+        for (int i = 0; i < count; i++) {
+            io_ring_push(&io.ring, IORING_OP_WRITEV, chunk[i]->fd, &chunk[i]->iov, chunk[i]->offset, (uint64_t)i);
+        }
+        io_ring_run(&io.ring, count, chunk);
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        ssize_t written = pwrite(chunk[i]->fd, chunk[i]->iov.iov_base, chunk[i]->iov.iov_len, (off_t)chunk[i]->offset);
+        if (written != (ssize_t)chunk[i]->iov.iov_len) {
+            io_report_failure("write", written < 0 ? errno : EIO);
+        }
+    }
+}
+
+void io_sync_all() {
+#ifdef IO_URING
+    if (io.use_ring) {
+        for (int i = 0; i < io.unsynced_count; i++) {
+            io_ring_push(&io.ring, IORING_OP_FSYNC, io.unsynced_fds[i], NULL, 0, 0);
+        }
+        io_ring_run(&io.ring, io.unsynced_count, NULL);
+        io.unsynced_count = 0;
+        return;
+    }
+#endif
+    for (int i = 0; i < io.unsynced_count; i++) {
+        if (fsync(io.unsynced_fds[i]) != 0) {
+            io_report_failure("fsync", errno);
+        }
+    }
+    io.unsynced_count = 0;
+}
+
+/* Remembers fd for the next sync. Returns 0 when the list is full; the
+ * caller then writes what it holds and syncs before trying again. */
+int io_note_unsynced(int fd) {
+    if (config.durability == DURABILITY_OS) {
+        return 1;
+    }
+    for (int i = 0; i < io.unsynced_count; i++) {
+        if (io.unsynced_fds[i] == fd) return 1;
+    }
+    if (io.unsynced_count == IO_MAX_FILES) {
+        return 0;
+    }
+    io.unsynced_fds[io.unsynced_count++] = fd;
+    return 1;
+}
+
+/* Writes one dequeued batch; returns how many commit points it held. */
+int io_process_batch(IoRequest *batch) {
+    IoRequest *chunk[IO_RING_ENTRIES];
+    int count = 0;
+    int commits = 0;
+
+    while (batch) {
+        IoRequest *request = batch;
+        batch = batch->next;
+
+        if (request->commit) {
+            commits++;
+            free(request);
+            continue;
+        }
+
+        int noted = io_note_unsynced(request->fd);
+        if (!noted || count == IO_RING_ENTRIES || io_overlaps(chunk, count, request)) {
+            io_write_chunk(chunk, count);
+            for (int i = 0; i < count; i++) {
+                free(chunk[i]->iov.iov_base);
+                free(chunk[i]);
+            }
+            count = 0;
+        }
+        if (!noted) {
+            /* Out of room: sync everything written so far, the chunk just
+             * written included, rather than lose track of a file. */
+            io_sync_all();
+            io_note_unsynced(request->fd);
+        }
+        chunk[count++] = request;
+    }
+
+    io_write_chunk(chunk, count);
+    for (int i = 0; i < count; i++) {
+        free(chunk[i]->iov.iov_base);
+        free(chunk[i]);
+    }
+    return commits;
+}
+
+void *io_thread_main(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&io.lock);
+
+    while (1) {
+        while (!io.head && !io.stopping && !io.sync_requested) {
+            if (io.commit_pending && config.durability == DURABILITY_GROUP) {
+                long long remaining = io.window_start_ms + config.group_commit_ms - monotonic_ms();
+                if (remaining <= 0) break;
+
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += remaining / 1000;
+                deadline.tv_nsec += (remaining % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&io.wake, &io.lock, &deadline);
+            } else {
+                pthread_cond_wait(&io.wake, &io.lock);
+            }
+        }
+
+        IoRequest *batch = io.head;
+        int sync_requested = io.sync_requested;
+        io.head = io.tail = NULL;
+        io.busy = 1;
+        pthread_mutex_unlock(&io.lock);
+
+        int commits = io_process_batch(batch);
+        if (commits > 0 && !io.commit_pending) {
+            io.commit_pending = 1;
+            io.window_start_ms = monotonic_ms();
+        }
+
+        int sync_now = 0;
+        if (config.durability == DURABILITY_SYNC) {
+            sync_now = sync_requested || commits > 0;
+        } else if (config.durability == DURABILITY_GROUP) {
+            sync_now = sync_requested ||
+                       (io.commit_pending && monotonic_ms() - io.window_start_ms >= config.group_commit_ms);
+        }
+        if (sync_now) {
+            io_sync_all();
+        }
+        if (sync_now || config.durability != DURABILITY_GROUP) {
+            io.commit_pending = 0;
+        }
+
+        pthread_mutex_lock(&io.lock);
+        io.busy = 0;
+        if (sync_requested) io.sync_requested = 0;
+        pthread_cond_broadcast(&io.idle);
+        if (io.stopping && !io.head) break;
+    }
+
+    pthread_mutex_unlock(&io.lock);
+    return NULL;
+}
+
+void io_enqueue(IoRequest *request) {
+    pthread_mutex_lock(&io.lock);
+    if (io.tail) {
+        io.tail->next = request;
+    } else {
+        io.head = request;
+    }
+    io.tail = request;
+    pthread_cond_signal(&io.wake);
+    pthread_mutex_unlock(&io.lock);
+}
+
+#endif
+
+int io_start() {
+#ifdef IO_BACKGROUND
+    if (io.running || !config.background_io) {
+        return io.running;
+    }
+
+    pthread_mutex_init(&io.lock, NULL);
+    pthread_cond_init(&io.wake, NULL);
+    pthread_cond_init(&io.idle, NULL);
+#ifdef IO_URING
+    io.use_ring = io_ring_setup(&io.ring, IO_RING_ENTRIES);
+#endif
+    if (pthread_create(&io.thread, NULL, io_thread_main, NULL) != 0) {
+        return 0;
+    }
+    io.running = 1;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Queues a positional write, or performs it now without the thread. */
+int io_write(FILE *file, uint64_t offset, const void *data, size_t len) {
+#ifdef IO_BACKGROUND
+    if (io.running) {
+        IoRequest *request = calloc(1, sizeof(IoRequest));
+        void *copy = malloc(len);
+        if (!request || !copy) {
+            free(request);
+            free(copy);
+            return 0;
+        }
+        memcpy(copy, data, len);
+        request->fd = fileno(file);
+        request->offset = offset;
+        request->iov.iov_base = copy;
+        request->iov.iov_len = len;
+        io_enqueue(request);
+        return 1;
+    }
+#endif
+    return write_at(file, offset, data, len);
+}
+
+/* Waits until every queued write has reached the OS. */
+void io_drain() {
+#ifdef IO_BACKGROUND
+    if (!io.running) return;
+    pthread_mutex_lock(&io.lock);
+    while (io.head || io.busy) {
+        pthread_cond_wait(&io.idle, &io.lock);
+    }
+    pthread_mutex_unlock(&io.lock);
+#endif
+}
+
+/* Barrier: queued writes are written and, unless durability is os, synced.
+ * Returns 0 if any background write has failed since the last flush. */
+int io_flush() {
+#ifdef IO_BACKGROUND
+    if (!io.running) return durable_commit(NULL, 0, 1);
+    pthread_mutex_lock(&io.lock);
+    unsigned long failures = io.failures;
+    io.sync_requested = 1;
+    pthread_cond_signal(&io.wake);
+    while (io.head || io.busy || io.sync_requested) {
+        pthread_cond_wait(&io.idle, &io.lock);
+    }
+    int ok = (io.failures == failures);
+    pthread_mutex_unlock(&io.lock);
+    return ok;
+#else
+    return durable_commit(NULL, 0, 1);
+#endif
+}
+
+/*
+ * Commit point for writes issued through io_write. Without the thread
+ * this is durable_commit; with it, the commit is queued behind the writes
+ * and force becomes a full io_flush().
+ */
+int io_commit(FILE **files, int file_count, int force) {
+#ifdef IO_BACKGROUND
+    if (io.running) {
+        if (force) {
+            return io_flush();
+        }
+        IoRequest *request = calloc(1, sizeof(IoRequest));
+        if (!request) return 0;
+        request->commit = 1;
+        io_enqueue(request);
+        return 1;
+    }
+#endif
+    return durable_commit(files, file_count, force);
+}
+
+unsigned long io_failure_count() {
+#ifdef IO_BACKGROUND
+    if (!io.running) return 0;
+    pthread_mutex_lock(&io.lock);
+    unsigned long failures = io.failures;
+    pthread_mutex_unlock(&io.lock);
+    return failures;
+#else
+    return 0;
+#endif
+}
+
+void io_stop() {
+#ifdef IO_BACKGROUND
+    if (!io.running) return;
+    io_flush();
+    pthread_mutex_lock(&io.lock);
+    io.stopping = 1;
+    pthread_cond_signal(&io.wake);
+    pthread_mutex_unlock(&io.lock);
+    pthread_join(io.thread, NULL);
+    io.running = 0;
+#endif
+}
+
+/* ===================== PARALLEL SCANS ===================== */
+
+/*
+ * Runs a scan over item_count items as morsels of morsel_size items on a
+ * pool of worker threads (scan_threads in config.txt, all cores by
+ * default). The calling thread works too. Each worker starts with an
+ * equal run of morsels and, when it runs out, steals the back half of
+ * another worker's remaining run, so uneven morsels still keep every core
+ * busy. fn gets the worker number, for per-worker state, and the morsel
+ * number, so results kept per morsel can be merged in order afterwards.
+ * scan_run returns when every morsel is done.
+ *
+ * Waking the pool costs more than a scan of a few thousand records, so
+ * scan_records runs a scan of fewer than SCAN_PARALLEL_MIN_RECORDS on the
+ * calling thread. The in-memory stores hold at most MAX_PATIENTS records
+ * and always scan that way; the B+tree store has no cap and hands out its
+ * leaves as morsels (see btree_leaf_pages).
+ */
+typedef void (*MorselFn)(void *context, int worker, int morsel, int first, int last);
+
+int scan_thread_count() {
+#ifdef HAVE_PTHREADS
+    int threads = config.scan_threads;
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores < 1 ? 1 : (int)cores;
+    }
+    return threads > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : threads;
+#else
+    return 1;
+#endif
+}
+
+#ifdef HAVE_PTHREADS
+
+/* Morsels [next, end) still to run; the owner takes from next, thieves from end. */
+typedef struct {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+} MorselQueue;
+
+typedef struct {
+    int thread_count;
+    int stopping;
+    unsigned generation;
+    int running;
+    MorselFn fn;
+    void *context;
+    int item_count;
+    int morsel_size;
+    pthread_t threads[SCAN_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t finished;
+    MorselQueue queues[SCAN_MAX_THREADS];
+} ScanPool;
+
+ScanPool scan_pool = {0};
+
+int morsel_pop(MorselQueue *queue) {
+    int morsel = -1;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->next < queue->end) morsel = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    return morsel;
+}
+
+/* Moves the back half of another worker's run into this worker's queue. */
+int morsel_steal(int worker) {
+    for (int i = 1; i < scan_pool.thread_count; i++) {
+        MorselQueue *victim = &scan_pool.queues[(worker + i) % scan_pool.thread_count];
+        int first = -1;
+        int end = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end - victim->next;
+        if (remaining > 0) {
+            end = victim->end;
+            first = end - (remaining + 1) / 2;
+            victim->end = first;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (first >= 0) {
+            MorselQueue *own = &scan_pool.queues[worker];
+            pthread_mutex_lock(&own->lock);
+            own->next = first + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            return first;
+        }
+    }
+    return -1;
+}
+
+void scan_work(int worker) {
+    while (1) {
+        int morsel = morsel_pop(&scan_pool.queues[worker]);
+        if (morsel < 0) morsel = morsel_steal(worker);
+        if (morsel < 0) return;
+
+        int first = morsel * scan_pool.morsel_size;
+        int last = first + scan_pool.morsel_size;
+        if (last > scan_pool.item_count) last = scan_pool.item_count;
+        scan_pool.fn(scan_pool.context, worker, morsel, first, last);
+    }
+}
+
+void *scan_thread_main(void *arg) {
+    int worker = (int)(intptr_t)arg;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&scan_pool.lock);
+    while (1) {
+        while (scan_pool.generation == seen && !scan_pool.stopping) {
+            pthread_cond_wait(&scan_pool.wake, &scan_pool.lock);
+        }
+        if (scan_pool.stopping) break;
+        seen = scan_pool.generation;
+        pthread_mutex_unlock(&scan_pool.lock);
+
+        scan_work(worker);
+
+        pthread_mutex_lock(&scan_pool.lock);
+        if (--scan_pool.running == 0) {
+            pthread_cond_signal(&scan_pool.finished);
+        }
+    }
+    pthread_mutex_unlock(&scan_pool.lock);
+    return NULL;
+}
+
+/* Starts the helpers on first use; returns the number of workers. */
+int scan_pool_start() {
+    if (scan_pool.thread_count > 0) return scan_pool.thread_count;
+
+    int wanted = scan_thread_count();
+    pthread_mutex_init(&scan_pool.lock, NULL);
+    pthread_cond_init(&scan_pool.wake, NULL);
+    pthread_cond_init(&scan_pool.finished, NULL);
+    for (int i = 0; i < wanted; i++) {
+        pthread_mutex_init(&scan_pool.queues[i].lock, NULL);
+    }
+
+    scan_pool.thread_count = 1;
+    for (int i = 1; i < wanted; i++) {
+        if (pthread_create(&scan_pool.threads[i], NULL, scan_thread_main, (void *)(intptr_t)i) != 0) {
+            break;
+        }
+        scan_pool.thread_count++;
+    }
+    return scan_pool.thread_count;
+}
+
+#endif
+
+/* Number of workers a scan runs on, and so of per-worker slots fn may use. */
+int scan_worker_count() {
+#ifdef HAVE_PTHREADS
+    return scan_pool_start();
+#else
+    return 1;
+#endif
+}
+
+/* Runs the morsels in order on the calling thread, as worker 0. */
+void scan_serial(int item_count, int morsel_size, MorselFn fn, void *context) {
+    for (int first = 0, morsel = 0; first < item_count; first += morsel_size, morsel++) {
+        int last = first + morsel_size < item_count ? first + morsel_size : item_count;
+        fn(context, 0, morsel, first, last);
+    }
+}
+
+void scan_run(int item_count, int morsel_size, MorselFn fn, void *context) {
+#ifdef HAVE_PTHREADS
+    int morsel_count = (item_count + morsel_size - 1) / morsel_size;
+    int workers = scan_pool_start();
+    if (morsel_count > 1 && workers > 1) {
+        scan_pool.fn = fn;
+        scan_pool.context = context;
+        scan_pool.item_count = item_count;
+        scan_pool.morsel_size = morsel_size;
+        for (int w = 0; w < workers; w++) {
+            scan_pool.queues[w].next = (int)((long long)morsel_count * w / workers);
+            scan_pool.queues[w].end = (int)((long long)morsel_count * (w + 1) / workers);
+        }
+
+        pthread_mutex_lock(&scan_pool.lock);
+        scan_pool.running = workers - 1;
+        scan_pool.generation++;
+        pthread_cond_broadcast(&scan_pool.wake);
+        pthread_mutex_unlock(&scan_pool.lock);
+
+        scan_work(0);
+
+        pthread_mutex_lock(&scan_pool.lock);
+        while (scan_pool.running > 0) {
+            pthread_cond_wait(&scan_pool.finished, &scan_pool.lock);
+        }
+        pthread_mutex_unlock(&scan_pool.lock);
+        return;
+    }
+#endif
+    scan_serial(item_count, morsel_size, fn, context);
+}
+
+/* scan_run for a scan that reads record_count records. */
+void scan_records(int record_count, int item_count, int morsel_size, MorselFn fn, void *context) {
+    if (record_count < SCAN_PARALLEL_MIN_RECORDS) {
+        scan_serial(item_count, morsel_size, fn, context);
+    } else {
+        scan_run(item_count, morsel_size, fn, context);
+    }
+}
+
+void scan_stop() {
+#ifdef HAVE_PTHREADS
+    if (scan_pool.thread_count == 0) return;
+    pthread_mutex_lock(&scan_pool.lock);
+    scan_pool.stopping = 1;
+    pthread_cond_broadcast(&scan_pool.wake);
+    pthread_mutex_unlock(&scan_pool.lock);
+    for (int i = 1; i < scan_pool.thread_count; i++) {
+        pthread_join(scan_pool.threads[i], NULL);
+    }
+    scan_pool.thread_count = 0;
+#endif
+}
+
+/*
+ * A scan that parses records as it goes, as the B+tree store's do, can add
+ * dictionary values from several workers. While scan_shared is set each
+ * morsel holds dictionary_lock for reading, and dict_intern trades it for
+ * the write lock to add a value. Both go through dictionary_gate, so
+ * readers queue behind a waiting writer instead of starving it. Codes and
+ * value strings stay put; only the arrays holding them move.
+ */
+int scan_shared = 0;
+
+#ifdef HAVE_PTHREADS
+pthread_rwlock_t dictionary_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t dictionary_gate = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void dictionary_read_lock() {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&dictionary_gate);
+    pthread_rwlock_rdlock(&dictionary_lock);
+    pthread_mutex_unlock(&dictionary_gate);
+#endif
+}
+
+void dictionary_write_lock() {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&dictionary_gate);
+    pthread_rwlock_wrlock(&dictionary_lock);
+    pthread_mutex_unlock(&dictionary_gate);
+#endif
+}
+
+void dictionary_unlock() {
+#ifdef HAVE_PTHREADS
+    pthread_rwlock_unlock(&dictionary_lock);
+#endif
+}
+
+typedef struct {
+    MorselFn fn;
+    void *context;
+} SharedScan;
+
+void shared_morsel(void *context, int worker, int morsel, int first, int last) {
+    SharedScan *scan = context;
+
+    dictionary_read_lock();
+    scan->fn(scan->context, worker, morsel, first, last);
+    dictionary_unlock();
+}
+
+/* scan_records for morsels that may add dictionary values. */
+void scan_records_shared(int record_count, int item_count, int morsel_size, MorselFn fn, void *context) {
+    SharedScan shared = {fn, context};
+
+    if (record_count < SCAN_PARALLEL_MIN_RECORDS) {
+        scan_serial(item_count, morsel_size, fn, context);
+        return;
+    }
+    scan_shared = 1;
+    scan_run(item_count, morsel_size, shared_morsel, &shared);
+    scan_shared = 0;
+}
+
+/*
+ * Hands a shared output to morsels in morsel order. A worker that has
+ * output ready waits for its morsel's turn, writes, and passes the turn on
+ * when the morsel is done. Each worker runs its own morsels in ascending
+ * order and a thief only takes later ones, so the earliest unfinished
+ * morsel is always running and its turn always comes.
+ */
+typedef struct {
+    int next;              /* the morsel whose output goes next */
+#ifdef HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#endif
+} MorselTurn;
+
+void morsel_turn_init(MorselTurn *turn) {
+    turn->next = 0;
+#ifdef HAVE_PTHREADS
+    pthread_mutex_init(&turn->lock, NULL);
+    pthread_cond_init(&turn->changed, NULL);
+#endif
+}
+
+void morsel_turn_wait(MorselTurn *turn, int morsel) {
+#ifdef HAVE_PTHREADS
+    /* The morsel holding the turn may need the write lock to finish. */
+    int shared = scan_shared;
+    if (shared) dictionary_unlock();
+
+    pthread_mutex_lock(&turn->lock);
+    while (turn->next != morsel) {
+        pthread_cond_wait(&turn->changed, &turn->lock);
+    }
+    pthread_mutex_unlock(&turn->lock);
+
+    if (shared) dictionary_read_lock();
+#else
+    (void)turn;
+    (void)morsel;
+#endif
+}
+
+/* Called by the morsel holding the turn when it is done. */
+void morsel_turn_pass(MorselTurn *turn) {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_lock(&turn->lock);
+    turn->next++;
+    pthread_cond_broadcast(&turn->changed);
+    pthread_mutex_unlock(&turn->lock);
+#else
+    turn->next++;
+#endif
+}
+
+void morsel_turn_free(MorselTurn *turn) {
+#ifdef HAVE_PTHREADS
+    pthread_mutex_destroy(&turn->lock);
+    pthread_cond_destroy(&turn->changed);
+#else
+    (void)turn;
+#endif
+}
+
+/* ===================== STRING DICTIONARIES ===================== */
+
+/*
+ * Low-cardinality columns (gender, blood group, address, disease, doctor)
+ * are stored as small integer codes into per-column interned string tables,
+ * so each distinct value is kept once and equality is an integer compare.
+ */
+typedef struct {
+    char **values;
+    int count;
+    int capacity;
+    int *slots;
+    int slot_count;
+} Dictionary;
+
+Dictionary gender_dict = {0};
+Dictionary blood_group_dict = {0};
+Dictionary address_dict = {0};
+Dictionary disease_dict = {0};
+Dictionary doctor_dict = {0};
+
+uint32_t hash_string(const char *str) {
+    uint32_t hash = 2166136261u;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void dict_clear(Dictionary *dict) {
+    for (int i = 0; i < dict->count; i++) {
+        free(dict->values[i]);
+    }
+    dict->count = 0;
+    for (int i = 0; i < dict->slot_count; i++) {
+        dict->slots[i] = -1;
+    }
+}
+
+int dict_grow_slots(Dictionary *dict) {
+    int new_slot_count = dict->slot_count ? dict->slot_count * 2 : 64;
+    int *slots = malloc(new_slot_count * sizeof(int));
+    if (!slots) {
+        return 0;
+    }
+
+    for (int i = 0; i < new_slot_count; i++) slots[i] = -1;
+    for (int code = 0; code < dict->count; code++) {
+        uint32_t slot = hash_string(dict->values[code]) & (new_slot_count - 1);
+        while (slots[slot] != -1) slot = (slot + 1) & (new_slot_count - 1);
+        slots[slot] = code;
+    }
+
+    free(dict->slots);
+    dict->slots = slots;
+    dict->slot_count = new_slot_count;
+    return 1;
+}
+
+/* Returns the code of value, or -1 if it has never been interned. */
+int dict_lookup(const Dictionary *dict, const char *value) {
+    if (dict->slot_count == 0) {
+        return -1;
+    }
+
+    uint32_t slot = hash_string(value) & (dict->slot_count - 1);
+    while (dict->slots[slot] != -1) {
+        int code = dict->slots[slot];
+        if (strcmp(dict->values[code], value) == 0) {
+            return code;
+        }
+        slot = (slot + 1) & (dict->slot_count - 1);
+    }
+    return -1;
+}
+
+/* Adds a value the dictionary does not hold; returns its code or -1. */
+int dict_add(Dictionary *dict, const char *value) {
+    int code;
+
+    if ((dict->count + 1) * 2 > dict->slot_count && !dict_grow_slots(dict)) {
+        return -1;
+    }
+
+    if (dict->count >= dict->capacity) {
+        int new_capacity = dict->capacity ? dict->capacity * 2 : 16;
+        char **grown = realloc(dict->values, new_capacity * sizeof(char *));
+        if (!grown) {
+            return -1;
+        }
+        dict->values = grown;
+        dict->capacity = new_capacity;
+    }
+
+    char *copy = malloc(strlen(value) + 1);
+    if (!copy) {
+        return -1;
+    }
+    strcpy(copy, value);
+
+    code = dict->count++;
+    dict->values[code] = copy;
+
+    uint32_t slot = hash_string(value) & (dict->slot_count - 1);
+    while (dict->slots[slot] != -1) slot = (slot + 1) & (dict->slot_count - 1);
+    dict->slots[slot] = code;
+    return code;
+}
+
+/* Returns the code of value, adding it to the dictionary if needed. */
+int dict_intern(Dictionary *dict, const char *value) {
+    int code = dict_lookup(dict, value);
+    if (code != -1 || !scan_shared) {
+        return code != -1 ? code : dict_add(dict, value);
+    }
+
+    /* Another worker may add it between the locks, so look again. */
+    dictionary_unlock();
+    dictionary_write_lock();
+    code = dict_lookup(dict, value);
+    if (code == -1) code = dict_add(dict, value);
+    dictionary_unlock();
+    dictionary_read_lock();
+    return code;
+}
+
+const char *dict_value(const Dictionary *dict, int code) {
+    if (code < 0 || code >= dict->count) {
+        return "";
+    }
+    return dict->values[code];
+}
+
+const char *patient_gender(const Patient *patient) {
+    return dict_value(&gender_dict, patient->gender);
+}
+
+const char *patient_blood_group(const Patient *patient) {
+    return dict_value(&blood_group_dict, patient->blood_group);
+}
+
+const char *patient_address(const Patient *patient) {
+    return dict_value(&address_dict, patient->address);
+}
+
+const char *patient_disease(const Patient *patient) {
+    return dict_value(&disease_dict, patient->disease);
+}
+
+const char *patient_doctor(const Patient *patient) {
+    return dict_value(&doctor_dict, patient->referred_doctor);
+}
+
+/* ===================== PHONE NUMBERS ===================== */
+
+/*
+ * Phones are kept as E.164 digits packed into 64 bits: the digit count in
+ * the top four bits and the number below it, 0 meaning no valid number.
+ * "01712-345678", "+880 1712 345678" and "008801712345678" all normalize
+ * to the same value; national numbers get DEFAULT_COUNTRY_CODE.
+ */
+uint64_t pack_phone_digits(const char *digits, int len) {
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++) {
+        value = value * 10 + (uint64_t)(digits[i] - '0');
+    }
+    return ((uint64_t)len << 60) | value;
+}
+
+/* Writes the number's digits, leading zeros included; returns the count. */
+int unpack_phone_digits(uint64_t packed, char *digits) {
+    int len = (int)(packed >> 60);
+    uint64_t value = packed & ((1ULL << 60) - 1);
+
+    for (int i = len - 1; i >= 0; i--) {
+        digits[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    digits[len] = '\0';
+    return len;
+}
+
+/*
+ * Reduces typed input to E.164 digits. partial accepts a leading fragment
+ * such as an operator code. Returns the digit count, or 0 when the input
+ * is not a phone number.
+ */
+int normalize_phone_digits(const char *input, char *digits, int partial) {
+    char raw[PHONE_MAX_DIGITS + 8];
+    int raw_len = 0;
+    int international = 0;
+
+    while (isspace((unsigned char)*input)) input++;
+    if (*input == '+') {
+        international = 1;
+        input++;
+    }
+    for (; *input; input++) {
+        if (isdigit((unsigned char)*input)) {
+            if (raw_len == (int)sizeof(raw) - 1) return 0;
+            raw[raw_len++] = *input;
+        } else if (!strchr(" -().", *input)) {
+            return 0;
+        }
+    }
+    raw[raw_len] = '\0';
+
+    const char *number = raw;
+    const char *country = "";
+    if (!international) {
+        if (raw[0] == '0' && raw[1] == '0') {
+            number = raw + 2;
+        } else if (strncmp(raw, DEFAULT_COUNTRY_CODE, strlen(DEFAULT_COUNTRY_CODE)) != 0) {
+            country = DEFAULT_COUNTRY_CODE;
+            if (raw[0] == '0') number = raw + 1;
+        }
+    }
+
+    size_t country_len = strlen(country);
+    size_t number_len = strlen(number);
+    int len = (int)(country_len + number_len);
+    if (number_len == 0 || len > PHONE_MAX_DIGITS || (!partial && len < PHONE_MIN_DIGITS)) {
+        return 0;
+    }
+    memcpy(digits, country, country_len);
+    memcpy(digits + country_len, number, number_len + 1);
+    return len;
+}
+
+uint64_t normalize_phone(const char *input) {
+    char digits[PHONE_MAX_DIGITS + 1];
+    int len = normalize_phone_digits(input, digits, 0);
+    return len ? pack_phone_digits(digits, len) : 0;
+}
+
+/* National form for home-country numbers, "+digits" for the rest, or
+ * with international set always "+digits". */
+void format_phone(uint64_t packed, char *buffer, int size, int international) {
+    char digits[PHONE_MAX_DIGITS + 1];
+    size_t country_len = strlen(DEFAULT_COUNTRY_CODE);
+
+    if (!packed) {
+        snprintf(buffer, size, "-");
+        return;
+    }
+    unpack_phone_digits(packed, digits);
+    if (!international && strncmp(digits, DEFAULT_COUNTRY_CODE, country_len) == 0) {
+        snprintf(buffer, size, "0%s", digits + country_len);
+    } else {
+        snprintf(buffer, size, "+%s", digits);
+    }
+}
+
+/* Display form; the text stays valid for the next three calls. */
+const char *patient_phone(const Patient *patient) {
+    static char buffers[4][PHONE_TEXT_LEN];
+    static int next = 0;
+
+    char *buffer = buffers[next];
+    next = (next + 1) % 4;
+    format_phone(patient->phone, buffer, PHONE_TEXT_LEN, 0);
+    return buffer;
+}
+
+/*
+ * Sorted (key, patients[] index) pairs. phone_index is keyed by the packed
+ * number for exact and prefix lookups; phone_suffix_index by the packed
+ * number with its digits reversed, so "last N digits" is a prefix lookup.
+ */
+typedef struct {
+    uint64_t *keys;
+    int *slots;
+    int count;
+    int capacity;
+} SortedKeys;
+
+SortedKeys phone_index = {0};
+SortedKeys phone_suffix_index = {0};
+
+uint64_t reverse_phone(uint64_t packed) {
+    char digits[PHONE_MAX_DIGITS + 1];
+    int len = unpack_phone_digits(packed, digits);
+
+    for (int i = 0; i < len / 2; i++) {
+        char swap = digits[i];
+        digits[i] = digits[len - 1 - i];
+        digits[len - 1 - i] = swap;
+    }
+    return pack_phone_digits(digits, len);
+}
+
+int sorted_lower_bound(const SortedKeys *index, uint64_t key) {
+    int low = 0;
+    int high = index->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (index->keys[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void sorted_insert(SortedKeys *index, uint64_t key, int slot) {
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : 256;
+        uint64_t *keys = realloc(index->keys, capacity * sizeof(uint64_t));
+        if (!keys) return;
+        index->keys = keys;
+        int *slots = realloc(index->slots, capacity * sizeof(int));
+        if (!slots) return;
+        index->slots = slots;
+        index->capacity = capacity;
+    }
+
+    int at = sorted_lower_bound(index, key);
+    memmove(&index->keys[at + 1], &index->keys[at], (index->count - at) * sizeof(uint64_t));
+    memmove(&index->slots[at + 1], &index->slots[at], (index->count - at) * sizeof(int));
+    index->keys[at] = key;
+    index->slots[at] = slot;
+    index->count++;
+}
+
+void sorted_remove(SortedKeys *index, uint64_t key, int slot) {
+    for (int at = sorted_lower_bound(index, key); at < index->count && index->keys[at] == key; at++) {
+        if (index->slots[at] == slot) {
+            memmove(&index->keys[at], &index->keys[at + 1], (index->count - at - 1) * sizeof(uint64_t));
+            memmove(&index->slots[at], &index->slots[at + 1], (index->count - at - 1) * sizeof(int));
+            index->count--;
+            return;
+        }
+    }
+}
+
+void phone_index_add(int patient_index) {
+    uint64_t phone = patients[patient_index].phone;
+    if (phone) {
+        sorted_insert(&phone_index, phone, patient_index);
+        sorted_insert(&phone_suffix_index, reverse_phone(phone), patient_index);
+    }
+}
+
+/* Call before patients[patient_index].phone changes. */
+void phone_index_remove(int patient_index) {
+    uint64_t phone = patients[patient_index].phone;
+    if (phone) {
+        sorted_remove(&phone_index, phone, patient_index);
+        sorted_remove(&phone_suffix_index, reverse_phone(phone), patient_index);
+    }
+}
+
+void rebuild_phone_index() {
+    phone_index.count = 0;
+    phone_suffix_index.count = 0;
+    for (int i = 0; i < patient_count; i++) {
+        phone_index_add(i);
+    }
+}
+
+typedef enum {
+    PHONE_EXACT,
+    PHONE_PREFIX,
+    PHONE_SUFFIX
+} PhoneMatch;
+
+typedef struct {
+    PhoneMatch match;
+    char digits[PHONE_MAX_DIGITS + 1];
+    int len;
+} PhoneQuery;
+
+/*
+ * Recognizes a full number, "prefix*" (e.g. "017*" for an operator) and
+ * "*last digits". Returns 0 for anything else, including short digit
+ * strings, which stay patient IDs.
+ */
+int parse_phone_query(const char *input, PhoneQuery *query) {
+    char text[64];
+    int typed_digits = 0;
+
+    snprintf(text, sizeof(text), "%s", input);
+    trim(text);
+    int len = (int)strlen(text);
+
+    query->match = PHONE_EXACT;
+    char *body = text;
+    if (len > 0 && text[0] == '*') {
+        query->match = PHONE_SUFFIX;
+        body++;
+    } else if (len > 0 && text[len - 1] == '*') {
+        query->match = PHONE_PREFIX;
+        text[len - 1] = '\0';
+    }
+
+    for (char *p = body; *p; p++) {
+        if (isdigit((unsigned char)*p)) {
+            typed_digits++;
+        } else if (!strchr(" -().+", *p)) {
+            return 0;
+        }
+    }
+
+    if (query->match == PHONE_SUFFIX) {
+        query->len = 0;
+        for (char *p = body; *p && query->len < PHONE_MAX_DIGITS; p++) {
+            if (isdigit((unsigned char)*p)) query->digits[query->len++] = *p;
+        }
+        query->digits[query->len] = '\0';
+        return query->len >= 3;
+    }
+
+    if (typed_digits < (query->match == PHONE_PREFIX ? 2 : 7)) {
+        return 0;
+    }
+    query->len = normalize_phone_digits(body, query->digits, query->match == PHONE_PREFIX);
+    return query->len > 0;
+}
+
+int phone_matches(uint64_t phone, const PhoneQuery *query) {
+    char digits[PHONE_MAX_DIGITS + 1];
+    int len;
+
+    if (!phone) return 0;
+    len = unpack_phone_digits(phone, digits);
+
+    switch (query->match) {
+        case PHONE_EXACT:
+            return len == query->len && memcmp(digits, query->digits, len) == 0;
+        case PHONE_PREFIX:
+            return len >= query->len && memcmp(digits, query->digits, query->len) == 0;
+        case PHONE_SUFFIX:
+            return len >= query->len && memcmp(digits + len - query->len, query->digits, query->len) == 0;
+    }
+    return 0;
+}
+
+/*
+ * Appends active patients whose key starts with the given digits: one
+ * binary search per possible number length, then a walk of the range.
+ */
+int phone_index_collect(const SortedKeys *index, const char *digits, int len, int exact,
+                        int *result_indices, int found_count, int max_results) {
+    int longest = exact ? len : PHONE_MAX_DIGITS;
+    uint64_t prefix = pack_phone_digits(digits, len) & ((1ULL << 60) - 1);
+
+    for (int total = len; total <= longest && found_count < max_results; total++) {
+        uint64_t span = 1;
+        for (int i = len; i < total; i++) span *= 10;
+
+        uint64_t low = ((uint64_t)total << 60) | (prefix * span);
+        uint64_t high = low + span;
+        for (int at = sorted_lower_bound(index, low);
+             at < index->count && index->keys[at] < high && found_count < max_results; at++) {
+            if (patients[index->slots[at]].is_active) {
+                result_indices[found_count++] = index->slots[at];
+            }
+        }
+    }
+    return found_count;
+}
+
+/* ===================== FUZZY NAME INDEX ===================== */
+
+/*
+ * BK-tree over the lowercase words of every patient name. Each node keeps
+ * the version of the name it was taken from, so a renamed patient just gets
+ * new nodes and the old ones are skipped until the next rebuild.
+ */
+typedef struct {
+    char token[FUZZY_TOKEN_LEN];
+    int length;
+    int patient_index;
+    int name_version;
+    int parent_distance;
+    int first_child;
+    int next_sibling;
+} BkNode;
+
+typedef struct {
+    BkNode *nodes;
+    int count;
+    int capacity;
+    int stale_count;
+    int name_version[MAX_PATIENTS];
+} BkTree;
+
+BkTree name_index = {0};
+
+/*
+ * Bit-parallel Levenshtein distance (Myers/Hyyro), pattern up to 64 chars.
+ * peq is a zeroed 256-entry scratch table, left zeroed on return, so
+ * threads can each pass their own.
+ */
+int edit_distance_with(uint64_t *peq, const char *a, int m, const char *b, int n) {
+    if (m == 0) return n;
+    if (n == 0) return m;
+
+    for (int i = 0; i < m; i++) {
+        peq[(unsigned char)a[i]] |= (uint64_t)1 << i;
+    }
+
+    uint64_t pv = ~(uint64_t)0;
+    uint64_t mv = 0;
+    uint64_t last = (uint64_t)1 << (m - 1);
+    int score = m;
+
+    for (int j = 0; j < n; j++) {
+        uint64_t eq = peq[(unsigned char)b[j]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & last) score++;
+        else if (mh & last) score--;
+
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+
+    for (int i = 0; i < m; i++) {
+        peq[(unsigned char)a[i]] = 0;
+    }
+
+    return score;
+}
+
+/* edit_distance_with on a table of its own, so any thread may call it. */
+int edit_distance(const char *a, int m, const char *b, int n) {
+    uint64_t peq[256] = {0};
+    return edit_distance_with(peq, a, m, b, n);
+}
+
+int fuzzy_max_distance(int token_len) {
+    if (token_len <= 2) return 0;
+    if (token_len <= 4) return 1;
+    if (token_len <= 8) return 2;
+    return 3;
+}
+
+/* Splits text into lowercase words; returns the number of tokens written. */
+int tokenize_name(const char *text, char tokens[][FUZZY_TOKEN_LEN], int max_tokens) {
+    int count = 0;
+    const char *p = text;
+
+    while (*p && count < max_tokens) {
+        while (*p && !isalnum((unsigned char)*p)) p++;
+        if (!*p) break;
+
+        int len = 0;
+        while (*p && isalnum((unsigned char)*p)) {
+            if (len < FUZZY_TOKEN_LEN - 1) {
+                tokens[count][len++] = (char)tolower((unsigned char)*p);
+            }
+            p++;
+        }
+        tokens[count][len] = '\0';
+        count++;
+    }
+
+    return count;
+}
+
+int bk_new_node(BkTree *tree, const char *token, int patient_index) {
+    if (tree->count >= tree->capacity) {
+        int new_capacity = tree->capacity ? tree->capacity * 2 : 1024;
+        BkNode *grown = realloc(tree->nodes, new_capacity * sizeof(BkNode));
+        if (!grown) {
+            return -1;
+        }
+        tree->nodes = grown;
+        tree->capacity = new_capacity;
+    }
+
+    BkNode *node = &tree->nodes[tree->count];
+    strcpy(node->token, token);
+    node->length = (int)strlen(token);
+    node->patient_index = patient_index;
+    node->name_version = tree->name_version[patient_index];
+    node->parent_distance = 0;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    return tree->count++;
+}
+
+void bk_insert(BkTree *tree, const char *token, int patient_index) {
+    int new_index = bk_new_node(tree, token, patient_index);
+    if (new_index <= 0) {
+        return;
+    }
+
+    BkNode *node = &tree->nodes[new_index];
+    int current = 0;
+
+    while (1) {
+        BkNode *cur = &tree->nodes[current];
+        int d = edit_distance(cur->token, cur->length, node->token, node->length);
+        int child = cur->first_child;
+
+        while (child != -1 && tree->nodes[child].parent_distance != d) {
+            child = tree->nodes[child].next_sibling;
+        }
+
+        if (child == -1) {
+            node->parent_distance = d;
+            node->next_sibling = cur->first_child;
+            cur->first_child = new_index;
+            return;
+        }
+
+        current = child;
+    }
+}
+
+void index_patient_name(int patient_index) {
+    char tokens[MAX_NAME_LEN / 2][FUZZY_TOKEN_LEN];
+    int count = tokenize_name(patients[patient_index].name, tokens, MAX_NAME_LEN / 2);
+
+    for (int i = 0; i < count; i++) {
+        bk_insert(&name_index, tokens[i], patient_index);
+    }
+}
+
+void rebuild_name_index() {
+    name_index.count = 0;
+    name_index.stale_count = 0;
+    memset(name_index.name_version, 0, sizeof(name_index.name_version));
+
+    for (int i = 0; i < patient_count; i++) {
+        index_patient_name(i);
+    }
+}
+
+/* Call after patients[patient_index].name has changed. */
+void reindex_patient_name(int patient_index) {
+    for (int i = 0; i < name_index.count; i++) {
+        BkNode *node = &name_index.nodes[i];
+        if (node->patient_index == patient_index &&
+            node->name_version == name_index.name_version[patient_index]) {
+            name_index.stale_count++;
+        }
+    }
+    name_index.name_version[patient_index]++;
+
+    if (name_index.stale_count > name_index.count - name_index.stale_count) {
+        rebuild_name_index();
+    } else {
+        index_patient_name(patient_index);
+    }
+}
+
+typedef struct {
+    int patient_index;
+    int score;
+} FuzzyMatch;
+
+int compare_fuzzy_match(const void *a, const void *b) {
+    const FuzzyMatch *x = a;
+    const FuzzyMatch *y = b;
+    if (x->score != y->score) return x->score - y->score;
+    return x->patient_index - y->patient_index;
+}
+
+/*
+ * Every word of the query must be within a few edits of some word of the
+ * patient name. Results are ranked by the summed distance, closest first.
+ */
+int find_patients_by_name_fuzzy(const char *search_name, int *result_indices, int max_results) {
+    static int token_best[MAX_PATIENTS];
+    static int total_score[MAX_PATIENTS];
+    static int tokens_matched[MAX_PATIENTS];
+    char tokens[MAX_NAME_LEN / 2][FUZZY_TOKEN_LEN];
+    int token_count = tokenize_name(search_name, tokens, MAX_NAME_LEN / 2);
+
+    if (token_count == 0 || name_index.count == 0) {
+        return 0;
+    }
+
+    int *stack = malloc(name_index.count * sizeof(int));
+    if (!stack) {
+        return 0;
+    }
+
+    memset(total_score, 0, sizeof(int) * patient_count);
+    memset(tokens_matched, 0, sizeof(int) * patient_count);
+
+    for (int t = 0; t < token_count; t++) {
+        int len = (int)strlen(tokens[t]);
+        int limit = fuzzy_max_distance(len);
+        int top = 0;
+
+        for (int i = 0; i < patient_count; i++) token_best[i] = -1;
+
+        stack[top++] = 0;
+        while (top > 0) {
+            BkNode *node = &name_index.nodes[stack[--top]];
+            int d = edit_distance(tokens[t], len, node->token, node->length);
+
+            if (d <= limit &&
+                node->name_version == name_index.name_version[node->patient_index] &&
+                patients[node->patient_index].is_active) {
+                int *best = &token_best[node->patient_index];
+                if (*best == -1 || d < *best) *best = d;
+            }
+
+            for (int c = node->first_child; c != -1; c = name_index.nodes[c].next_sibling) {
+                int pd = name_index.nodes[c].parent_distance;
+                if (pd >= d - limit && pd <= d + limit) {
+                    stack[top++] = c;
+                }
+            }
+        }
+
+        for (int i = 0; i < patient_count; i++) {
+            if (token_best[i] >= 0) {
+                total_score[i] += token_best[i];
+                tokens_matched[i]++;
+            }
+        }
+    }
+
+    static FuzzyMatch matches[MAX_PATIENTS];
+    int match_count = 0;
+    for (int i = 0; i < patient_count; i++) {
+        if (tokens_matched[i] == token_count) {
+            matches[match_count].patient_index = i;
+            matches[match_count].score = total_score[i];
+            match_count++;
+        }
+    }
+
+    free(stack);
+    qsort(matches, match_count, sizeof(FuzzyMatch), compare_fuzzy_match);
+
+    if (match_count > max_results) match_count = max_results;
+    for (int i = 0; i < match_count; i++) {
+        result_indices[i] = matches[i].patient_index;
+    }
+
+    return match_count;
+}
+
+/* ===================== PHONETIC NAME INDEX ===================== */
+
+/*
+ * Metaphone-style keys tuned for romanized Bangla names: vowels after the
+ * first letter are dropped, aspirated digraphs (kh, bh, dh, sh...) fold into
+ * their plain consonant, z/j and v/w are merged, and a non-initial 'h' is
+ * silent. "Hossain", "Hosain" and "Hussain" all encode to "HSN".
+ */
+int is_vowel(char c) {
+    return c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u' || c == 'y';
+}
+
+int phonetic_encode_word(const char *word, char *out, int max_len) {
+    int n = (int)strlen(word);
+    int len = 0;
+    char last = 0;
+
+    for (int i = 0; i < n && len < max_len - 2; i++) {
+        char c = word[i];
+        char next = (i + 1 < n) ? word[i + 1] : '\0';
+        char code = 0;
+
+        if (is_vowel(c)) {
+            if (i == 0) out[len++] = 'A';
+            last = 0;
+            continue;
+        }
+
+        switch (c) {
+            case 'b': code = 'B'; break;
+            case 'p': code = (next == 'h') ? 'F' : 'P'; break;
+            case 'f': code = 'F'; break;
+            case 'v': case 'w': code = 'V'; break;
+            case 't': code = 'T'; break;
+            case 'd': code = 'D'; break;
+            case 'k': case 'q': code = 'K'; break;
+            case 'c': code = (next == 'h') ? 'C' : 'K'; break;
+            case 'g': code = 'G'; break;
+            case 'j': case 'z': code = 'J'; break;
+            case 's': code = 'S'; break;
+            case 'l': code = 'L'; break;
+            case 'm': code = 'M'; break;
+            case 'n': code = 'N'; break;
+            case 'r': code = 'R'; break;
+            case 'x':
+                if (last != 'K') out[len++] = 'K';
+                code = 'S';
+                break;
+            case 'h':
+                if (i == 0) code = 'H';
+                break;
+            default:
+                break;
+        }
+
+        if (c != 'h' && next == 'h') i++;
+        if (!code) continue;
+        if (code == last) continue;
+
+        out[len++] = code;
+        last = code;
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+/* Encodes every word of text, joined by single spaces. */
+void phonetic_key(const char *text, char *key, int max_len) {
+    char tokens[MAX_NAME_LEN / 2][FUZZY_TOKEN_LEN];
+    int count = tokenize_name(text, tokens, MAX_NAME_LEN / 2);
+    int len = 0;
+
+    key[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        char word_key[PHONETIC_WORD_LEN];
+        int word_len = phonetic_encode_word(tokens[i], word_key, PHONETIC_WORD_LEN);
+
+        if (word_len == 0) continue;
+        if (len + word_len + 2 > max_len) break;
+        if (len > 0) key[len++] = ' ';
+        strcpy(key + len, word_key);
+        len += word_len;
+    }
+}
+
+typedef struct {
+    int patient_index;
+    uint32_t hash;
+    int next;
+} PhoneticEntry;
+
+/*
+ * Hash index from each word key of a patient name to the patients carrying
+ * it. Whole-name and guardian keys are kept per record for duplicate checks.
+ */
+typedef struct {
+    int buckets[PHONETIC_BUCKETS];
+    PhoneticEntry *entries;
+    int entry_count;
+    int capacity;
+    int free_list;
+    char name_key[MAX_PATIENTS][PHONETIC_KEY_LEN];
+    char guardian_key[MAX_PATIENTS][PHONETIC_KEY_LEN];
+} PhoneticIndex;
+
+PhoneticIndex phonetic_index;
+
+/* Splits a space-separated key into its words. */
+int phonetic_key_words(const char *key, char words[][PHONETIC_WORD_LEN], int max_words) {
+    int count = 0;
+    const char *p = key;
+
+    while (*p && count < max_words) {
+        int len = 0;
+        while (*p && *p != ' ') {
+            if (len < PHONETIC_WORD_LEN - 1) words[count][len++] = *p;
+            p++;
+        }
+        words[count][len] = '\0';
+        count++;
+        while (*p == ' ') p++;
+    }
+
+    return count;
+}
+
+void phonetic_index_add(int patient_index) {
+    PhoneticIndex *index = &phonetic_index;
+    char words[MAX_NAME_LEN / 2][PHONETIC_WORD_LEN];
+
+    phonetic_key(patients[patient_index].name, index->name_key[patient_index], PHONETIC_KEY_LEN);
+    phonetic_key(patients[patient_index].guardian, index->guardian_key[patient_index], PHONETIC_KEY_LEN);
+
+    int count = phonetic_key_words(index->name_key[patient_index], words, MAX_NAME_LEN / 2);
+    for (int i = 0; i < count; i++) {
+        int slot = index->free_list;
+
+        if (slot != -1) {
+            index->free_list = index->entries[slot].next;
+        } else {
+            if (index->entry_count >= index->capacity) {
+                int new_capacity = index->capacity ? index->capacity * 2 : 1024;
+                PhoneticEntry *grown = realloc(index->entries, new_capacity * sizeof(PhoneticEntry));
+                if (!grown) return;
+                index->entries = grown;
+                index->capacity = new_capacity;
+            }
+            slot = index->entry_count++;
+        }
+
+        uint32_t hash = hash_string(words[i]);
+        int bucket = hash % PHONETIC_BUCKETS;
+        index->entries[slot].patient_index = patient_index;
+        index->entries[slot].hash = hash;
+        index->entries[slot].next = index->buckets[bucket];
+        index->buckets[bucket] = slot;
+    }
+}
+
+void phonetic_index_remove(int patient_index) {
+    PhoneticIndex *index = &phonetic_index;
+    char words[MAX_NAME_LEN / 2][PHONETIC_WORD_LEN];
+    int count = phonetic_key_words(index->name_key[patient_index], words, MAX_NAME_LEN / 2);
+
+    for (int i = 0; i < count; i++) {
+        int *link = &index->buckets[hash_string(words[i]) % PHONETIC_BUCKETS];
+
+        while (*link != -1) {
+            int slot = *link;
+            if (index->entries[slot].patient_index == patient_index) {
+                *link = index->entries[slot].next;
+                index->entries[slot].next = index->free_list;
+                index->free_list = slot;
+            } else {
+                link = &index->entries[slot].next;
+            }
+        }
+    }
+}
+
+void rebuild_phonetic_index() {
+    for (int i = 0; i < PHONETIC_BUCKETS; i++) {
+        phonetic_index.buckets[i] = -1;
+    }
+    phonetic_index.entry_count = 0;
+    phonetic_index.free_list = -1;
+
+    for (int i = 0; i < patient_count; i++) {
+        phonetic_index_add(i);
+    }
+}
+
+int key_has_word(const char *key, const char *word) {
+    int word_len = (int)strlen(word);
+    const char *p = key;
+
+    while ((p = strstr(p, word)) != NULL) {
+        if ((p == key || p[-1] == ' ') && (p[word_len] == ' ' || p[word_len] == '\0')) {
+            return 1;
+        }
+        p++;
+    }
+    return 0;
+}
+
+/* Patients whose name contains a word sounding like every word of the query. */
+int find_patients_by_sound(const char *search_name, int *result_indices, int max_results) {
+    PhoneticIndex *index = &phonetic_index;
+    char key[PHONETIC_KEY_LEN];
+    char words[MAX_NAME_LEN / 2][PHONETIC_WORD_LEN];
+    int found_count = 0;
+
+    phonetic_key(search_name, key, PHONETIC_KEY_LEN);
+    int count = phonetic_key_words(key, words, MAX_NAME_LEN / 2);
+    if (count == 0) {
+        return 0;
+    }
+
+    uint32_t hash = hash_string(words[0]);
+    for (int slot = index->buckets[hash % PHONETIC_BUCKETS];
+         slot != -1 && found_count < max_results;
+         slot = index->entries[slot].next) {
+        int p = index->entries[slot].patient_index;
+        int matches = index->entries[slot].hash == hash && patients[p].is_active;
+
+        for (int i = 0; i < count && matches; i++) {
+            matches = key_has_word(index->name_key[p], words[i]);
+        }
+        for (int i = 0; i < found_count && matches; i++) {
+            matches = result_indices[i] != p;
+        }
+
+        if (matches) {
+            result_indices[found_count++] = p;
+        }
+    }
+
+    return found_count;
+}
+
+/* Returns the ID of an active patient whose name and guardian sound the same. */
+int find_phonetic_duplicate(const char *name, const char *guardian) {
+    PhoneticIndex *index = &phonetic_index;
+    char name_key[PHONETIC_KEY_LEN];
+    char guardian_key[PHONETIC_KEY_LEN];
+    char words[1][PHONETIC_WORD_LEN];
+
+    phonetic_key(name, name_key, PHONETIC_KEY_LEN);
+    phonetic_key(guardian, guardian_key, PHONETIC_KEY_LEN);
+    if (phonetic_key_words(name_key, words, 1) == 0) {
+        return 0;
+    }
+
+    uint32_t hash = hash_string(words[0]);
+    for (int slot = index->buckets[hash % PHONETIC_BUCKETS]; slot != -1; slot = index->entries[slot].next) {
+        int p = index->entries[slot].patient_index;
+
+        if (patients[p].is_active &&
+            strcmp(index->name_key[p], name_key) == 0 &&
+            strcmp(index->guardian_key[p], guardian_key) == 0) {
+            return patients[p].id;
+        }
+    }
+
+    return 0;
+}
+
+/* Sounds-alike matches first, then fuzzy spelling matches not already listed. */
+int find_similar_patients(const char *search_name, int *result_indices, int max_results) {
+    int fuzzy_indices[MAX_SEARCH_RESULTS];
+    int found_count = find_patients_by_sound(search_name, result_indices, max_results);
+    int fuzzy_count = find_patients_by_name_fuzzy(search_name, fuzzy_indices, MAX_SEARCH_RESULTS);
+
+    for (int i = 0; i < fuzzy_count && found_count < max_results; i++) {
+        int seen = 0;
+        for (int j = 0; j < found_count && !seen; j++) {
+            seen = result_indices[j] == fuzzy_indices[i];
+        }
+        if (!seen) {
+            result_indices[found_count++] = fuzzy_indices[i];
+        }
+    }
+
+    return found_count;
+}
+
+/* ===================== AUTOCOMPLETE ===================== */
+
+/*
+ * Compact radix trie over lowercase field values. Each node counts the
+ * active records whose value ends there and caches the largest count in its
+ * subtree, so a top-K walk can skip branches that cannot make the cut.
+ */
+typedef struct {
+    char *label;
+    int label_len;
+    int first_child;
+    int next_sibling;
+    int count;
+    int best;
+    char *display;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;
+    int count;
+    int capacity;
+} RadixTrie;
+
+RadixTrie name_trie = {0};
+RadixTrie doctor_trie = {0};
+RadixTrie address_trie = {0};
+
+int trie_new_node(RadixTrie *trie, const char *label, int label_len) {
+    if (trie->count >= trie->capacity) {
+        int new_capacity = trie->capacity ? trie->capacity * 2 : 256;
+        TrieNode *grown = realloc(trie->nodes, new_capacity * sizeof(TrieNode));
+        if (!grown) {
+            return -1;
+        }
+        trie->nodes = grown;
+        trie->capacity = new_capacity;
+    }
+
+    TrieNode *node = &trie->nodes[trie->count];
+    node->label = malloc(label_len + 1);
+    if (!node->label) {
+        return -1;
+    }
+    memcpy(node->label, label, label_len);
+    node->label[label_len] = '\0';
+    node->label_len = label_len;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->count = 0;
+    node->best = 0;
+    node->display = NULL;
+    return trie->count++;
+}
+
+void trie_clear(RadixTrie *trie) {
+    for (int i = 0; i < trie->count; i++) {
+        free(trie->nodes[i].label);
+        free(trie->nodes[i].display);
+    }
+    trie->count = 0;
+    trie_new_node(trie, "", 0);
+}
+
+/* Splits node so its label is exactly the first at characters. */
+void trie_split(RadixTrie *trie, int node_index, int at) {
+    TrieNode *node = &trie->nodes[node_index];
+    int tail = trie_new_node(trie, node->label + at, node->label_len - at);
+    if (tail == -1) {
+        return;
+    }
+
+    node = &trie->nodes[node_index];
+    TrieNode *tail_node = &trie->nodes[tail];
+    tail_node->first_child = node->first_child;
+    tail_node->count = node->count;
+    tail_node->best = node->best;
+    tail_node->display = node->display;
+
+    node->first_child = tail;
+    node->count = 0;
+    node->display = NULL;
+    node->label[at] = '\0';
+    node->label_len = at;
+}
+
+int trie_refresh_best(RadixTrie *trie, int node_index) {
+    TrieNode *node = &trie->nodes[node_index];
+    int best = node->count;
+
+    for (int c = node->first_child; c != -1; c = trie->nodes[c].next_sibling) {
+        if (trie->nodes[c].best > best) best = trie->nodes[c].best;
+    }
+    node->best = best;
+    return best;
+}
+
+/* Adds delta occurrences of value (case-insensitive). */
+void trie_update(RadixTrie *trie, const char *value, int delta) {
+    char key[MAX_ADDRESS_LEN];
+    int path[MAX_ADDRESS_LEN + 1];
+    int depth = 0;
+    int len = 0;
+
+    if (trie->count == 0) {
+        trie_new_node(trie, "", 0);
+    }
+
+    for (const char *p = value; *p && len < MAX_ADDRESS_LEN - 1; p++) {
+        key[len++] = (char)tolower((unsigned char)*p);
+    }
+    key[len] = '\0';
+    if (len == 0) {
+        return;
+    }
+
+    int current = 0;
+    int pos = 0;
+    path[depth++] = 0;
+
+    while (pos < len) {
+        int child = trie->nodes[current].first_child;
+        while (child != -1 && trie->nodes[child].label[0] != key[pos]) {
+            child = trie->nodes[child].next_sibling;
+        }
+
+        if (child == -1) {
+            if (delta < 0) return;
+            child = trie_new_node(trie, key + pos, len - pos);
+            if (child == -1) return;
+            trie->nodes[child].next_sibling = trie->nodes[current].first_child;
+            trie->nodes[current].first_child = child;
+            pos = len;
+        } else {
+            int common = 0;
+            while (common < trie->nodes[child].label_len && pos + common < len &&
+                   trie->nodes[child].label[common] == key[pos + common]) {
+                common++;
+            }
+            if (common < trie->nodes[child].label_len) {
+                if (delta < 0) return;
+                trie_split(trie, child, common);
+            }
+            pos += common;
+        }
+
+        current = child;
+        path[depth++] = current;
+    }
+
+    TrieNode *node = &trie->nodes[current];
+    node->count += delta;
+    if (node->count < 0) node->count = 0;
+    if (delta > 0 && !node->display) {
+        node->display = malloc(strlen(value) + 1);
+        if (node->display) strcpy(node->display, value);
+    }
+
+    while (depth > 0) {
+        trie_refresh_best(trie, path[--depth]);
+    }
+}
+
+void trie_collect(RadixTrie *trie, int node_index, const char **values, int *counts, int *found, int k) {
+    TrieNode *node = &trie->nodes[node_index];
+
+    if (*found == k && node->best <= counts[k - 1]) {
+        return;
+    }
+
+    if (node->count > 0 && node->display) {
+        int pos = -1;
+        if (*found < k) {
+            pos = (*found)++;
+        } else if (node->count > counts[k - 1]) {
+            pos = k - 1;
+        }
+        if (pos >= 0) {
+            while (pos > 0 && counts[pos - 1] < node->count) {
+                values[pos] = values[pos - 1];
+                counts[pos] = counts[pos - 1];
+                pos--;
+            }
+            values[pos] = node->display;
+            counts[pos] = node->count;
+        }
+    }
+
+    for (int c = node->first_child; c != -1; c = trie->nodes[c].next_sibling) {
+        trie_collect(trie, c, values, counts, found, k);
+    }
+}
+
+/* Fills up to k most frequent values starting with prefix; returns how many. */
+int trie_complete(RadixTrie *trie, const char *prefix, const char **values, int *counts, int k) {
+    int current = 0;
+    int pos = 0;
+    int len = (int)strlen(prefix);
+    int found = 0;
+
+    if (trie->count == 0) {
+        return 0;
+    }
+
+    while (pos < len) {
+        int child = trie->nodes[current].first_child;
+        while (child != -1 &&
+               trie->nodes[child].label[0] != (char)tolower((unsigned char)prefix[pos])) {
+            child = trie->nodes[child].next_sibling;
+        }
+        if (child == -1) {
+            return 0;
+        }
+
+        TrieNode *node = &trie->nodes[child];
+        for (int i = 0; i < node->label_len && pos < len; i++, pos++) {
+            if (node->label[i] != (char)tolower((unsigned char)prefix[pos])) {
+                return 0;
+            }
+        }
+        current = child;
+    }
+
+    trie_collect(trie, current, values, counts, &found, k);
+    return found;
+}
+
+void autocomplete_track(Patient *patient, int delta) {
+    trie_update(&name_trie, patient->name, delta);
+    trie_update(&doctor_trie, patient_doctor(patient), delta);
+    trie_update(&address_trie, patient_address(patient), delta);
+}
+
+void rebuild_autocomplete() {
+    trie_clear(&name_trie);
+    trie_clear(&doctor_trie);
+    trie_clear(&address_trie);
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].is_active) {
+            autocomplete_track(&patients[i], 1);
+        }
+    }
+}
+
+/*
+ * Like read_line, but an entry ending in '?' lists the most common values
+ * starting with what was typed; the user can pick one by number.
+ */
+int read_line_with_suggestions(char *buffer, int max_len, RadixTrie *trie) {
+    if (!read_line(buffer, max_len)) {
+        return 0;
+    }
+
+    while (1) {
+        int len = (int)strlen(buffer);
+        if (len == 0 || buffer[len - 1] != '?') {
+            return 1;
+        }
+
+        buffer[len - 1] = '\0';
+        trim(buffer);
+
+        const char *values[AUTOCOMPLETE_TOP_K];
+        int counts[AUTOCOMPLETE_TOP_K];
+        int found = trie_complete(trie, buffer, values, counts, AUTOCOMPLETE_TOP_K);
+
+        if (found == 0) {
+            printf("No suggestions for \"%s\". Enter value: ", buffer);
+        } else {
+            for (int i = 0; i < found; i++) {
+                printf("  %d) %s (%d)\n", i + 1, values[i], counts[i]);
+            }
+            printf("Pick 1-%d or enter value: ", found);
+        }
+
+        char typed[256];
+        if (!read_line(typed, sizeof(typed))) {
+            return 0;
+        }
+        trim(typed);
+
+        int pick = (strlen(typed) > 0 && is_digits_only(typed)) ? atoi(typed) : 0;
+        if (pick >= 1 && pick <= found) {
+            strncpy(buffer, values[pick - 1], max_len);
+            buffer[max_len - 1] = '\0';
+            return 1;
+        }
+
+        strncpy(buffer, typed, max_len);
+        buffer[max_len - 1] = '\0';
+    }
+}
+
+/* ===================== FILE OPERATIONS ===================== */
+
+/*
+ * Each branch keeps its data files in branches/<name>/. The main branch
+ * keeps them beside the program, where they were before branches existed.
+ * users.txt and config.txt are shared by all branches.
+ */
+char current_branch[BRANCH_NAME_LEN] = MAIN_BRANCH;
+
+/* Path of a data file of the open branch; valid for the next three calls. */
+const char *branch_file(const char *name) {
+    static char buffers[4][BRANCH_PATH_LEN];
+    static int next = 0;
+    char *path = buffers[next];
+    next = (next + 1) % 4;
+
+    if (strcmp(current_branch, MAIN_BRANCH) == 0) {
+        snprintf(path, BRANCH_PATH_LEN, "%s", name);
+    } else {
+        snprintf(path, BRANCH_PATH_LEN, "branches/%s/%s", current_branch, name);
+    }
+    return path;
+}
+
+/* Writes users.txt.tmp and renames it over users.txt, so a failed save
+ * leaves the accounts as they were. */
+int save_users() {
+    SecureFile file;
+    if (!secure_open_write(&file, "users.txt.tmp")) {
+        perror("Error opening users.txt.tmp for writing");
+        return 0;
+    }
+
+    for (int i = 0; i < user_count; i++) {
+        User *user = &users[i];
+        secure_printf(&file, "%d|%s|%s|%d|%d\n",
+                      user->user_id,
+                      user->username,
+                      user->password,
+                      user->role,
+                      user->is_active);
+    }
+
+    int written = secure_finish(&file) && durable_commit(&file.file, 1, 1);
+    if (!secure_close(&file) || !written) {
+        remove("users.txt.tmp");
+        return 0;
+    }
+    return replace_file("users.txt.tmp", "users.txt");
+}
+
+int load_users() {
+    SecureFile file;
+    if (!secure_open_read(&file, "users.txt")) {
+        return 0;
+    }
+
+    user_count = 0;
+    next_user_id = 1;
+
+    char line[512];
+    while (secure_gets(line, sizeof(line), &file) && user_count < MAX_USERS) {
+        User *user = &users[user_count];
+        int role_int;
+
+        if (sscanf(line, "%d|%[^|]|%[^|]|%d|%d",
+                   &user->user_id,
+                   user->username,
+                   user->password,
+                   &role_int,
+                   &user->is_active) == 5) {
+
+            user->role = (role_int == 0) ? ROLE_ADMIN : ROLE_MODERATOR;
+
+            if (user->user_id >= next_user_id) {
+                next_user_id = user->user_id + 1;
+            }
+
+            user_count++;
+        }
+    }
+
+    int sealed = file.encrypted;
+    if (!secure_close(&file)) {
+        report_damaged_file("users.txt");
+        return -1;
+    }
+    /* Brings a file written before encryption was turned on or off in line. */
+    if (sealed != config.encryption && !save_users()) {
+        fprintf(stderr, COLOR_RED "users.txt could not be %s; it was left as it was.\n" COLOR_RESET,
+                config.encryption ? "encrypted" : "decrypted");
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * patients.txt starts with "@column|code|value" dictionary lines followed by
+ * records whose dictionary columns hold those codes. Files without any
+ * dictionary lines are read as the older all-text format.
+ */
+typedef struct {
+    const char *name;
+    Dictionary *dict;
+    PatientField field;
+} DictionaryColumn;
+
+#define DICTIONARY_COLUMN_INT(tag, dict, column)
+#define DICTIONARY_COLUMN_TEXT(tag, dict, column)
+#define DICTIONARY_COLUMN_CODE(tag, dict, column) {column, &dict, tag},
+#define DICTIONARY_COLUMN_PHONE(tag, dict, column)
+#define DICTIONARY_COLUMN_FLAG(tag, dict, column)
+#define DICTIONARY_COLUMN(tag, member, kind, size, dict, label, column, min, max) \
+    DICTIONARY_COLUMN_##kind(tag, dict, column)
+
+DictionaryColumn dictionary_columns[DICTIONARY_COLUMN_COUNT] = {
+    PATIENT_FIELDS(DICTIONARY_COLUMN)
+};
+
+#define COLUMN_CASE_INT(tag, member)
+#define COLUMN_CASE_TEXT(tag, member)
+#define COLUMN_CASE_CODE(tag, member) case tag##_COLUMN: return patient->member;
+#define COLUMN_CASE_PHONE(tag, member)
+#define COLUMN_CASE_FLAG(tag, member)
+#define COLUMN_CASE(tag, member, kind, size, dict, label, column, min, max) COLUMN_CASE_##kind(tag, member)
+
+int patient_column_code(const Patient *patient, int column) {
+    switch (column) {
+        PATIENT_FIELDS(COLUMN_CASE)
+    }
+    return -1;
+}
+
+typedef struct {
+    int *codes;
+    int count;
+} CodeMap;
+
+void code_map_set(CodeMap *map, int file_code, int code) {
+    if (file_code < 0) {
+        return;
+    }
+
+    if (file_code >= map->count) {
+        int new_count = file_code + 16;
+        int *grown = realloc(map->codes, new_count * sizeof(int));
+        if (!grown) {
+            return;
+        }
+        for (int i = map->count; i < new_count; i++) grown[i] = -1;
+        map->codes = grown;
+        map->count = new_count;
+    }
+
+    map->codes[file_code] = code;
+}
+
+int code_map_get(const CodeMap *map, int file_code) {
+    if (file_code < 0 || file_code >= map->count) {
+        return -1;
+    }
+    return map->codes[file_code];
+}
+
+int parse_dictionary_line(const char *line, CodeMap *maps) {
+    char column[32];
+    char value[MAX_ADDRESS_LEN];
+    int file_code;
+
+    if (sscanf(line, "@%31[^|]|%d|%255[^\n]", column, &file_code, value) != 3) {
+        return 0;
+    }
+
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        if (strcmp(dictionary_columns[c].name, column) == 0) {
+            code_map_set(&maps[c], file_code, dict_intern(dictionary_columns[c].dict, value));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Readers for one '|'-separated field. Each consumes the field and its
+ * separator and fails on an empty or malformed field. Text longer than
+ * its buffer is truncated.
+ */
+int field_ends(char c) {
+    return c == '|' || c == '\n' || c == '\r' || c == '\0';
+}
+
+int read_text_field(const char **cursor, char *out, int size) {
+    const char *p = *cursor;
+    int len = 0;
+
+    while (*p && *p != '|' && *p != '\n') {
+        if (len < size - 1) out[len++] = *p;
+        p++;
+    }
+    if (p == *cursor) return 0;
+    out[len] = '\0';
+    *cursor = (*p == '|') ? p + 1 : p;
+    return 1;
+}
+
+int read_int_field(const char **cursor, int *out) {
+    const char *p = *cursor;
+    int negative = 0;
+    long long value = 0;
+
+    while (*p == ' ') p++;
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+    const char *digits = p;
+    while (*p >= '0' && *p <= '9') {
+        if (value < 10000000000LL) value = value * 10 + (*p - '0');
+        p++;
+    }
+    if (p == digits || !field_ends(*p) || value > 2147483647LL) return 0;
+
+    *out = (int)(negative ? -value : value);
+    *cursor = (*p == '|') ? p + 1 : p;
+    return 1;
+}
+
+/*
+ * Per-kind field parsers. encoded is a literal at every expansion, so each
+ * generated parser keeps only the branch for its own format.
+ */
+#define PARSE_INT(member, size, dict, column_index, encoded) \
+    if (!read_int_field(&p, &patient->member)) return 0;
+#define PARSE_FLAG PARSE_INT
+#define PARSE_TEXT(member, size, dict, column_index, encoded) \
+    if (!read_text_field(&p, patient->member, size)) return 0;
+#define PARSE_PHONE(member, size, dict, column_index, encoded) { \
+        char phone[32]; \
+        if (!read_text_field(&p, phone, sizeof(phone))) return 0; \
+        patient->member = normalize_phone(phone); \
+    }
+#define PARSE_CODE(member, size, dict, column_index, encoded) \
+    if (encoded) { \
+        int file_code; \
+        if (!read_int_field(&p, &file_code)) return 0; \
+        patient->member = code_map_get(&maps[column_index], file_code); \
+    } else { \
+        char value[MAX_ADDRESS_LEN]; \
+        if (!read_text_field(&p, value, sizeof(value))) return 0; \
+        patient->member = dict_intern(&dict, value); \
+    }
+#define PARSE_ENCODED(tag, member, kind, size, dict, label, column, min, max) \
+    PARSE_##kind(member, size, dict, tag##_COLUMN, 1)
+#define PARSE_TEXT_FORMAT(tag, member, kind, size, dict, label, column, min, max) \
+    PARSE_##kind(member, size, dict, 0, 0)
+
+/* Dictionary columns hold file codes, translated through maps. */
+int parse_encoded_patient(const char *line, Patient *patient, const CodeMap *maps) {
+    const char *p = line;
+    PATIENT_FIELDS(PARSE_ENCODED)
+    return 1;
+}
+
+int parse_text_patient(const char *line, Patient *patient) {
+    const CodeMap *maps = NULL;
+    const char *p = line;
+    (void)maps;
+    PATIENT_FIELDS(PARSE_TEXT_FORMAT)
+    return 1;
+}
+
+/*
+ * Appends to a fixed buffer with snprintf's contract: the text is cut to
+ * fit and NUL-terminated, and length counts what would have been written.
+ */
+typedef struct {
+    char *buffer;
+    int size;
+    int length;
+} RecordWriter;
+
+void put_bytes(RecordWriter *writer, const char *data, int len) {
+    int room = writer->size - 1 - writer->length;
+    if (room > 0) memcpy(writer->buffer + writer->length, data, len < room ? len : room);
+    writer->length += len;
+}
+
+void put_string(RecordWriter *writer, const char *text) {
+    put_bytes(writer, text, (int)strlen(text));
+}
+
+void put_int(RecordWriter *writer, int value) {
+    char digits[12];
+    int pos = sizeof(digits);
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do {
+        digits[--pos] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    if (value < 0) digits[--pos] = '-';
+    put_bytes(writer, digits + pos, (int)sizeof(digits) - pos);
+}
+
+int finish_record(RecordWriter *writer) {
+    /* Every field was followed by '|'; the last one ends the line instead. */
+    writer->length--;
+    put_bytes(writer, "\n", 1);
+    if (writer->size > 0) {
+        writer->buffer[writer->length < writer->size ? writer->length : writer->size - 1] = '\0';
+    }
+    return writer->length;
+}
+
+#define WRITE_INT(member, dict, encoded) put_int(&writer, patient->member);
+#define WRITE_FLAG WRITE_INT
+#define WRITE_TEXT(member, dict, encoded) put_string(&writer, patient->member);
+#define WRITE_PHONE(member, dict, encoded) put_string(&writer, patient_phone(patient));
+#define WRITE_CODE(member, dict, encoded) \
+    if (encoded) put_int(&writer, patient->member); \
+    else put_string(&writer, dict_value(&dict, patient->member));
+#define WRITE_ENCODED(tag, member, kind, size, dict, label, column, min, max) \
+    WRITE_##kind(member, dict, 1) put_bytes(&writer, "|", 1);
+#define WRITE_TEXT_FORMAT(tag, member, kind, size, dict, label, column, min, max) \
+    WRITE_##kind(member, dict, 0) put_bytes(&writer, "|", 1);
+
+/* Writes patient in the all-text record format, newline included. */
+int format_patient_text(const Patient *patient, char *buffer, int size) {
+    RecordWriter writer = {buffer, size, 0};
+    PATIENT_FIELDS(WRITE_TEXT_FORMAT)
+    return finish_record(&writer);
+}
+
+/* Writes patient with dictionary codes, as in the encoded patients.txt. */
+int format_patient_encoded(const Patient *patient, char *buffer, int size) {
+    RecordWriter writer = {buffer, size, 0};
+    PATIENT_FIELDS(WRITE_ENCODED)
+    return finish_record(&writer);
+}
+
+/*
+ * patients.txt ends with a line holding the number of records and the
+ * CRC32C of every byte before it:
+ *   @checksum|<records>|<crc>
+ * Loading checks each record's checksum and the file's. A record that
+ * fails its checksum or does not parse is left out, and the file as found
+ * is kept beside it so nothing is lost when patients.txt is next saved.
+ * Records without a checksum, as in files written before checksums, load
+ * as they are.
+ */
+typedef struct {
+    uint32_t crc;            /* of the lines before the trailer */
+    int records;             /* record lines, damaged ones included */
+    int unchecked;           /* records without a checksum */
+    int damaged;
+    int trailer_records;     /* as the trailer gives them; -1 without one */
+    int file_ok;             /* the trailer matches and ends the file */
+    char kept[BRANCH_PATH_LEN]; /* where a damaged file was kept, or "" */
+} StoreCheck;
+
+/* Starts as for a missing file, which is not damaged. */
+StoreCheck patients_check = {0, 0, 0, 0, -1, 0, ""};
+
+typedef enum {
+    STORE_OTHER,             /* a dictionary or blank line */
+    STORE_RECORD,
+    STORE_DAMAGED,
+    STORE_TRAILER
+} StoreLine;
+
+void store_check_start(StoreCheck *check) {
+    memset(check, 0, sizeof(*check));
+    check->trailer_records = -1;
+}
+
+/* Classifies a line of patients.txt and strips a record's checksum. */
+StoreLine check_store_line(StoreCheck *check, char *line) {
+    if (strncmp(line, "@checksum|", 10) == 0) {
+        unsigned stored;
+        check->file_ok = sscanf(line, "@checksum|%d|%8x", &check->trailer_records, &stored) == 2 &&
+                         stored == check->crc;
+        return STORE_TRAILER;
+    }
+
+    /* Nothing may follow the trailer. */
+    if (check->trailer_records >= 0) check->file_ok = 0;
+    check->crc = crc32c(check->crc, line, strlen(line));
+    if (line[0] == '@' || line[strspn(line, "\r\n")] == '\0') {
+        return STORE_OTHER;
+    }
+
+    check->records++;
+    int sealed = open_record_line(line);
+    if (sealed < 0) {
+        check->damaged++;
+        return STORE_DAMAGED;
+    }
+    if (sealed == 0) check->unchecked++;
+    return STORE_RECORD;
+}
+
+/* Whether the file was written with checksums and no longer matches them.
+ * Such a file lacking its trailer was cut short. */
+int store_check_failed(const StoreCheck *check) {
+    if (check->damaged > 0) return 1;
+    if (check->trailer_records >= 0) return !check->file_ok;
+    return check->records > check->unchecked;
+}
+
+void print_store_problems(FILE *out, const StoreCheck *check) {
+    if (check->damaged > 0) {
+        fprintf(out, "%d record(s) fail their checksum or cannot be read.\n", check->damaged);
+    }
+    if (check->trailer_records >= 0 && !check->file_ok) {
+        fprintf(out, "The file does not match its checksum line; lines are missing or altered.\n");
+    } else if (check->trailer_records < 0 && check->records > check->unchecked) {
+        fprintf(out, "The file ends before its checksum line; it was cut short.\n");
+    }
+    if (check->trailer_records >= 0 && check->trailer_records != check->records) {
+        fprintf(out, "It should hold %d record(s) and holds %d.\n", check->trailer_records, check->records);
+    }
+}
+
+/* Copies patients.txt as found to patients-<time>.damaged. A file from
+ * before encryption was turned on is sealed as it is copied, so no
+ * plaintext copy is left behind. */
+void keep_damaged_store(StoreCheck *check) {
+    char name[64];
+    char buffer[65536];
+    time_t now = time(NULL);
+    SecureFile sealed = {0};
+    size_t n;
+
+    strftime(name, sizeof(name), "patients-%Y%m%d-%H%M%S.damaged", localtime(&now));
+    snprintf(check->kept, sizeof(check->kept), "%s", branch_file(name));
+
+    int seal = config.encryption && !secure_file_sealed(branch_file("patients.txt"));
+    FILE *from = fopen(branch_file("patients.txt"), "rb");
+    FILE *to = NULL;
+    int ok = from && (seal ? secure_open_write(&sealed, check->kept) : (to = fopen(check->kept, "wb")) != NULL);
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        ok = seal ? secure_write(&sealed, buffer, n) : fwrite(buffer, 1, n, to) == n;
+    }
+    if (from) fclose(from);
+    if (sealed.file) {
+        int finished = secure_finish(&sealed);
+        if (!secure_close(&sealed) || !finished) ok = 0;
+    }
+    if (to && fclose(to) != 0) ok = 0;
+    if (!ok) {
+        remove(check->kept);
+        check->kept[0] = '\0';
+    }
+
+    fprintf(stderr, COLOR_RED "%s is damaged.\n" COLOR_RESET, branch_file("patients.txt"));
+    print_store_problems(stderr, check);
+    if (ok) fprintf(stderr, "The file as found is kept as %s.\n", check->kept);
+}
+
+/*
+ * With lazy_load=on, startup only scans patients.txt for each record's ID,
+ * active flag and file offset. The rest of a record is parsed into
+ * patients[] the first time patient_at() hands it out, and the name
+ * indexes are built the first time a form needs them.
+ */
+typedef struct {
+    FILE *file;
+    int scanned;
+    int remaining;
+    long offsets[MAX_PATIENTS];
+    unsigned char parsed[MAX_PATIENTS];
+    CodeMap maps[DICTIONARY_COLUMN_COUNT];
+    int encoded;
+} LazyLoad;
+
+LazyLoad lazy = {0};
+
+void lazy_finish() {
+    if (lazy.file) {
+        fclose(lazy.file);
+        lazy.file = NULL;
+    }
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        free(lazy.maps[c].codes);
+        lazy.maps[c].codes = NULL;
+        lazy.maps[c].count = 0;
+    }
+    lazy.remaining = 0;
+}
+
+/* Call after patients[index] has been overwritten with a full record. */
+void lazy_mark_parsed(int index) {
+    if (lazy.remaining > 0 && index < lazy.scanned && !lazy.parsed[index]) {
+        lazy.parsed[index] = 1;
+        if (--lazy.remaining == 0) lazy_finish();
+    }
+}
+
+Patient *patient_at(int index) {
+    if (lazy.remaining > 0 && index < lazy.scanned && !lazy.parsed[index]) {
+        char line[1024];
+        Patient patient;
+
+        /* A record that no longer parses keeps its scanned ID and flag. */
+        if (fseek(lazy.file, lazy.offsets[index], SEEK_SET) == 0 &&
+            fgets(line, sizeof(line), lazy.file) &&
+            (lazy.encoded ? parse_encoded_patient(line, &patient, lazy.maps)
+                          : parse_text_patient(line, &patient))) {
+            patients[index] = patient;
+        }
+        lazy_mark_parsed(index);
+    }
+    return &patients[index];
+}
+
+void materialize_all_patients() {
+    for (int i = 0; lazy.remaining > 0 && i < lazy.scanned; i++) {
+        patient_at(i);
+    }
+}
+
+int patient_indexes_built = 0;
+
+void rebuild_patient_indexes() {
+    materialize_all_patients();
+    rebuild_name_index();
+    rebuild_phonetic_index();
+    rebuild_autocomplete();
+    rebuild_phone_index();
+    patient_indexes_built = 1;
+}
+
+/* Builds the name indexes on first use when loading lazily. */
+void ensure_patient_indexes() {
+    if (!patient_indexes_built) {
+        rebuild_patient_indexes();
+    }
+}
+
+int load_patient_index() {
+    store_check_start(&patients_check);
+    FILE *file = fopen(branch_file("patients.txt"), "rb");
+    if (!file) {
+        return 0;
+    }
+
+    lazy_finish();
+    patient_count = 0;
+    next_patient_id = 1;
+    patient_indexes_built = 0;
+    lazy.encoded = 0;
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        dict_clear(dictionary_columns[c].dict);
+    }
+
+    char line[1024];
+    long offset = 0;
+    while (fgets(line, sizeof(line), file) && patient_count < MAX_PATIENTS) {
+        long line_offset = offset;
+        offset += (long)strlen(line);
+
+        StoreLine kind = check_store_line(&patients_check, line);
+        if (kind == STORE_OTHER && line[0] == '@') {
+            lazy.encoded |= parse_dictionary_line(line, lazy.maps);
+        }
+        if (kind != STORE_RECORD) {
+            continue;
+        }
+
+        char *end;
+        long id = strtol(line, &end, 10);
+        char *last_field = strrchr(line, '|');
+        if (end == line || *end != '|' || !last_field) {
+            patients_check.damaged++;
+            continue;
+        }
+
+        Patient *patient = &patients[patient_count];
+        patient->id = (int)id;
+        patient->is_active = atoi(last_field + 1);
+        lazy.offsets[patient_count] = line_offset;
+        lazy.parsed[patient_count] = 0;
+        if (patient->id >= next_patient_id) {
+            next_patient_id = patient->id + 1;
+        }
+        patient_count++;
+    }
+
+    lazy.file = file;
+    lazy.scanned = lazy.remaining = patient_count;
+    if (lazy.remaining == 0) {
+        lazy_finish();
+    }
+    if (store_check_failed(&patients_check)) {
+        keep_damaged_store(&patients_check);
+    }
+    return 1;
+}
+
+/* Whether the patients.txt just loaded was sealed; a file in the other
+ * format than configured is rewritten after loading. A file that did not
+ * decrypt is never saved over, so it can still be recovered. */
+int patients_file_sealed = 0;
+int patients_damaged = 0;
+
+/* Where load_patient_text and journal_replay send each record; NULL keeps
+ * them in patients[]. The first B+tree start imports through it, so the
+ * import is not limited to what fits in patients[]. */
+int (*text_record_sink)(const Patient *patient) = NULL;
+
+int load_patient_text() {
+    SecureFile file;
+    patients_file_sealed = config.encryption;
+    store_check_start(&patients_check);
+    if (!secure_open_read(&file, branch_file("patients.txt"))) {
+        rebuild_patient_indexes();
+        return 0;
+    }
+
+    patient_count = 0;
+    next_patient_id = 1;
+
+    CodeMap maps[DICTIONARY_COLUMN_COUNT] = {{0}};
+    int encoded = 0;
+
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        dict_clear(dictionary_columns[c].dict);
+    }
+
+    char line[1024];
+    Patient imported;
+    int sink_failed = 0;
+    while (!sink_failed && secure_gets(line, sizeof(line), &file) &&
+           (text_record_sink || patient_count < MAX_PATIENTS)) {
+        Patient *patient = text_record_sink ? &imported : &patients[patient_count];
+
+        StoreLine kind = check_store_line(&patients_check, line);
+        if (kind == STORE_OTHER && line[0] == '@') {
+            encoded |= parse_dictionary_line(line, maps);
+        }
+        if (kind != STORE_RECORD) {
+            continue;
+        }
+
+        int parsed = encoded ? parse_encoded_patient(line, patient, maps)
+                             : parse_text_patient(line, patient);
+        if (parsed) {
+            if (patient->id >= next_patient_id) {
+                next_patient_id = patient->id + 1;
+            }
+
+            if (!text_record_sink) {
+                patient_count++;
+            } else if (!text_record_sink(patient)) {
+                sink_failed = 1;
+            }
+        } else {
+            patients_check.damaged++;
+        }
+    }
+
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        free(maps[c].codes);
+    }
+
+    patients_file_sealed = file.encrypted;
+    if (!secure_close(&file)) {
+        report_damaged_file(branch_file("patients.txt"));
+        patients_damaged = 1;
+    } else if (store_check_failed(&patients_check)) {
+        keep_damaged_store(&patients_check);
+    }
+    rebuild_patient_indexes();
+    return !sink_failed;
+}
+
+/* ===================== WRITE JOURNAL ===================== */
+
+/*
+ * Text-store changes are appended to patients.journal as all-text record
+ * lines instead of rewriting patients.txt on every edit. A checkpoint folds
+ * the journal back into patients.txt every JOURNAL_CHECKPOINT_RECORDS lines
+ * and at logout and exit. A journal left behind by a crash is replayed over
+ * patients.txt at startup, later lines for an ID replacing earlier ones.
+ */
+typedef struct {
+    FILE *file;
+    uint64_t size;
+    int records;
+} Journal;
+
+Journal journal = {0};
+
+int journal_append(const Patient *patient) {
+    char line[1024];
+    unsigned char frame[sizeof(line) + SECURE_FRAME_OVERHEAD];
+    const void *record = line;
+    int len = seal_record_line(line, format_patient_text(patient, line, sizeof(line)), sizeof(line));
+    if (len <= 0) {
+        return 0;
+    }
+    if (config.encryption) {
+        len = seal_journal_frame(line, len, frame);
+        record = frame;
+    }
+
+    if (!journal.file) {
+        journal.file = open_or_create(branch_file("patients.journal"));
+        if (!journal.file) {
+            perror("Error opening patients.journal");
+            return 0;
+        }
+        /* Anything in an unreplayed journal is a torn tail; drop it. */
+        journal.size = file_size(journal.file);
+        if (journal.records == 0 && journal.size > 0) {
+            truncate_file(journal.file, 0);
+            journal.size = 0;
+        }
+    }
+
+    if (!io_write(journal.file, journal.size, record, len) || !io_commit(&journal.file, 1, 0)) {
+        return 0;
+    }
+    journal.size += len;
+    journal.records++;
+    return 1;
+}
+
+/* Applies one journal line; a line cut short by a crash has no newline
+ * and is dropped, as is one that fails its checksum. */
+int journal_apply_line(char *line) {
+    Patient patient;
+    size_t len = strlen(line);
+
+    if (len == 0 || line[len - 1] != '\n') {
+        return 0;
+    }
+    if (open_record_line(line) < 0) {
+        fprintf(stderr, "Skipped a record of %s that fails its checksum.\n", branch_file("patients.journal"));
+        return 0;
+    }
+    if (!parse_text_patient(line, &patient)) {
+        return 0;
+    }
+    if (patient.id >= next_patient_id) {
+        next_patient_id = patient.id + 1;
+    }
+    if (text_record_sink) {
+        return text_record_sink(&patient);
+    }
+
+    int i = 0;
+    while (i < patient_count && patients[i].id != patient.id) i++;
+    if (i == patient_count) {
+        if (patient_count >= MAX_PATIENTS) return 0;
+        patient_count++;
+    }
+    patients[i] = patient;
+    lazy_mark_parsed(i);
+    return 1;
+}
+
+/* Reads sealed journal frames up to the first one that is cut short or
+ * does not authenticate. */
+int journal_replay_sealed(FILE *file) {
+    unsigned char frame[1024 + SECURE_FRAME_OVERHEAD];
+    char line[1024];
+    int applied = 0;
+
+    while (fread(frame, 1, 16, file) == 16) {
+        size_t len = get_be32(frame);
+        if (len >= sizeof(line) ||
+            fread(frame + 16, 1, len + SECURE_TAG_SIZE, file) != len + SECURE_TAG_SIZE ||
+            !gcm_open(&crypto.key, frame + 4, frame, 4, frame + 16, (unsigned char *)line, len, frame + 16 + len)) {
+            break;
+        }
+        line[len] = '\0';
+        applied += journal_apply_line(line);
+    }
+    if (!feof(file)) {
+        fprintf(stderr, "Dropped the unreadable tail of %s.\n", branch_file("patients.journal"));
+    }
+    return applied;
+}
+
+/* Applies a leftover journal to patients[]; returns the lines applied. */
+int journal_replay() {
+    FILE *file = fopen(branch_file("patients.journal"), "rb");
+    if (!file) {
+        return 0;
+    }
+
+    char line[1024];
+    int applied = 0;
+    int first = fgetc(file);
+    if (first == 0) {
+        rewind(file);
+        applied = crypto_unlock() ? journal_replay_sealed(file) : 0;
+    } else if (first != EOF) {
+        fclose(file);
+        file = fopen(branch_file("patients.journal"), "r");
+        while (file && fgets(line, sizeof(line), file)) {
+            applied += journal_apply_line(line);
+        }
+    }
+
+    if (file) fclose(file);
+    journal.records = applied;
+    return applied;
+}
+
+void journal_reset() {
+    if (journal.file) {
+        io_flush();
+        fclose(journal.file);
+        journal.file = NULL;
+    }
+    remove(branch_file("patients.journal"));
+    journal.size = 0;
+    journal.records = 0;
+}
+
+/* ===================== B+TREE STORAGE ===================== */
+
+/*
+ * Out-of-core store used when config.txt sets storage=btree. patients.db
+ * is a paged B+tree keyed by patient ID whose leaves point at the record's
+ * text line in the append-only patients.heap. Pages are only touched through
+ * a fixed-size buffer pool with CLOCK eviction, so memory stays bounded by
+ * buffer_pool_pages no matter how large the files grow.
+ *
+ * Page 0 is the meta page. Leaves hold (id, heap offset, length) entries and
+ * are chained both ways; internal pages hold child0 then (key, child) pairs,
+ * where keys >= key live under child.
+ */
+typedef struct {
+    uint32_t page_no;
+    int valid;
+    int dirty;
+    int pins;
+    int referenced;
+    unsigned char *data;
+} PoolFrame;
+
+typedef struct {
+    FILE *file;
+    PoolFrame *frames;
+    int frame_count;
+    int clock_hand;
+    uint32_t page_count;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writes;
+} BufferPool;
+
+typedef struct {
+    int open;
+    BufferPool pool;
+    FILE *heap;
+    uint32_t root;
+    uint32_t record_count;
+    uint32_t active_count;
+} BTreeStore;
+
+BTreeStore btree_store = {0};
+
+int pool_write_frame(BufferPool *pool, PoolFrame *frame) {
+    if (!file_seek(pool->file, (uint64_t)frame->page_no * BTREE_PAGE_SIZE, SEEK_SET) ||
+        fwrite(frame->data, 1, BTREE_PAGE_SIZE, pool->file) != BTREE_PAGE_SIZE) {
+        return 0;
+    }
+    frame->dirty = 0;
+    pool->writes++;
+    return 1;
+}
+
+PoolFrame *pool_victim(BufferPool *pool) {
+    for (int sweep = 0; sweep < pool->frame_count * 2; sweep++) {
+        PoolFrame *frame = &pool->frames[pool->clock_hand];
+        pool->clock_hand = (pool->clock_hand + 1) % pool->frame_count;
+
+        if (frame->pins > 0) continue;
+        if (frame->valid && frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+        if (frame->valid && frame->dirty && !pool_write_frame(pool, frame)) {
+            return NULL;
+        }
+        frame->valid = 0;
+        return frame;
+    }
+    return NULL;
+}
+
+/* Pins page_no in the pool and returns its bytes, or NULL. */
+unsigned char *pool_fetch(BufferPool *pool, uint32_t page_no) {
+    for (int i = 0; i < pool->frame_count; i++) {
+        PoolFrame *frame = &pool->frames[i];
+        if (frame->valid && frame->page_no == page_no) {
+            frame->pins++;
+            frame->referenced = 1;
+            pool->hits++;
+            return frame->data;
+        }
+    }
+
+    PoolFrame *frame = pool_victim(pool);
+    if (!frame) {
+        return NULL;
+    }
+
+    pool->misses++;
+    memset(frame->data, 0, BTREE_PAGE_SIZE);
+    if (page_no < pool->page_count) {
+        if (!file_seek(pool->file, (uint64_t)page_no * BTREE_PAGE_SIZE, SEEK_SET) ||
+            fread(frame->data, 1, BTREE_PAGE_SIZE, pool->file) != BTREE_PAGE_SIZE) {
+            return NULL;
+        }
+    }
+
+    frame->page_no = page_no;
+    frame->valid = 1;
+    frame->dirty = 0;
+    frame->pins = 1;
+    frame->referenced = 1;
+    return frame->data;
+}
+
+void pool_unpin(BufferPool *pool, uint32_t page_no, int dirty) {
+    for (int i = 0; i < pool->frame_count; i++) {
+        PoolFrame *frame = &pool->frames[i];
+        if (frame->valid && frame->page_no == page_no) {
+            if (frame->pins > 0) frame->pins--;
+            if (dirty) frame->dirty = 1;
+            return;
+        }
+    }
+}
+
+/* Appends a zeroed page; returns its number (pinned) or 0 on failure. */
+uint32_t pool_new_page(BufferPool *pool, unsigned char **data) {
+    uint32_t page_no = pool->page_count;
+
+    *data = pool_fetch(pool, page_no);
+    if (!*data) {
+        return 0;
+    }
+    pool->page_count++;
+    return page_no;
+}
+
+int pool_flush(BufferPool *pool) {
+    for (int i = 0; i < pool->frame_count; i++) {
+        PoolFrame *frame = &pool->frames[i];
+        if (frame->valid && frame->dirty && !pool_write_frame(pool, frame)) {
+            return 0;
+        }
+    }
+    return fflush(pool->file) == 0;
+}
+
+int btree_write_meta() {
+    BTreeStore *tree = &btree_store;
+    unsigned char *meta = pool_fetch(&tree->pool, 0);
+    if (!meta) {
+        return 0;
+    }
+
+    memcpy(meta, "PRBT", 4);
+    put_u32(meta + 4, tree->root);
+    put_u32(meta + 8, tree->pool.page_count);
+    put_u32(meta + 12, (uint32_t)next_patient_id);
+    put_u32(meta + 16, tree->record_count);
+    put_u32(meta + 20, tree->active_count);
+    pool_unpin(&tree->pool, 0, 1);
+    return 1;
+}
+
+int btree_commit() {
+    BTreeStore *tree = &btree_store;
+    FILE *files[2] = {tree->pool.file, tree->heap};
+    return btree_write_meta() && pool_flush(&tree->pool) && durable_commit(files, 2, 0);
+}
+
+/* First slot in a leaf whose key is >= key. */
+int leaf_lower_bound(const unsigned char *page, uint32_t key) {
+    int lo = 0;
+    int hi = get_u16(page + 2);
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (get_u32(page + BTREE_LEAF_HEADER + mid * BTREE_LEAF_ENTRY) < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+uint32_t internal_child_for(const unsigned char *page, uint32_t key) {
+    int lo = 0;
+    int hi = get_u16(page + 2);
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (get_u32(page + BTREE_INTERNAL_HEADER + mid * BTREE_INTERNAL_ENTRY) <= key) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return get_u32(page + 4);
+    return get_u32(page + BTREE_INTERNAL_HEADER + (lo - 1) * BTREE_INTERNAL_ENTRY + 4);
+}
+
+/* Descends to the leaf that would hold key, recording internal pages in path. */
+uint32_t btree_find_leaf(uint32_t key, uint32_t *path, int *depth) {
+    BTreeStore *tree = &btree_store;
+    uint32_t page_no = tree->root;
+
+    *depth = 0;
+    while (1) {
+        unsigned char *page = pool_fetch(&tree->pool, page_no);
+        if (!page) return 0;
+
+        if (get_u16(page) == BTREE_PAGE_LEAF) {
+            pool_unpin(&tree->pool, page_no, 0);
+            return page_no;
+        }
+
+        if (*depth >= BTREE_MAX_DEPTH) {
+            pool_unpin(&tree->pool, page_no, 0);
+            return 0;
+        }
+        path[(*depth)++] = page_no;
+        uint32_t child = internal_child_for(page, key);
+        pool_unpin(&tree->pool, page_no, 0);
+        page_no = child;
+    }
+}
+
+/* Inserts (key, child) into the internal pages on path, splitting upward. */
+int btree_insert_separator(uint32_t *path, int depth, uint32_t key, uint32_t child) {
+    BTreeStore *tree = &btree_store;
+    static uint32_t keys[BTREE_INTERNAL_MAX + 1];
+    static uint32_t children[BTREE_INTERNAL_MAX + 2];
+
+    while (depth > 0) {
+        uint32_t page_no = path[--depth];
+        unsigned char *page = pool_fetch(&tree->pool, page_no);
+        if (!page) return 0;
+
+        int count = get_u16(page + 2);
+        int pos = 0;
+        while (pos < count && get_u32(page + BTREE_INTERNAL_HEADER + pos * BTREE_INTERNAL_ENTRY) <= key) {
+            pos++;
+        }
+
+        if (count < BTREE_INTERNAL_MAX) {
+            unsigned char *slot = page + BTREE_INTERNAL_HEADER + pos * BTREE_INTERNAL_ENTRY;
+            memmove(slot + BTREE_INTERNAL_ENTRY, slot, (count - pos) * BTREE_INTERNAL_ENTRY);
+            put_u32(slot, key);
+            put_u32(slot + 4, child);
+            put_u16(page + 2, (uint16_t)(count + 1));
+            pool_unpin(&tree->pool, page_no, 1);
+            return 1;
+        }
+
+        children[0] = get_u32(page + 4);
+        for (int i = 0, j = 0; i <= count; i++) {
+            if (i == pos) {
+                keys[i] = key;
+                children[i + 1] = child;
+            } else {
+                keys[i] = get_u32(page + BTREE_INTERNAL_HEADER + j * BTREE_INTERNAL_ENTRY);
+                children[i + 1] = get_u32(page + BTREE_INTERNAL_HEADER + j * BTREE_INTERNAL_ENTRY + 4);
+                j++;
+            }
+        }
+
+        int mid = (count + 1) / 2;
+        unsigned char *right;
+        uint32_t right_no = pool_new_page(&tree->pool, &right);
+        if (!right_no) {
+            pool_unpin(&tree->pool, page_no, 0);
+            return 0;
+        }
+
+        put_u16(page + 2, (uint16_t)mid);
+        for (int i = 0; i < mid; i++) {
+            put_u32(page + BTREE_INTERNAL_HEADER + i * BTREE_INTERNAL_ENTRY, keys[i]);
+            put_u32(page + BTREE_INTERNAL_HEADER + i * BTREE_INTERNAL_ENTRY + 4, children[i + 1]);
+        }
+
+        put_u16(right, BTREE_PAGE_INTERNAL);
+        put_u16(right + 2, (uint16_t)(count - mid));
+        put_u32(right + 4, children[mid + 1]);
+        for (int i = mid + 1; i <= count; i++) {
+            int r = i - mid - 1;
+            put_u32(right + BTREE_INTERNAL_HEADER + r * BTREE_INTERNAL_ENTRY, keys[i]);
+            put_u32(right + BTREE_INTERNAL_HEADER + r * BTREE_INTERNAL_ENTRY + 4, children[i + 1]);
+        }
+
+        pool_unpin(&tree->pool, page_no, 1);
+        pool_unpin(&tree->pool, right_no, 1);
+        key = keys[mid];
+        child = right_no;
+    }
+
+    unsigned char *root;
+    uint32_t root_no = pool_new_page(&tree->pool, &root);
+    if (!root_no) return 0;
+
+    put_u16(root, BTREE_PAGE_INTERNAL);
+    put_u16(root + 2, 1);
+    put_u32(root + 4, tree->root);
+    put_u32(root + BTREE_INTERNAL_HEADER, key);
+    put_u32(root + BTREE_INTERNAL_HEADER + 4, child);
+    pool_unpin(&tree->pool, root_no, 1);
+    tree->root = root_no;
+    return 1;
+}
+
+/* Points key at a heap record, inserting it if new. */
+int btree_put(uint32_t key, uint64_t offset, uint32_t length, int *is_new) {
+    BTreeStore *tree = &btree_store;
+    static unsigned char entries[(BTREE_LEAF_MAX + 1) * BTREE_LEAF_ENTRY];
+    uint32_t path[BTREE_MAX_DEPTH];
+    int depth;
+
+    uint32_t leaf_no = btree_find_leaf(key, path, &depth);
+    unsigned char *leaf = leaf_no ? pool_fetch(&tree->pool, leaf_no) : NULL;
+    if (!leaf) return 0;
+
+    int count = get_u16(leaf + 2);
+    int pos = leaf_lower_bound(leaf, key);
+    unsigned char *slot = leaf + BTREE_LEAF_HEADER + pos * BTREE_LEAF_ENTRY;
+
+    *is_new = !(pos < count && get_u32(slot) == key);
+    if (!*is_new) {
+        put_u64(slot + 4, offset);
+        put_u32(slot + 12, length);
+        pool_unpin(&tree->pool, leaf_no, 1);
+        return 1;
+    }
+
+    if (count < BTREE_LEAF_MAX) {
+        memmove(slot + BTREE_LEAF_ENTRY, slot, (count - pos) * BTREE_LEAF_ENTRY);
+        put_u32(slot, key);
+        put_u64(slot + 4, offset);
+        put_u32(slot + 12, length);
+        put_u16(leaf + 2, (uint16_t)(count + 1));
+        pool_unpin(&tree->pool, leaf_no, 1);
+        return 1;
+    }
+
+    memcpy(entries, leaf + BTREE_LEAF_HEADER, pos * BTREE_LEAF_ENTRY);
+    put_u32(entries + pos * BTREE_LEAF_ENTRY, key);
+    put_u64(entries + pos * BTREE_LEAF_ENTRY + 4, offset);
+    put_u32(entries + pos * BTREE_LEAF_ENTRY + 12, length);
+    memcpy(entries + (pos + 1) * BTREE_LEAF_ENTRY, slot, (count - pos) * BTREE_LEAF_ENTRY);
+
+    unsigned char *right;
+    uint32_t right_no = pool_new_page(&tree->pool, &right);
+    if (!right_no) {
+        pool_unpin(&tree->pool, leaf_no, 0);
+        return 0;
+    }
+
+    int left_count = (count + 1) / 2;
+    int right_count = count + 1 - left_count;
+    uint32_t next_no = get_u32(leaf + 4);
+
+    put_u16(leaf + 2, (uint16_t)left_count);
+    memcpy(leaf + BTREE_LEAF_HEADER, entries, left_count * BTREE_LEAF_ENTRY);
+    put_u32(leaf + 4, right_no);
+
+    put_u16(right, BTREE_PAGE_LEAF);
+    put_u16(right + 2, (uint16_t)right_count);
+    put_u32(right + 4, next_no);
+    put_u32(right + 8, leaf_no);
+    memcpy(right + BTREE_LEAF_HEADER, entries + left_count * BTREE_LEAF_ENTRY, right_count * BTREE_LEAF_ENTRY);
+
+    uint32_t separator = get_u32(right + BTREE_LEAF_HEADER);
+    pool_unpin(&tree->pool, leaf_no, 1);
+    pool_unpin(&tree->pool, right_no, 1);
+
+    if (next_no) {
+        unsigned char *next = pool_fetch(&tree->pool, next_no);
+        if (!next) return 0;
+        put_u32(next + 8, right_no);
+        pool_unpin(&tree->pool, next_no, 1);
+    }
+
+    return btree_insert_separator(path, depth, separator, right_no);
+}
+
+int btree_read_record(uint64_t offset, uint32_t length, Patient *out) {
+    char line[BTREE_MAX_RECORD];
+
+    if (length == 0 || length >= sizeof(line)) return 0;
+    if (!file_seek(btree_store.heap, offset, SEEK_SET) ||
+        fread(line, 1, length, btree_store.heap) != length) {
+        return 0;
+    }
+    line[length] = '\0';
+    return parse_text_patient(line, out);
+}
+
+/* Appends patient to the heap and points its ID at the new copy. */
+int btree_store_patient(const Patient *patient) {
+    BTreeStore *tree = &btree_store;
+    char line[BTREE_MAX_RECORD];
+    int is_new;
+
+    int length = format_patient_text(patient, line, sizeof(line));
+    if (length <= 0 || length >= (int)sizeof(line)) return 0;
+
+    if (!file_seek(tree->heap, 0, SEEK_END)) return 0;
+    int64_t offset = file_tell(tree->heap);
+    if (offset < 0 || fwrite(line, 1, length, tree->heap) != (size_t)length) return 0;
+
+    if (!btree_put((uint32_t)patient->id, (uint64_t)offset, (uint32_t)length, &is_new)) {
+        return 0;
+    }
+    return 1;
+}
+
+int btree_get(int patient_id, Patient *out) {
+    BTreeStore *tree = &btree_store;
+    uint32_t path[BTREE_MAX_DEPTH];
+    int depth;
+    int found = 0;
+
+    uint32_t leaf_no = btree_find_leaf((uint32_t)patient_id, path, &depth);
+    unsigned char *leaf = leaf_no ? pool_fetch(&tree->pool, leaf_no) : NULL;
+    if (!leaf) return 0;
+
+    int pos = leaf_lower_bound(leaf, (uint32_t)patient_id);
+    unsigned char *slot = leaf + BTREE_LEAF_HEADER + pos * BTREE_LEAF_ENTRY;
+    uint64_t offset = 0;
+    uint32_t length = 0;
+
+    if (pos < get_u16(leaf + 2) && get_u32(slot) == (uint32_t)patient_id) {
+        offset = get_u64(slot + 4);
+        length = get_u32(slot + 12);
+        found = 1;
+    }
+    pool_unpin(&tree->pool, leaf_no, 0);
+
+    return found && btree_read_record(offset, length, out);
+}
+
+typedef struct {
+    uint32_t leaf;
+    int index;
+} BTreeCursor;
+
+/* Positions the cursor on the first ID >= key. */
+void btree_seek(BTreeCursor *cursor, uint32_t key) {
+    uint32_t path[BTREE_MAX_DEPTH];
+    int depth;
+
+    cursor->leaf = btree_find_leaf(key, path, &depth);
+    cursor->index = 0;
+
+    unsigned char *leaf = cursor->leaf ? pool_fetch(&btree_store.pool, cursor->leaf) : NULL;
+    if (leaf) {
+        cursor->index = leaf_lower_bound(leaf, key);
+        pool_unpin(&btree_store.pool, cursor->leaf, 0);
+    }
+}
+
+int btree_next(BTreeCursor *cursor, Patient *out) {
+    BufferPool *pool = &btree_store.pool;
+
+    while (cursor->leaf) {
+        unsigned char *leaf = pool_fetch(pool, cursor->leaf);
+        if (!leaf) return 0;
+
+        if (cursor->index < get_u16(leaf + 2)) {
+            unsigned char *slot = leaf + BTREE_LEAF_HEADER + cursor->index * BTREE_LEAF_ENTRY;
+            uint64_t offset = get_u64(slot + 4);
+            uint32_t length = get_u32(slot + 12);
+
+            pool_unpin(pool, cursor->leaf, 0);
+            cursor->index++;
+            if (btree_read_record(offset, length, out)) return 1;
+            continue;
+        }
+
+        uint32_t next = get_u32(leaf + 4);
+        pool_unpin(pool, cursor->leaf, 0);
+        cursor->leaf = next;
+        cursor->index = 0;
+    }
+
+    return 0;
+}
+
+/* Steps backwards; after btree_seek(key) the first record has ID < key. */
+int btree_prev(BTreeCursor *cursor, Patient *out) {
+    BufferPool *pool = &btree_store.pool;
+
+    while (cursor->leaf) {
+        unsigned char *leaf = pool_fetch(pool, cursor->leaf);
+        if (!leaf) return 0;
+
+        int count = get_u16(leaf + 2);
+        if (cursor->index > count) cursor->index = count;
+
+        if (cursor->index > 0) {
+            cursor->index--;
+            unsigned char *slot = leaf + BTREE_LEAF_HEADER + cursor->index * BTREE_LEAF_ENTRY;
+            uint64_t offset = get_u64(slot + 4);
+            uint32_t length = get_u32(slot + 12);
+
+            pool_unpin(pool, cursor->leaf, 0);
+            if (btree_read_record(offset, length, out)) return 1;
+            continue;
+        }
+
+        uint32_t prev = get_u32(leaf + 8);
+        pool_unpin(pool, cursor->leaf, 0);
+        cursor->leaf = prev;
+        cursor->index = BTREE_LEAF_MAX + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Full scans split the leaf chain into morsels of one leaf each. The leaves
+ * are listed in key order by walking the internal levels, so no leaf is
+ * read here. Returns a malloc'd array, or NULL if memory runs out or a page
+ * cannot be read.
+ */
+uint32_t *btree_leaf_pages(int *count) {
+    BufferPool *pool = &btree_store.pool;
+    uint32_t *level = malloc(sizeof(uint32_t));
+    int level_count = 1;
+
+    if (!level) return NULL;
+    level[0] = btree_store.root;
+
+    for (int depth = 0; depth <= BTREE_MAX_DEPTH; depth++) {
+        unsigned char *page = pool_fetch(pool, level[0]);
+        if (!page) break;
+        int is_leaf = get_u16(page) == BTREE_PAGE_LEAF;
+        pool_unpin(pool, level[0], 0);
+        if (is_leaf) {
+            *count = level_count;
+            return level;
+        }
+
+        uint32_t *children = malloc((size_t)level_count * (BTREE_INTERNAL_MAX + 1) * sizeof(uint32_t));
+        int child_count = 0;
+        for (int i = 0; children && i < level_count; i++) {
+            page = pool_fetch(pool, level[i]);
+            if (!page) {
+                free(children);
+                children = NULL;
+                break;
+            }
+            int keys = get_u16(page + 2);
+            children[child_count++] = get_u32(page + 4);
+            for (int k = 0; k < keys && k < BTREE_INTERNAL_MAX; k++) {
+                children[child_count++] = get_u32(page + BTREE_INTERNAL_HEADER + k * BTREE_INTERNAL_ENTRY + 4);
+            }
+            pool_unpin(pool, level[i], 0);
+        }
+
+        free(level);
+        level = children;
+        level_count = child_count;
+        if (!level) return NULL;
+    }
+
+    free(level);
+    return NULL;
+}
+
+/*
+ * Reads the records of leaves[first, last) for one morsel. Pages and
+ * records are read with read_at rather than through the pool and the heap's
+ * FILE, so workers can read side by side; btree_scan_start flushes both
+ * first. Records are parsed with dict_intern, so the scan runs through
+ * scan_records_shared.
+ */
+typedef struct {
+    const uint32_t *leaves;
+    int next_leaf;
+    int last_leaf;
+    int index;
+    int count;
+    unsigned char page[BTREE_PAGE_SIZE];
+} BTreeRun;
+
+void btree_run_open(BTreeRun *run, const uint32_t *leaves, int first, int last) {
+    run->leaves = leaves;
+    run->next_leaf = first;
+    run->last_leaf = last;
+    run->index = 0;
+    run->count = 0;
+}
+
+int btree_run_next(BTreeRun *run, Patient *out) {
+    char line[BTREE_MAX_RECORD];
+
+    while (1) {
+        if (run->index < run->count) {
+            unsigned char *slot = run->page + BTREE_LEAF_HEADER + run->index++ * BTREE_LEAF_ENTRY;
+            uint64_t offset = get_u64(slot + 4);
+            uint32_t length = get_u32(slot + 12);
+
+            if (length == 0 || length >= sizeof(line) || !read_at(btree_store.heap, offset, line, length)) {
+                continue;
+            }
+            line[length] = '\0';
+            if (parse_text_patient(line, out)) return 1;
+            continue;
+        }
+
+        if (run->next_leaf >= run->last_leaf) return 0;
+        uint32_t leaf_no = run->leaves[run->next_leaf++];
+        run->index = 0;
+        run->count = 0;
+        if (read_at(btree_store.pool.file, (uint64_t)leaf_no * BTREE_PAGE_SIZE, run->page, BTREE_PAGE_SIZE) &&
+            get_u16(run->page) == BTREE_PAGE_LEAF) {
+            run->count = get_u16(run->page + 2);
+            if (run->count > BTREE_LEAF_MAX) run->count = BTREE_LEAF_MAX;
+        }
+    }
+}
+
+/* Lists the leaves for btree_run_next (free them after); NULL on failure. */
+uint32_t *btree_scan_start(int *leaf_count) {
+    if (!pool_flush(&btree_store.pool) || fflush(btree_store.heap) != 0) {
+        return NULL;
+    }
+    return btree_leaf_pages(leaf_count);
+}
+
+/* Opens patients.db, creating it from patients.txt on first use. */
+int btree_open() {
+    BTreeStore *tree = &btree_store;
+    BufferPool *pool = &tree->pool;
+
+    pool->file = open_or_create(branch_file("patients.db"));
+    tree->heap = open_or_create(branch_file("patients.heap"));
+    if (!pool->file || !tree->heap) {
+        return 0;
+    }
+
+    pool->frame_count = config.buffer_pool_pages;
+    pool->frames = calloc(pool->frame_count, sizeof(PoolFrame));
+    if (!pool->frames) {
+        return 0;
+    }
+    for (int i = 0; i < pool->frame_count; i++) {
+        pool->frames[i].data = malloc(BTREE_PAGE_SIZE);
+        if (!pool->frames[i].data) return 0;
+    }
+
+    pool->page_count = (uint32_t)(file_size(pool->file) / BTREE_PAGE_SIZE);
+    tree->open = 1;
+
+    if (pool->page_count > 0) {
+        unsigned char *meta = pool_fetch(pool, 0);
+        if (!meta || memcmp(meta, "PRBT", 4) != 0) {
+            return 0;
+        }
+        tree->root = get_u32(meta + 4);
+        next_patient_id = (int)get_u32(meta + 12);
+        tree->record_count = get_u32(meta + 16);
+        tree->active_count = get_u32(meta + 20);
+        pool_unpin(pool, 0, 0);
+        return 1;
+    }
+
+    unsigned char *root;
+    if (!pool_fetch(pool, 0)) {
+        return 0;
+    }
+    pool->page_count = 1;
+    pool_unpin(pool, 0, 1);
+
+    tree->root = pool_new_page(pool, &root);
+    if (!tree->root) {
+        return 0;
+    }
+    put_u16(root, BTREE_PAGE_LEAF);
+    pool_unpin(pool, tree->root, 1);
+    return btree_commit();
+}
+
+/* Adds or replaces one imported record; a journal line can replace one
+ * read from patients.txt. */
+int btree_import_patient(const Patient *patient) {
+    BTreeStore *tree = &btree_store;
+    Patient current;
+    int existed = btree_get(patient->id, &current);
+
+    if (!btree_store_patient(patient)) {
+        return 0;
+    }
+    if (!existed) tree->record_count++;
+    tree->active_count += patient->is_active - (existed ? current.is_active : 0);
+    return 1;
+}
+
+/*
+ * Fills a new, empty tree from patients.txt and a leftover journal. The
+ * records go straight into the tree, so any number of them is imported.
+ * On failure the new files are removed and patients.txt stays in use.
+ */
+int btree_import_text() {
+    BTreeStore *tree = &btree_store;
+    FILE *text = fopen(branch_file("patients.txt"), "rb");
+    int ok = 1;
+
+    text_record_sink = btree_import_patient;
+    if (text) {
+        fclose(text);
+        ok = load_patient_text() && !patients_damaged;
+    }
+    journal_replay();
+    text_record_sink = NULL;
+    patient_count = 0;
+
+    if (ok && btree_commit()) {
+        return 1;
+    }
+
+    io_flush();
+    fclose(tree->pool.file);
+    fclose(tree->heap);
+    tree->pool.file = NULL;
+    tree->heap = NULL;
+    tree->open = 0;
+    remove(branch_file("patients.db"));
+    remove(branch_file("patients.heap"));
+    return 0;
+}
+
+/*
+ * In B+tree mode patients[] is only a ring of recently materialized
+ * records, so pointers handed to the UI stay valid for a whole screen.
+ */
+int btree_cache_slot = 0;
+
+int cache_patient(const Patient *patient) {
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient->id) {
+            patients[i] = *patient;
+            return i;
+        }
+    }
+
+    int slot = btree_cache_slot;
+    btree_cache_slot = (btree_cache_slot + 1) % MAX_PATIENTS;
+    if (patient_count < MAX_PATIENTS) patient_count++;
+    patients[slot] = *patient;
+    return slot;
+}
+
+/* ===================== SLOT STORAGE ===================== */
+
+/*
+ * Used when config.txt sets storage=slots. patients.slots holds a header
+ * slot followed by one SLOT_SIZE slot per entry of patients[], in the same
+ * order, so a record's offset is computed from its index: a modify or
+ * delete is one positional write and an add is an append. A slot holds
+ * the record's text line; whatever does not fit inline continues in a
+ * chain of pages in patients.ovf.
+ *
+ * Slot: text length, first overflow page (0 = none), patient ID, text.
+ * Overflow page: next page (0 = end), text. Pages are numbered from 1.
+ * A record that shrinks reuses the head of its chain; the rest is not
+ * reclaimed.
+ */
+typedef struct {
+    int open;
+    FILE *file;
+    FILE *overflow;
+    int slot_count;
+    uint32_t overflow_pages;
+    uint32_t overflow_head[MAX_PATIENTS];
+    Patient saved[MAX_PATIENTS];
+} SlotStore;
+
+SlotStore slot_store = {0};
+
+uint64_t slot_offset(int index) {
+    return (uint64_t)(index + 1) * SLOT_SIZE;
+}
+
+uint64_t overflow_offset(uint32_t page) {
+    return (uint64_t)(page - 1) * OVERFLOW_PAGE_SIZE;
+}
+
+/* Writes text into a page chain, rewriting the pages of chain first. */
+int overflow_write(uint32_t chain, const char *text, int len, uint32_t *first) {
+    SlotStore *store = &slot_store;
+    unsigned char page_data[OVERFLOW_PAGE_SIZE];
+    uint32_t page = chain;
+    int pos = 0;
+
+    *first = 0;
+    while (pos < len) {
+        uint32_t next_in_chain = 0;
+        if (page) {
+            io_drain();
+            if (!read_at(store->overflow, overflow_offset(page), page_data, 4)) return 0;
+            next_in_chain = get_u32(page_data);
+        } else {
+            page = ++store->overflow_pages;
+        }
+        if (!*first) *first = page;
+
+        int chunk = len - pos < OVERFLOW_DATA ? len - pos : OVERFLOW_DATA;
+        uint32_t next = 0;
+        if (pos + chunk < len) {
+            next = next_in_chain ? next_in_chain : store->overflow_pages + 1;
+        }
+
+        memset(page_data, 0, sizeof(page_data));
+        put_u32(page_data, next);
+        memcpy(page_data + 4, text + pos, chunk);
+        if (!io_write(store->overflow, overflow_offset(page), page_data, OVERFLOW_PAGE_SIZE)) {
+            return 0;
+        }
+
+        pos += chunk;
+        page = next_in_chain;
+    }
+    return 1;
+}
+
+int slot_write(int index) {
+    SlotStore *store = &slot_store;
+    unsigned char slot[SLOT_SIZE];
+    char line[1024];
+    uint32_t first_page = 0;
+
+    int len = format_patient_text(&patients[index], line, sizeof(line));
+    if (len <= 0 || len >= (int)sizeof(line)) {
+        return 0;
+    }
+    len--;
+
+    if (len > SLOT_INLINE &&
+        !overflow_write(store->overflow_head[index], line + SLOT_INLINE, len - SLOT_INLINE, &first_page)) {
+        return 0;
+    }
+
+    memset(slot, 0, sizeof(slot));
+    put_u32(slot, (uint32_t)len);
+    put_u32(slot + 4, first_page);
+    put_u32(slot + 8, (uint32_t)patients[index].id);
+    memcpy(slot + SLOT_HEADER, line, len < SLOT_INLINE ? len : SLOT_INLINE);
+    if (!io_write(store->file, slot_offset(index), slot, SLOT_SIZE)) {
+        return 0;
+    }
+
+    if (first_page) store->overflow_head[index] = first_page;
+    store->saved[index] = patients[index];
+    if (index >= store->slot_count) store->slot_count = index + 1;
+    return 1;
+}
+
+/* Reads the text line stored in a slot, without the newline. */
+int slot_read(int index, char *line, int size, uint32_t *first_page) {
+    SlotStore *store = &slot_store;
+    unsigned char slot[SLOT_SIZE];
+    unsigned char page_data[OVERFLOW_PAGE_SIZE];
+
+    if (!read_at(store->file, slot_offset(index), slot, SLOT_SIZE)) {
+        return 0;
+    }
+    int len = (int)get_u32(slot);
+    *first_page = get_u32(slot + 4);
+    if (len <= 0 || len >= size) {
+        return 0;
+    }
+
+    int pos = len < SLOT_INLINE ? len : SLOT_INLINE;
+    memcpy(line, slot + SLOT_HEADER, pos);
+
+    uint32_t page = *first_page;
+    while (pos < len && page) {
+        if (!read_at(store->overflow, overflow_offset(page), page_data, OVERFLOW_PAGE_SIZE)) {
+            return 0;
+        }
+        int chunk = len - pos < OVERFLOW_DATA ? len - pos : OVERFLOW_DATA;
+        memcpy(line + pos, page_data + 4, chunk);
+        pos += chunk;
+        page = get_u32(page_data);
+    }
+    line[pos] = '\0';
+    return pos == len;
+}
+
+int slot_commit(int force) {
+    FILE *files[2] = {slot_store.file, slot_store.overflow};
+    return io_commit(files, 2, force);
+}
+
+/*
+ * Writes only the slots whose record differs from what was last written
+ * there, then drops slots past the end of patients[].
+ */
+int slot_save_all() {
+    SlotStore *store = &slot_store;
+
+    for (int i = 0; i < patient_count; i++) {
+        if (i >= store->slot_count || memcmp(&store->saved[i], &patients[i], sizeof(Patient)) != 0) {
+            if (!slot_write(i)) return 0;
+        }
+    }
+
+    if (store->slot_count > patient_count) {
+        io_drain();
+        if (!truncate_file(store->file, slot_offset(patient_count))) return 0;
+        store->slot_count = patient_count;
+    }
+    return slot_commit(1);
+}
+
+/* Opens patients.slots, creating it from the current patients[] if missing. */
+int slot_open() {
+    SlotStore *store = &slot_store;
+    unsigned char header[SLOT_SIZE];
+
+    FILE *existing = fopen(branch_file("patients.slots"), "rb");
+    int created = (existing == NULL);
+    if (existing) fclose(existing);
+
+    store->file = open_or_create(branch_file("patients.slots"));
+    store->overflow = open_or_create(branch_file("patients.ovf"));
+    if (!store->file || !store->overflow) {
+        return 0;
+    }
+    store->open = 1;
+
+    store->overflow_pages = (uint32_t)(file_size(store->overflow) / OVERFLOW_PAGE_SIZE);
+
+    if (created) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, "PRSL", 4);
+        put_u32(header + 4, SLOT_SIZE);
+        store->slot_count = 0;
+        return write_at(store->file, 0, header, SLOT_SIZE) && slot_save_all();
+    }
+
+    if (!read_at(store->file, 0, header, SLOT_SIZE) ||
+        memcmp(header, "PRSL", 4) != 0 || get_u32(header + 4) != SLOT_SIZE) {
+        return 0;
+    }
+
+    int slots = (int)(file_size(store->file) / SLOT_SIZE) - 1;
+
+    patient_count = 0;
+    next_patient_id = 1;
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        dict_clear(dictionary_columns[c].dict);
+    }
+
+    int skipped = 0;
+    char line[1024];
+    for (int s = 0; s < slots && patient_count < MAX_PATIENTS; s++) {
+        uint32_t first_page;
+        Patient *patient = &patients[patient_count];
+        if (!slot_read(s, line, sizeof(line), &first_page) || !parse_text_patient(line, patient)) {
+            skipped++;
+            continue;
+        }
+
+        /* After a skipped slot, records sit one slot later on disk than
+         * their index, so they are marked for rewriting. */
+        if (s == patient_count) {
+            store->saved[patient_count] = *patient;
+            store->overflow_head[patient_count] = first_page;
+        } else {
+            store->saved[patient_count].id = -1;
+            store->overflow_head[patient_count] = 0;
+        }
+
+        if (patient->id >= next_patient_id) {
+            next_patient_id = patient->id + 1;
+        }
+        patient_count++;
+    }
+    store->slot_count = slots;
+
+    return skipped == 0 || slot_save_all();
+}
+
+/* ===================== PATIENT CURSOR ===================== */
+
+/*
+ * patients[] indices in ID order, so the in-memory stores can seek by ID
+ * the way the B+tree does. Appends with rising IDs extend it in place;
+ * anything else re-sorts it on the next seek.
+ */
+int id_order[MAX_PATIENTS];
+int id_order_count = 0;
+
+int compare_patient_ids(const void *a, const void *b) {
+    int id_a = patients[*(const int *)a].id;
+    int id_b = patients[*(const int *)b].id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+void refresh_id_order() {
+    if (id_order_count > patient_count) {
+        id_order_count = 0;
+    }
+
+    for (int i = id_order_count; i < patient_count; i++) {
+        if (id_order_count > 0 && patients[i].id < patients[id_order[id_order_count - 1]].id) {
+            for (int j = 0; j < patient_count; j++) id_order[j] = j;
+            qsort(id_order, patient_count, sizeof(int), compare_patient_ids);
+            id_order_count = patient_count;
+            return;
+        }
+        id_order[id_order_count++] = i;
+    }
+}
+
+/*
+ * Walks stored records, active or not, in ID order in every storage mode.
+ * slot is the patients[] index of the record last returned by the
+ * in-memory stores.
+ */
+typedef struct {
+    int index;
+    int slot;
+    int backward;
+    BTreeCursor btree;
+    Patient current;
+} PatientCursor;
+
+/*
+ * Positions the cursor on the records with ID > id, or ID < id walking
+ * backwards. A seek is one tree descent or binary search, so it costs the
+ * same wherever id falls.
+ */
+void patient_cursor_seek(PatientCursor *cursor, int id, int backward) {
+    uint32_t key = backward ? (uint32_t)id : (uint32_t)id + 1;
+
+    cursor->backward = backward;
+    cursor->slot = -1;
+    if (config.storage == STORAGE_BTREE) {
+        btree_seek(&cursor->btree, key);
+        return;
+    }
+
+    refresh_id_order();
+    int low = 0;
+    int high = id_order_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if ((uint32_t)patients[id_order[mid]].id < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    cursor->index = backward ? low - 1 : low;
+}
+
+void patient_cursor_open(PatientCursor *cursor) {
+    patient_cursor_seek(cursor, 0, 0);
+}
+
+Patient *patient_cursor_next(PatientCursor *cursor) {
+    if (config.storage == STORAGE_BTREE) {
+        int found = cursor->backward ? btree_prev(&cursor->btree, &cursor->current)
+                                     : btree_next(&cursor->btree, &cursor->current);
+        return found ? &cursor->current : NULL;
+    }
+    if (cursor->index < 0 || cursor->index >= id_order_count) {
+        return NULL;
+    }
+    cursor->slot = id_order[cursor->backward ? cursor->index-- : cursor->index++];
+    return patient_at(cursor->slot);
+}
+
+int count_active_patients() {
+    int active_count = 0;
+
+    if (config.storage == STORAGE_BTREE) {
+        return (int)btree_store.active_count;
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].is_active) active_count++;
+    }
+    return active_count;
+}
+
+int save_patients() {
+    if (config.storage == STORAGE_BTREE) {
+        return btree_commit();
+    }
+    if (config.storage == STORAGE_SLOTS) {
+        return slot_save_all();
+    }
+
+    if (patients_damaged) {
+        fprintf(stderr, "%s did not decrypt when loaded; it is not saved over.\n", branch_file("patients.txt"));
+        return 0;
+    }
+    materialize_all_patients();
+
+    /* Written beside the old file and renamed over it, so a crash mid-save
+     * leaves either the old or the new patients.txt. */
+    SecureFile file;
+    if (!secure_open_write(&file, branch_file("patients.txt.tmp"))) {
+        perror("Error opening patients.txt.tmp for writing");
+        return 0;
+    }
+
+    char line[BTREE_MAX_RECORD + RECORD_CHECKSUM_LEN];
+    uint32_t crc = 0;
+
+    /* Only codes still referenced by a record are written out. */
+    for (int c = 0; c < DICTIONARY_COLUMN_COUNT; c++) {
+        Dictionary *dict = dictionary_columns[c].dict;
+        char *used = calloc(dict->count ? dict->count : 1, 1);
+        if (!used) {
+            secure_close(&file);
+            remove(branch_file("patients.txt.tmp"));
+            return 0;
+        }
+
+        for (int i = 0; i < patient_count; i++) {
+            int code = patient_column_code(&patients[i], c);
+            if (code >= 0 && code < dict->count) used[code] = 1;
+        }
+
+        for (int code = 0; code < dict->count; code++) {
+            if (used[code]) {
+                snprintf(line, sizeof(line), "@%s|%d|%s\n", dictionary_columns[c].name, code, dict->values[code]);
+                crc = crc32c(crc, line, strlen(line));
+                secure_write(&file, line, strlen(line));
+            }
+        }
+        free(used);
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        int len = format_patient_encoded(&patients[i], line, BTREE_MAX_RECORD);
+        int sealed = seal_record_line(line, len, sizeof(line));
+        len = sealed > 0 ? sealed : (int)strlen(line);
+        crc = crc32c(crc, line, len);
+        secure_write(&file, line, len);
+    }
+    secure_printf(&file, "@checksum|%d|%08x\n", patient_count, (unsigned)crc);
+
+    int written = secure_finish(&file) && durable_commit(&file.file, 1, 1);
+    if (!secure_close(&file) || !written) {
+        remove(branch_file("patients.txt.tmp"));
+        return 0;
+    }
+
+    if (!replace_file(branch_file("patients.txt.tmp"), branch_file("patients.txt"))) {
+        return 0;
+    }
+
+    journal_reset();
+    return 1;
+}
+
+/* Persists one changed record of the text store. */
+int persist_patient(const Patient *patient) {
+    if (config.storage == STORAGE_SLOTS) {
+        return slot_write((int)(patient - patients)) && slot_commit(0);
+    }
+    if (!journal_append(patient)) {
+        return 0;
+    }
+    if (journal.records >= JOURNAL_CHECKPOINT_RECORDS) {
+        return save_patients();
+    }
+    return 1;
+}
+
+/* Makes every committed change durable; called at logout and exit. */
+int flush_patients() {
+    int ok = 1;
+
+    if (config.storage == STORAGE_BTREE) {
+        FILE *files[2] = {btree_store.pool.file, btree_store.heap};
+        ok = btree_commit() && durable_commit(files, 2, 1);
+    } else if (config.storage == STORAGE_SLOTS) {
+        ok = slot_commit(1);
+    } else if (journal.records > 0) {
+        ok = save_patients();
+    }
+    /* Also syncs the replication log and change feed. */
+    return io_flush() && ok;
+}
+
+int load_patients() {
+    if (config.storage == STORAGE_BTREE) {
+        FILE *db = fopen(branch_file("patients.db"), "rb");
+        int import = !db;
+        if (db) fclose(db);
+
+        if (btree_open() && (!import || btree_import_text())) {
+            patient_count = 0;
+            btree_cache_slot = 0;
+            rebuild_patient_indexes();
+            return 1;
+        }
+
+        fprintf(stderr, "Could not open patients.db; using patients.txt instead.\n");
+        config.storage = STORAGE_TEXT;
+    }
+
+    if (config.storage == STORAGE_SLOTS) {
+        FILE *slots = fopen(branch_file("patients.slots"), "rb");
+        if (slots) {
+            fclose(slots);
+        } else {
+            load_patient_text();
+            journal_replay();
+        }
+
+        if (slot_open()) {
+            rebuild_patient_indexes();
+            return 1;
+        }
+
+        fprintf(stderr, "Could not open patients.slots; using patients.txt instead.\n");
+        config.storage = STORAGE_TEXT;
+    }
+
+    if (config.lazy_load && !secure_file_sealed(branch_file("patients.txt"))) {
+        int loaded = load_patient_index();
+        if (journal_replay() > 0) {
+            save_patients();
+            loaded = 1;
+        }
+        return loaded;
+    }
+
+    int loaded = load_patient_text();
+    if (journal_replay() > 0 || patients_file_sealed != config.encryption) {
+        rebuild_patient_indexes();
+        save_patients();
+        loaded = 1;
+    }
+    return loaded;
+}
+
+
+/* ===================== QUERY CACHE ===================== */
+
+/*
+ * Name and column searches keep their results as lists of matching patient
+ * IDs, keyed by the kind of search and its case-folded text. Each change
+ * bumps the store generation. Adding or archiving a record stamps the row
+ * set with it, and an edit stamps only the fields it changed. An entry is
+ * served while neither the row set nor a field it depends on has a newer
+ * stamp than the entry. The least recently used entry makes room.
+ */
+#define QUERY_NAME DICTIONARY_COLUMN_COUNT
+
+typedef struct {
+    int kind;                /* a dictionary column, or QUERY_NAME */
+    char key[TEXT_PATTERN_LEN];
+    uint64_t generation;
+    uint64_t last_used;
+    int count;
+    int total;               /* every match; more than count when cut short */
+    int ids[QUERY_CACHE_IDS];
+} QueryCacheEntry;
+
+typedef struct {
+    QueryCacheEntry entries[QUERY_CACHE_ENTRIES];
+    int count;
+    uint64_t generation;
+    uint64_t rows_changed;
+    uint64_t field_changed[FIELD_COUNT];
+    uint64_t clock;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;
+} QueryCache;
+
+QueryCache query_cache = {0};
+
+void note_rows_changed() {
+    query_cache.rows_changed = ++query_cache.generation;
+}
+
+void note_fields_changed(unsigned fields) {
+    query_cache.generation++;
+    for (int f = 0; f < FIELD_COUNT; f++) {
+        if (fields & (1u << f)) query_cache.field_changed[f] = query_cache.generation;
+    }
+}
+
+#define FIELD_DIFFERS_INT(member) a->member != b->member
+#define FIELD_DIFFERS_CODE FIELD_DIFFERS_INT
+#define FIELD_DIFFERS_PHONE FIELD_DIFFERS_INT
+#define FIELD_DIFFERS_FLAG FIELD_DIFFERS_INT
+#define FIELD_DIFFERS_TEXT(member) strcmp(a->member, b->member) != 0
+#define FIELD_DIFFERS(tag, member, kind, size, dict, label, column, min, max) \
+    if (FIELD_DIFFERS_##kind(member)) fields |= 1u << tag;
+
+/* Bit set of the fields whose values differ between a and b. */
+unsigned changed_fields(const Patient *a, const Patient *b) {
+    unsigned fields = 0;
+    PATIENT_FIELDS(FIELD_DIFFERS)
+    return fields;
+}
+
+unsigned query_fields(int kind) {
+    int field = kind == QUERY_NAME ? FIELD_NAME : dictionary_columns[kind].field;
+    return 1u << field | 1u << FIELD_IS_ACTIVE;
+}
+
+/* Case-folded text with runs of spaces collapsed and the ends trimmed.
+ * Searches match on this form, so equal keys always mean equal results. */
+void normalize_query(const char *text, char *key) {
+    int len = 0;
+    for (; *text && len < TEXT_PATTERN_LEN - 1; text++) {
+        if (isspace((unsigned char)*text)) {
+            if (len > 0 && key[len - 1] != ' ') key[len++] = ' ';
+        } else {
+            key[len++] = (char)fold_char((unsigned char)*text);
+        }
+    }
+    if (len > 0 && key[len - 1] == ' ') len--;
+    key[len] = '\0';
+}
+
+/* Returns the valid entry for a search, or NULL after counting a miss. */
+QueryCacheEntry *query_cache_find(int kind, const char *text) {
+    char key[TEXT_PATTERN_LEN];
+    QueryCache *cache = &query_cache;
+
+    normalize_query(text, key);
+    for (int i = 0; i < cache->count; i++) {
+        QueryCacheEntry *entry = &cache->entries[i];
+        if (entry->kind != kind || strcmp(entry->key, key) != 0) continue;
+
+        int valid = entry->generation >= cache->rows_changed;
+        unsigned fields = query_fields(kind);
+        for (int f = 0; valid && f < FIELD_COUNT; f++) {
+            if ((fields & (1u << f)) && cache->field_changed[f] > entry->generation) valid = 0;
+        }
+        if (!valid) {
+            cache->entries[i] = cache->entries[--cache->count];
+            cache->stale++;
+            break;
+        }
+
+        entry->last_used = ++cache->clock;
+        cache->hits++;
+        return entry;
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/* Remembers the first count matching IDs, in ID order, of total matches. */
+QueryCacheEntry *query_cache_store(int kind, const char *text, const int *ids, int count, int total) {
+    QueryCache *cache = &query_cache;
+    QueryCacheEntry *entry;
+
+    if (cache->count < QUERY_CACHE_ENTRIES) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[0];
+        for (int i = 1; i < cache->count; i++) {
+            if (cache->entries[i].last_used < entry->last_used) entry = &cache->entries[i];
+        }
+    }
+
+    entry->kind = kind;
+    normalize_query(text, entry->key);
+    entry->generation = cache->generation;
+    entry->last_used = ++cache->clock;
+    entry->count = count < QUERY_CACHE_IDS ? count : QUERY_CACHE_IDS;
+    entry->total = total;
+    memcpy(entry->ids, ids, (size_t)entry->count * sizeof(int));
+    return entry;
+}
+
+/* patients[] index of an in-memory record, found through id_order. */
+int patient_slot_by_id(int patient_id) {
+    refresh_id_order();
+    int low = 0;
+    int high = id_order_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (patients[id_order[mid]].id < patient_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < id_order_count && patients[id_order[low]].id == patient_id ? id_order[low] : -1;
+}
+
+/* Loads a cached ID into patients[] and returns its index, or -1. */
+int cached_patient_slot(int patient_id) {
+    if (config.storage == STORAGE_BTREE) {
+        Patient patient;
+        return btree_get(patient_id, &patient) ? cache_patient(&patient) : -1;
+    }
+    int slot = patient_slot_by_id(patient_id);
+    if (slot >= 0) patient_at(slot);
+    return slot;
+}
+
+/* ===================== BITMAP INDEXES ===================== */
+
+/*
+ * Compressed bitmaps of patient IDs, one per value of the columns reports
+ * filter on most: gender, blood group, active or not, age in years and
+ * registration month. IDs are split on their high 16 bits into containers.
+ * A container holds a sorted array of the low 16 bits while it has up to
+ * BITMAP_ARRAY_MAX of them, and a 65536-bit set beyond that, so sparse
+ * and dense values both stay small.
+ *
+ * A filter on several columns is an AND of their bitmaps, and a range of
+ * ages or months an OR, so reports count matches from the bitmaps alone
+ * and fetch only the records that match. The index is built on first use
+ * and kept up to date by every add, change, delete, archive and restore.
+ */
+typedef struct {
+    uint16_t key;            /* high 16 bits of the IDs held */
+    int cardinality;
+    int capacity;            /* array slots allocated */
+    uint16_t *array;         /* sorted; NULL once a bit set */
+    uint64_t *bits;          /* BITMAP_WORDS words, or NULL */
+} BitmapContainer;
+
+typedef struct {
+    BitmapContainer *containers; /* sorted by key */
+    int count;
+    int capacity;
+} Bitmap;
+
+typedef struct {
+    Bitmap *bitmaps;         /* indexed by code; grown on demand */
+    int count;
+} CodeBitmaps;
+
+typedef struct {
+    int built;
+    Bitmap stored;           /* every record in the store */
+    Bitmap active;
+    CodeBitmaps gender;
+    CodeBitmaps blood_group;
+    Bitmap age[BITMAP_MAX_AGE + 1];
+    CodeBitmaps month;       /* by months since January BITMAP_FIRST_YEAR */
+    Bitmap undated;          /* registration date without a month */
+} BitmapIndex;
+
+BitmapIndex bitmap_index = {0};
+
+int popcount64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x -= (x >> 1) & 0x5555555555555555ULL;
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+int trailing_zeros64(uint64_t x) {
+#ifdef __GNUC__
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+void container_free(BitmapContainer *container) {
+    free(container->array);
+    free(container->bits);
+    memset(container, 0, sizeof(*container));
+}
+
+int container_has(const BitmapContainer *container, uint16_t low) {
+    if (container->bits) {
+        return (container->bits[low >> 6] >> (low & 63)) & 1;
+    }
+    int first = 0;
+    int last = container->cardinality;
+    while (first < last) {
+        int mid = (first + last) / 2;
+        if (container->array[mid] < low) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    return first < container->cardinality && container->array[first] == low;
+}
+
+int container_to_bits(BitmapContainer *container) {
+    uint64_t *bits = calloc(BITMAP_WORDS, sizeof(uint64_t));
+    if (!bits) {
+        return 0;
+    }
+    for (int i = 0; i < container->cardinality; i++) {
+        uint16_t low = container->array[i];
+        bits[low >> 6] |= 1ULL << (low & 63);
+    }
+    free(container->array);
+    container->array = NULL;
+    container->capacity = 0;
+    container->bits = bits;
+    return 1;
+}
+
+int container_to_array(BitmapContainer *container) {
+    uint16_t *array = malloc((container->cardinality ? container->cardinality : 1) * sizeof(uint16_t));
+    int count = 0;
+    if (!array) {
+        return 0;
+    }
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        for (uint64_t word = container->bits[w]; word; word &= word - 1) {
+            array[count++] = (uint16_t)(w * 64 + trailing_zeros64(word));
+        }
+    }
+    free(container->bits);
+    container->bits = NULL;
+    container->array = array;
+    container->capacity = container->cardinality;
+    return 1;
+}
+
+int container_add(BitmapContainer *container, uint16_t low) {
+    if (container->bits) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (!(container->bits[low >> 6] & bit)) {
+            container->bits[low >> 6] |= bit;
+            container->cardinality++;
+        }
+        return 1;
+    }
+
+    int first = 0;
+    int last = container->cardinality;
+    while (first < last) {
+        int mid = (first + last) / 2;
+        if (container->array[mid] < low) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    if (first < container->cardinality && container->array[first] == low) {
+        return 1;
+    }
+
+    if (container->cardinality == BITMAP_ARRAY_MAX) {
+        return container_to_bits(container) && container_add(container, low);
+    }
+    if (container->cardinality == container->capacity) {
+        int capacity = container->capacity ? container->capacity * 2 : 4;
+        if (capacity > BITMAP_ARRAY_MAX) capacity = BITMAP_ARRAY_MAX;
+        uint16_t *grown = realloc(container->array, capacity * sizeof(uint16_t));
+        if (!grown) {
+            return 0;
+        }
+        container->array = grown;
+        container->capacity = capacity;
+    }
+    memmove(container->array + first + 1, container->array + first,
+            (container->cardinality - first) * sizeof(uint16_t));
+    container->array[first] = low;
+    container->cardinality++;
+    return 1;
+}
+
+void container_remove(BitmapContainer *container, uint16_t low) {
+    if (container->bits) {
+        uint64_t bit = 1ULL << (low & 63);
+        if (container->bits[low >> 6] & bit) {
+            container->bits[low >> 6] &= ~bit;
+            container->cardinality--;
+            /* Half the switch-over point, so one ID cannot flip it back and forth. */
+            if (container->cardinality <= BITMAP_ARRAY_MAX / 2) container_to_array(container);
+        }
+        return;
+    }
+
+    for (int i = 0; i < container->cardinality; i++) {
+        if (container->array[i] == low) {
+            memmove(container->array + i, container->array + i + 1,
+                    (container->cardinality - i - 1) * sizeof(uint16_t));
+            container->cardinality--;
+            return;
+        }
+    }
+}
+
+int container_copy(BitmapContainer *to, const BitmapContainer *from) {
+    *to = *from;
+    if (from->bits) {
+        to->bits = malloc(BITMAP_WORDS * sizeof(uint64_t));
+        if (!to->bits) return 0;
+        memcpy(to->bits, from->bits, BITMAP_WORDS * sizeof(uint64_t));
+    } else {
+        to->capacity = from->cardinality;
+        to->array = malloc((from->cardinality ? from->cardinality : 1) * sizeof(uint16_t));
+        if (!to->array) return 0;
+        memcpy(to->array, from->array, from->cardinality * sizeof(uint16_t));
+    }
+    return 1;
+}
+
+/* The values in both a and b. Arrays are merged, bit sets ANDed. */
+int container_and(const BitmapContainer *a, const BitmapContainer *b, BitmapContainer *out) {
+    memset(out, 0, sizeof(*out));
+    out->key = a->key;
+
+    if (a->bits && b->bits) {
+        out->bits = malloc(BITMAP_WORDS * sizeof(uint64_t));
+        if (!out->bits) return 0;
+        for (int w = 0; w < BITMAP_WORDS; w++) {
+            out->bits[w] = a->bits[w] & b->bits[w];
+            out->cardinality += popcount64(out->bits[w]);
+        }
+        return out->cardinality > BITMAP_ARRAY_MAX || container_to_array(out);
+    }
+
+    if (a->bits) {
+        const BitmapContainer *swap = a;
+        a = b;
+        b = swap;
+    }
+    out->capacity = a->cardinality < b->cardinality ? a->cardinality : b->cardinality;
+    out->array = malloc((out->capacity ? out->capacity : 1) * sizeof(uint16_t));
+    if (!out->array) return 0;
+
+    if (b->bits) {
+        for (int i = 0; i < a->cardinality; i++) {
+            if (container_has(b, a->array[i])) out->array[out->cardinality++] = a->array[i];
+        }
+        return 1;
+    }
+    for (int i = 0, j = 0; i < a->cardinality && j < b->cardinality;) {
+        if (a->array[i] < b->array[j]) {
+            i++;
+        } else if (a->array[i] > b->array[j]) {
+            j++;
+        } else {
+            out->array[out->cardinality++] = a->array[i];
+            i++;
+            j++;
+        }
+    }
+    return 1;
+}
+
+/* |a AND b| without building the result. */
+long container_and_cardinality(const BitmapContainer *a, const BitmapContainer *b) {
+    long count = 0;
+
+    if (a->bits && b->bits) {
+        for (int w = 0; w < BITMAP_WORDS; w++) {
+            count += popcount64(a->bits[w] & b->bits[w]);
+        }
+        return count;
+    }
+    if (a->bits) {
+        const BitmapContainer *swap = a;
+        a = b;
+        b = swap;
+    }
+    if (b->bits) {
+        for (int i = 0; i < a->cardinality; i++) {
+            count += container_has(b, a->array[i]);
+        }
+        return count;
+    }
+    for (int i = 0, j = 0; i < a->cardinality && j < b->cardinality;) {
+        if (a->array[i] < b->array[j]) {
+            i++;
+        } else if (a->array[i] > b->array[j]) {
+            j++;
+        } else {
+            count++;
+            i++;
+            j++;
+        }
+    }
+    return count;
+}
+
+/* The values in either a or b. */
+int container_or(const BitmapContainer *a, const BitmapContainer *b, BitmapContainer *out) {
+    memset(out, 0, sizeof(*out));
+    out->key = a->key;
+
+    if (!a->bits && !b->bits && a->cardinality + b->cardinality <= BITMAP_ARRAY_MAX) {
+        out->capacity = a->cardinality + b->cardinality;
+        out->array = malloc((out->capacity ? out->capacity : 1) * sizeof(uint16_t));
+        if (!out->array) return 0;
+        int i = 0;
+        int j = 0;
+        while (i < a->cardinality || j < b->cardinality) {
+            if (j == b->cardinality || (i < a->cardinality && a->array[i] < b->array[j])) {
+                out->array[out->cardinality++] = a->array[i++];
+            } else if (i == a->cardinality || b->array[j] < a->array[i]) {
+                out->array[out->cardinality++] = b->array[j++];
+            } else {
+                out->array[out->cardinality++] = a->array[i++];
+                j++;
+            }
+        }
+        return 1;
+    }
+
+    out->bits = calloc(BITMAP_WORDS, sizeof(uint64_t));
+    if (!out->bits) return 0;
+    const BitmapContainer *sides[2] = {a, b};
+    for (int s = 0; s < 2; s++) {
+        const BitmapContainer *side = sides[s];
+        if (side->bits) {
+            for (int w = 0; w < BITMAP_WORDS; w++) out->bits[w] |= side->bits[w];
+        } else {
+            for (int i = 0; i < side->cardinality; i++) {
+                out->bits[side->array[i] >> 6] |= 1ULL << (side->array[i] & 63);
+            }
+        }
+    }
+    for (int w = 0; w < BITMAP_WORDS; w++) {
+        out->cardinality += popcount64(out->bits[w]);
+    }
+    return out->cardinality > BITMAP_ARRAY_MAX || container_to_array(out);
+}
+
+void bitmap_free(Bitmap *bitmap) {
+    for (int i = 0; i < bitmap->count; i++) {
+        container_free(&bitmap->containers[i]);
+    }
+    free(bitmap->containers);
+    memset(bitmap, 0, sizeof(*bitmap));
+}
+
+/* Position of key's container, or -(insertion point) - 1. */
+int bitmap_find(const Bitmap *bitmap, uint16_t key) {
+    int first = 0;
+    int last = bitmap->count;
+    while (first < last) {
+        int mid = (first + last) / 2;
+        if (bitmap->containers[mid].key < key) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    return first < bitmap->count && bitmap->containers[first].key == key ? first : -first - 1;
+}
+
+/* Appends a container built by the caller; keys must arrive in order. */
+int bitmap_append(Bitmap *bitmap, const BitmapContainer *container) {
+    if (bitmap->count == bitmap->capacity) {
+        int capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+        BitmapContainer *grown = realloc(bitmap->containers, capacity * sizeof(BitmapContainer));
+        if (!grown) {
+            return 0;
+        }
+        bitmap->containers = grown;
+        bitmap->capacity = capacity;
+    }
+    bitmap->containers[bitmap->count++] = *container;
+    return 1;
+}
+
+int bitmap_add(Bitmap *bitmap, uint32_t value) {
+    uint16_t key = (uint16_t)(value >> 16);
+    int i = bitmap_find(bitmap, key);
+
+    if (i < 0) {
+        BitmapContainer empty = {0};
+        empty.key = key;
+        i = -i - 1;
+        if (!bitmap_append(bitmap, &empty)) {
+            return 0;
+        }
+        memmove(bitmap->containers + i + 1, bitmap->containers + i,
+                (bitmap->count - i - 1) * sizeof(BitmapContainer));
+        bitmap->containers[i] = empty;
+    }
+    return container_add(&bitmap->containers[i], (uint16_t)value);
+}
+
+void bitmap_remove(Bitmap *bitmap, uint32_t value) {
+    int i = bitmap_find(bitmap, (uint16_t)(value >> 16));
+    if (i < 0) {
+        return;
+    }
+    container_remove(&bitmap->containers[i], (uint16_t)value);
+    if (bitmap->containers[i].cardinality == 0) {
+        container_free(&bitmap->containers[i]);
+        memmove(bitmap->containers + i, bitmap->containers + i + 1,
+                (bitmap->count - i - 1) * sizeof(BitmapContainer));
+        bitmap->count--;
+    }
+}
+
+long bitmap_cardinality(const Bitmap *bitmap) {
+    long count = 0;
+    for (int i = 0; i < bitmap->count; i++) {
+        count += bitmap->containers[i].cardinality;
+    }
+    return count;
+}
+
+int bitmap_copy(Bitmap *to, const Bitmap *from) {
+    memset(to, 0, sizeof(*to));
+    for (int i = 0; i < from->count; i++) {
+        BitmapContainer container;
+        if (!container_copy(&container, &from->containers[i]) || !bitmap_append(to, &container)) {
+            container_free(&container);
+            bitmap_free(to);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Replaces *result with *result AND other; a NULL other is empty. */
+int bitmap_and_into(Bitmap *result, const Bitmap *other) {
+    Bitmap out = {0};
+    int ok = 1;
+
+    for (int i = 0, j = 0; ok && other && i < result->count && j < other->count;) {
+        const BitmapContainer *a = &result->containers[i];
+        const BitmapContainer *b = &other->containers[j];
+        if (a->key < b->key) {
+            i++;
+        } else if (a->key > b->key) {
+            j++;
+        } else {
+            BitmapContainer both;
+            ok = container_and(a, b, &both);
+            if (ok && both.cardinality > 0) {
+                ok = bitmap_append(&out, &both);
+            }
+            if (!ok || both.cardinality == 0) container_free(&both);
+            i++;
+            j++;
+        }
+    }
+
+    if (!ok) {
+        bitmap_free(&out);
+        return 0;
+    }
+    bitmap_free(result);
+    *result = out;
+    return 1;
+}
+
+/* Replaces *result with *result OR other. */
+int bitmap_or_into(Bitmap *result, const Bitmap *other) {
+    Bitmap out = {0};
+    int ok = 1;
+    int i = 0;
+    int j = 0;
+
+    while (ok && (i < result->count || j < other->count)) {
+        BitmapContainer merged;
+        if (j == other->count || (i < result->count && result->containers[i].key < other->containers[j].key)) {
+            ok = container_copy(&merged, &result->containers[i++]);
+        } else if (i == result->count || other->containers[j].key < result->containers[i].key) {
+            ok = container_copy(&merged, &other->containers[j++]);
+        } else {
+            ok = container_or(&result->containers[i++], &other->containers[j++], &merged);
+        }
+        ok = ok && bitmap_append(&out, &merged);
+        if (!ok) container_free(&merged);
+    }
+
+    if (!ok) {
+        bitmap_free(&out);
+        return 0;
+    }
+    bitmap_free(result);
+    *result = out;
+    return 1;
+}
+
+/* |a AND b|, counted container by container with popcounts. */
+long bitmap_and_cardinality(const Bitmap *a, const Bitmap *b) {
+    long count = 0;
+    for (int i = 0, j = 0; b && i < a->count && j < b->count;) {
+        if (a->containers[i].key < b->containers[j].key) {
+            i++;
+        } else if (a->containers[i].key > b->containers[j].key) {
+            j++;
+        } else {
+            count += container_and_cardinality(&a->containers[i++], &b->containers[j++]);
+        }
+    }
+    return count;
+}
+
+/* Writes the IDs in ascending order; ids needs bitmap_cardinality slots. */
+void bitmap_to_ids(const Bitmap *bitmap, int *ids) {
+    int count = 0;
+    for (int i = 0; i < bitmap->count; i++) {
+        const BitmapContainer *container = &bitmap->containers[i];
+        int high = (int)container->key << 16;
+        if (!container->bits) {
+            for (int k = 0; k < container->cardinality; k++) {
+                ids[count++] = high | container->array[k];
+            }
+            continue;
+        }
+        for (int w = 0; w < BITMAP_WORDS; w++) {
+            for (uint64_t word = container->bits[w]; word; word &= word - 1) {
+                ids[count++] = high | (w * 64 + trailing_zeros64(word));
+            }
+        }
+    }
+}
+
+/* Bitmap for a code, or NULL when the code has none and create is 0. */
+Bitmap *code_bitmap(CodeBitmaps *set, int code, int create) {
+    if (code < 0) {
+        return NULL;
+    }
+    if (code >= set->count) {
+        if (!create) {
+            return NULL;
+        }
+        Bitmap *grown = realloc(set->bitmaps, (code + 1) * sizeof(Bitmap));
+        if (!grown) {
+            return NULL;
+        }
+        memset(grown + set->count, 0, (code + 1 - set->count) * sizeof(Bitmap));
+        set->bitmaps = grown;
+        set->count = code + 1;
+    }
+    return &set->bitmaps[code];
+}
+
+void code_bitmaps_free(CodeBitmaps *set) {
+    for (int i = 0; i < set->count; i++) {
+        bitmap_free(&set->bitmaps[i]);
+    }
+    free(set->bitmaps);
+    memset(set, 0, sizeof(*set));
+}
+
+/* Months since January BITMAP_FIRST_YEAR for a date starting "YYYY-MM",
+ * or -1. Only zero-padded dates count, so months sort as the text does. */
+int registration_month(const char *date) {
+    for (int i = 0; i < 7; i++) {
+        if (i == 4 ? date[i] != '-' : !isdigit((unsigned char)date[i])) return -1;
+    }
+    int year = atoi(date);
+    int month = atoi(date + 5);
+    if (year < BITMAP_FIRST_YEAR || month < 1 || month > 12) {
+        return -1;
+    }
+    return (year - BITMAP_FIRST_YEAR) * 12 + month - 1;
+}
+
+/* Drops the index; the next query builds it again. */
+void bitmap_index_free() {
+    BitmapIndex *index = &bitmap_index;
+    bitmap_free(&index->stored);
+    bitmap_free(&index->active);
+    bitmap_free(&index->undated);
+    code_bitmaps_free(&index->gender);
+    code_bitmaps_free(&index->blood_group);
+    code_bitmaps_free(&index->month);
+    for (int age = 0; age <= BITMAP_MAX_AGE; age++) {
+        bitmap_free(&index->age[age]);
+    }
+    index->built = 0;
+}
+
+/* Adds the record's ID to the bitmaps of its values, or removes it. */
+int bitmap_index_apply(const Patient *patient, int add) {
+    BitmapIndex *index = &bitmap_index;
+    Bitmap *bitmaps[6];
+    int count = 0;
+    uint32_t id = (uint32_t)patient->id;
+
+    bitmaps[count++] = &index->stored;
+    if (patient->is_active) bitmaps[count++] = &index->active;
+    if (patient->age >= 0 && patient->age <= BITMAP_MAX_AGE) bitmaps[count++] = &index->age[patient->age];
+    bitmaps[count] = code_bitmap(&index->gender, patient->gender, add);
+    if (bitmaps[count]) count++;
+    bitmaps[count] = code_bitmap(&index->blood_group, patient->blood_group, add);
+    if (bitmaps[count]) count++;
+    int month = registration_month(patient->registration_date);
+    bitmaps[count] = month >= 0 ? code_bitmap(&index->month, month, add) : &index->undated;
+    if (bitmaps[count]) count++;
+
+    for (int i = 0; i < count; i++) {
+        if (!add) {
+            bitmap_remove(bitmaps[i], id);
+        } else if (!bitmap_add(bitmaps[i], id)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Keeps a built index in step with one committed change. */
+void bitmap_index_update(const Patient *before, const Patient *after) {
+    if (!bitmap_index.built) {
+        return;
+    }
+    if (before) bitmap_index_apply(before, 0);
+    if (after && !bitmap_index_apply(after, 1)) {
+        bitmap_index_free();
+    }
+}
+
+int ensure_bitmap_index() {
+    PatientCursor cursor;
+    Patient *patient;
+
+    if (bitmap_index.built) {
+        return 1;
+    }
+    if (config.storage != STORAGE_BTREE) {
+        materialize_all_patients();
+    }
+
+    patient_cursor_open(&cursor);
+    while ((patient = patient_cursor_next(&cursor))) {
+        if (!bitmap_index_apply(patient, 1)) {
+            bitmap_index_free();
+            return 0;
+        }
+    }
+    bitmap_index.built = 1;
+    return 1;
+}
+
+/* What the bitmaps can select on; -1 and 0 leave a criterion open. */
+typedef struct {
+    int include_deleted;
+    int gender;
+    int blood_group;
+    int min_age;
+    int max_age;
+    int from_month;          /* registration_month() values */
+    int to_month;
+    int with_undated;        /* and records whose date has no month */
+} BitmapQuery;
+
+/* ORs the bitmaps of codes first..last into result. */
+int bitmap_union(Bitmap *result, Bitmap *bitmaps, int count, int first, int last) {
+    memset(result, 0, sizeof(*result));
+    for (int i = first < 0 ? 0 : first; i <= last && i < count; i++) {
+        if (!bitmap_or_into(result, &bitmaps[i])) {
+            bitmap_free(result);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Sets result to the IDs matching query. Returns 0 if out of memory. */
+int bitmap_query(const BitmapQuery *query, Bitmap *result) {
+    BitmapIndex *index = &bitmap_index;
+    Bitmap range;
+    int ok;
+
+    if (!ensure_bitmap_index() ||
+        !bitmap_copy(result, query->include_deleted ? &index->stored : &index->active)) {
+        return 0;
+    }
+
+    ok = query->gender == -1 || bitmap_and_into(result, code_bitmap(&index->gender, query->gender, 0));
+    if (ok && query->blood_group != -1) {
+        ok = bitmap_and_into(result, code_bitmap(&index->blood_group, query->blood_group, 0));
+    }
+    if (ok && (query->min_age > 0 || query->max_age > 0)) {
+        ok = bitmap_union(&range, index->age, BITMAP_MAX_AGE + 1, query->min_age,
+                          query->max_age > 0 ? query->max_age : BITMAP_MAX_AGE);
+        ok = ok && bitmap_and_into(result, &range);
+        bitmap_free(&range);
+    }
+    if (ok && (query->from_month >= 0 || query->to_month >= 0)) {
+        ok = bitmap_union(&range, index->month.bitmaps, index->month.count, query->from_month,
+                          query->to_month >= 0 ? query->to_month : index->month.count - 1);
+        if (ok && query->with_undated) ok = bitmap_or_into(&range, &index->undated);
+        ok = ok && bitmap_and_into(result, &range);
+        bitmap_free(&range);
+    }
+
+    if (!ok) {
+        bitmap_free(result);
+    }
+    return ok;
+}
+
+/* ===================== REPLICATION ===================== */
+
+/*
+ * Log shipping to a hot standby. With replica_dir set, the primary appends
+ * every committed change to <replica_dir>/replication.log, one line each:
+ *
+ *   seq|commit_ms|U|<record in the all-text format>   added or changed
+ *   seq|commit_ms|R|<id>                             moved to the archive
+ *
+ * The lines go out through the background I/O thread, so shipping adds a
+ * copy to each save and no waiting. A new log starts with every current
+ * record, which is all a standby with an empty store needs to catch up.
+ *
+ * A standby (replica_role=standby) applies the complete lines past its
+ * saved position before each menu, serves searches from its own store and
+ * refuses changes until promoted. Applying an entry twice has the same
+ * effect as once, so a standby that crashed before saving its position
+ * simply re-applies from the older one.
+ */
+typedef struct {
+    FILE *log;
+    uint64_t size;               /* primary: where the next entry goes */
+    uint64_t next_seq;           /* primary: sequence of the next entry */
+    unsigned long failures;      /* primary: entries that could not be queued */
+    uint64_t applied_offset;     /* standby: log bytes applied */
+    uint64_t applied_seq;        /* standby: last entry applied */
+    long long applied_commit_ms; /* standby: when that entry was committed */
+    long long applied_at_ms;     /* standby: when it was applied here */
+    int stalled;                 /* standby: stopped at an entry it cannot apply */
+} Replica;
+
+Replica replica = {0};
+
+typedef struct {
+    uint64_t last_seq;
+    uint64_t entries_behind;
+    uint64_t bytes_behind;
+    long long oldest_pending_ms;
+} ReplicaLag;
+
+int replica_enabled() {
+    return config.replica_dir[0] != '\0';
+}
+
+void replica_log_path(char *path, int size) {
+    if (strcmp(current_branch, MAIN_BRANCH) == 0) {
+        snprintf(path, size, "%s/replication.log", config.replica_dir);
+    } else {
+        snprintf(path, size, "%s/replication-%s.log", config.replica_dir, current_branch);
+    }
+}
+
+/* Splits "seq|commit_ms|kind|body"; returns the body, or NULL if malformed. */
+const char *parse_replica_entry(const char *line, uint64_t *seq, long long *commit_ms, char *kind) {
+    char *end;
+
+    *seq = strtoull(line, &end, 10);
+    if (end == line || *end != '|') return NULL;
+    line = end + 1;
+    *commit_ms = strtoll(line, &end, 10);
+    if (end == line || *end != '|') return NULL;
+    if ((end[1] != 'U' && end[1] != 'R') || end[2] != '|') return NULL;
+    *kind = end[1];
+    return end + 3;
+}
+
+/*
+ * Reads the last complete line of a log that is size bytes long into
+ * tail, which holds capacity bytes, and returns it without its newline.
+ * *end is set past the newline, or to 0 when there is no complete line.
+ */
+const char *read_last_line(FILE *log, uint64_t size, char *tail, int capacity, uint64_t *end) {
+    uint64_t start = size > (uint64_t)(capacity - 1) ? size - (uint64_t)(capacity - 1) : 0;
+    int len = (int)(size - start);
+
+    *end = 0;
+    if (len == 0 || !read_at(log, start, tail, len)) {
+        return NULL;
+    }
+
+    while (len > 0 && tail[len - 1] != '\n') len--;
+    if (len == 0) {
+        return NULL;
+    }
+    *end = start + len;
+    tail[len - 1] = '\0';
+
+    int begin = len - 1;
+    while (begin > 0 && tail[begin - 1] != '\n') begin--;
+    return tail + begin;
+}
+
+/* Finds the last complete entry of the log, as read_last_line. */
+int replica_read_tail(FILE *log, uint64_t size, uint64_t *seq, long long *commit_ms, uint64_t *end) {
+    char tail[REPLICA_TAIL_SIZE + 1];
+    char kind;
+
+    const char *line = read_last_line(log, size, tail, sizeof(tail), end);
+    return line && parse_replica_entry(line, seq, commit_ms, &kind) != NULL;
+}
+
+uint64_t replica_log_size() {
+    return replica.log ? file_size(replica.log) : 0;
+}
+
+int replica_append(char kind, const char *body) {
+    char line[REPLICA_LINE_LEN];
+    int len = snprintf(line, sizeof(line), "%llu|%lld|%c|%s",
+                       (unsigned long long)replica.next_seq, wall_clock_ms(), kind, body);
+    if (len <= 0 || len >= (int)sizeof(line) ||
+        !io_write(replica.log, replica.size, line, len) || !io_commit(&replica.log, 1, 0)) {
+        replica.failures++;
+        return 0;
+    }
+    replica.size += len;
+    replica.next_seq++;
+    return 1;
+}
+
+/* Ships an added, changed or deleted record; a no-op unless primary. */
+void replicate_patient(const Patient *patient) {
+    char record[BTREE_MAX_RECORD];
+
+    if (!replica.log || config.replica_role != REPLICA_PRIMARY) return;
+
+    int len = format_patient_text(patient, record, sizeof(record));
+    if (len <= 0 || len >= (int)sizeof(record)) {
+        replica.failures++;
+        return;
+    }
+    replica_append('U', record);
+}
+
+/* Ships the removal of a record that was moved to the archive. */
+void replicate_removal(int patient_id) {
+    char body[16];
+
+    if (!replica.log || config.replica_role != REPLICA_PRIMARY) return;
+
+    snprintf(body, sizeof(body), "%d\n", patient_id);
+    replica_append('R', body);
+}
+
+int replica_open_primary() {
+    char path[256];
+    uint64_t seq;
+    long long commit_ms;
+
+    replica_log_path(path, sizeof(path));
+    replica.log = open_or_create(path);
+    if (!replica.log) {
+        perror("Error opening replication log");
+        return 0;
+    }
+
+    uint64_t size = replica_log_size();
+    replica.next_seq = 1;
+    if (replica_read_tail(replica.log, size, &seq, &commit_ms, &replica.size)) {
+        replica.next_seq = seq + 1;
+    }
+    /* A crash can leave half an entry behind; the next one starts clean. */
+    if (replica.size < size) {
+        truncate_file(replica.log, replica.size);
+    }
+
+    if (replica.size == 0) {
+        if (config.storage == STORAGE_BTREE) {
+            BTreeCursor cursor;
+            Patient patient;
+            btree_seek(&cursor, 0);
+            while (btree_next(&cursor, &patient)) {
+                replicate_patient(&patient);
+            }
+        } else {
+            materialize_all_patients();
+            for (int i = 0; i < patient_count; i++) {
+                replicate_patient(&patients[i]);
+            }
+        }
+    }
+    return 1;
+}
+
+/* The position is rewritten in place; losing it only means re-applying. */
+void replica_save_position() {
+    FILE *file = fopen(branch_file("replica.pos"), "w");
+    if (!file) return;
+    fprintf(file, "%llu|%llu|%lld|%lld\n", (unsigned long long)replica.applied_offset,
+            (unsigned long long)replica.applied_seq, replica.applied_commit_ms, replica.applied_at_ms);
+    fclose(file);
+}
+
+void replica_open_standby() {
+    unsigned long long offset;
+    unsigned long long seq;
+    long long commit_ms;
+    long long applied_ms;
+
+    FILE *file = fopen(branch_file("replica.pos"), "r");
+    if (file) {
+        if (fscanf(file, "%llu|%llu|%lld|%lld", &offset, &seq, &commit_ms, &applied_ms) == 4) {
+            replica.applied_offset = offset;
+            replica.applied_seq = seq;
+            replica.applied_commit_ms = commit_ms;
+            replica.applied_at_ms = applied_ms;
+        }
+        fclose(file);
+    }
+}
+
+int replica_apply_removal(int patient_id) {
+    if (config.storage == STORAGE_BTREE) {
+        Patient current;
+        if (!btree_get(patient_id, &current) || !current.is_active) {
+            return 1;
+        }
+        current.is_active = 0;
+        if (!btree_store_patient(&current)) {
+            return 0;
+        }
+        btree_store.active_count--;
+        cache_patient(&current);
+        return 1;
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient_id) {
+            materialize_all_patients();
+            memmove(&patients[i], &patients[i + 1], (size_t)(patient_count - i - 1) * sizeof(Patient));
+            patient_count--;
+            id_order_count = 0;
+            return 1;
+        }
+    }
+    return 1;
+}
+
+int replica_apply_patient(const Patient *patient) {
+    if (patient->id >= next_patient_id) {
+        next_patient_id = patient->id + 1;
+    }
+
+    if (config.storage == STORAGE_BTREE) {
+        Patient current;
+        int existed = btree_get(patient->id, &current);
+        if (!btree_store_patient(patient)) {
+            return 0;
+        }
+        if (!existed) btree_store.record_count++;
+        btree_store.active_count += patient->is_active - (existed ? current.is_active : 0);
+        cache_patient(patient);
+        return 1;
+    }
+
+    int i = 0;
+    while (i < patient_count && patients[i].id != patient->id) i++;
+    if (i == patient_count) {
+        if (patient_count >= MAX_PATIENTS) return 0;
+        patient_count++;
+    }
+    patients[i] = *patient;
+    lazy_mark_parsed(i);
+    return persist_patient(&patients[i]);
+}
+
+/*
+ * Applies every complete entry shipped since the last call. Returns the
+ * number applied, or -1 once an entry is out of sequence or cannot be
+ * applied; the standby then stays at the entry before it.
+ */
+int replica_catch_up() {
+    char line[REPLICA_LINE_LEN];
+    char path[256];
+    int applied = 0;
+    int removed = 0;
+
+    if (config.replica_role != REPLICA_STANDBY) return 0;
+    if (replica.stalled) return -1;
+
+    if (!replica.log) {
+        replica_log_path(path, sizeof(path));
+        replica.log = fopen(path, "rb");
+        if (!replica.log) return 0;
+    }
+
+    clearerr(replica.log);
+    if (!file_seek(replica.log, replica.applied_offset, SEEK_SET)) {
+        return 0;
+    }
+
+    int indexed = patient_indexes_built;
+    while (fgets(line, sizeof(line), replica.log)) {
+        uint64_t seq;
+        long long commit_ms;
+        char kind;
+        Patient patient;
+        size_t len = strlen(line);
+
+        /* The primary is still writing this one. */
+        if (line[len - 1] != '\n') break;
+
+        const char *body = parse_replica_entry(line, &seq, &commit_ms, &kind);
+        int ok = body && seq == replica.applied_seq + 1;
+        if (ok && kind == 'R') {
+            ok = replica_apply_removal(atoi(body));
+            removed = 1;
+        } else if (ok) {
+            ok = parse_text_patient(body, &patient) && replica_apply_patient(&patient);
+        }
+        if (!ok) {
+            replica.stalled = 1;
+            break;
+        }
+
+        replica.applied_offset += len;
+        replica.applied_seq = seq;
+        replica.applied_commit_ms = commit_ms;
+        applied++;
+    }
+
+    if (applied > 0) {
+        note_rows_changed();
+        bitmap_index_free();
+        replica.applied_at_ms = wall_clock_ms();
+        if (config.storage == STORAGE_BTREE) {
+            btree_commit();
+        } else {
+            /* The journal has no way to say a record is gone. */
+            if (removed) save_patients();
+            if (indexed) rebuild_patient_indexes();
+        }
+        replica_save_position();
+    }
+    return replica.stalled ? -1 : applied;
+}
+
+void replica_lag(ReplicaLag *lag) {
+    char line[REPLICA_LINE_LEN];
+    uint64_t seq;
+    uint64_t end;
+    long long commit_ms;
+    char kind;
+
+    memset(lag, 0, sizeof(*lag));
+    if (config.replica_role == REPLICA_PRIMARY) {
+        lag->last_seq = replica.next_seq ? replica.next_seq - 1 : 0;
+        return;
+    }
+
+    if (!replica.log || !replica_read_tail(replica.log, replica_log_size(), &seq, &commit_ms, &end)) {
+        lag->last_seq = replica.applied_seq;
+        return;
+    }
+    lag->last_seq = seq;
+    if (seq <= replica.applied_seq) return;
+
+    lag->entries_behind = seq - replica.applied_seq;
+    lag->bytes_behind = end > replica.applied_offset ? end - replica.applied_offset : 0;
+    clearerr(replica.log);
+    if (file_seek(replica.log, replica.applied_offset, SEEK_SET) &&
+        fgets(line, sizeof(line), replica.log) &&
+        parse_replica_entry(line, &seq, &commit_ms, &kind)) {
+        lag->oldest_pending_ms = wall_clock_ms() - commit_ms;
+    }
+}
+
+void replica_start() {
+    if (!replica_enabled()) return;
+
+    if (config.replica_role == REPLICA_STANDBY) {
+        replica_open_standby();
+        replica_catch_up();
+    } else {
+        replica_open_primary();
+    }
+}
+
+/*
+ * Reopens the open branch's log as its primary once replica_role has been
+ * changed; every entry must already be applied. The new primary continues
+ * the sequence in the same log.
+ */
+int replica_become_primary() {
+    remove(branch_file("replica.pos"));
+    if (replica.next_seq > 0) {
+        return 1;   /* loaded after the change, so opened as a primary */
+    }
+
+    if (replica.log) {
+        io_flush();
+        fclose(replica.log);
+        replica.log = NULL;
+    }
+    return replica_open_primary();
+}
+
+/* ===================== CHANGE FEED ===================== */
+
+/*
+ * Every committed add, change and delete is published as a numbered event
+ * carrying the record before and after it. Code in this program subscribes
+ * a callback; other programs tail changes.feed (change_feed=on), one line
+ * per event:
+ *
+ *   seq|commit_ms|I|<after>            added, or restored from the archive
+ *   seq|commit_ms|U|<before>|<after>   changed
+ *   seq|commit_ms|D|<before>           deleted, or moved to the archive
+ *
+ * Images are records in the all-text format without their newline, so
+ * each is FIELD_COUNT fields and the kind says which are present. Lines
+ * are only ever appended. A consumer keeps the offset past the last line
+ * it handled and reads on from there; a line without its newline is still
+ * being written. Sequence numbers carry on across restarts; without the
+ * feed file they count from 1 each run.
+ */
+typedef enum {
+    CHANGE_INSERT = 'I',
+    CHANGE_UPDATE = 'U',
+    CHANGE_DELETE = 'D'
+} ChangeKind;
+
+typedef struct {
+    uint64_t seq;
+    long long commit_ms;
+    ChangeKind kind;
+    const Patient *before; /* NULL for inserts */
+    const Patient *after;  /* NULL for deletes */
+} ChangeEvent;
+
+/* Called on the thread that made the change, after it is committed. */
+typedef void (*ChangeListener)(const ChangeEvent *event, void *context);
+
+typedef struct {
+    ChangeListener listener;
+    void *context;
+} ChangeSubscription;
+
+ChangeSubscription change_subscriptions[MAX_CHANGE_LISTENERS];
+
+typedef struct {
+    FILE *file;
+    int opened;
+    uint64_t size;
+    uint64_t next_seq;
+    unsigned long failures;
+} ChangeFeed;
+
+ChangeFeed change_feed = {0};
+
+/* Returns a handle for unsubscribe_changes, or -1 if all are taken. */
+int subscribe_changes(ChangeListener listener, void *context) {
+    for (int i = 0; i < MAX_CHANGE_LISTENERS; i++) {
+        if (!change_subscriptions[i].listener) {
+            change_subscriptions[i].listener = listener;
+            change_subscriptions[i].context = context;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void unsubscribe_changes(int handle) {
+    if (handle >= 0 && handle < MAX_CHANGE_LISTENERS) {
+        change_subscriptions[handle].listener = NULL;
+        change_subscriptions[handle].context = NULL;
+    }
+}
+
+/* Opens the branch's feed on first use and continues its numbering. */
+void change_feed_open() {
+    char tail[FEED_LINE_LEN + 1];
+
+    change_feed.opened = 1;
+    change_feed.next_seq = 1;
+    if (!config.change_feed) {
+        return;
+    }
+
+    change_feed.file = open_or_create(branch_file("changes.feed"));
+    if (!change_feed.file) {
+        perror("Error opening changes.feed");
+        return;
+    }
+    uint64_t size = file_size(change_feed.file);
+
+    const char *last = read_last_line(change_feed.file, size, tail, sizeof(tail), &change_feed.size);
+    if (last) {
+        change_feed.next_seq = strtoull(last, NULL, 10) + 1;
+    }
+    /* A crash can leave half a line behind; the next one starts clean. */
+    if (change_feed.size < size) {
+        truncate_file(change_feed.file, change_feed.size);
+    }
+}
+
+int append_image(char *line, int len, int size, const Patient *patient) {
+    if (len <= 0 || len >= size) {
+        return -1;
+    }
+    line[len++] = '|';
+    int image = format_patient_text(patient, line + len, size - len);
+    if (image <= 0 || len + image >= size) {
+        return -1;
+    }
+    return len + image - 1; /* drop the newline */
+}
+
+/* Publishes one committed change to subscribers and the feed file. */
+void publish_change(ChangeKind kind, const Patient *before, const Patient *after) {
+    char line[FEED_LINE_LEN];
+
+    if (!change_feed.opened) {
+        change_feed_open();
+    }
+
+    ChangeEvent event = {change_feed.next_seq++, wall_clock_ms(), kind, before, after};
+    for (int i = 0; i < MAX_CHANGE_LISTENERS; i++) {
+        if (change_subscriptions[i].listener) {
+            change_subscriptions[i].listener(&event, change_subscriptions[i].context);
+        }
+    }
+
+    if (!change_feed.file) {
+        return;
+    }
+    int len = snprintf(line, sizeof(line), "%llu|%lld|%c",
+                       (unsigned long long)event.seq, event.commit_ms, (char)kind);
+    if (before) len = append_image(line, len, sizeof(line), before);
+    if (after) len = append_image(line, len, sizeof(line), after);
+    if (len < 0 || len + 1 >= (int)sizeof(line)) {
+        change_feed.failures++;
+        return;
+    }
+    line[len++] = '\n';
+
+    if (!io_write(change_feed.file, change_feed.size, line, len) || !io_commit(&change_feed.file, 1, 0)) {
+        change_feed.failures++;
+        return;
+    }
+    change_feed.size += len;
+}
+
+/* ===================== USER OPERATIONS ===================== */
+
+User* find_user_by_username(const char *username) {
+    for (int i = 0; i < user_count; i++) {
+        if (strcmp(users[i].username, username) == 0 && users[i].is_active) {
+            return &users[i];
+        }
+    }
+    return NULL;
+}
+
+int authenticate_user(const char *username, const char *password) {
+    User *user = find_user_by_username(username);
+    if (!user) {
+        return 0;
+    }
+    return strcmp(user->password, password) == 0;
+}
+
+int count_active_admins() {
+    int count = 0;
+    for (int i = 0; i < user_count; i++) {
+        if (users[i].is_active && users[i].role == ROLE_ADMIN) {
+            count++;
+        }
+    }
+    return count;
+}
+
+int register_user(const char *username, const char *password, UserRole role) {
+    if (user_count >= MAX_USERS) {
+        return 0;
+    }
+
+    if (find_user_by_username(username)) {
+        return -1;
+    }
+
+    User *new_user = &users[user_count];
+    new_user->user_id = next_user_id++;
+    strncpy(new_user->username, username, MAX_USERNAME_LEN);
+    new_user->username[MAX_USERNAME_LEN - 1] = '\0';
+    strncpy(new_user->password, password, MAX_PASSWORD_LEN);
+    new_user->password[MAX_PASSWORD_LEN - 1] = '\0';
+    new_user->role = role;
+    new_user->is_active = 1;
+
+    user_count++;
+    save_users();
+    return 1;
+}
+
+/* ===================== PATIENT OPERATIONS ===================== */
+
+/*
+ * Schema checks run before a record is stored: numbers within their
+ * range, text present and free of the '|' and newline separators, codes
+ * naming a dictionary value, and a valid phone number.
+ */
+const char *check_text_field(const char *text) {
+    if (text[0] == '\0') return "is required";
+    if (strpbrk(text, "|\n")) return "cannot contain '|'";
+    return NULL;
+}
+
+#define VALIDATE_INT(member, dict, min, max) \
+    if (patient->member < min || patient->member > max) problem = "is out of range";
+#define VALIDATE_FLAG VALIDATE_INT
+#define VALIDATE_TEXT(member, dict, min, max) problem = check_text_field(patient->member);
+#define VALIDATE_CODE(member, dict, min, max) \
+    if (patient->member < 0 || patient->member >= dict.count) problem = "is required"; \
+    else problem = check_text_field(dict_value(&dict, patient->member));
+#define VALIDATE_PHONE(member, dict, min, max) \
+    if (!patient->member) problem = "is not a valid number";
+#define VALIDATE_FIELD(tag, member, kind, size, dict, label, column, min, max) \
+    VALIDATE_##kind(member, dict, min, max) \
+    if (problem) { \
+        snprintf(message, sizeof(message), "%s %s.", label, problem); \
+        return message; \
+    }
+
+/* Returns NULL for a valid record, else a message naming the bad field. */
+const char *validate_patient(const Patient *patient) {
+    static char message[96];
+    const char *problem = NULL;
+    PATIENT_FIELDS(VALIDATE_FIELD)
+    return NULL;
+}
+
+int add_patient(Patient *patient) {
+    patient->id = next_patient_id;
+    patient->is_active = 1;
+    if (validate_patient(patient)) {
+        return 0;
+    }
+
+    if (config.storage == STORAGE_BTREE) {
+        patient->id = next_patient_id++;
+        patient->is_active = 1;
+        if (!btree_store_patient(patient)) {
+            next_patient_id--;
+            return 0;
+        }
+        btree_store.record_count++;
+        btree_store.active_count++;
+        if (!btree_commit()) {
+            return 0;
+        }
+        note_rows_changed();
+        bitmap_index_update(NULL, patient);
+        replicate_patient(patient);
+        publish_change(CHANGE_INSERT, NULL, patient);
+        return 1;
+    }
+
+    if (patient_count >= MAX_PATIENTS) {
+        return 0;
+    }
+
+    patient->id = next_patient_id++;
+    patient->is_active = 1;
+
+    patients[patient_count] = *patient;
+    int old_count = patient_count;
+    int old_next_id = next_patient_id - 1;
+    patient_count++;
+
+    if (!persist_patient(&patients[old_count])) {
+        patient_count = old_count;
+        next_patient_id = old_next_id;
+        return 0;
+    }
+
+    if (patient_indexes_built) {
+        index_patient_name(old_count);
+        phonetic_index_add(old_count);
+        phone_index_add(old_count);
+        autocomplete_track(&patients[old_count], 1);
+    }
+    note_rows_changed();
+    bitmap_index_update(NULL, &patients[old_count]);
+    replicate_patient(&patients[old_count]);
+    publish_change(CHANGE_INSERT, NULL, &patients[old_count]);
+    return 1;
+}
+
+int modify_patient(int patient_id, Patient *updated_patient) {
+    if (config.storage == STORAGE_BTREE) {
+        Patient current;
+        if (!btree_get(patient_id, &current) || !current.is_active) {
+            return 0;
+        }
+        updated_patient->id = patient_id;
+        updated_patient->is_active = 1;
+        strcpy(updated_patient->registration_date, current.registration_date);
+        if (validate_patient(updated_patient) || !btree_store_patient(updated_patient)) {
+            return 0;
+        }
+        cache_patient(updated_patient);
+        if (!btree_commit()) {
+            return 0;
+        }
+        note_fields_changed(changed_fields(&current, updated_patient));
+        bitmap_index_update(&current, updated_patient);
+        replicate_patient(updated_patient);
+        publish_change(CHANGE_UPDATE, &current, updated_patient);
+        return 1;
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient_id && patients[i].is_active) {
+            Patient *current = patient_at(i);
+            Patient before = *current;
+            updated_patient->id = patient_id;
+            updated_patient->is_active = 1;
+            strcpy(updated_patient->registration_date, current->registration_date);
+            if (validate_patient(updated_patient)) {
+                return 0;
+            }
+            note_fields_changed(changed_fields(current, updated_patient));
+            if (!patient_indexes_built) {
+                patients[i] = *updated_patient;
+                if (!persist_patient(&patients[i])) {
+                    return 0;
+                }
+                bitmap_index_update(&before, &patients[i]);
+                replicate_patient(&patients[i]);
+                publish_change(CHANGE_UPDATE, &before, &patients[i]);
+                return 1;
+            }
+
+            int name_changed = strcmp(current->name, updated_patient->name) != 0;
+            int guardian_changed = strcmp(current->guardian, updated_patient->guardian) != 0;
+            int phone_changed = current->phone != updated_patient->phone;
+            if (name_changed || guardian_changed) {
+                phonetic_index_remove(i);
+            }
+            if (phone_changed) {
+                phone_index_remove(i);
+            }
+            autocomplete_track(current, -1);
+            autocomplete_track(updated_patient, 1);
+            patients[i] = *updated_patient;
+            if (name_changed) {
+                reindex_patient_name(i);
+            }
+            if (name_changed || guardian_changed) {
+                phonetic_index_add(i);
+            }
+            if (phone_changed) {
+                phone_index_add(i);
+            }
+            if (!persist_patient(&patients[i])) {
+                return 0;
+            }
+            bitmap_index_update(&before, &patients[i]);
+            replicate_patient(&patients[i]);
+            publish_change(CHANGE_UPDATE, &before, &patients[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int delete_patient(int patient_id) {
+    if (config.storage == STORAGE_BTREE) {
+        Patient current;
+        if (!btree_get(patient_id, &current) || !current.is_active) {
+            return 0;
+        }
+        Patient before = current;
+        current.is_active = 0;
+        if (!btree_store_patient(&current)) {
+            return 0;
+        }
+        btree_store.active_count--;
+        cache_patient(&current);
+        if (!btree_commit()) {
+            return 0;
+        }
+        note_fields_changed(1u << FIELD_IS_ACTIVE);
+        bitmap_index_update(&before, &current);
+        replicate_patient(&current);
+        publish_change(CHANGE_DELETE, &before, NULL);
+        return 1;
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient_id && patients[i].is_active) {
+            Patient *current = patient_at(i);
+            Patient before = *current;
+            current->is_active = 0;
+            note_fields_changed(1u << FIELD_IS_ACTIVE);
+            if (patient_indexes_built) {
+                autocomplete_track(current, -1);
+            }
+            if (!persist_patient(current)) {
+                return 0;
+            }
+            bitmap_index_update(&before, current);
+            replicate_patient(current);
+            publish_change(CHANGE_DELETE, &before, NULL);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Patient* find_patient_by_id(int patient_id) {
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient_id && patients[i].is_active) {
+            return patient_at(i);
+        }
+    }
+
+    if (config.storage == STORAGE_BTREE) {
+        Patient patient;
+        if (btree_get(patient_id, &patient) && patient.is_active) {
+            return &patients[cache_patient(&patient)];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Substring search on a dictionary column such as address or disease. The text
+ * is matched once per distinct value, which leaves a code lookup per
+ * record. Each morsel keeps its first max_results matches so the merge
+ * stays in ID order: patients[] indexes for the in-memory stores, IDs for
+ * the B+tree store, whose morsels are leaves.
+ */
+typedef struct {
+    int column;
+    const Dictionary *dict;
+    const TextPattern *pattern;
+    const char *matches;
+    int match_count;
+    int max_results;
+    int *rows;
+    int *row_counts;
+    int *totals;
+    const uint32_t *leaves;
+} ColumnScan;
+
+/* A B+tree record read during the scan can add a value past matches. */
+int column_code_matches(const ColumnScan *scan, int code) {
+    if (code < 0) return 0;
+    if (code < scan->match_count) return scan->matches[code];
+    return text_contains(dict_value(scan->dict, code), scan->pattern);
+}
+
+void column_scan_morsel(void *context, int worker, int morsel, int first, int last) {
+    ColumnScan *scan = context;
+    int *rows = scan->rows + (size_t)morsel * scan->max_results;
+    int found = 0;
+    int total = 0;
+    (void)worker;
+
+    for (int i = first; i < last; i++) {
+        const Patient *patient = &patients[id_order[i]];
+        if (patient->is_active && column_code_matches(scan, patient_column_code(patient, scan->column))) {
+            if (found < scan->max_results) rows[found++] = id_order[i];
+            total++;
+        }
+    }
+    scan->row_counts[morsel] = found;
+    scan->totals[morsel] = total;
+}
+
+void column_scan_leaves(void *context, int worker, int morsel, int first, int last) {
+    ColumnScan *scan = context;
+    int *rows = scan->rows + (size_t)morsel * scan->max_results;
+    int found = 0;
+    int total = 0;
+    BTreeRun run;
+    Patient patient;
+    (void)worker;
+
+    btree_run_open(&run, scan->leaves, first, last);
+    while (btree_run_next(&run, &patient)) {
+        if (patient.is_active && column_code_matches(scan, patient_column_code(&patient, scan->column))) {
+            if (found < scan->max_results) rows[found++] = patient.id;
+            total++;
+        }
+    }
+    scan->row_counts[morsel] = found;
+    scan->totals[morsel] = total;
+}
+
+void remember_column_search(int column, const char *search, const int *result_indices,
+                            int found_count, int total_found) {
+    int ids[QUERY_CACHE_IDS];
+    int count = found_count < QUERY_CACHE_IDS ? found_count : QUERY_CACHE_IDS;
+
+    for (int i = 0; i < count; i++) {
+        ids[i] = patients[result_indices[i]].id;
+    }
+    query_cache_store(column, search, ids, count, total_found);
+}
+
+/*
+ * Fills result_indices with patients[] indexes of the first matches in ID
+ * order and returns how many; *total_found counts every match. Returns -1
+ * when memory runs out.
+ */
+int find_patients_by_column(int column, const char *search, int *result_indices,
+                            int max_results, int *total_found) {
+    Dictionary *dict = dictionary_columns[column].dict;
+    char key[TEXT_PATTERN_LEN];
+    TextPattern pattern;
+    int found_count = 0;
+
+    QueryCacheEntry *cached = query_cache_find(column, search);
+    if (cached && (cached->count == cached->total || cached->count >= max_results)) {
+        for (int i = 0; i < cached->count && found_count < max_results; i++) {
+            int slot = cached_patient_slot(cached->ids[i]);
+            if (slot >= 0) result_indices[found_count++] = slot;
+        }
+        *total_found = cached->total;
+        return found_count;
+    }
+
+    normalize_query(search, key);
+    text_pattern_init(&pattern, key);
+
+    /* Lazily loaded records add their values to the dictionary when parsed. */
+    materialize_all_patients();
+    char *matches = calloc(dict->count + 1, 1);
+    if (!matches) return -1;
+    for (int code = 0; code < dict->count; code++) {
+        matches[code] = (char)text_contains(dict_value(dict, code), &pattern);
+    }
+
+    ColumnScan scan = {column, dict, &pattern, matches, dict->count, max_results, NULL, NULL, NULL, NULL};
+    int morsel_count;
+    uint32_t *leaves = NULL;
+    if (config.storage == STORAGE_BTREE) {
+        leaves = btree_scan_start(&morsel_count);
+        if (!leaves) {
+            free(matches);
+            return -1;
+        }
+    } else {
+        refresh_id_order();
+        morsel_count = (id_order_count + SCAN_MORSEL_SIZE - 1) / SCAN_MORSEL_SIZE;
+    }
+
+    scan.rows = malloc(((size_t)morsel_count * max_results + 1) * sizeof(int));
+    scan.row_counts = malloc(((size_t)morsel_count * 2 + 1) * sizeof(int));
+    scan.totals = scan.row_counts ? scan.row_counts + morsel_count : NULL;
+    scan.leaves = leaves;
+    if (!scan.rows || !scan.row_counts) {
+        free(scan.rows);
+        free(scan.row_counts);
+        free(leaves);
+        free(matches);
+        return -1;
+    }
+
+    if (leaves) {
+        scan_records_shared((int)btree_store.record_count, morsel_count, 1, column_scan_leaves, &scan);
+    } else {
+        scan_records(id_order_count, id_order_count, SCAN_MORSEL_SIZE, column_scan_morsel, &scan);
+    }
+
+    *total_found = 0;
+    for (int m = 0; m < morsel_count; m++) {
+        for (int i = 0; i < scan.row_counts[m] && found_count < max_results; i++) {
+            int row = scan.rows[(size_t)m * max_results + i];
+            Patient patient;
+            if (!leaves) {
+                result_indices[found_count++] = row;
+            } else if (btree_get(row, &patient)) {
+                result_indices[found_count++] = cache_patient(&patient);
+            }
+        }
+        *total_found += scan.totals[m];
+    }
+    free(scan.rows);
+    free(scan.row_counts);
+    free(leaves);
+    free(matches);
+    remember_column_search(column, search, result_indices, found_count, *total_found);
+    return found_count;
+}
+
+/* The cached IDs of every active patient whose name contains search. */
+QueryCacheEntry *name_search_ids(const char *search) {
+    QueryCacheEntry *entry = query_cache_find(QUERY_NAME, search);
+    if (entry) {
+        return entry;
+    }
+
+    int ids[QUERY_CACHE_IDS];
+    int count = 0;
+    int total = 0;
+    char key[TEXT_PATTERN_LEN];
+    TextPattern pattern;
+    PatientCursor cursor;
+    Patient *patient;
+
+    normalize_query(search, key);
+    text_pattern_init(&pattern, key);
+    patient_cursor_open(&cursor);
+    while ((patient = patient_cursor_next(&cursor))) {
+        if (!patient->is_active || !text_contains(patient->name, &pattern)) continue;
+        if (count < QUERY_CACHE_IDS) ids[count++] = patient->id;
+        total++;
+    }
+    return query_cache_store(QUERY_NAME, search, ids, count, total);
+}
+
+/*
+ * find_patients_page() from a cached ID list. Returns -1 when the page
+ * reaches past the IDs the entry holds.
+ */
+int cached_patients_page(const QueryCacheEntry *entry, int from_id, int backward,
+                         Patient *rows, int max_rows, int *more) {
+    int complete = entry->count == entry->total;
+    int key = backward ? from_id : from_id + 1;
+    int low = 0;
+    int high = entry->count;
+    int first;
+    int last;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (entry->ids[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (backward) {
+        if (!complete && low == entry->count) return -1;
+        last = low;
+        first = last > max_rows ? last - max_rows : 0;
+        *more = first > 0;
+    } else {
+        if (!complete && low + max_rows >= entry->count) return -1;
+        first = low;
+        last = first + max_rows < entry->count ? first + max_rows : entry->count;
+        *more = last < entry->count;
+    }
+
+    int count = 0;
+    for (int i = first; i < last; i++) {
+        int slot = cached_patient_slot(entry->ids[i]);
+        if (slot < 0) return -1;
+        rows[count++] = patients[slot];
+    }
+    return count;
+}
+
+/*
+ * Keyset pagination: fills rows with up to max_rows active patients whose
+ * name contains search (everyone when it is empty), in ID order, starting
+ * after from_id, or ending just before it when backward. *more tells
+ * whether further matches lie beyond the page in that direction.
+ */
+int find_patients_page(const char *search, int from_id, int backward,
+                       Patient *rows, int max_rows, int *more) {
+    char key[TEXT_PATTERN_LEN];
+    TextPattern pattern;
+    int count = 0;
+
+    if (search[0]) {
+        count = cached_patients_page(name_search_ids(search), from_id, backward, rows, max_rows, more);
+        if (count >= 0) return count;
+        count = 0;
+    }
+
+    normalize_query(search, key);
+    text_pattern_init(&pattern, key);
+
+    PatientCursor cursor;
+    Patient *patient;
+    patient_cursor_seek(&cursor, from_id, backward);
+
+    *more = 0;
+    while ((patient = patient_cursor_next(&cursor))) {
+        if (!patient->is_active || !text_contains(patient->name, &pattern)) continue;
+        if (count == max_rows) {
+            *more = 1;
+            break;
+        }
+        rows[count++] = *patient;
+    }
+
+    if (backward) {
+        for (int i = 0; i < count / 2; i++) {
+            Patient swap = rows[i];
+            rows[i] = rows[count - 1 - i];
+            rows[count - 1 - i] = swap;
+        }
+    }
+    return count;
+}
+
+/*
+ * Returns matches for a phone query in patients[] index order, or in ID
+ * order from the B-tree. B-tree rows are cached so the pointers stay
+ * usable until the next lookup.
+ */
+int find_patients_by_phone(const PhoneQuery *query, Patient **results, int max_results) {
+    int found_count = 0;
+
+    if (config.storage != STORAGE_BTREE) {
+        int slots[MAX_SEARCH_RESULTS];
+        if (max_results > MAX_SEARCH_RESULTS) max_results = MAX_SEARCH_RESULTS;
+
+        ensure_patient_indexes();
+        if (query->match == PHONE_SUFFIX) {
+            char reversed[PHONE_MAX_DIGITS + 1];
+            for (int i = 0; i < query->len; i++) {
+                reversed[i] = query->digits[query->len - 1 - i];
+            }
+            found_count = phone_index_collect(&phone_suffix_index, reversed, query->len, 0,
+                                              slots, 0, max_results);
+        } else {
+            found_count = phone_index_collect(&phone_index, query->digits, query->len,
+                                              query->match == PHONE_EXACT, slots, 0, max_results);
+        }
+        for (int i = 0; i < found_count; i++) {
+            results[i] = &patients[slots[i]];
+        }
+        return found_count;
+    }
+
+    PatientCursor cursor;
+    Patient *patient;
+    patient_cursor_open(&cursor);
+    while (found_count < max_results && (patient = patient_cursor_next(&cursor))) {
+        if (patient->is_active && phone_matches(patient->phone, query)) {
+            results[found_count++] = &patients[cache_patient(patient)];
+        }
+    }
+    return found_count;
+}
+
+int same_name_and_guardian(const Patient *patient, const char *name, const char *guardian) {
+    return text_equals(patient->name, name) && text_equals(patient->guardian, guardian);
+}
+
+int is_duplicate_patient(const char *name, const char *guardian, uint64_t phone) {
+    if (!phone) return 0;
+
+    /* Only the patients sharing the number need a name comparison. */
+    if (config.storage != STORAGE_BTREE) {
+        ensure_patient_indexes();
+        for (int at = sorted_lower_bound(&phone_index, phone);
+             at < phone_index.count && phone_index.keys[at] == phone; at++) {
+            Patient *patient = &patients[phone_index.slots[at]];
+            if (patient->is_active && same_name_and_guardian(patient, name, guardian)) {
+                return patient->id;
+            }
+        }
+        return 0;
+    }
+
+    PatientCursor cursor;
+    Patient *patient;
+    patient_cursor_open(&cursor);
+
+    while ((patient = patient_cursor_next(&cursor))) {
+        if (patient->is_active && patient->phone == phone &&
+            same_name_and_guardian(patient, name, guardian)) {
+            return patient->id;
+        }
+    }
+    return 0;
+}
+
+
+/* ===================== ARCHIVE TIER ===================== */
+
+/*
+ * Inactive and aged-out records move to append-only segment files
+ * (archive_0001.seg, ...) as LZ-compressed blocks of all-text records.
+ * archive.idx lists every block ("B|segment|offset|first_id|last_id|count")
+ * and every restore ("R|id"); a restore hides older copies of that ID.
+ */
+typedef struct {
+    int is_restore;
+    int segment;
+    uint64_t offset;
+    int first_id;
+    int last_id;
+    int count;
+} ArchiveEntry;
+
+typedef struct {
+    ArchiveEntry *entries;
+    int count;
+    int capacity;
+    int loaded;
+    int segment;
+} ArchiveIndex;
+
+ArchiveIndex archive_index = {0};
+
+int lz_write_length(unsigned char *dst, int pos, int cap, int length) {
+    while (length >= 255) {
+        if (pos >= cap) return -1;
+        dst[pos++] = 255;
+        length -= 255;
+    }
+    if (pos >= cap) return -1;
+    dst[pos++] = (unsigned char)length;
+    return pos;
+}
+
+/*
+ * LZ4-style compressor: each sequence is a token (literal length, match
+ * length - 4), the literals, and a 16-bit back offset. The final sequence
+ * carries literals only. Returns the compressed size or -1 if dst is full.
+ */
+int lz_compress(const unsigned char *src, int src_len, unsigned char *dst, int dst_cap) {
+    int table[LZ_HASH_SIZE];
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+
+    for (int i = 0; i < LZ_HASH_SIZE; i++) table[i] = -1;
+
+    while (ip + LZ_MIN_MATCH + 5 <= src_len) {
+        uint32_t seq = get_u32(src + ip);
+        int h = (int)((seq * 2654435761u) >> (32 - LZ_HASH_BITS));
+        int ref = table[h];
+        table[h] = ip;
+
+        if (ref < 0 || ip - ref > 65535 || get_u32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        int match_len = LZ_MIN_MATCH;
+        while (ip + match_len < src_len - 5 && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+
+        int lit_len = ip - anchor;
+        int m = match_len - LZ_MIN_MATCH;
+        if (op >= dst_cap) return -1;
+        int token_pos = op++;
+        dst[token_pos] = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (m < 15 ? m : 15));
+
+        if (lit_len >= 15 && (op = lz_write_length(dst, op, dst_cap, lit_len - 15)) < 0) return -1;
+        if (op + lit_len + 2 > dst_cap) return -1;
+        memcpy(dst + op, src + anchor, lit_len);
+        op += lit_len;
+        dst[op++] = (unsigned char)(ip - ref);
+        dst[op++] = (unsigned char)((ip - ref) >> 8);
+        if (m >= 15 && (op = lz_write_length(dst, op, dst_cap, m - 15)) < 0) return -1;
+
+        ip += match_len;
+        anchor = ip;
+    }
+
+    int lit_len = src_len - anchor;
+    if (op >= dst_cap) return -1;
+    dst[op++] = (unsigned char)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15 && (op = lz_write_length(dst, op, dst_cap, lit_len - 15)) < 0) return -1;
+    if (op + lit_len > dst_cap) return -1;
+    memcpy(dst + op, src + anchor, lit_len);
+    return op + lit_len;
+}
+
+/* Returns the decompressed size, or -1 if src is malformed or dst too small. */
+int lz_decompress(const unsigned char *src, int src_len, unsigned char *dst, int dst_cap) {
+    int ip = 0;
+    int op = 0;
+
+    while (ip < src_len) {
+        int token = src[ip++];
+        int lit_len = token >> 4;
+
+        if (lit_len == 15) {
+            int b;
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+
+        if (ip + lit_len > src_len || op + lit_len > dst_cap) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip >= src_len) break;
+        if (ip + 2 > src_len) return -1;
+
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+
+        if ((token & 15) == 15) {
+            int b;
+            do {
+                if (ip >= src_len) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+
+        if (offset == 0 || offset > op || op + match_len > dst_cap) return -1;
+        for (int i = 0; i < match_len; i++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    return op;
+}
+
+void archive_segment_path(int segment, char *path, int size) {
+    char name[32];
+    snprintf(name, sizeof(name), "archive_%04d.seg", segment);
+    snprintf(path, size, "%s", branch_file(name));
+}
+
+int archive_add_entry(const ArchiveEntry *entry) {
+    ArchiveIndex *index = &archive_index;
+
+    if (index->count >= index->capacity) {
+        int new_capacity = index->capacity ? index->capacity * 2 : 64;
+        ArchiveEntry *grown = realloc(index->entries, new_capacity * sizeof(ArchiveEntry));
+        if (!grown) {
+            return 0;
+        }
+        index->entries = grown;
+        index->capacity = new_capacity;
+    }
+
+    index->entries[index->count++] = *entry;
+    if (entry->segment > index->segment) {
+        index->segment = entry->segment;
+    }
+    return 1;
+}
+
+void load_archive_index() {
+    ArchiveIndex *index = &archive_index;
+    char line[128];
+
+    if (index->loaded) {
+        return;
+    }
+    index->loaded = 1;
+    index->count = 0;
+    index->segment = 1;
+
+    FILE *file = fopen(branch_file("archive.idx"), "r");
+    if (!file) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        ArchiveEntry entry = {0};
+        unsigned long long offset;
+
+        if (sscanf(line, "B|%d|%llu|%d|%d|%d", &entry.segment, &offset,
+                   &entry.first_id, &entry.last_id, &entry.count) == 5) {
+            entry.offset = offset;
+            archive_add_entry(&entry);
+        } else if (sscanf(line, "R|%d", &entry.first_id) == 1) {
+            entry.is_restore = 1;
+            entry.last_id = entry.first_id;
+            archive_add_entry(&entry);
+        }
+    }
+
+    fclose(file);
+}
+
+/*
+ * Archived records leave patients.txt, so the IDs read from it can be
+ * below the highest archived one. Called after the store is loaded so a
+ * new patient never takes the ID of a record that may be restored later.
+ */
+void reserve_archived_ids() {
+    load_archive_index();
+
+    for (int i = 0; i < archive_index.count; i++) {
+        ArchiveEntry *entry = &archive_index.entries[i];
+        if (!entry->is_restore && entry->last_id >= next_patient_id) {
+            next_patient_id = entry->last_id + 1;
+        }
+    }
+}
+
+/* Reads and decompresses one block; returns its raw size or -1. */
+int archive_read_block(const ArchiveEntry *entry, unsigned char *raw, int raw_cap) {
+    char path[64];
+    unsigned char header[ARCHIVE_BLOCK_HEADER];
+    unsigned char *compressed;
+    int raw_len = -1;
+
+    archive_segment_path(entry->segment, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    if (file_seek(file, entry->offset, SEEK_SET) &&
+        fread(header, 1, sizeof(header), file) == sizeof(header) &&
+        memcmp(header, "PRAB", 4) == 0) {
+        int expected = (int)get_u32(header + 4);
+        int compressed_len = (int)get_u32(header + 8);
+
+        compressed = malloc(compressed_len);
+        if (compressed && expected <= raw_cap &&
+            fread(compressed, 1, compressed_len, file) == (size_t)compressed_len) {
+            raw_len = lz_decompress(compressed, compressed_len, raw, raw_cap);
+            if (raw_len != expected) raw_len = -1;
+        }
+        free(compressed);
+    }
+
+    fclose(file);
+    return raw_len;
+}
+
+/* Finds the newest archived copy of patient_id; returns 1 and fills out. */
+int archive_find(int patient_id, Patient *out) {
+    static unsigned char raw[ARCHIVE_BLOCK_SIZE + 1024];
+
+    load_archive_index();
+
+    for (int i = archive_index.count - 1; i >= 0; i--) {
+        ArchiveEntry *entry = &archive_index.entries[i];
+        if (patient_id < entry->first_id || patient_id > entry->last_id) continue;
+        if (entry->is_restore) return 0;
+
+        int raw_len = archive_read_block(entry, raw, sizeof(raw) - 1);
+        if (raw_len < 0) continue;
+        raw[raw_len] = '\0';
+
+        for (char *line = (char *)raw; *line; ) {
+            char *end = strchr(line, '\n');
+            if (end) *end = '\0';
+            if (atoi(line) == patient_id && parse_text_patient(line, out)) {
+                return 1;
+            }
+            if (!end) break;
+            line = end + 1;
+        }
+    }
+
+    return 0;
+}
+
+int archive_write_block(FILE *segment_file, int segment, const unsigned char *raw, int raw_len,
+                        int first_id, int last_id, int count, FILE *index_file) {
+    static unsigned char compressed[ARCHIVE_BLOCK_SIZE + ARCHIVE_BLOCK_SIZE / 8 + 1024];
+    unsigned char header[ARCHIVE_BLOCK_HEADER];
+    ArchiveEntry entry = {0};
+
+    int compressed_len = lz_compress(raw, raw_len, compressed, sizeof(compressed));
+    if (compressed_len < 0) {
+        return 0;
+    }
+
+    entry.segment = segment;
+    entry.offset = file_size(segment_file);
+    entry.first_id = first_id;
+    entry.last_id = last_id;
+    entry.count = count;
+
+    memcpy(header, "PRAB", 4);
+    put_u32(header + 4, (uint32_t)raw_len);
+    put_u32(header + 8, (uint32_t)compressed_len);
+
+    if (fwrite(header, 1, sizeof(header), segment_file) != sizeof(header) ||
+        fwrite(compressed, 1, compressed_len, segment_file) != (size_t)compressed_len ||
+        fflush(segment_file) != 0) {
+        return 0;
+    }
+
+    fprintf(index_file, "B|%d|%llu|%d|%d|%d\n", entry.segment, (unsigned long long)entry.offset,
+            entry.first_id, entry.last_id, entry.count);
+    return archive_add_entry(&entry);
+}
+
+/*
+ * Moves inactive records and records registered before cutoff_date
+ * (YYYY-MM-DD) to the archive. Returns the number archived, or -1.
+ */
+int archive_patients(const char *cutoff_date) {
+    static unsigned char raw[ARCHIVE_BLOCK_SIZE + 1024];
+    char path[64];
+    int raw_len = 0;
+    int block_count = 0;
+    int first_id = 0;
+    int last_id = 0;
+    int archived = 0;
+
+    if (config.storage == STORAGE_BTREE || config.encryption) {
+        return -1;
+    }
+    materialize_all_patients();
+
+    load_archive_index();
+
+    archive_segment_path(archive_index.segment, path, sizeof(path));
+    FILE *segment_file = fopen(path, "ab");
+    FILE *index_file = fopen(branch_file("archive.idx"), "a");
+    if (!segment_file || !index_file) {
+        if (segment_file) fclose(segment_file);
+        if (index_file) fclose(index_file);
+        return -1;
+    }
+
+    char *moved = calloc(patient_count ? patient_count : 1, 1);
+    if (!moved) {
+        fclose(segment_file);
+        fclose(index_file);
+        return -1;
+    }
+
+    for (int i = 0; i <= patient_count; i++) {
+        int flush = i == patient_count ? block_count > 0 : raw_len >= ARCHIVE_BLOCK_SIZE;
+
+        if (flush) {
+            if (!archive_write_block(segment_file, archive_index.segment, raw, raw_len,
+                                     first_id, last_id, block_count, index_file)) {
+                archived = -1;
+                break;
+            }
+            archived += block_count;
+            raw_len = 0;
+            block_count = 0;
+
+            if (file_tell(segment_file) >= ARCHIVE_SEGMENT_SIZE) {
+                fclose(segment_file);
+                archive_index.segment++;
+                archive_segment_path(archive_index.segment, path, sizeof(path));
+                segment_file = fopen(path, "ab");
+                if (!segment_file) {
+                    archived = -1;
+                    break;
+                }
+            }
+        }
+
+        if (i == patient_count) break;
+
+        Patient *patient = &patients[i];
+        if (patient->is_active && strcmp(patient->registration_date, cutoff_date) >= 0) {
+            continue;
+        }
+
+        if (block_count == 0 || patient->id < first_id) first_id = patient->id;
+        if (block_count == 0 || patient->id > last_id) last_id = patient->id;
+        raw_len += format_patient_text(patient, (char *)raw + raw_len, (int)sizeof(raw) - raw_len);
+        block_count++;
+        moved[i] = 1;
+    }
+
+    if (segment_file) fclose(segment_file);
+    fclose(index_file);
+
+    if (archived > 0) {
+        int kept = 0;
+        for (int i = 0; i < patient_count; i++) {
+            if (moved[i]) {
+                bitmap_index_update(&patients[i], NULL);
+                replicate_removal(patients[i].id);
+                /* Deleted records were published when they were deleted. */
+                if (patients[i].is_active) {
+                    publish_change(CHANGE_DELETE, &patients[i], NULL);
+                }
+            } else {
+                patients[kept++] = patients[i];
+            }
+        }
+        patient_count = kept;
+        id_order_count = 0;
+        note_rows_changed();
+        rebuild_patient_indexes();
+        if (!save_patients()) archived = -1;
+    }
+
+    free(moved);
+    return archived;
+}
+
+/* Brings an archived record back into the active set; 1 on success. */
+int restore_archived_patient(int patient_id) {
+    Patient patient;
+
+    if (config.storage == STORAGE_BTREE || patient_count >= MAX_PATIENTS) {
+        return 0;
+    }
+
+    for (int i = 0; i < patient_count; i++) {
+        if (patients[i].id == patient_id) {
+            return 0;
+        }
+    }
+
+    if (!archive_find(patient_id, &patient)) {
+        return 0;
+    }
+
+    FILE *index_file = fopen(branch_file("archive.idx"), "a");
+    if (!index_file) {
+        return 0;
+    }
+    fprintf(index_file, "R|%d\n", patient_id);
+    fclose(index_file);
+
+    ArchiveEntry entry = {0};
+    entry.is_restore = 1;
+    entry.first_id = patient_id;
+    entry.last_id = patient_id;
+    archive_add_entry(&entry);
+
+    patient.is_active = 1;
+    patients[patient_count] = patient;
+    patient_count++;
+    if (patient.id >= next_patient_id) {
+        next_patient_id = patient.id + 1;
+    }
+
+    if (patient_indexes_built) {
+        index_patient_name(patient_count - 1);
+        phonetic_index_add(patient_count - 1);
+        phone_index_add(patient_count - 1);
+        autocomplete_track(&patients[patient_count - 1], 1);
+    }
+    note_rows_changed();
+    bitmap_index_update(NULL, &patients[patient_count - 1]);
+    if (!save_patients()) {
+        return 0;
+    }
+    replicate_patient(&patients[patient_count - 1]);
+    publish_change(CHANGE_INSERT, NULL, &patients[patient_count - 1]);
+    return 1;
+}
+
+/* ===================== BRANCHES ===================== */
+
+/*
+ * One process can serve several branches. The open branch lives in the
+ * usual globals. Up to open_branches - 1 others stay parked in memory with
+ * their records and indexes, so switching back to one is a copy. When room
+ * is needed, the least recently used parked branch is flushed and closed;
+ * it is loaded from its files again on next use.
+ */
+#define BRANCH_STATE(X) \
+    X(Patient,       patients,              [MAX_PATIENTS]) \
+    X(int,           patient_count,         ) \
+    X(int,           next_patient_id,       ) \
+    X(Dictionary,    gender_dict,           ) \
+    X(Dictionary,    blood_group_dict,      ) \
+    X(Dictionary,    address_dict,          ) \
+    X(Dictionary,    disease_dict,          ) \
+    X(Dictionary,    doctor_dict,           ) \
+    X(SortedKeys,    phone_index,           ) \
+    X(SortedKeys,    phone_suffix_index,    ) \
+    X(BkTree,        name_index,            ) \
+    X(PhoneticIndex, phonetic_index,        ) \
+    X(RadixTrie,     name_trie,             ) \
+    X(RadixTrie,     doctor_trie,           ) \
+    X(RadixTrie,     address_trie,          ) \
+    X(LazyLoad,      lazy,                  ) \
+    X(int,           patient_indexes_built, ) \
+    X(int,           patients_damaged,      ) \
+    X(StoreCheck,    patients_check,        ) \
+    X(Journal,       journal,               ) \
+    X(BTreeStore,    btree_store,           ) \
+    X(int,           btree_cache_slot,      ) \
+    X(SlotStore,     slot_store,            ) \
+    X(int,           id_order,              [MAX_PATIENTS]) \
+    X(int,           id_order_count,        ) \
+    X(Replica,       replica,               ) \
+    X(ArchiveIndex,  archive_index,         ) \
+    X(QueryCache,    query_cache,           ) \
+    X(BitmapIndex,   bitmap_index,          ) \
+    X(ChangeFeed,    change_feed,           )
+
+#define BRANCH_MEMBER(type, name, dims) type name dims;
+#define BRANCH_PARK(type, name, dims) memcpy(&state->name, &name, sizeof(name));
+#define BRANCH_UNPARK(type, name, dims) memcpy(&name, &state->name, sizeof(name));
+#define BRANCH_RESET(type, name, dims) memset(&name, 0, sizeof(name));
+
+typedef struct {
+    BRANCH_STATE(BRANCH_MEMBER)
+} BranchState;
+
+typedef struct {
+    char name[BRANCH_NAME_LEN];
+    BranchState *state;    /* NULL while this is the open branch */
+    long long last_used_ms;
+    int pinned;
+} OpenBranch;
+
+OpenBranch open_branches[MAX_OPEN_BRANCHES];
+int open_branch_count = 0;
+
+/* Every branch in branches.txt, with the main branch first. */
+char branch_names[MAX_BRANCHES][BRANCH_NAME_LEN];
+int branch_count = 0;
+
+int valid_branch_name(const char *name) {
+    int len = (int)strlen(name);
+    if (len == 0 || len >= BRANCH_NAME_LEN) return 0;
+    for (int i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') return 0;
+    }
+    return 1;
+}
+
+int find_branch(const char *name) {
+    for (int i = 0; i < branch_count; i++) {
+        if (strcmp(branch_names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+void load_branches() {
+    char line[64];
+
+    strcpy(branch_names[0], MAIN_BRANCH);
+    branch_count = 1;
+
+    FILE *file = fopen("branches.txt", "r");
+    if (!file) {
+        return;
+    }
+    while (fgets(line, sizeof(line), file) && branch_count < MAX_BRANCHES) {
+        trim(line);
+        if (valid_branch_name(line) && find_branch(line) < 0) {
+            strcpy(branch_names[branch_count++], line);
+        }
+    }
+    fclose(file);
+}
+
+int make_directory(const char *path) {
+#ifdef _WIN32
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+int create_branch(const char *name) {
+    char path[BRANCH_PATH_LEN];
+
+    if (!valid_branch_name(name) || find_branch(name) >= 0 || branch_count >= MAX_BRANCHES) {
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "branches/%s", name);
+    if (!make_directory("branches") || !make_directory(path)) {
+        return 0;
+    }
+
+    FILE *file = fopen("branches.txt", "a");
+    if (!file) {
+        return 0;
+    }
+    fprintf(file, "%s\n", name);
+    if (fclose(file) != 0) {
+        return 0;
+    }
+
+    strcpy(branch_names[branch_count++], name);
+    return 1;
+}
+
+int find_open_branch(const char *name) {
+    if (open_branch_count == 0) {
+        strcpy(open_branches[0].name, current_branch);
+        open_branches[0].state = NULL;
+        open_branch_count = 1;
+    }
+    for (int i = 0; i < open_branch_count; i++) {
+        if (strcmp(open_branches[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Flushes the open branch and frees everything it holds. */
+void close_branch_store() {
+    Dictionary *dicts[] = {&gender_dict, &blood_group_dict, &address_dict, &disease_dict, &doctor_dict};
+    RadixTrie *tries[] = {&name_trie, &doctor_trie, &address_trie};
+    BufferPool *pool = &btree_store.pool;
+
+    flush_patients();
+    io_flush();
+
+    if (journal.file) fclose(journal.file);
+    if (pool->file) fclose(pool->file);
+    if (btree_store.heap) fclose(btree_store.heap);
+    for (int i = 0; pool->frames && i < pool->frame_count; i++) {
+        free(pool->frames[i].data);
+    }
+    free(pool->frames);
+    if (slot_store.file) fclose(slot_store.file);
+    if (slot_store.overflow) fclose(slot_store.overflow);
+    lazy_finish();
+    if (replica.log) fclose(replica.log);
+    if (change_feed.file) fclose(change_feed.file);
+
+    for (int d = 0; d < 5; d++) {
+        dict_clear(dicts[d]);
+        free(dicts[d]->values);
+        free(dicts[d]->slots);
+    }
+    for (int t = 0; t < 3; t++) {
+        for (int i = 0; i < tries[t]->count; i++) {
+            free(tries[t]->nodes[i].label);
+            free(tries[t]->nodes[i].display);
+        }
+        free(tries[t]->nodes);
+    }
+    free(name_index.nodes);
+    free(phonetic_index.entries);
+    free(phone_index.keys);
+    free(phone_index.slots);
+    free(phone_suffix_index.keys);
+    free(phone_suffix_index.slots);
+    free(archive_index.entries);
+    bitmap_index_free();
+
+    BRANCH_STATE(BRANCH_RESET)
+    store_check_start(&patients_check);
+    next_patient_id = 1;
+}
+
+/* Closes the least recently used parked branch. */
+void evict_branch() {
+    int victim = -1;
+
+    for (int pass = 0; pass < 2 && victim < 0; pass++) {
+        for (int i = 0; i < open_branch_count; i++) {
+            OpenBranch *branch = &open_branches[i];
+            if (!branch->state || (pass == 0 && branch->pinned)) continue;
+            if (victim < 0 || branch->last_used_ms < open_branches[victim].last_used_ms) victim = i;
+        }
+    }
+    if (victim < 0) {
+        return;
+    }
+
+    BranchState *state = open_branches[victim].state;
+    BRANCH_STATE(BRANCH_UNPARK)
+    free(state);
+    strcpy(current_branch, open_branches[victim].name);
+    close_branch_store();
+    open_branches[victim] = open_branches[--open_branch_count];
+}
+
+/*
+ * Makes name the open branch: parks the current one, then unparks name or
+ * loads it from its files, closing the least recently used branch if the
+ * cache is full.
+ */
+int switch_branch(const char *name) {
+    if (strcmp(name, current_branch) == 0) {
+        return 1;
+    }
+    if (find_branch(name) < 0) {
+        return 0;
+    }
+
+    BranchState *state = malloc(sizeof(BranchState));
+    if (!state) {
+        return 0;
+    }
+    int active = find_open_branch(current_branch);
+    BRANCH_STATE(BRANCH_PARK)
+    open_branches[active].state = state;
+    open_branches[active].last_used_ms = monotonic_ms();
+
+    int target = find_open_branch(name);
+    if (target >= 0) {
+        state = open_branches[target].state;
+        BRANCH_STATE(BRANCH_UNPARK)
+        free(state);
+        open_branches[target].state = NULL;
+        open_branches[target].last_used_ms = monotonic_ms();
+        strcpy(current_branch, name);
+        return 1;
+    }
+
+    if (open_branch_count >= config.open_branches) {
+        evict_branch();
+    }
+    BRANCH_STATE(BRANCH_RESET)
+    store_check_start(&patients_check);
+    next_patient_id = 1;
+
+    OpenBranch *branch = &open_branches[open_branch_count++];
+    strcpy(branch->name, name);
+    branch->state = NULL;
+    branch->last_used_ms = monotonic_ms();
+    branch->pinned = 0;
+
+    strcpy(current_branch, name);
+    load_patients();
+    reserve_archived_ids();
+    replica_start();
+    return 1;
+}
+
+/* Flushes every parked branch; the open one is flushed by the caller. */
+void flush_parked_branches() {
+    char home[BRANCH_NAME_LEN];
+
+    strcpy(home, current_branch);
+    for (int i = 0; i < open_branch_count; i++) {
+        if (open_branches[i].state) {
+            switch_branch(open_branches[i].name);
+            flush_patients();
+        }
+    }
+    switch_branch(home);
+}
+
+/*
+ * Failover: applies what the log of every branch still holds, then turns
+ * this standby into the primary, in config.txt as well. A branch that
+ * cannot apply its log stops the promotion before anything changes. The
+ * old primary must be stopped first.
+ */
+int replica_promote() {
+    char home[BRANCH_NAME_LEN];
+    int ok = config.replica_role == REPLICA_STANDBY;
+
+    strcpy(home, current_branch);
+    for (int i = 0; ok && i < branch_count; i++) {
+        ok = switch_branch(branch_names[i]) && replica_catch_up() >= 0 && flush_patients();
+        if (!ok) {
+            printf(COLOR_RED "\nBranch %s cannot apply all of its log.\n" COLOR_RESET, branch_names[i]);
+        }
+    }
+
+    if (ok && save_config_value("replica_role", "primary")) {
+        config.replica_role = REPLICA_PRIMARY;
+        for (int i = 0; i < branch_count; i++) {
+            if (!switch_branch(branch_names[i]) || !replica_become_primary()) ok = 0;
+        }
+    } else {
+        ok = 0;
+    }
+
+    switch_branch(home);
+    return ok;
+}
+
+/* Dictionary codes only mean something inside their own branch, so a
+ * match is kept in the all-text record format. */
+typedef struct {
+    char branch[BRANCH_NAME_LEN];
+    char record[BTREE_MAX_RECORD];
+} BranchMatch;
+
+/*
+ * Looks a patient ID up in every branch. Branches already in memory are
+ * searched first; the others are opened through the cache, which keeps
+ * the caller's branch and reopens it at the end.
+ */
+int find_patient_in_branches(int patient_id, BranchMatch *matches, int max_matches) {
+    char home[BRANCH_NAME_LEN];
+    char order[MAX_BRANCHES][BRANCH_NAME_LEN];
+    int order_count = 0;
+    int found = 0;
+
+    strcpy(home, current_branch);
+    open_branches[find_open_branch(home)].pinned = 1;
+    strcpy(order[order_count++], home);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < branch_count; i++) {
+            int is_open = find_open_branch(branch_names[i]) >= 0;
+            if (strcmp(branch_names[i], home) != 0 && is_open == (pass == 0)) {
+                strcpy(order[order_count++], branch_names[i]);
+            }
+        }
+    }
+
+    for (int i = 0; i < order_count && found < max_matches; i++) {
+        if (!switch_branch(order[i])) continue;
+
+        Patient *patient = find_patient_by_id(patient_id);
+        if (patient) {
+            strcpy(matches[found].branch, order[i]);
+            format_patient_text(patient, matches[found].record, sizeof(matches[found].record));
+            found++;
+        }
+    }
+
+    switch_branch(home);
+    for (int i = 0; i < open_branch_count; i++) {
+        open_branches[i].pinned = 0;
+    }
+    return found;
+}
+
+/* ===================== EXPORT ===================== */
+
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_NDJSON
+} ExportFormat;
+
+#define EXPORT_FIELD_NAME(tag, member, kind, size, dict, label, column, min, max) column,
+
+const char *export_field_names[FIELD_COUNT] = {
+    PATIENT_FIELDS(EXPORT_FIELD_NAME)
+};
+
+/*
+ * Dictionary filters hold codes; -1 matches any value and FILTER_NO_CODE a
+ * value no record in memory has. The typed values are kept because archived
+ * and B+tree records add theirs to the dictionaries only as they are read,
+ * so such a filter is matched on the value.
+ */
+#define FILTER_NO_CODE -2
+
+typedef struct {
+    int include_deleted;
+    int include_archived;
+    int gender;
+    int blood_group;
+    int disease;
+    int referred_doctor;
+    int min_age;
+    int max_age;
+    char registered_from[20];
+    char registered_to[20];
+    char gender_value[MAX_ADDRESS_LEN];
+    char blood_group_value[MAX_ADDRESS_LEN];
+    char disease_value[MAX_ADDRESS_LEN];
+    char doctor_value[MAX_ADDRESS_LEN];
+} ExportFilter;
+
+typedef struct {
+    FILE *file;
+    char *buffer;
+    size_t used;
+    size_t capacity;
+    int failed;
+} OutputBuffer;
+
+void out_flush(OutputBuffer *out) {
+    if (out->used > 0 && !out->failed &&
+        fwrite(out->buffer, 1, out->used, out->file) != out->used) {
+        out->failed = 1;
+    }
+    out->used = 0;
+}
+
+/* A buffer with no file collects in memory and grows instead of flushing. */
+int out_grow(OutputBuffer *out, size_t len) {
+    size_t capacity = out->capacity ? out->capacity : 4096;
+    while (capacity < out->used + len) capacity *= 2;
+
+    char *buffer = realloc(out->buffer, capacity);
+    if (!buffer) {
+        out->failed = 1;
+        return 0;
+    }
+    out->buffer = buffer;
+    out->capacity = capacity;
+    return 1;
+}
+
+void out_write(OutputBuffer *out, const char *data, size_t len) {
+    if (out->used + len > out->capacity) {
+        if (!out->file) {
+            if (!out_grow(out, len)) return;
+        } else {
+            out_flush(out);
+            if (len > out->capacity) {
+                if (!out->failed && fwrite(data, 1, len, out->file) != len) out->failed = 1;
+                return;
+            }
+        }
+    }
+    memcpy(out->buffer + out->used, data, len);
+    out->used += len;
+}
+
+void out_char(OutputBuffer *out, char c) {
+    if (out->used == out->capacity) {
+        if (!out->file) {
+            if (!out_grow(out, 1)) return;
+        } else {
+            out_flush(out);
+        }
+    }
+    out->buffer[out->used++] = c;
+}
+
+void out_int(OutputBuffer *out, int value) {
+    char digits[12];
+    int len = 0;
+    unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+    do {
+        digits[len++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    if (value < 0) out_char(out, '-');
+    while (len > 0) out_char(out, digits[--len]);
+}
+
+/* RFC 4180: quote only when the value holds a comma, quote or line break. */
+void out_csv_string(OutputBuffer *out, const char *str) {
+    size_t len = strlen(str);
+
+    if (strcspn(str, ",\"\r\n") == len) {
+        out_write(out, str, len);
+        return;
+    }
+
+    out_char(out, '"');
+    for (const char *p = str; *p; p++) {
+        if (*p == '"') out_char(out, '"');
+        out_char(out, *p);
+    }
+    out_char(out, '"');
+}
+
+void out_json_string(OutputBuffer *out, const char *str) {
+    static const char hex[] = "0123456789abcdef";
+    const char *run = str;
+
+    out_char(out, '"');
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        out_write(out, run, p - run);
+        run = p + 1;
+        out_char(out, '\\');
+        switch (c) {
+            case '"': out_char(out, '"'); break;
+            case '\\': out_char(out, '\\'); break;
+            case '\n': out_char(out, 'n'); break;
+            case '\r': out_char(out, 'r'); break;
+            case '\t': out_char(out, 't'); break;
+            default:
+                out_write(out, "u00", 3);
+                out_char(out, hex[c >> 4]);
+                out_char(out, hex[c & 15]);
+                break;
+        }
+    }
+    out_write(out, run, strlen(run));
+    out_char(out, '"');
+}
+
+/* A FILTER_NO_CODE value may have been added since by a record read later. */
+int filter_code_matches(int filter_code, const char *value, const Dictionary *dict, int code) {
+    if (filter_code == -1) return 1;
+    if (filter_code == FILTER_NO_CODE) return strcmp(dict_value(dict, code), value) == 0;
+    return code == filter_code;
+}
+
+int export_matches(const Patient *patient, const ExportFilter *filter) {
+    if (!patient->is_active && !filter->include_deleted) return 0;
+    if (!filter_code_matches(filter->gender, filter->gender_value, &gender_dict, patient->gender)) return 0;
+    if (!filter_code_matches(filter->blood_group, filter->blood_group_value, &blood_group_dict,
+                             patient->blood_group)) {
+        return 0;
+    }
+    if (!filter_code_matches(filter->disease, filter->disease_value, &disease_dict, patient->disease)) return 0;
+    if (!filter_code_matches(filter->referred_doctor, filter->doctor_value, &doctor_dict,
+                             patient->referred_doctor)) {
+        return 0;
+    }
+    if (filter->min_age > 0 && patient->age < filter->min_age) return 0;
+    if (filter->max_age > 0 && patient->age > filter->max_age) return 0;
+    if (filter->registered_from[0] && strcmp(patient->registration_date, filter->registered_from) < 0) return 0;
+    if (filter->registered_to[0] && strcmp(patient->registration_date, filter->registered_to) > 0) return 0;
+    return 1;
+}
+
+/* Exports give phones in international form. */
+#define EXPORT_INT(member, dict) number = patient->member;
+#define EXPORT_FLAG EXPORT_INT
+#define EXPORT_TEXT(member, dict) text = patient->member;
+#define EXPORT_CODE(member, dict) text = dict_value(&dict, patient->member);
+#define EXPORT_PHONE(member, dict) \
+    format_phone(patient->member, phone, sizeof(phone), 1); \
+    text = phone;
+#define EXPORT_CASE(tag, member, kind, size, dict, label, column, min, max) \
+    case tag: EXPORT_##kind(member, dict) break;
+
+void export_field(OutputBuffer *out, ExportFormat format, const Patient *patient, int field) {
+    char phone[PHONE_TEXT_LEN];
+    const char *text = NULL;
+    int number = 0;
+
+    switch (field) {
+        PATIENT_FIELDS(EXPORT_CASE)
+    }
+
+    if (!text) {
+        out_int(out, number);
+    } else if (format == EXPORT_CSV) {
+        out_csv_string(out, text);
+    } else {
+        out_json_string(out, text);
+    }
+}
+
+void export_record(OutputBuffer *out, ExportFormat format, const Patient *patient,
+                   const int *fields, int field_count) {
+    if (format == EXPORT_NDJSON) out_char(out, '{');
+
+    for (int i = 0; i < field_count; i++) {
+        if (i > 0) out_char(out, ',');
+        if (format == EXPORT_NDJSON) {
+            out_char(out, '"');
+            out_write(out, export_field_names[fields[i]], strlen(export_field_names[fields[i]]));
+            out_write(out, "\":", 2);
+        }
+        export_field(out, format, patient, fields[i]);
+    }
+
+    if (format == EXPORT_NDJSON) out_char(out, '}');
+    out_char(out, '\n');
+}
+
+/* The last restore of a restored ID, as an index into archive_index. */
+typedef struct {
+    int id;
+    int entry;
+} ArchiveRestore;
+
+int compare_archive_restores(const void *a, const void *b) {
+    const ArchiveRestore *x = a;
+    const ArchiveRestore *y = b;
+    if (x->id != y->id) return x->id < y->id ? -1 : 1;
+    return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+/* Sorts the restores by ID, keeping the last of each; NULL if there are none. */
+ArchiveRestore *collect_archive_restores(int *count) {
+    ArchiveRestore *restores = NULL;
+    int kept = 0;
+
+    *count = 0;
+    for (int e = 0; e < archive_index.count; e++) {
+        if (archive_index.entries[e].is_restore) (*count)++;
+    }
+    if (*count == 0 || !(restores = malloc(*count * sizeof(ArchiveRestore)))) {
+        *count = 0;
+        return NULL;
+    }
+
+    for (int e = 0, n = 0; e < archive_index.count; e++) {
+        if (!archive_index.entries[e].is_restore) continue;
+        restores[n].id = archive_index.entries[e].first_id;
+        restores[n++].entry = e;
+    }
+    qsort(restores, *count, sizeof(ArchiveRestore), compare_archive_restores);
+    for (int i = 0; i < *count; i++) {
+        if (i + 1 < *count && restores[i + 1].id == restores[i].id) continue;
+        restores[kept++] = restores[i];
+    }
+    *count = kept;
+    return restores;
+}
+
+/* An archived copy is skipped if the record was restored or is still hot. */
+int archived_copy_is_current(int patient_id, int entry_index,
+                             const ArchiveRestore *restores, int restore_count) {
+    ArchiveRestore key = {patient_id, 0};
+    const ArchiveRestore *restore = restore_count > 0
+        ? bsearch(&key, restores, restore_count, sizeof(ArchiveRestore), compare_archive_restores)
+        : NULL;
+
+    if (restore && restore->entry > entry_index) {
+        return 0;
+    }
+    if (config.storage == STORAGE_BTREE) {
+        Patient patient;
+        return !btree_get(patient_id, &patient);
+    }
+    return patient_slot_by_id(patient_id) < 0;
+}
+
+/* Gives a filter value unknown when the export started the code a record
+ * read since has added for it. */
+void resolve_filter_code(int *code, const Dictionary *dict, const char *value) {
+    if (*code == FILTER_NO_CODE) {
+        int found = dict_lookup(dict, value);
+        if (found >= 0) *code = found;
+    }
+}
+
+int export_archived(OutputBuffer *out, ExportFormat format, const ExportFilter *filter,
+                    const int *fields, int field_count) {
+    static unsigned char raw[ARCHIVE_BLOCK_SIZE + 1024];
+    int exported = 0;
+    int restore_count;
+
+    load_archive_index();
+    ArchiveRestore *restores = collect_archive_restores(&restore_count);
+
+    for (int e = 0; e < archive_index.count; e++) {
+        ArchiveEntry *entry = &archive_index.entries[e];
+        if (entry->is_restore) continue;
+
+        int raw_len = archive_read_block(entry, raw, sizeof(raw) - 1);
+        if (raw_len < 0) continue;
+        raw[raw_len] = '\0';
+
+        for (char *line = (char *)raw; *line; ) {
+            char *end = strchr(line, '\n');
+            Patient patient;
+
+            if (end) *end = '\0';
+            if (parse_text_patient(line, &patient)) {
+                if (export_matches(&patient, filter) &&
+                    archived_copy_is_current(patient.id, e, restores, restore_count)) {
+                    export_record(out, format, &patient, fields, field_count);
+                    exported++;
+                }
+            }
+            if (!end) break;
+            line = end + 1;
+        }
+    }
+
+    free(restores);
+    return exported;
+}
+
+/*
+ * Each worker formats into a chunk of EXPORT_CHUNK_SIZE bytes. It hands a
+ * chunk to the output when the chunk is half full and when the morsel ends,
+ * in morsel order, so memory stays the same however many records match.
+ */
+typedef struct {
+    ExportFormat format;
+    const ExportFilter *filter;
+    const int *fields;
+    int field_count;
+    OutputBuffer *out;
+    OutputBuffer chunks[SCAN_MAX_THREADS];
+    int counts[SCAN_MAX_THREADS];
+    MorselTurn turn;
+    const uint32_t *leaves;    /* for export_leaves */
+} ExportScan;
+
+void export_drain(ExportScan *scan, OutputBuffer *chunk, int morsel) {
+    morsel_turn_wait(&scan->turn, morsel);
+    out_write(scan->out, chunk->buffer, chunk->used);
+    chunk->used = 0;
+}
+
+void export_scan_record(ExportScan *scan, int worker, int morsel, const Patient *patient) {
+    OutputBuffer *chunk = &scan->chunks[worker];
+
+    if (export_matches(patient, scan->filter)) {
+        export_record(chunk, scan->format, patient, scan->fields, scan->field_count);
+        scan->counts[worker]++;
+        if (chunk->used >= chunk->capacity / 2) {
+            export_drain(scan, chunk, morsel);
+        }
+    }
+}
+
+void export_scan_done(ExportScan *scan, int worker, int morsel) {
+    export_drain(scan, &scan->chunks[worker], morsel);
+    morsel_turn_pass(&scan->turn);
+}
+
+/* Exports one morsel of id_order. */
+void export_morsel(void *context, int worker, int morsel, int first, int last) {
+    ExportScan *scan = context;
+
+    for (int i = first; i < last; i++) {
+        export_scan_record(scan, worker, morsel, &patients[id_order[i]]);
+    }
+    export_scan_done(scan, worker, morsel);
+}
+
+/* Exports the records of B+tree leaves [first, last). */
+void export_leaves(void *context, int worker, int morsel, int first, int last) {
+    ExportScan *scan = context;
+    BTreeRun run;
+    Patient patient;
+
+    btree_run_open(&run, scan->leaves, first, last);
+    while (btree_run_next(&run, &patient)) {
+        export_scan_record(scan, worker, morsel, &patient);
+    }
+    export_scan_done(scan, worker, morsel);
+}
+
+/* Sets up a chunk per worker; returns 0 when memory runs out. */
+int export_scan_start(ExportScan *scan, OutputBuffer *out, ExportFormat format, const ExportFilter *filter,
+                      const int *fields, int field_count) {
+    int workers = scan_worker_count();
+
+    memset(scan, 0, sizeof(*scan));
+    scan->format = format;
+    scan->filter = filter;
+    scan->fields = fields;
+    scan->field_count = field_count;
+    scan->out = out;
+    for (int w = 0; w < workers; w++) {
+        scan->chunks[w].buffer = malloc(EXPORT_CHUNK_SIZE);
+        scan->chunks[w].capacity = EXPORT_CHUNK_SIZE;
+        if (!scan->chunks[w].buffer) {
+            for (int i = 0; i < w; i++) free(scan->chunks[i].buffer);
+            return 0;
+        }
+    }
+    morsel_turn_init(&scan->turn);
+    return 1;
+}
+
+/* Returns the number of records written, or -1. */
+int export_scan_finish(ExportScan *scan) {
+    int exported = 0;
+    int failed = 0;
+
+    for (int w = 0; w < SCAN_MAX_THREADS; w++) {
+        failed |= scan->chunks[w].failed;
+        exported += scan->counts[w];
+        free(scan->chunks[w].buffer);
+    }
+    morsel_turn_free(&scan->turn);
+    return failed ? -1 : exported;
+}
+
+/* Exports the in-memory stores in ID order on the scan pool. */
+int export_memory_store(OutputBuffer *out, ExportFormat format, const ExportFilter *filter,
+                        const int *fields, int field_count) {
+    ExportScan scan;
+
+    materialize_all_patients();
+    refresh_id_order();
+    if (!export_scan_start(&scan, out, format, filter, fields, field_count)) {
+        return -1;
+    }
+    scan_records(id_order_count, id_order_count, SCAN_MORSEL_SIZE, export_morsel, &scan);
+    return export_scan_finish(&scan);
+}
+
+/* Exports the B+tree store in ID order, a leaf per morsel. */
+int export_btree_store(OutputBuffer *out, ExportFormat format, const ExportFilter *filter,
+                       const int *fields, int field_count) {
+    ExportScan scan;
+    int leaf_count;
+    uint32_t *leaves = btree_scan_start(&leaf_count);
+
+    if (!leaves) {
+        return -1;
+    }
+    if (!export_scan_start(&scan, out, format, filter, fields, field_count)) {
+        free(leaves);
+        return -1;
+    }
+    scan.leaves = leaves;
+    scan_records_shared((int)btree_store.record_count, leaf_count, 1, export_leaves, &scan);
+    free(leaves);
+    return export_scan_finish(&scan);
+}
+
+/*
+ * Narrows a filter to candidate IDs with the bitmap index. Returns 0 when
+ * the filter names nothing the bitmaps hold, or they cannot be built. A
+ * date bound can fall inside a month, so candidates still need checking.
+ */
+int export_candidates(const ExportFilter *filter, Bitmap *candidates) {
+    BitmapQuery query = {filter->include_deleted, filter->gender, filter->blood_group,
+                         filter->min_age, filter->max_age, -1, -1, 1};
+
+    if (filter->registered_from[0]) query.from_month = registration_month(filter->registered_from);
+    if (filter->registered_to[0]) query.to_month = registration_month(filter->registered_to);
+    if (query.gender == -1 && query.blood_group == -1 && query.min_age <= 0 && query.max_age <= 0 &&
+        query.from_month < 0 && query.to_month < 0) {
+        return 0;
+    }
+    /* Building the bitmaps reads every record, so it can add a filter value. */
+    if (!ensure_bitmap_index()) {
+        return 0;
+    }
+    resolve_filter_code(&query.gender, &gender_dict, filter->gender_value);
+    resolve_filter_code(&query.blood_group, &blood_group_dict, filter->blood_group_value);
+    return bitmap_query(&query, candidates);
+}
+
+/* Fetches the candidates in ID order and writes those that match. */
+int export_candidate_records(OutputBuffer *out, ExportFormat format, const ExportFilter *filter,
+                             const Bitmap *candidates, const int *fields, int field_count) {
+    long count = bitmap_cardinality(candidates);
+    int *ids = malloc((count ? count : 1) * sizeof(int));
+    int exported = 0;
+
+    if (!ids) {
+        return -1;
+    }
+    bitmap_to_ids(candidates, ids);
+
+    for (long i = 0; i < count; i++) {
+        Patient stored;
+        const Patient *patient = NULL;
+        if (config.storage == STORAGE_BTREE) {
+            if (btree_get(ids[i], &stored)) patient = &stored;
+        } else {
+            int slot = patient_slot_by_id(ids[i]);
+            if (slot >= 0) patient = patient_at(slot);
+        }
+        if (patient && export_matches(patient, filter)) {
+            export_record(out, format, patient, fields, field_count);
+            exported++;
+        }
+    }
+    free(ids);
+    return exported;
+}
+
+/*
+ * Streams matching records to path, formatting straight into one large
+ * output buffer. fields lists the projected columns in output order.
+ * Returns the number of records written, or -1 on an I/O error.
+ */
+int export_patients(const char *path, ExportFormat format, const ExportFilter *filter,
+                    const int *fields, int field_count) {
+    OutputBuffer out = {0};
+    Bitmap candidates = {0};
+    int exported = 0;
+
+    out.file = fopen(path, "wb");
+    if (!out.file) {
+        return -1;
+    }
+
+    out.capacity = EXPORT_BUFFER_SIZE;
+    out.buffer = malloc(out.capacity);
+    if (!out.buffer) {
+        fclose(out.file);
+        return -1;
+    }
+
+    if (format == EXPORT_CSV) {
+        for (int i = 0; i < field_count; i++) {
+            if (i > 0) out_char(&out, ',');
+            out_write(&out, export_field_names[fields[i]], strlen(export_field_names[fields[i]]));
+        }
+        out_char(&out, '\n');
+    }
+
+    if (export_candidates(filter, &candidates)) {
+        exported = export_candidate_records(&out, format, filter, &candidates, fields, field_count);
+        if (exported < 0) out.failed = 1;
+        bitmap_free(&candidates);
+    } else {
+        exported = config.storage == STORAGE_BTREE
+                       ? export_btree_store(&out, format, filter, fields, field_count)
+                       : export_memory_store(&out, format, filter, fields, field_count);
+        if (exported < 0) out.failed = 1;
+    }
+
+    if (filter->include_archived) {
+        exported += export_archived(&out, format, filter, fields, field_count);
+    }
+
+    out_flush(&out);
+    if (fclose(out.file) != 0) out.failed = 1;
+    free(out.buffer);
+    return out.failed ? -1 : exported;
+}
+
+/* Parses "name,phone,age" into field numbers; returns the count or -1. */
+int parse_export_fields(const char *list, int *fields) {
+    char copy[256];
+    int count = 0;
+
+    strncpy(copy, list, sizeof(copy));
+    copy[sizeof(copy) - 1] = '\0';
+
+    for (char *name = strtok(copy, ", "); name; name = strtok(NULL, ", ")) {
+        int found = -1;
+        for (int f = 0; f < FIELD_COUNT; f++) {
+            if (strcmp(export_field_names[f], name) == 0) found = f;
+        }
+        if (found == -1 || count >= FIELD_COUNT) {
+            return -1;
+        }
+        fields[count++] = found;
+    }
+
+    return count;
+}
+
+/* ===================== DUPLICATE CLUSTERING ===================== */
+
+/*
+ * Batch search for patients registered more than once. Every active record
+ * gets up to three blocking keys: the last DUPLICATE_PHONE_SUFFIX phone
+ * digits, the phonetic key of the whole name, and the guardian's phonetic
+ * key together with the first word of the name. Only records sharing a key
+ * are compared, so the work grows with the block sizes rather than N^2.
+ * Blocks larger than DUPLICATE_MAX_BLOCK are skipped and reported.
+ *
+ * Blocks are scored on the scan pool, which also reads a B+tree store a
+ * leaf per morsel. A pair sharing several keys is scored only in the block
+ * of its first shared key. Pairs at or above DUPLICATE_MIN_SCORE are joined
+ * into clusters.
+ */
+typedef enum {
+    BLOCK_PHONE,
+    BLOCK_NAME,
+    BLOCK_GUARDIAN,
+    BLOCK_KIND_COUNT
+} BlockKind;
+
+const char *block_kind_names[BLOCK_KIND_COUNT] = {"phone", "name", "guardian"};
+
+typedef struct {
+    int id;
+    int gender;
+    uint64_t phone;
+    uint64_t keys[BLOCK_KIND_COUNT];
+    char display_name[FUZZY_TOKEN_LEN];
+    char name[FUZZY_TOKEN_LEN];
+    char guardian[FUZZY_TOKEN_LEN];
+    int name_len;
+    int guardian_len;
+} DupRecord;
+
+typedef struct {
+    uint64_t key;
+    int record;
+} BlockEntry;
+
+typedef struct {
+    int start;
+    int count;
+    BlockKind kind;
+} Block;
+
+typedef struct {
+    int a;
+    int b;
+    int score;
+    int cluster;
+    BlockKind kind;
+} DupPair;
+
+typedef struct {
+    DupPair *pairs;
+    int count;
+    int capacity;
+    long long comparisons;
+    int failed;
+} PairList;
+
+/* Each worker keeps its own pair list and edit-distance scratch table. */
+typedef struct {
+    PairList pairs;
+    uint64_t peq[256];
+} DupWorker;
+
+typedef struct {
+    const DupRecord *records;
+    const BlockEntry *entries;
+    const Block *blocks;
+    DupWorker *workers;
+} DupJob;
+
+typedef struct {
+    int record_count;
+    int block_count;
+    int skipped_blocks;
+    int skipped_records;
+    int thread_count;
+    long long comparisons;
+    int pair_count;
+    int cluster_count;
+    long long elapsed_ms;
+} DupSummary;
+
+/* Lowercase letters and digits, single spaces, at most FUZZY_TOKEN_LEN - 1. */
+int simplify_name(const char *text, char *out) {
+    int len = 0;
+    for (const char *p = text; *p && len < FUZZY_TOKEN_LEN - 1; p++) {
+        if (isalnum((unsigned char)*p)) {
+            out[len++] = (char)tolower((unsigned char)*p);
+        } else if (len > 0 && out[len - 1] != ' ') {
+            out[len++] = ' ';
+        }
+    }
+    while (len > 0 && out[len - 1] == ' ') len--;
+    out[len] = '\0';
+    return len;
+}
+
+void build_dup_record(const Patient *patient, DupRecord *record) {
+    char key[PHONETIC_KEY_LEN];
+    char first_word[1][PHONETIC_WORD_LEN];
+
+    record->id = patient->id;
+    record->gender = patient->gender;
+    record->phone = patient->phone;
+    snprintf(record->display_name, sizeof(record->display_name), "%.63s", patient->name);
+    record->name_len = simplify_name(patient->name, record->name);
+    record->guardian_len = simplify_name(patient->guardian, record->guardian);
+
+    /* The kind sits in the top bits so keys of different kinds never meet. */
+    memset(record->keys, 0, sizeof(record->keys));
+    if (patient->phone) {
+        uint64_t suffix = 1;
+        for (int i = 0; i < DUPLICATE_PHONE_SUFFIX; i++) suffix *= 10;
+        record->keys[BLOCK_PHONE] = ((uint64_t)(BLOCK_PHONE + 1) << 56) |
+                                    ((patient->phone & ((1ULL << 60) - 1)) % suffix);
+    }
+
+    phonetic_key(patient->name, key, PHONETIC_KEY_LEN);
+    if (key[0]) {
+        record->keys[BLOCK_NAME] = ((uint64_t)(BLOCK_NAME + 1) << 56) | hash_string(key);
+    }
+
+    if (phonetic_key_words(key, first_word, 1) == 1) {
+        char combined[PHONETIC_KEY_LEN + PHONETIC_WORD_LEN + 1];
+        phonetic_key(patient->guardian, combined, PHONETIC_KEY_LEN);
+        if (combined[0]) {
+            strcat(combined, "/");
+            strcat(combined, first_word[0]);
+            record->keys[BLOCK_GUARDIAN] = ((uint64_t)(BLOCK_GUARDIAN + 1) << 56) |
+                                           hash_string(combined);
+        }
+    }
+}
+
+int compare_block_entries(const void *a, const void *b) {
+    const BlockEntry *x = a;
+    const BlockEntry *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->record - y->record;
+}
+
+/* Percentage similarity from edit distance over the longer string. */
+int string_similarity(uint64_t *peq, const char *a, int a_len, const char *b, int b_len) {
+    int longest = a_len > b_len ? a_len : b_len;
+    if (longest == 0) return 100;
+    return 100 - (100 * edit_distance_with(peq, a, a_len, b, b_len)) / longest;
+}
+
+/* Name 50%, guardian 30%, phone 20%; without two phones, name and guardian only. */
+int score_dup_pair(uint64_t *peq, const DupRecord *a, const DupRecord *b) {
+    int name = string_similarity(peq, a->name, a->name_len, b->name, b->name_len);
+    if (name < 50) return 0;
+    int guardian = string_similarity(peq, a->guardian, a->guardian_len, b->guardian, b->guardian_len);
+
+    if (!a->phone || !b->phone) {
+        return (name * 5 + guardian * 3) / 8;
+    }
+    int phone = a->phone == b->phone ? 100 : 0;
+    return (name * 50 + guardian * 30 + phone * 20) / 100;
+}
+
+int pair_list_add(PairList *list, const DupPair *pair) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        DupPair *pairs = realloc(list->pairs, capacity * sizeof(DupPair));
+        if (!pairs) {
+            list->failed = 1;
+            return 0;
+        }
+        list->pairs = pairs;
+        list->capacity = capacity;
+    }
+    list->pairs[list->count++] = *pair;
+    return 1;
+}
+
+void score_block(const DupJob *job, const Block *block, uint64_t *peq, PairList *out) {
+    const BlockEntry *entries = job->entries + block->start;
+
+    for (int i = 0; i < block->count; i++) {
+        const DupRecord *a = &job->records[entries[i].record];
+        for (int j = i + 1; j < block->count; j++) {
+            const DupRecord *b = &job->records[entries[j].record];
+            int seen = 0;
+
+            for (int k = 0; k < (int)block->kind && !seen; k++) {
+                seen = a->keys[k] && a->keys[k] == b->keys[k];
+            }
+            if (seen || a->gender != b->gender) continue;
+
+            out->comparisons++;
+            DupPair pair = {entries[i].record, entries[j].record, score_dup_pair(peq, a, b), 0, block->kind};
+            if (pair.score >= DUPLICATE_MIN_SCORE && !pair_list_add(out, &pair)) return;
+        }
+    }
+}
+
+void score_block_morsel(void *context, int worker, int morsel, int first, int last) {
+    DupJob *job = context;
+    DupWorker *state = &job->workers[worker];
+    (void)morsel;
+
+    for (int b = first; b < last && !state->pairs.failed; b++) {
+        score_block(job, &job->blocks[b], state->peq, &state->pairs);
+    }
+}
+
+int find_cluster_root(int *parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/* Clusters by best score, pairs by score within a cluster. */
+int *dup_cluster_best = NULL;
+
+int compare_dup_pairs(const void *a, const void *b) {
+    const DupPair *x = a;
+    const DupPair *y = b;
+    int best_x = dup_cluster_best[x->cluster];
+    int best_y = dup_cluster_best[y->cluster];
+    if (best_x != best_y) return best_y - best_x;
+    if (x->cluster != y->cluster) return x->cluster - y->cluster;
+    if (x->score != y->score) return y->score - x->score;
+    return x->a != y->a ? x->a - y->a : x->b - y->b;
+}
+
+/* Numbers clusters 1.. in order of their best pair. */
+int cluster_dup_pairs(DupPair *pairs, int pair_count, int record_count) {
+    int *parent = malloc(record_count * sizeof(int));
+    int *number = malloc(record_count * sizeof(int));
+    int cluster_count = 0;
+
+    if (!parent || !number) {
+        free(parent);
+        free(number);
+        return -1;
+    }
+    for (int i = 0; i < record_count; i++) {
+        parent[i] = i;
+        number[i] = -1;
+    }
+    for (int i = 0; i < pair_count; i++) {
+        int ra = find_cluster_root(parent, pairs[i].a);
+        int rb = find_cluster_root(parent, pairs[i].b);
+        if (ra != rb) parent[rb] = ra;
+    }
+
+    dup_cluster_best = calloc(pair_count + 1, sizeof(int));
+    if (!dup_cluster_best) {
+        free(parent);
+        free(number);
+        return -1;
+    }
+    for (int i = 0; i < pair_count; i++) {
+        int root = find_cluster_root(parent, pairs[i].a);
+        if (number[root] == -1) number[root] = cluster_count++;
+        pairs[i].cluster = number[root];
+        if (pairs[i].score > dup_cluster_best[pairs[i].cluster]) {
+            dup_cluster_best[pairs[i].cluster] = pairs[i].score;
+        }
+    }
+    qsort(pairs, pair_count, sizeof(DupPair), compare_dup_pairs);
+
+    int current = -1;
+    int renumbered = 0;
+    for (int i = 0; i < pair_count; i++) {
+        if (pairs[i].cluster != current) {
+            current = pairs[i].cluster;
+            renumbered++;
+        }
+        pairs[i].cluster = renumbered;
+    }
+
+    free(dup_cluster_best);
+    dup_cluster_best = NULL;
+    free(parent);
+    free(number);
+    return cluster_count;
+}
+
+int write_dup_candidates(const char *path, const DupRecord *records, const DupPair *pairs, int pair_count) {
+    OutputBuffer out = {0};
+    char phone[PHONE_TEXT_LEN];
+    static const char header[] = "cluster,score,patient_id,duplicate_id,patient_name,duplicate_name,phone,matched_on\n";
+
+    out.file = fopen(path, "wb");
+    if (!out.file) return 0;
+    out.capacity = EXPORT_BUFFER_SIZE;
+    out.buffer = malloc(out.capacity);
+    if (!out.buffer) {
+        fclose(out.file);
+        return 0;
+    }
+
+    out_write(&out, header, sizeof(header) - 1);
+    for (int i = 0; i < pair_count; i++) {
+        const DupRecord *a = &records[pairs[i].a];
+        const DupRecord *b = &records[pairs[i].b];
+
+        out_int(&out, pairs[i].cluster);
+        out_char(&out, ',');
+        out_int(&out, pairs[i].score);
+        out_char(&out, ',');
+        out_int(&out, a->id);
+        out_char(&out, ',');
+        out_int(&out, b->id);
+        out_char(&out, ',');
+        out_csv_string(&out, a->display_name);
+        out_char(&out, ',');
+        out_csv_string(&out, b->display_name);
+        out_char(&out, ',');
+        format_phone(a->phone == b->phone ? a->phone : 0, phone, sizeof(phone), 1);
+        out_csv_string(&out, phone);
+        out_char(&out, ',');
+        out_csv_string(&out, block_kind_names[pairs[i].kind]);
+        out_char(&out, '\n');
+    }
+
+    out_flush(&out);
+    if (fclose(out.file) != 0) out.failed = 1;
+    free(out.buffer);
+    return !out.failed;
+}
+
+/* Active records of B+tree leaves, kept per morsel and joined in order. */
+typedef struct {
+    const uint32_t *leaves;
+    DupRecord **records;
+    int *counts;               /* -1 when the morsel ran out of memory */
+} DupCollect;
+
+void collect_dup_leaves(void *context, int worker, int morsel, int first, int last) {
+    DupCollect *collect = context;
+    DupRecord *records = malloc((size_t)(last - first) * BTREE_LEAF_MAX * sizeof(DupRecord));
+    int count = 0;
+    BTreeRun run;
+    Patient patient;
+    (void)worker;
+
+    if (records) {
+        btree_run_open(&run, collect->leaves, first, last);
+        while (btree_run_next(&run, &patient)) {
+            if (patient.is_active) build_dup_record(&patient, &records[count++]);
+        }
+    }
+    collect->records[morsel] = records;
+    collect->counts[morsel] = records ? count : -1;
+}
+
+DupRecord *collect_btree_dup_records(int *count) {
+    DupRecord *records = NULL;
+    int leaf_count;
+    int total = 0;
+    uint32_t *leaves = btree_scan_start(&leaf_count);
+
+    if (!leaves) {
+        return NULL;
+    }
+    DupCollect collect = {leaves, calloc(leaf_count, sizeof(DupRecord *)), calloc(leaf_count, sizeof(int))};
+    if (collect.records && collect.counts) {
+        scan_records_shared((int)btree_store.record_count, leaf_count, 1, collect_dup_leaves, &collect);
+
+        int failed = 0;
+        for (int m = 0; m < leaf_count; m++) {
+            if (collect.counts[m] < 0) failed = 1;
+            else total += collect.counts[m];
+        }
+        records = failed ? NULL : malloc((size_t)(total ? total : 1) * sizeof(DupRecord));
+        for (int m = 0, at = 0; records && m < leaf_count; m++) {
+            memcpy(records + at, collect.records[m], collect.counts[m] * sizeof(DupRecord));
+            at += collect.counts[m];
+        }
+        for (int m = 0; m < leaf_count; m++) free(collect.records[m]);
+    }
+
+    free(collect.records);
+    free(collect.counts);
+    free(leaves);
+    *count = total;
+    return records;
+}
+
+/* The active records in ID order; NULL when memory runs out. */
+DupRecord *collect_dup_records(int *count) {
+    if (config.storage == STORAGE_BTREE) {
+        return collect_btree_dup_records(count);
+    }
+
+    int capacity = 1024;
+    DupRecord *records = malloc(capacity * sizeof(DupRecord));
+    PatientCursor cursor;
+    Patient *patient;
+
+    *count = 0;
+    patient_cursor_open(&cursor);
+    while (records && (patient = patient_cursor_next(&cursor))) {
+        if (!patient->is_active) continue;
+        if (*count == capacity) {
+            capacity *= 2;
+            DupRecord *grown = realloc(records, capacity * sizeof(DupRecord));
+            if (!grown) {
+                free(records);
+                return NULL;
+            }
+            records = grown;
+        }
+        build_dup_record(patient, &records[(*count)++]);
+    }
+    return records;
+}
+
+/*
+ * Runs the whole job. On success *pairs_out holds the ranked pairs (free
+ * both it and *records_out) and the summary is filled in. Returns 0 when
+ * memory runs out.
+ */
+int find_duplicate_clusters(DupRecord **records_out, DupPair **pairs_out, DupSummary *summary) {
+    BlockEntry *entries = NULL;
+    Block *blocks = NULL;
+    int count = 0;
+    long long started = monotonic_ms();
+
+    memset(summary, 0, sizeof(*summary));
+    *records_out = NULL;
+    *pairs_out = NULL;
+
+    DupRecord *records = collect_dup_records(&count);
+    if (!records) {
+        return 0;
+    }
+    summary->record_count = count;
+
+    entries = malloc((size_t)(count ? count : 1) * BLOCK_KIND_COUNT * sizeof(BlockEntry));
+    if (!entries) {
+        free(records);
+        return 0;
+    }
+    int entry_count = 0;
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < BLOCK_KIND_COUNT; k++) {
+            if (records[i].keys[k]) {
+                entries[entry_count].key = records[i].keys[k];
+                entries[entry_count].record = i;
+                entry_count++;
+            }
+        }
+    }
+    qsort(entries, entry_count, sizeof(BlockEntry), compare_block_entries);
+
+    blocks = malloc((size_t)(entry_count / 2 + 1) * sizeof(Block));
+    if (!blocks) {
+        free(entries);
+        free(records);
+        return 0;
+    }
+    int block_count = 0;
+    for (int start = 0; start < entry_count; ) {
+        int end = start + 1;
+        while (end < entry_count && entries[end].key == entries[start].key) end++;
+
+        if (end - start > DUPLICATE_MAX_BLOCK) {
+            summary->skipped_blocks++;
+            summary->skipped_records += end - start;
+        } else if (end - start > 1) {
+            blocks[block_count].start = start;
+            blocks[block_count].count = end - start;
+            blocks[block_count].kind = (BlockKind)((entries[start].key >> 56) - 1);
+            block_count++;
+        }
+        start = end;
+    }
+    summary->block_count = block_count;
+
+    int thread_count = scan_worker_count();
+    DupWorker *workers = calloc(thread_count, sizeof(DupWorker));
+    if (!workers) {
+        free(blocks);
+        free(entries);
+        free(records);
+        return 0;
+    }
+    DupJob job = {records, entries, blocks, workers};
+    scan_records(count, block_count, DUPLICATE_BLOCK_BATCH, score_block_morsel, &job);
+    summary->thread_count = count < SCAN_PARALLEL_MIN_RECORDS ? 1 : thread_count;
+
+    int pair_count = 0;
+    int failed = 0;
+    for (int t = 0; t < thread_count; t++) {
+        pair_count += workers[t].pairs.count;
+        summary->comparisons += workers[t].pairs.comparisons;
+        failed |= workers[t].pairs.failed;
+    }
+
+    DupPair *pairs = failed ? NULL : malloc((size_t)(pair_count ? pair_count : 1) * sizeof(DupPair));
+    if (pairs) {
+        int at = 0;
+        for (int t = 0; t < thread_count; t++) {
+            memcpy(pairs + at, workers[t].pairs.pairs, workers[t].pairs.count * sizeof(DupPair));
+            at += workers[t].pairs.count;
+        }
+    }
+    for (int t = 0; t < thread_count; t++) free(workers[t].pairs.pairs);
+    free(workers);
+    free(blocks);
+    free(entries);
+
+    summary->cluster_count = pairs ? cluster_dup_pairs(pairs, pair_count, count) : -1;
+    if (summary->cluster_count < 0) {
+        free(pairs);
+        free(records);
+        return 0;
+    }
+
+    summary->pair_count = pair_count;
+    summary->elapsed_ms = monotonic_ms() - started;
+    *records_out = records;
+    *pairs_out = pairs;
+    return 1;
+}
+
+/* ===================== UI FUNCTIONS ===================== */
+
+unsigned long save_failures_shown = 0;
+
+/* Called on the I/O thread when a queued write or fsync fails. */
+void report_save_failure(const char *operation, int error) {
+    fprintf(stderr, "\nBackground save failed (%s): %s\n", operation, strerror(error));
+}
+
+void print_save_warnings() {
+    unsigned long failures = io_failure_count();
+    if (failures > save_failures_shown) {
+        printf(COLOR_RED "Warning: %lu background save(s) failed; recent changes may not be on disk.\n\n" COLOR_RESET,
+               failures - save_failures_shown);
+        save_failures_shown = failures;
+    }
+}
+
+void print_store_warning() {
+    if (config.storage == STORAGE_TEXT && store_check_failed(&patients_check)) {
+        printf(COLOR_RED "Warning: patients.txt was damaged when loaded; see Data Tools -> Verify Store.\n\n" COLOR_RESET);
+    }
+}
+
+void print_branch_banner() {
+    if (branch_count > 1) {
+        printf("Branch: %s\n\n", current_branch);
+    }
+}
+
+/* Catches a standby up and says how far behind the primary it still is. */
+void print_replica_banner() {
+    ReplicaLag lag;
+
+    if (config.replica_role != REPLICA_STANDBY || !replica_enabled()) return;
+
+    if (replica_catch_up() < 0) {
+        printf(COLOR_RED "Replication stopped after entry %llu; see Data Tools.\n" COLOR_RESET,
+               (unsigned long long)replica.applied_seq);
+    }
+    replica_lag(&lag);
+    printf(COLOR_MAROON "Read-only standby: entry %llu applied, %llu behind.\n\n" COLOR_RESET,
+           (unsigned long long)replica.applied_seq, (unsigned long long)lag.entries_behind);
+}
+
+/* Forms that change records call this first; a standby only serves reads. */
+int standby_read_only() {
+    if (config.replica_role != REPLICA_STANDBY || !replica_enabled()) {
+        return 0;
+    }
+    printf("This is a read-only standby. Promote it from Data Tools to make changes.\n");
+    printf("\nPress Enter to continue...");
+    read_char();
+    return 1;
+}
+
+/* Archives and exports are written unencrypted, so they are refused while
+ * encryption is on. */
+int plaintext_refused(const char *what) {
+    if (!config.encryption) {
+        return 0;
+    }
+    printf("%s would be written unencrypted, so it is not available with encryption=on.\n", what);
+    printf("\nPress Enter to continue...");
+    read_char();
+    return 1;
+}
+
+void show_startup_menu() {
+    clear_screen();
+    print_centered_title("PATIENT RECORD MANAGEMENT SYSTEM");
+
+    printf("1) Login\n");
+    printf("2) Exit\n\n");
+    printf("Enter your choice: ");
+}
+
+void show_admin_menu() {
+    clear_screen();
+    print_centered_title("ADMIN DASHBOARD");
+    print_branch_banner();
+    print_save_warnings();
+    print_store_warning();
+    print_replica_banner();
+
+    printf("1. Add New Patient\n");
+    printf("2. View All Patients\n");
+    printf("3. Search Patient\n");
+    printf("4. Modify Patient\n");
+    printf("5. Delete Patient\n");
+    printf("6. Register New User\n");
+    printf("7. Data Tools\n");
+    printf("8. Logout\n\n");
+    printf("Enter your choice: ");
+}
+
+void show_moderator_menu() {
+    clear_screen();
+    print_centered_title("MODERATOR DASHBOARD");
+    print_branch_banner();
+    print_save_warnings();
+    print_replica_banner();
+
+    printf("1. Add New Patient\n");
+    printf("2. View All Patients\n");
+    printf("3. Search Patient\n");
+    printf("4. Logout\n\n");
+    printf("Enter your choice: ");
+}
+
+/* ===================== PATIENT FORMS ===================== */
+
+void print_detail_line(const char *label, const char *value) {
+    fputs(label, stdout);
+    fputs(": ", stdout);
+    fputs(value, stdout);
+    putchar('\n');
+}
+
+void print_detail_number(const char *label, int value) {
+    char digits[12];
+    snprintf(digits, sizeof(digits), "%d", value);
+    print_detail_line(label, digits);
+}
+
+#define PRINT_INT(member, dict, label) print_detail_number(label, patient->member);
+#define PRINT_FLAG(member, dict, label)
+#define PRINT_TEXT(member, dict, label) print_detail_line(label, patient->member);
+#define PRINT_CODE(member, dict, label) print_detail_line(label, dict_value(&dict, patient->member));
+#define PRINT_PHONE(member, dict, label) print_detail_line(label, patient_phone(patient));
+#define PRINT_FIELD(tag, member, kind, size, dict, label, column, min, max) PRINT_##kind(member, dict, label)
+
+void print_patient_details(const Patient *patient) {
+    PATIENT_FIELDS(PRINT_FIELD)
+}
+
+/* Shows an archived record and lets an admin restore it. */
+void show_archived_patient(const Patient *patient) {
+    char input[10];
+
+    printf("\nPatient is archived%s:\n", patient->is_active ? "" : " (deleted)");
+    print_patient_details(patient);
+
+    if (!current_user || current_user->role != ROLE_ADMIN || config.replica_role == REPLICA_STANDBY) {
+        return;
+    }
+
+    printf("\nRestore to active records? (y/N): ");
+    if (!read_line(input, sizeof(input))) return;
+    trim(input);
+
+    if (input[0] == 'y' || input[0] == 'Y') {
+        if (restore_archived_patient(patient->id)) {
+            printf(COLOR_GREEN "\nPatient restored.\n" COLOR_RESET);
+        } else {
+            printf(COLOR_RED "\nRestore failed.\n" COLOR_RESET);
+        }
+    }
+}
+
+void add_patient_form() {
+    Patient patient = {0};
+    char input[256];
+
+    ensure_patient_indexes();
+    clear_screen();
+    print_centered_title("ADD NEW PATIENT");
+    if (standby_read_only()) {
+        return;
+    }
+
+    printf("Enter '0' For Go Back.\n");
+    printf("End a name, address or doctor with '?' for suggestions.\n\n");
+
+    while (1) {
+        printf("Patient Name: ");
+        if (!read_line_with_suggestions(input, sizeof(input), &name_trie)) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please enter a name.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        strcpy(patient.name, input);
+        break;
+    }
+
+    while (1) {
+        printf("Guardian Name: ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please enter guardian name.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Guardian name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        strcpy(patient.guardian, input);
+        break;
+    }
+
+    while (1) {
+        printf("Enter gender (M=Male, F=Female): ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please select a gender.\n" COLOR_RESET);
+            continue;
+        }
+
+        char gender = (char)toupper((unsigned char)input[0]);
+        if (gender == 'M' || gender == 'F') {
+            patient.gender = dict_intern(&gender_dict, (gender == 'M') ? "Male" : "Female");
+            break;
+        } else {
+            printf(COLOR_RED "That doesn't look right. Please enter M or F.\n" COLOR_RESET);
+        }
+    }
+
+    while (1) {
+        printf("Age: ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please enter age.\n" COLOR_RESET);
+            continue;
+        }
+
+        patient.age = atoi(input);
+        if (patient.age <= 0 || patient.age > 150) {
+            printf(COLOR_RED "Age must be between 1 and 150.\n" COLOR_RESET);
+            continue;
+        }
+        break;
+    }
+
+    printf("\nSelect Blood Group:\n");
+    printf("1) A+\n");
+    printf("2) A-\n");
+    printf("3) B+\n");
+    printf("4) B-\n");
+    printf("5) AB+\n");
+    printf("6) AB-\n");
+    printf("7) O+\n");
+    printf("8) O-\n");
+
+    while (1) {
+        printf("Select Blood Group [1-8]: ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please select blood group.\n" COLOR_RESET);
+            continue;
+        }
+
+        int choice = atoi(input);
+        if (choice < 1 || choice > 8) {
+            printf(COLOR_RED "Please select 1-8.\n" COLOR_RESET);
+            continue;
+        }
+
+        switch (choice) {
+            case 1: patient.blood_group = dict_intern(&blood_group_dict, "A+"); break;
+            case 2: patient.blood_group = dict_intern(&blood_group_dict, "A-"); break;
+            case 3: patient.blood_group = dict_intern(&blood_group_dict, "B+"); break;
+            case 4: patient.blood_group = dict_intern(&blood_group_dict, "B-"); break;
+            case 5: patient.blood_group = dict_intern(&blood_group_dict, "AB+"); break;
+            case 6: patient.blood_group = dict_intern(&blood_group_dict, "AB-"); break;
+            case 7: patient.blood_group = dict_intern(&blood_group_dict, "O+"); break;
+            case 8: patient.blood_group = dict_intern(&blood_group_dict, "O-"); break;
+        }
+        break;
+    }
+
+    while (1) {
+        printf("Phone: ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Phone number is required.\n" COLOR_RESET);
+            continue;
+        }
+
+        patient.phone = normalize_phone(input);
+        if (!patient.phone) {
+            printf(COLOR_RED "Enter a phone number such as 01712345678 or +8801712345678.\n" COLOR_RESET);
+            continue;
+        }
+        break;
+    }
+
+    int duplicate_id = is_duplicate_patient(patient.name, patient.guardian, patient.phone);
+    int sounds_alike_id = duplicate_id ? 0 : find_phonetic_duplicate(patient.name, patient.guardian);
+    if (duplicate_id || sounds_alike_id) {
+        printf(COLOR_RED "\n⚠️  Similar patient found!\n" COLOR_RESET);
+        if (duplicate_id) {
+            printf("Existing Patient ID: %d\n", duplicate_id);
+            printf("Same name, guardian, and phone already exists.\n\n");
+        } else {
+            Patient *existing = find_patient_by_id(sounds_alike_id);
+            printf("Existing Patient ID: %d\n", sounds_alike_id);
+            printf("Name and guardian sound the same: %s (guardian %s, phone %s).\n\n",
+                   existing->name, existing->guardian, patient_phone(existing));
+        }
+
+        while (1) {
+            printf("1) Cancel (keep existing)\n");
+            printf("2) Add anyway (new record)\n");
+            printf("Choice [1]: ");
+
+            if (!read_line(input, sizeof(input))) continue;
+            trim(input);
+
+            if (strlen(input) == 0 || strcmp(input, "1") == 0) {
+                printf("Cancelled. Patient not added.\n");
+                printf("\nPress Enter to continue...");
+                read_char();
+                return;
+            }
+
+            if (strcmp(input, "2") == 0) {
+                printf("Proceeding with new patient...\n");
+                break;
+            }
+
+            printf(COLOR_RED "Please enter 1 or 2.\n" COLOR_RESET);
+        }
+    }
+
+    while (1) {
+        printf("Address: ");
+        if (!read_line_with_suggestions(input, sizeof(input), &address_trie)) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Address is required.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Address cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        patient.address = dict_intern(&address_dict, input);
+        break;
+    }
+
+    while (1) {
+        printf("Disease: ");
+        if (!read_line(input, sizeof(input))) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please enter disease.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Disease cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        patient.disease = dict_intern(&disease_dict, input);
+        break;
+    }
+
+    while (1) {
+        printf("Referred Doctor: ");
+        if (!read_line_with_suggestions(input, sizeof(input), &doctor_trie)) continue;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            printf("Operation cancelled.\n");
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            printf(COLOR_RED "Please enter doctor's name.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Doctor name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        patient.referred_doctor = dict_intern(&doctor_dict, input);
+        break;
+    }
+
+    get_current_date(patient.registration_date);
+
+    if (add_patient(&patient)) {
+        printf(COLOR_GREEN "\nPatient added successfully!\n" COLOR_RESET);
+        printf("Patient ID: %d\n", patient.id);
+        printf("Registration Date: %s \n", patient.registration_date);
+    } else {
+        const char *problem = validate_patient(&patient);
+        printf(COLOR_RED "\nFailed to add patient.%s%s\n" COLOR_RESET, problem ? " " : "", problem ? problem : "");
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+/*
+ * Pages through matching patients by keyset: each page is fetched from
+ * the first or last ID on screen, so paging deep into a large store costs
+ * the same as the first page.
+ */
+void browse_patients(const char *title, const char *search) {
+    Patient rows[PATIENT_PAGE_SIZE];
+    Patient probe;
+    char input[32];
+    int more_after;
+    int more_before = 0;
+    int count = find_patients_page(search, 0, 0, rows, PATIENT_PAGE_SIZE, &more_after);
+
+    while (1) {
+        clear_screen();
+        print_centered_title(title);
+
+        if (count == 0) {
+            printf("No patient records found.\n");
+        } else {
+            printf("ID    Name                 Gender  Age  Phone       Disease\n");
+            printf("----------------------------------------------------------------\n");
+            for (int i = 0; i < count; i++) {
+                printf("%-5d %-20s %-7s %-4d %-11s %s\n",
+                       rows[i].id, rows[i].name, patient_gender(&rows[i]),
+                       rows[i].age, patient_phone(&rows[i]), patient_disease(&rows[i]));
+            }
+        }
+
+        if (search[0] == '\0') {
+            printf("\nTotal patients: %d\n", count_active_patients());
+        }
+        printf("\n%s%sG) Go to ID  0) Back\n",
+               more_after ? "Enter) Next page  " : "", more_before ? "P) Previous page  " : "");
+        printf("Patient ID for details, or choice: ");
+        if (!read_line(input, sizeof(input))) {
+            return;
+        }
+        trim(input);
+
+        if (strcmp(input, "0") == 0 || (input[0] == '\0' && !more_after)) {
+            return;
+        }
+
+        if (input[0] == '\0' || tolower((unsigned char)input[0]) == 'n') {
+            if (more_after) {
+                int last_id = rows[count - 1].id;
+                count = find_patients_page(search, last_id, 0, rows, PATIENT_PAGE_SIZE, &more_after);
+                more_before = 1;
+            }
+        } else if (tolower((unsigned char)input[0]) == 'p') {
+            if (more_before) {
+                int first_id = rows[0].id;
+                count = find_patients_page(search, first_id, 1, rows, PATIENT_PAGE_SIZE, &more_before);
+                more_after = 1;
+            }
+        } else if (tolower((unsigned char)input[0]) == 'g') {
+            printf("Go to patient ID: ");
+            if (!read_line(input, sizeof(input)) || !is_digits_only(input) || atoi(input) <= 0) {
+                continue;
+            }
+            int target = atoi(input);
+            int found = find_patients_page(search, target - 1, 0, rows, PATIENT_PAGE_SIZE, &more_after);
+            if (found > 0) {
+                count = found;
+                more_before = find_patients_page(search, rows[0].id, 1, &probe, 1, &more_before) > 0;
+            } else {
+                count = find_patients_page(search, 0, 0, rows, PATIENT_PAGE_SIZE, &more_after);
+                more_before = 0;
+            }
+        } else if (is_digits_only(input)) {
+            Patient *patient = find_patient_by_id(atoi(input));
+            if (patient) {
+                printf("\nPatient Details:\n");
+                print_patient_details(patient);
+            } else {
+                printf(COLOR_RED "\nPatient not found.\n" COLOR_RESET);
+            }
+            printf("\nPress Enter to continue...");
+            read_char();
+        }
+    }
+}
+
+void view_all_patients() {
+    browse_patients("ALL PATIENT RECORDS", "");
+}
+
+void search_patient_menu() {
+    char search[256];
+    int patient_id;
+
+    clear_screen();
+    print_centered_title("SEARCH PATIENT");
+
+    printf("Enter patient ID, name or phone (017* = starts with, *5678 = ends with),\n");
+    printf("or disease:<text> / address:<text> / doctor:<text>: ");
+    if (!read_line(search, sizeof(search))) {
+        return;
+    }
+
+    trim(search);
+
+    if (strlen(search) == 0) {
+        return;
+    }
+
+    PhoneQuery phone_query;
+    int column = -1;
+    const char *label = NULL;
+    const char *noun = NULL;
+    const char *text = search;
+    if (strncmp(search, "disease:", 8) == 0) {
+        column = FIELD_DISEASE_COLUMN;
+        label = "Disease";
+        noun = "disease";
+        text += 8;
+    } else if (strncmp(search, "address:", 8) == 0) {
+        column = FIELD_ADDRESS_COLUMN;
+        label = "Address";
+        noun = "address";
+        text += 8;
+    } else if (strncmp(search, "doctor:", 7) == 0) {
+        column = FIELD_DOCTOR_COLUMN;
+        label = "Doctor";
+        noun = "referring doctor";
+        text += 7;
+    }
+
+    if (column != -1) {
+        int result_indices[MAX_SEARCH_RESULTS];
+        int total_found = 0;
+        while (isspace((unsigned char)*text)) text++;
+
+        int found_count = find_patients_by_column(column, text, result_indices,
+                                                  MAX_SEARCH_RESULTS, &total_found);
+        if (found_count < 0) {
+            printf(COLOR_RED "\nNot enough memory for this search.\n" COLOR_RESET);
+        } else if (found_count == 0) {
+            printf("\nNo patients found with %s containing: %s\n", noun, text);
+        } else {
+            printf("\n%d patient(s) found", total_found);
+            if (total_found > found_count) printf(", showing the first %d", found_count);
+            printf(":\n");
+            printf("ID    %-25s %s\n", "Name", label);
+            printf("--------------------------------------------------\n");
+            for (int i = 0; i < found_count; i++) {
+                Patient *patient = &patients[result_indices[i]];
+                printf("%-5d %-25s %s\n", patient->id, patient->name,
+                       dict_value(dictionary_columns[column].dict, patient_column_code(patient, column)));
+            }
+
+            printf("\nEnter patient ID to view details: ");
+            if (read_line(search, sizeof(search))) {
+                trim(search);
+                Patient *patient = is_digits_only(search) ? find_patient_by_id(atoi(search)) : NULL;
+                if (patient) {
+                    printf("\nPatient Details:\n");
+                    print_patient_details(patient);
+                } else if (strlen(search) > 0 && strcmp(search, "0") != 0) {
+                    printf(COLOR_RED "\nPatient not found.\n" COLOR_RESET);
+                }
+            }
+        }
+    } else if (parse_phone_query(search, &phone_query)) {
+        Patient *results[MAX_SEARCH_RESULTS];
+        int found_count = find_patients_by_phone(&phone_query, results, MAX_SEARCH_RESULTS);
+
+        if (found_count == 0) {
+            printf("\nNo patients found with phone matching: %s\n", search);
+        } else if (found_count == 1) {
+            Patient *patient = results[0];
+            printf("\nPatient Found:\n");
+            print_patient_details(patient);
+        } else {
+            printf("\n%d patient(s) found%s:\n", found_count,
+                   found_count == MAX_SEARCH_RESULTS ? " (showing first matches)" : "");
+            printf("S.No  ID    %-25s Phone\n", "Name");
+            printf("--------------------------------------------------\n");
+            for (int i = 0; i < found_count; i++) {
+                printf("%-5d %-5d %-25s %s\n", i + 1, results[i]->id, results[i]->name,
+                       patient_phone(results[i]));
+            }
+
+            printf("\nEnter patient ID to view details: ");
+            if (read_line(search, sizeof(search))) {
+                trim(search);
+                Patient *patient = is_digits_only(search) ? find_patient_by_id(atoi(search)) : NULL;
+                if (patient) {
+                    printf("\nPatient Details:\n");
+                    print_patient_details(patient);
+                } else if (strlen(search) > 0 && strcmp(search, "0") != 0) {
+                    printf(COLOR_RED "\nPatient not found.\n" COLOR_RESET);
+                }
+            }
+        }
+    } else if (is_digits_only(search)) {
+        patient_id = atoi(search);
+        Patient *patient = find_patient_by_id(patient_id);
+
+        if (patient) {
+            printf("\nPatient Found:\n");
+            print_patient_details(patient);
+        } else {
+            Patient archived;
+            if (archive_find(patient_id, &archived)) {
+                show_archived_patient(&archived);
+            } else {
+                printf("\nNo patient found with ID: %d\n", patient_id);
+            }
+        }
+    } else {
+        Patient first_match;
+        int more_matches;
+        int found_count = find_patients_page(search, 0, 0, &first_match, 1, &more_matches);
+
+        if (more_matches) {
+            char title[HEADER_WIDTH];
+            snprintf(title, sizeof(title), "MATCHES FOR \"%.20s\"", search);
+            browse_patients(title, search);
+            return;
+        }
+
+        int result_indices[MAX_SEARCH_RESULTS];
+        int is_fuzzy = 0;
+
+        if (found_count == 0) {
+            ensure_patient_indexes();
+            found_count = find_similar_patients(search, result_indices, MAX_SEARCH_RESULTS);
+            is_fuzzy = found_count > 0;
+        }
+
+        if (found_count == 0) {
+            printf("\nNo patients found with name containing: %s\n", search);
+        } else if (found_count == 1 && !is_fuzzy) {
+            Patient *patient = &first_match;
+            printf("\nPatient Found:\n");
+            print_patient_details(patient);
+        } else {
+            printf("\nNo exact match. Did you mean:\n");
+            printf("S.No  ID    Name\n");
+            printf("----------------------------\n");
+
+            for (int i = 0; i < found_count; i++) {
+                Patient *patient = &patients[result_indices[i]];
+                printf("%-5d %-5d %s\n", i + 1, patient->id, patient->name);
+            }
+
+            printf("\nEnter patient ID to view details: ");
+            if (!read_line(search, sizeof(search))) {
+                return;
+            }
+
+            trim(search);
+
+            if (is_digits_only(search)) {
+                patient_id = atoi(search);
+                if (patient_id == 0) {
+                    return;
+                }
+
+                Patient *patient = find_patient_by_id(patient_id);
+                if (patient) {
+                    printf("\nPatient Details:\n");
+                    print_patient_details(patient);
+                } else {
+                    printf(COLOR_RED "\nPatient not found.\n" COLOR_RESET);
+                }
+            }
+        }
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void modify_patient_form() {
+    int patient_id;
+    Patient *patient;
+    Patient updated_patient = {0};
+    char input[256];
+
+    ensure_patient_indexes();
+    clear_screen();
+    print_centered_title("MODIFY PATIENT");
+    if (standby_read_only()) {
+        return;
+    }
+
+    printf("Enter Patient ID to modify: ");
+    if (!read_line(input, sizeof(input))) return;
+
+    patient_id = atoi(input);
+    if (patient_id == 0) {
+        return;
+    }
+
+    patient = find_patient_by_id(patient_id);
+    if (!patient) {
+        printf(COLOR_RED "Patient not found.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    printf("\nCurrent Details:\n");
+    print_patient_details(patient);
+    printf("Leave field blank to keep current value.\n");
+    printf("End a name, address or doctor with '?' for suggestions.\n\n");
+
+    while (1) {
+        printf("Patient Name [%s]: ", patient->name);
+        if (!read_line_with_suggestions(input, sizeof(input), &name_trie)) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) {
+            return;
+        }
+
+        if (strlen(input) == 0) {
+            strcpy(updated_patient.name, patient->name);
+            break;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        strcpy(updated_patient.name, input);
+        break;
+    }
+
+    while (1) {
+        printf("Guardian Name [%s]: ", patient->guardian);
+        if (!read_line(input, sizeof(input))) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            strcpy(updated_patient.guardian, patient->guardian);
+            break;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Guardian name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        strcpy(updated_patient.guardian, input);
+        break;
+    }
+
+    while (1) {
+        printf("Gender (M/F) [%s]: ", patient_gender(patient));
+        if (!read_line(input, sizeof(input))) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.gender = patient->gender;
+            break;
+        }
+
+        char gender = (char)toupper((unsigned char)input[0]);
+        if (gender == 'M' || gender == 'F') {
+            updated_patient.gender = dict_intern(&gender_dict, (gender == 'M') ? "Male" : "Female");
+            break;
+        } else {
+            printf(COLOR_RED "Please enter M or F.\n" COLOR_RESET);
+        }
+    }
+
+    while (1) {
+        printf("Age [%d]: ", patient->age);
+        if (!read_line(input, sizeof(input))) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.age = patient->age;
+            break;
+        }
+
+        int age_input = atoi(input);
+        if (age_input > 0 && age_input <= 150) {
+            updated_patient.age = age_input;
+            break;
+        } else {
+            printf(COLOR_RED "Age must be 1-150.\n" COLOR_RESET);
+        }
+    }
+
+    while (1) {
+        printf("Phone [%s]: ", patient_phone(patient));
+        if (!read_line(input, sizeof(input))) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.phone = patient->phone;
+            break;
+        }
+
+        updated_patient.phone = normalize_phone(input);
+        if (updated_patient.phone) {
+            break;
+        } else {
+            printf(COLOR_RED "Enter a phone number such as 01712345678 or +8801712345678.\n" COLOR_RESET);
+        }
+    }
+
+    while (1) {
+        printf("Address [%s]: ", patient_address(patient));
+        if (!read_line_with_suggestions(input, sizeof(input), &address_trie)) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.address = patient->address;
+            break;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Address cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        updated_patient.address = dict_intern(&address_dict, input);
+        break;
+    }
+
+    while (1) {
+        printf("Disease [%s]: ", patient_disease(patient));
+        if (!read_line(input, sizeof(input))) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.disease = patient->disease;
+            break;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Disease cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        updated_patient.disease = dict_intern(&disease_dict, input);
+        break;
+    }
+
+    while (1) {
+        printf("Referred Doctor [%s]: ", patient_doctor(patient));
+        if (!read_line_with_suggestions(input, sizeof(input), &doctor_trie)) break;
+        trim(input);
+
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) {
+            updated_patient.referred_doctor = patient->referred_doctor;
+            break;
+        }
+
+        if (contains_pipe(input)) {
+            printf(COLOR_RED "Doctor name cannot contain '|' character.\n" COLOR_RESET);
+            continue;
+        }
+
+        updated_patient.referred_doctor = dict_intern(&doctor_dict, input);
+        break;
+    }
+
+    updated_patient.blood_group = patient->blood_group;
+    strcpy(updated_patient.registration_date, patient->registration_date);
+
+    if (modify_patient(patient_id, &updated_patient)) {
+        printf(COLOR_GREEN "\nPatient updated.\n" COLOR_RESET);
+    } else {
+        const char *problem = validate_patient(&updated_patient);
+        printf(COLOR_RED "\nUpdate failed.%s%s\n" COLOR_RESET, problem ? " " : "", problem ? problem : "");
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void delete_patient_form() {
+    int patient_id;
+    char confirm[10];
+
+    clear_screen();
+    print_centered_title("DELETE PATIENT");
+    if (standby_read_only()) {
+        return;
+    }
+
+    printf("Enter Patient ID to delete: ");
+    if (!read_line(confirm, sizeof(confirm))) return;
+
+    patient_id = atoi(confirm);
+    if (patient_id == 0) {
+        return;
+    }
+
+    Patient *patient = find_patient_by_id(patient_id);
+    if (!patient) {
+        printf(COLOR_RED "Patient not found.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    printf("\nPatient Details:\n");
+    print_patient_details(patient);
+
+    printf("\nAre you sure? (y/N): ");
+    read_line(confirm, sizeof(confirm));
+    trim(confirm);
+
+    if (confirm[0] == 'y' || confirm[0] == 'Y') {
+        if (delete_patient(patient_id)) {
+            printf(COLOR_GREEN "\nPatient deleted.\n" COLOR_RESET);
+        } else {
+            printf(COLOR_RED "\nFailed to delete.\n" COLOR_RESET);
+        }
+    } else {
+        printf("\nCancelled.\n");
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+/* ===================== DATA TOOLS ===================== */
+
+void archive_records_form() {
+    char cutoff[20];
+    char input[20];
+
+    clear_screen();
+    print_centered_title("ARCHIVE RECORDS");
+    if (standby_read_only() || plaintext_refused("The archive")) {
+        return;
+    }
+
+    if (config.storage == STORAGE_BTREE) {
+        printf("Archiving works on the text store only (storage=text).\n");
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    get_current_date(cutoff);
+    int year = atoi(cutoff) - ARCHIVE_AFTER_YEARS;
+    snprintf(cutoff, sizeof(cutoff), "%04d%s", year, strchr(cutoff, '-'));
+
+    printf("Deleted records and records registered before the cutoff\n");
+    printf("are moved to compressed archive files.\n\n");
+    printf("Cutoff date (YYYY-MM-DD) [%s]: ", cutoff);
+    if (!read_line(input, sizeof(input))) return;
+    trim(input);
+
+    if (strcmp(input, "0") == 0) {
+        return;
+    }
+    if (strlen(input) > 0) {
+        if (strlen(input) != 10 || input[4] != '-' || input[7] != '-') {
+            printf(COLOR_RED "\nDate must look like 2020-01-31.\n" COLOR_RESET);
+            printf("\nPress Enter to continue...");
+            read_char();
+            return;
+        }
+        strcpy(cutoff, input);
+    }
+
+    int archived = archive_patients(cutoff);
+    if (archived < 0) {
+        printf(COLOR_RED "\nArchiving failed.\n" COLOR_RESET);
+    } else {
+        printf(COLOR_GREEN "\n%d record(s) archived.\n" COLOR_RESET, archived);
+        printf("Active file now holds %d record(s).\n", patient_count);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void archived_patient_form() {
+    char input[20];
+    Patient patient;
+
+    clear_screen();
+    print_centered_title("ARCHIVED PATIENT");
+
+    printf("Enter Patient ID: ");
+    if (!read_line(input, sizeof(input))) return;
+
+    int patient_id = atoi(input);
+    if (patient_id == 0) {
+        return;
+    }
+
+    if (archive_find(patient_id, &patient)) {
+        show_archived_patient(&patient);
+    } else {
+        printf(COLOR_RED "\nPatient %d is not in the archive.\n" COLOR_RESET, patient_id);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+/*
+ * Prompts for an optional dictionary value into value (MAX_ADDRESS_LEN).
+ * Returns its code, -1 for any, or FILTER_NO_CODE for a value no record
+ * has; the dictionaries are left as they are.
+ */
+int prompt_dictionary_filter(const char *label, const Dictionary *dict, char *value) {
+    printf("%s [any]: ", label);
+    value[0] = '\0';
+    if (!read_line(value, MAX_ADDRESS_LEN)) return -1;
+    trim(value);
+
+    if (strlen(value) == 0) {
+        return -1;
+    }
+
+    int code = dict_lookup(dict, value);
+    return code >= 0 ? code : FILTER_NO_CODE;
+}
+
+void export_records_form() {
+    ExportFilter filter = {0};
+    int fields[FIELD_COUNT];
+    int field_count = FIELD_COUNT;
+    char path[256];
+    char input[256];
+
+    clear_screen();
+    print_centered_title("EXPORT RECORDS");
+    if (plaintext_refused("An export")) {
+        return;
+    }
+
+    printf("Enter '0' For Go Back.\n\n");
+    printf("Format (1=CSV, 2=JSON Lines) [1]: ");
+    if (!read_line(input, sizeof(input))) return;
+    trim(input);
+    if (strcmp(input, "0") == 0) return;
+    ExportFormat format = (atoi(input) == 2) ? EXPORT_NDJSON : EXPORT_CSV;
+
+    const char *default_path = (format == EXPORT_CSV) ? "patients_export.csv" : "patients_export.jsonl";
+    printf("Output file [%s]: ", default_path);
+    if (!read_line(path, sizeof(path))) return;
+    trim(path);
+    if (strcmp(path, "0") == 0) return;
+    if (strlen(path) == 0) strcpy(path, default_path);
+
+    for (int f = 0; f < FIELD_COUNT; f++) fields[f] = f;
+    while (1) {
+        printf("Fields, comma separated [all]: ");
+        if (!read_line(input, sizeof(input))) return;
+        trim(input);
+        if (strcmp(input, "0") == 0) return;
+        if (strlen(input) == 0) break;
+
+        field_count = parse_export_fields(input, fields);
+        if (field_count > 0) break;
+
+        printf(COLOR_RED "Unknown field. Choose from:" COLOR_RESET);
+        for (int f = 0; f < FIELD_COUNT; f++) printf(" %s", export_field_names[f]);
+        printf("\n");
+    }
+
+    filter.gender = prompt_dictionary_filter("Gender (Male/Female)", &gender_dict, filter.gender_value);
+    filter.blood_group = prompt_dictionary_filter("Blood Group", &blood_group_dict, filter.blood_group_value);
+    filter.disease = prompt_dictionary_filter("Disease", &disease_dict, filter.disease_value);
+    filter.referred_doctor = prompt_dictionary_filter("Referred Doctor", &doctor_dict, filter.doctor_value);
+
+    printf("Minimum age [any]: ");
+    if (!read_line(input, sizeof(input))) return;
+    filter.min_age = atoi(input);
+    printf("Maximum age [any]: ");
+    if (!read_line(input, sizeof(input))) return;
+    filter.max_age = atoi(input);
+
+    printf("Registered from (YYYY-MM-DD) [any]: ");
+    if (!read_line(filter.registered_from, sizeof(filter.registered_from))) return;
+    trim(filter.registered_from);
+    printf("Registered to (YYYY-MM-DD) [any]: ");
+    if (!read_line(filter.registered_to, sizeof(filter.registered_to))) return;
+    trim(filter.registered_to);
+
+    printf("Include deleted records? (y/N): ");
+    if (!read_line(input, sizeof(input))) return;
+    filter.include_deleted = (input[0] == 'y' || input[0] == 'Y');
+    printf("Include archived records? (y/N): ");
+    if (!read_line(input, sizeof(input))) return;
+    filter.include_archived = (input[0] == 'y' || input[0] == 'Y');
+
+    clock_t started = clock();
+    int exported = export_patients(path, format, &filter, fields, field_count);
+    double seconds = (double)(clock() - started) / CLOCKS_PER_SEC;
+
+    if (exported < 0) {
+        printf(COLOR_RED "\nExport to %s failed.\n" COLOR_RESET, path);
+    } else {
+        printf(COLOR_GREEN "\n%d record(s) exported to %s (%.3f s).\n" COLOR_RESET, exported, path, seconds);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+/* Prompts for an optional "YYYY-MM"; 1 with the month or -1 for any, else 0. */
+int prompt_month_filter(const char *label, int *month) {
+    char input[20];
+
+    printf("%s (YYYY-MM) [any]: ", label);
+    if (!read_line(input, sizeof(input))) return 0;
+    trim(input);
+
+    *month = -1;
+    if (strlen(input) == 0) {
+        return 1;
+    }
+    *month = registration_month(input);
+    if (*month < 0 || strlen(input) != 7) {
+        printf(COLOR_RED "\nMonth must look like 2024-03, from %d on.\n" COLOR_RESET, BITMAP_FIRST_YEAR);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return 0;
+    }
+    return 1;
+}
+
+void print_code_counts(const char *label, const Bitmap *matches, CodeBitmaps *set, Dictionary *dict) {
+    printf("\n%-24s %10s\n", label, "Patients");
+    for (int code = 0; code < set->count; code++) {
+        long count = bitmap_and_cardinality(matches, &set->bitmaps[code]);
+        if (count > 0) printf("%-24s %10ld\n", dict_value(dict, code), count);
+    }
+}
+
+/* Counts from the bitmap index alone; no record is read. */
+void patient_counts_form() {
+    BitmapQuery query = {0, -1, -1, 0, 0, -1, -1, 0};
+    Bitmap matches;
+    char input[20];
+    char value[MAX_ADDRESS_LEN];
+
+    clear_screen();
+    print_centered_title("PATIENT COUNTS");
+
+    /* Built first: B+tree records add their values to the dictionaries as
+     * the bitmaps read them, and the prompts look the values up there. */
+    if (!ensure_bitmap_index()) {
+        printf(COLOR_RED "Not enough memory to count.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    query.gender = prompt_dictionary_filter("Gender (Male/Female)", &gender_dict, value);
+    query.blood_group = prompt_dictionary_filter("Blood Group", &blood_group_dict, value);
+
+    printf("Minimum age [any]: ");
+    if (!read_line(input, sizeof(input))) return;
+    query.min_age = atoi(input);
+    printf("Maximum age [any]: ");
+    if (!read_line(input, sizeof(input))) return;
+    query.max_age = atoi(input);
+
+    if (!prompt_month_filter("Registered from", &query.from_month) ||
+        !prompt_month_filter("Registered to", &query.to_month)) {
+        return;
+    }
+
+    printf("Include deleted records? (y/N): ");
+    if (!read_line(input, sizeof(input))) return;
+    query.include_deleted = (input[0] == 'y' || input[0] == 'Y');
+
+    long long started = session_clock_us();
+    if (!bitmap_query(&query, &matches)) {
+        printf(COLOR_RED "\nNot enough memory to count.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+    long total = bitmap_cardinality(&matches);
+    long long elapsed = session_clock_us() - started;
+
+    printf(COLOR_GREEN "\n%ld patient(s) match (%.3f ms).\n" COLOR_RESET, total, elapsed / 1e3);
+    if (total > 0) {
+        print_code_counts("Gender", &matches, &bitmap_index.gender, &gender_dict);
+        print_code_counts("Blood Group", &matches, &bitmap_index.blood_group, &blood_group_dict);
+    }
+    bitmap_free(&matches);
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void print_verify_problem(int *shown, int line_no, const char *line, const char *problem) {
+    if ((*shown)++ >= VERIFY_SHOWN) return;
+    int id = atoi(line);
+    if (id > 0) {
+        printf("  line %-7d patient %-7d %s\n", line_no, id, problem);
+    } else {
+        printf("  line %-7d %-15s %s\n", line_no, "", problem);
+    }
+}
+
+/*
+ * Checks every line of a file in the patients.txt format and lists the
+ * records that fail. Returns the number of problems, or -1 without the file.
+ */
+int verify_store_file(const char *path, long long *bytes) {
+    SecureFile file;
+    StoreCheck check;
+    CodeMap maps[DICTIONARY_COLUMN_COUNT] = {{0}};
+    char line[1024];
+    char original[1024];
+    int line_no = 0;
+    int encoded = 0;
+    int shown = 0;
+
+    printf("\n%s\n", path);
+    if (!secure_open_read(&file, path)) {
+        printf("  Not found.\n");
+        return -1;
+    }
+
+    store_check_start(&check);
+    while (secure_gets(line, sizeof(line), &file)) {
+        Patient patient;
+        line_no++;
+        *bytes += (long long)strlen(line);
+        strcpy(original, line);
+
+        int unchecked = check.unchecked;
+        StoreLine kind = check_store_line(&check, line);
+        if (kind == STORE_OTHER && line[0] == '@') {
+            encoded = 1;
+        } else if (kind == STORE_DAMAGED) {
+            print_verify_problem(&shown, line_no, original, "fails its checksum");
+        } else if (kind == STORE_RECORD &&
+                   !(encoded ? parse_encoded_patient(line, &patient, maps) : parse_text_patient(line, &patient))) {
+            check.damaged++;
+            print_verify_problem(&shown, line_no, original, "cannot be read");
+        } else if (check.unchecked > unchecked && check.unchecked < check.records) {
+            /* Among records that have one: added or edited by hand. */
+            print_verify_problem(&shown, line_no, original, "has no checksum");
+        }
+    }
+
+    int readable = secure_close(&file);
+    if (shown > VERIFY_SHOWN) {
+        printf("  ... and %d more.\n", shown - VERIFY_SHOWN);
+    }
+    if (!readable) {
+        printf(COLOR_RED "  Does not decrypt after line %d: the file was damaged or altered.\n" COLOR_RESET, line_no);
+    }
+
+    int problems = check.damaged + !readable;
+    if (store_check_failed(&check)) {
+        printf(COLOR_RED);
+        print_store_problems(stdout, &check);
+        printf(COLOR_RESET);
+        return problems > 0 ? problems : 1;
+    }
+    if (check.records > 0 && check.unchecked == check.records) {
+        printf("  %d record(s), written before checksums; the next save adds them.\n", check.records);
+    } else {
+        printf(COLOR_GREEN "  %d record(s); every checksum matches.\n" COLOR_RESET, check.records);
+    }
+    return problems;
+}
+
+/* Checks the journal's records; an encrypted one is authenticated when replayed. */
+int verify_journal_file(long long *bytes) {
+    char line[1024];
+    char original[1024];
+    Patient patient;
+    int line_no = 0;
+    int problems = 0;
+    int shown = 0;
+    int records = 0;
+
+    FILE *file = fopen(branch_file("patients.journal"), "rb");
+    if (!file) {
+        return 0;
+    }
+    printf("\n%s\n", branch_file("patients.journal"));
+    if (fgetc(file) == 0) {
+        printf("  Encrypted; each record is authenticated when it is replayed.\n");
+        fclose(file);
+        return 0;
+    }
+    rewind(file);
+
+    while (fgets(line, sizeof(line), file)) {
+        size_t len = strlen(line);
+        line_no++;
+        *bytes += (long long)len;
+        strcpy(original, line);
+
+        if (line[len - 1] != '\n') {
+            print_verify_problem(&shown, line_no, original, "was cut short by an interrupted write");
+        } else if (open_record_line(line) < 0) {
+            print_verify_problem(&shown, line_no, original, "fails its checksum");
+        } else if (!parse_text_patient(line, &patient)) {
+            print_verify_problem(&shown, line_no, original, "cannot be read");
+        } else {
+            records++;
+            continue;
+        }
+        problems++;
+    }
+    fclose(file);
+
+    if (shown > VERIFY_SHOWN) {
+        printf("  ... and %d more.\n", shown - VERIFY_SHOWN);
+    }
+    if (problems == 0) {
+        printf(COLOR_GREEN "  %d record(s); every checksum matches.\n" COLOR_RESET, records);
+    }
+    return problems;
+}
+
+void verify_store_form() {
+    long long bytes = 0;
+
+    clear_screen();
+    print_centered_title("VERIFY STORE");
+
+    if (config.storage != STORAGE_TEXT) {
+        printf("Checksums cover the text store only (storage=text).\n");
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    io_flush();
+    long long started = session_clock_us();
+    int problems = verify_store_file(branch_file("patients.txt"), &bytes);
+    if (problems < 0) problems = 0;
+    problems += verify_journal_file(&bytes);
+    if (patients_check.kept[0]) {
+        printf("\nKept when patients.txt was found damaged at load:");
+        verify_store_file(patients_check.kept, &bytes);
+    }
+    long long elapsed = session_clock_us() - started;
+
+    printf("\nChecked %.1f KB in %.3f ms", bytes / 1024.0, elapsed / 1e3);
+    if (elapsed > 0) printf(" (%.0f MB/s)", bytes / (double)elapsed);
+    printf(".\n");
+    if (problems > 0) {
+        printf(COLOR_RED "%d problem(s) found.\n" COLOR_RESET, problems);
+    } else {
+        printf(COLOR_GREEN "No problems found.\n" COLOR_RESET);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void duplicate_clusters_form() {
+    char path[256];
+
+    clear_screen();
+    print_centered_title("FIND DUPLICATE PATIENTS");
+
+    /* The candidate file holds names and phones, so it is not written
+     * while encryption is on. */
+    path[0] = '\0';
+    if (!config.encryption) {
+        printf("Enter '0' For Go Back.\n\n");
+        printf("Output file [duplicate_candidates.csv]: ");
+        if (!read_line(path, sizeof(path))) return;
+        trim(path);
+        if (strcmp(path, "0") == 0) return;
+        if (strlen(path) == 0) strcpy(path, "duplicate_candidates.csv");
+    }
+
+    printf("\nScanning records...\n");
+    DupRecord *records;
+    DupPair *pairs;
+    DupSummary summary;
+    if (!find_duplicate_clusters(&records, &pairs, &summary)) {
+        printf(COLOR_RED "\nNot enough memory to run the duplicate search.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    printf("%d record(s) in %d block(s), %lld comparison(s) on %d thread(s), %lld ms.\n",
+           summary.record_count, summary.block_count, summary.comparisons,
+           summary.thread_count, summary.elapsed_ms);
+    if (summary.skipped_blocks > 0) {
+        printf("%d block(s) with over %d records (%d records) were too common to compare.\n",
+               summary.skipped_blocks, DUPLICATE_MAX_BLOCK, summary.skipped_records);
+    }
+
+    if (summary.pair_count == 0) {
+        printf(COLOR_GREEN "\nNo likely duplicates found.\n" COLOR_RESET);
+    } else {
+        printf("\n%d candidate pair(s) in %d cluster(s):\n\n", summary.pair_count, summary.cluster_count);
+        printf("%-7s %-5s %-6s %-6s %-22s %-22s\n", "Cluster", "Score", "ID", "Dup ID", "Name", "Duplicate Name");
+        printf("--------------------------------------------------------------------------\n");
+        for (int i = 0; i < summary.pair_count && i < DUPLICATE_SHOWN; i++) {
+            const DupRecord *a = &records[pairs[i].a];
+            const DupRecord *b = &records[pairs[i].b];
+            printf("%-7d %-5d %-6d %-6d %-22.22s %-22.22s\n",
+                   pairs[i].cluster, pairs[i].score, a->id, b->id, a->display_name, b->display_name);
+        }
+        if (summary.pair_count > DUPLICATE_SHOWN) {
+            printf("... %d more.\n", summary.pair_count - DUPLICATE_SHOWN);
+        }
+
+        if (!path[0]) {
+            printf("\nWith encryption=on the candidates are not written to a file.\n");
+        } else if (write_dup_candidates(path, records, pairs, summary.pair_count)) {
+            printf(COLOR_GREEN "\nAll candidates written to %s.\n" COLOR_RESET, path);
+        } else {
+            printf(COLOR_RED "\nWriting %s failed.\n" COLOR_RESET, path);
+        }
+    }
+
+    free(pairs);
+    free(records);
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void replication_status_form() {
+    char input[10];
+    ReplicaLag lag;
+
+    clear_screen();
+    print_centered_title("REPLICATION STATUS");
+
+    if (!replica_enabled()) {
+        printf("Replication is off. Set replica_dir in config.txt to ship changes\n");
+        printf("to a standby, and replica_role=standby on the standby itself.\n");
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    replica_catch_up();
+    replica_lag(&lag);
+
+    printf("Role:              %s\n", config.replica_role == REPLICA_STANDBY ? "standby" : "primary");
+    printf("Log directory:     %s\n", config.replica_dir);
+    if (config.replica_role == REPLICA_PRIMARY) {
+        printf("Last entry:        %llu\n", (unsigned long long)lag.last_seq);
+        printf("Log size:          %llu bytes\n", (unsigned long long)replica.size);
+        if (!replica.log) {
+            printf(COLOR_RED "The replication log could not be opened.\n" COLOR_RESET);
+        } else if (replica.failures > 0) {
+            printf(COLOR_RED "%lu change(s) could not be shipped.\n" COLOR_RESET, replica.failures);
+        }
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    printf("Applied entry:     %llu of %llu\n", (unsigned long long)replica.applied_seq,
+           (unsigned long long)lag.last_seq);
+    printf("Behind:            %llu entries, %llu bytes\n", (unsigned long long)lag.entries_behind,
+           (unsigned long long)lag.bytes_behind);
+    printf("Oldest unapplied:  %lld ms old\n", lag.oldest_pending_ms);
+    if (replica.applied_seq > 0) {
+        printf("Last apply delay:  %lld ms after commit\n", replica.applied_at_ms - replica.applied_commit_ms);
+    }
+    if (replica.stalled) {
+        printf(COLOR_RED "\nEntry %llu is out of sequence or unreadable; replication has stopped.\n" COLOR_RESET,
+               (unsigned long long)replica.applied_seq + 1);
+    }
+
+    printf("\nPromote this standby to primary? Stop the old primary first. (y/N): ");
+    if (!read_line(input, sizeof(input))) return;
+    trim(input);
+
+    if (input[0] == 'y' || input[0] == 'Y') {
+        if (replica_promote()) {
+            printf(COLOR_GREEN "\nThis system is now the primary; changes are allowed.\n" COLOR_RESET);
+        } else {
+            printf(COLOR_RED "\nPromotion failed.\n" COLOR_RESET);
+        }
+        printf("\nPress Enter to continue...");
+        read_char();
+    }
+}
+
+void switch_branch_form() {
+    char name[64];
+    char input[10];
+
+    clear_screen();
+    print_centered_title("SWITCH BRANCH");
+
+    printf("Branches (* = open, + = in memory):\n\n");
+    for (int i = 0; i < branch_count; i++) {
+        int open = find_open_branch(branch_names[i]);
+        char mark = strcmp(branch_names[i], current_branch) == 0 ? '*' : (open >= 0 ? '+' : ' ');
+        printf("  %c %s\n", mark, branch_names[i]);
+    }
+
+    printf("\nEnter '0' For Go Back.\n");
+    printf("Branch name: ");
+    if (!read_line(name, sizeof(name))) return;
+    trim(name);
+    if (strlen(name) == 0 || strcmp(name, "0") == 0) {
+        return;
+    }
+
+    if (find_branch(name) < 0) {
+        if (!valid_branch_name(name)) {
+            printf(COLOR_RED "\nBranch names use letters, digits, '-' and '_' (up to %d).\n" COLOR_RESET,
+                   BRANCH_NAME_LEN - 1);
+            printf("\nPress Enter to continue...");
+            read_char();
+            return;
+        }
+        printf("\nBranch '%s' does not exist. Create it? (y/N): ", name);
+        if (!read_line(input, sizeof(input))) return;
+        trim(input);
+        if (input[0] != 'y' && input[0] != 'Y') {
+            return;
+        }
+        if (!create_branch(name)) {
+            printf(COLOR_RED "\nCould not create branches/%s.\n" COLOR_RESET, name);
+            printf("\nPress Enter to continue...");
+            read_char();
+            return;
+        }
+    }
+
+    long long start = monotonic_ms();
+    if (switch_branch(name)) {
+        printf(COLOR_GREEN "\nNow working in branch %s (%lld ms).\n" COLOR_RESET, current_branch,
+               monotonic_ms() - start);
+    } else {
+        printf(COLOR_RED "\nCould not open branch %s.\n" COLOR_RESET, name);
+    }
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void branch_lookup_form() {
+    char input[20];
+    BranchMatch matches[MAX_BRANCHES];
+
+    clear_screen();
+    print_centered_title("FIND PATIENT IN ALL BRANCHES");
+
+    printf("Enter Patient ID: ");
+    if (!read_line(input, sizeof(input))) return;
+
+    int patient_id = atoi(input);
+    if (patient_id == 0) {
+        return;
+    }
+
+    int found = find_patient_in_branches(patient_id, matches, MAX_BRANCHES);
+    if (found == 0) {
+        printf(COLOR_RED "\nNo branch has an active patient with ID %d.\n" COLOR_RESET, patient_id);
+    }
+    for (int i = 0; i < found; i++) {
+        Patient patient;
+        if (parse_text_patient(matches[i].record, &patient)) {
+            printf("\nBranch %s:\n", matches[i].branch);
+            print_patient_details(&patient);
+        }
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void search_cache_form() {
+    QueryCache *cache = &query_cache;
+    unsigned long lookups = cache->hits + cache->misses;
+
+    clear_screen();
+    print_centered_title("SEARCH CACHE");
+
+    printf("Cached searches:   %d of %d\n", cache->count, QUERY_CACHE_ENTRIES);
+    printf("Lookups:           %lu\n", lookups);
+    if (lookups > 0) {
+        printf("Hits:              %lu (%.1f%%)\n", cache->hits, 100.0 * cache->hits / lookups);
+        printf("Misses:            %lu (%.1f%%)\n", cache->misses, 100.0 * cache->misses / lookups);
+    }
+    printf("Dropped as stale:  %lu\n", cache->stale);
+    printf("Store generation:  %llu\n", (unsigned long long)cache->generation);
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void data_tools_menu() {
+    while (1) {
+        clear_screen();
+        print_centered_title("DATA TOOLS");
+
+        printf("1. Archive Old Records\n");
+        printf("2. View/Restore Archived Patient\n");
+        printf("3. Export Records (CSV/JSON)\n");
+        printf("4. Find Duplicate Patients\n");
+        printf("5. Replication Status\n");
+        printf("6. Switch Branch\n");
+        printf("7. Find Patient In All Branches\n");
+        printf("8. Search Cache Statistics\n");
+        printf("9. Patient Counts\n");
+        printf("10. Verify Store\n");
+        printf("0. Back\n\n");
+        printf("Enter your choice: ");
+
+        char choice_str[10];
+        if (!read_line(choice_str, sizeof(choice_str))) return;
+        int choice = atoi(choice_str);
+
+        switch (choice) {
+            case 1:
+                archive_records_form();
+                break;
+            case 2:
+                archived_patient_form();
+                break;
+            case 3:
+                export_records_form();
+                break;
+            case 4:
+                duplicate_clusters_form();
+                break;
+            case 5:
+                replication_status_form();
+                break;
+            case 6:
+                switch_branch_form();
+                break;
+            case 7:
+                branch_lookup_form();
+                break;
+            case 8:
+                search_cache_form();
+                break;
+            case 9:
+                patient_counts_form();
+                break;
+            case 10:
+                verify_store_form();
+                break;
+            case 0:
+                return;
+            default:
+                printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
+                printf("\nPress Enter to continue...");
+                read_char();
+                break;
+        }
+    }
+}
+
+/* ===================== USER MANAGEMENT ===================== */
+
+void registration_flow(int is_first_user) {
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+    char confirm_password[MAX_PASSWORD_LEN];
+    UserRole role = ROLE_MODERATOR;
+
+    clear_screen();
+    print_centered_title("USER REGISTRATION");
+
+    if (is_first_user) {
+        printf("ADMIN REGISTRATION.\n\n");
+        role = ROLE_ADMIN;
+    } else if (current_user && current_user->role == ROLE_ADMIN) {
+        printf("New User Registration\n\n");
+    } else {
+        printf("New users will be MODERATORs.\n\n");
+    }
+
+    while (1) {
+        printf("Username: ");
+        if (!read_line(username, MAX_USERNAME_LEN)) continue;
+        trim(username);
+
+        if (strlen(username) == 0) {
+            printf(COLOR_RED "Username required.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(username)) {
+            printf(COLOR_RED "Username cannot contain '|'.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (find_user_by_username(username)) {
+            printf(COLOR_RED "Username taken.\n" COLOR_RESET);
+            continue;
+        }
+
+        break;
+    }
+
+    while (1) {
+        printf("Password: ");
+        if (!read_password(password, MAX_PASSWORD_LEN)) continue;
+        trim(password);
+
+        if (strlen(password) == 0) {
+            printf(COLOR_RED "Password required.\n" COLOR_RESET);
+            continue;
+        }
+
+        if (contains_pipe(password)) {
+            printf(COLOR_RED "Password cannot contain '|'.\n" COLOR_RESET);
+            continue;
+        }
+
+        break;
+    }
+
+    while (1) {
+        printf("Confirm Password: ");
+        if (!read_password(confirm_password, MAX_PASSWORD_LEN)) continue;
+        trim(confirm_password);
+
+        if (strcmp(password, confirm_password) != 0) {
+            printf(COLOR_RED "Passwords don't match.\n" COLOR_RESET);
+
+            printf("Password: ");
+            if (!read_password(password, MAX_PASSWORD_LEN)) continue;
+            trim(password);
+
+            if (strlen(password) == 0) {
+                printf(COLOR_RED "Password required.\n" COLOR_RESET);
+                continue;
+            }
+
+            continue;
+        }
+        break;
+    }
+
+    if (!is_first_user && current_user && current_user->role == ROLE_ADMIN) {
+        printf("\nRole (1=ADMIN, 2=MODERATOR): ");
+        char role_input[10];
+        read_line(role_input, sizeof(role_input));
+        trim(role_input);
+
+        if (atoi(role_input) == 1) {
+            role = ROLE_ADMIN;
+        }
+    }
+
+    int result = register_user(username, password, role);
+    if (result == 1) {
+        printf(COLOR_GREEN "\nRegistration successful.\n" COLOR_RESET);
+
+        if (is_first_user) {
+            current_user = find_user_by_username(username);
+            printf("Automatically logged in as first user.\n");
+        }
+    } else if (result == -1) {
+        printf(COLOR_RED "\nUsername already exists.\n" COLOR_RESET);
+    } else {
+        printf(COLOR_RED "\nRegistration failed.\n" COLOR_RESET);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+void login_flow() {
+    char username[MAX_USERNAME_LEN];
+    char password[MAX_PASSWORD_LEN];
+
+    clear_screen();
+    print_centered_title("LOGIN");
+
+    printf("Username: ");
+    read_line(username, MAX_USERNAME_LEN);
+    trim(username);
+
+    if (strlen(username) == 0) {
+        printf(COLOR_RED "\nUsername required.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    printf("Password: ");
+    if (!read_password(password, MAX_PASSWORD_LEN)) password[0] = '\0';
+    trim(password);
+
+    if (strlen(password) == 0) {
+        printf(COLOR_RED "\nPassword required.\n" COLOR_RESET);
+        printf("\nPress Enter to continue...");
+        read_char();
+        return;
+    }
+
+    if (authenticate_user(username, password)) {
+        current_user = find_user_by_username(username);
+        printf(COLOR_GREEN "\nWelcome, %s.\n" COLOR_RESET, current_user->username);
+    } else {
+        printf(COLOR_RED "\nInvalid Password or Username.\n" COLOR_RESET);
+    }
+
+    printf("\nPress Enter to continue...");
+    read_char();
+}
+
+/* ===================== MAIN APPLICATION FLOW ===================== */
+
+void admin_flow() {
+    while (current_user && current_user->role == ROLE_ADMIN) {
+        show_admin_menu();
+
+        char choice_str[10];
+        read_line(choice_str, sizeof(choice_str));
+        int choice = atoi(choice_str);
+
+        switch (choice) {
+            case 1:
+                add_patient_form();
+                break;
+            case 2:
+                view_all_patients();
+                break;
+            case 3:
+                search_patient_menu();
+                break;
+            case 4:
+                modify_patient_form();
+                break;
+            case 5:
+                delete_patient_form();
+                break;
+            case 6:
+                registration_flow(0);
+                break;
+            case 7:
+                data_tools_menu();
+                break;
+            case 8:
+                flush_patients();
+                current_user = NULL;
+                return;
+            default:
+                printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
+                printf("\nPress Enter to continue...");
+                read_char();
+                break;
+        }
+    }
+}
+
+void moderator_flow() {
+    while (current_user && current_user->role == ROLE_MODERATOR) {
+        show_moderator_menu();
+
+        char choice_str[10];
+        read_line(choice_str, sizeof(choice_str));
+        int choice = atoi(choice_str);
+
+        switch (choice) {
+            case 1:
+                add_patient_form();
+                break;
+            case 2:
+                view_all_patients();
+                break;
+            case 3:
+                search_patient_menu();
+                break;
+            case 4:
+                flush_patients();
+                current_user = NULL;
+                return;
+            default:
+                printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
+                printf("\nPress Enter to continue...");
+                read_char();
+                break;
+        }
+    }
+}
+
+/* Saves everything and stops the worker threads, before exiting. */
+void shutdown_program() {
+    flush_parked_branches();
+    flush_patients();
+    io_stop();
+    scan_stop();
+}
+
+void end_replay() {
+    shutdown_program();
+    session_finish();
+    exit(0);
+}
+
+/*
+ * Command line:
+ *   --record <trace>  record the session's input to trace
+ *   --replay <trace>  run on the input recorded in trace and time it
+ *   --data <dir>      use the data files in dir
+ */
+int parse_arguments(int argc, char **argv) {
+    const char *data_dir = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && strcmp(argv[i], "--record") == 0) {
+            if (!session_start_record(argv[++i])) return 0;
+        } else if (i + 1 < argc && strcmp(argv[i], "--replay") == 0) {
+            if (!session_start_replay(argv[++i])) return 0;
+            session_end_handler = end_replay;
+        } else if (i + 1 < argc && strcmp(argv[i], "--data") == 0) {
+            data_dir = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--record <trace> | --replay <trace>] [--data <dir>]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    if (data_dir) {
+#ifdef _WIN32
+        int changed = _chdir(data_dir) == 0;
+#else
+        int changed = chdir(data_dir) == 0;
+#endif
+        if (!changed) {
+            perror(data_dir);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_arguments(argc, argv)) {
+        return 1;
+    }
+    load_config();
+    if (config.encryption && (!encryption_settings_ok() || !crypto_unlock())) {
+        return 1;
+    }
+    if (load_users() < 0) {
+        return 1;
+    }
+    load_branches();
+    load_patients();
+    reserve_archived_ids();
+    if (patients_damaged) {
+        return 1;
+    }
+
+    /* B+tree pages are written by the buffer pool itself; the thread is
+     * still needed there to ship the replication log and the change feed. */
+    if (config.storage != STORAGE_BTREE || replica_enabled() || config.change_feed) {
+        io_failure_handler = report_save_failure;
+        io_start();
+    }
+    replica_start();
+
+    while (1) {
+        if (current_user) {
+            if (current_user->role == ROLE_ADMIN) {
+                admin_flow();
+            } else {
+                moderator_flow();
+            }
+        } else {
+            if (user_count == 0) {
+                clear_screen();
+                print_centered_title("PATIENT RECORD MANAGEMENT SYSTEM");
+                printf("No users found. Please Register First User.\n\n");
+                registration_flow(1);
+            } else {
+                show_startup_menu();
+
+                char choice_str[10];
+                read_line(choice_str, sizeof(choice_str));
+                int choice = atoi(choice_str);
+
+                switch (choice) {
+                    case 1:
+                        login_flow();
+                        break;
+                    case 2:
+                        shutdown_program();
+                        clear_screen();
+                        printf("Thank you for using Patient Record Management System!\n");
+                        session_finish();
+                        return 0;
+                    default:
+                        printf(COLOR_RED "Invalid choice.\n" COLOR_RESET);
+                        printf("\nPress Enter to continue...");
+                        read_char();
+                        break;
+                }
+            }
+        }
+    }
+
+    return 0;
+}